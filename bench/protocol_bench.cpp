@@ -0,0 +1,260 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// GET throughput of a running server over HTTP (keep-alive) and over RESP,
+// one connection per client thread. RESP runs once without and once with
+// pipelining; given a memcached port, so does the memcached protocol, its
+// pipeline being quiet meta gets closed by mn. Keys are loaded through RESP
+// MSET first, so the server needs RESP_PORT; start it with a cache at least
+// as large as the keyspace to compare the protocols rather than the store.
+
+using namespace std;
+
+#define BENCH_VALUE_SIZE 64
+#define BENCH_LOAD_BATCH 500
+
+atomic<bool> done(false);
+
+static int connect_to(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if(fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+    cerr << "Cannot connect to port " << port << ": " << strerror(errno) << endl;
+    exit(1);
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+static void send_all(int fd, const string& data) {
+  size_t sent = 0;
+  while(sent < data.size()) {
+    ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if(n <= 0) {
+      cerr << "send failed" << endl;
+      exit(1);
+    }
+    sent += n;
+  }
+}
+
+// Buffered reader over a socket.
+struct Reader {
+  int fd;
+  string buf;
+  size_t pos = 0;
+
+  explicit Reader(int fd) : fd(fd) {}
+
+  void fill() {
+    if(pos > 0 && pos == buf.size()) {
+      buf.clear();
+      pos = 0;
+    }
+    char tmp[65536];
+    ssize_t n = recv(fd, tmp, sizeof(tmp), 0);
+    if(n <= 0) {
+      cerr << "connection closed" << endl;
+      exit(1);
+    }
+    buf.append(tmp, n);
+  }
+
+  // Up to and without "\r\n".
+  string line() {
+    size_t eol;
+    while((eol = buf.find("\r\n", pos)) == string::npos) fill();
+    string l = buf.substr(pos, eol - pos);
+    pos = eol + 2;
+    return l;
+  }
+
+  void skip(size_t n) {
+    while(buf.size() - pos < n) fill();
+    pos += n;
+  }
+};
+
+// Returns false when the server closes the connection after this response
+// (httplib does after CPPHTTPLIB_KEEPALIVE_MAX_COUNT requests).
+static bool read_http(Reader& r) {
+  size_t length = 0;
+  bool keep = true;
+  string status = r.line();
+  if(status.compare(9, 3, "200") != 0) {
+    cerr << "unexpected response: " << status << endl;
+    exit(1);
+  }
+  for(string l = r.line(); !l.empty(); l = r.line()) {
+    if(strncasecmp(l.c_str(), "Content-Length:", 15) == 0) length = strtoul(l.c_str() + 15, nullptr, 10);
+    if(strncasecmp(l.c_str(), "Connection: close", 17) == 0) keep = false;
+  }
+  r.skip(length);
+  return keep;
+}
+
+static void read_resp(Reader& r) {
+  string l = r.line();
+  if(l[0] != '$' || l == "$-1") {
+    cerr << "unexpected reply: " << l << endl;
+    exit(1);
+  }
+  r.skip(strtoul(l.c_str() + 1, nullptr, 10) + 2);
+}
+
+// One "VALUE"/"VA" item, then "END" for a classic get.
+static void read_memcache(Reader& r, bool meta) {
+  string l = r.line();
+  if(l.compare(0, meta ? 3 : 6, meta ? "VA " : "VALUE ") != 0) {
+    cerr << "unexpected reply: " << l << endl;
+    exit(1);
+  }
+  // "VA <bytes>" or "VALUE <key> <flags> <bytes>".
+  size_t at = meta ? 3 : l.rfind(' ') + 1;
+  r.skip(strtoul(l.c_str() + at, nullptr, 10) + 2);
+  if(!meta && r.line() != "END") {
+    cerr << "missing END" << endl;
+    exit(1);
+  }
+}
+
+static string resp_command(const vector<string>& args) {
+  string out = "*" + to_string(args.size()) + "\r\n";
+  for(const string& a : args) out += "$" + to_string(a.size()) + "\r\n" + a + "\r\n";
+  return out;
+}
+
+static string key_of(int i) {
+  return "bench:" + to_string(i);
+}
+
+struct Result {
+  unsigned long long ops = 0;
+  double latency_us = 0;
+};
+
+enum Protocol { HTTP, RESP, MEMCACHE };
+
+// pipeline requests per round trip; latency is per round trip.
+static Result run(Protocol protocol, int port, int clients, int seconds, int keyspace, int pipeline) {
+  atomic<unsigned long long> ops(0), rounds(0), micros(0);
+  done = false;
+  vector<thread> workers;
+  for(int c=0; c<clients; c++) {
+    workers.emplace_back([&, c]() {
+      Reader reader{connect_to(port)};
+      mt19937 rng(c + 1);
+      uniform_int_distribution<int> pick(0, keyspace - 1);
+      string request;
+      unsigned long long my_ops = 0, my_rounds = 0, my_micros = 0;
+      while(!done) {
+        request.clear();
+        for(int i=0; i<pipeline; i++) {
+          string key = key_of(pick(rng));
+          if(protocol == HTTP) request += "GET /api/" + key + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+          else if(protocol == RESP) request += resp_command({"GET", key});
+          else if(pipeline == 1) request += "get " + key + "\r\n";
+          else request += "mg " + key + " v q\r\n";
+        }
+        if(protocol == MEMCACHE && pipeline > 1) request += "mn\r\n";
+        auto start = chrono::steady_clock::now();
+        send_all(reader.fd, request);
+        bool keep = true;
+        for(int i=0; i<pipeline; i++) {
+          if(protocol == HTTP) keep = read_http(reader) && keep;
+          else if(protocol == RESP) read_resp(reader);
+          else read_memcache(reader, pipeline > 1);
+        }
+        if(protocol == MEMCACHE && pipeline > 1 && reader.line() != "MN") {
+          cerr << "missing MN" << endl;
+          exit(1);
+        }
+        if(!keep) {
+          close(reader.fd);
+          reader = Reader{connect_to(port)};
+        }
+        my_micros += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+        my_ops += pipeline;
+        my_rounds++;
+      }
+      ops += my_ops;
+      rounds += my_rounds;
+      micros += my_micros;
+      close(reader.fd);
+    });
+  }
+  this_thread::sleep_for(chrono::seconds(seconds));
+  done = true;
+  for(thread& t : workers) t.join();
+  Result result;
+  result.ops = ops.load();
+  result.latency_us = rounds.load() ? (double)micros.load() / rounds.load() : 0;
+  return result;
+}
+
+int main(int argc, char* argv[]) {
+  if(argc < 3) {
+    cerr << "format : ./protocol_bench.out <http port> <resp port> [clients] [seconds] [keyspace] [pipeline] [memcache port]\n";
+    return 1;
+  }
+  int http_port = atoi(argv[1]);
+  int resp_port = atoi(argv[2]);
+  int clients = argc >= 4 ? max(1, atoi(argv[3])) : 8;
+  int seconds = argc >= 5 ? max(1, atoi(argv[4])) : 10;
+  int keyspace = argc >= 6 ? max(1, atoi(argv[5])) : 10000;
+  int pipeline = argc >= 7 ? max(1, atoi(argv[6])) : 16;
+  int memcache_port = argc >= 8 ? atoi(argv[7]) : 0;
+
+  int fd = connect_to(resp_port);
+  Reader reader{fd};
+  string value(BENCH_VALUE_SIZE, 'v');
+  for(int begin=0; begin<keyspace; begin+=BENCH_LOAD_BATCH) {
+    vector<string> args = {"MSET"};
+    for(int i=begin; i<min(keyspace, begin + BENCH_LOAD_BATCH); i++) {
+      args.push_back(key_of(i));
+      args.push_back(value);
+    }
+    send_all(fd, resp_command(args));
+    string reply = reader.line();
+    if(reply != "+OK") {
+      cerr << "MSET failed: " << reply << endl;
+      return 1;
+    }
+  }
+  close(fd);
+
+  cout << "clients=" << clients << " seconds=" << seconds << " keyspace=" << keyspace
+       << " value=" << BENCH_VALUE_SIZE << "B\n";
+  cout << left << setw(22) << "protocol" << right << setw(14) << "GET/s" << setw(16) << "round trip us" << "\n";
+  auto report = [&](const string& name, const Result& r) {
+    cout << left << setw(22) << name << right << setw(14) << (unsigned long long)(r.ops / seconds)
+         << setw(16) << fixed << setprecision(1) << r.latency_us << "\n";
+  };
+  report("http", run(HTTP, http_port, clients, seconds, keyspace, 1));
+  report("resp", run(RESP, resp_port, clients, seconds, keyspace, 1));
+  report("resp pipeline " + to_string(pipeline), run(RESP, resp_port, clients, seconds, keyspace, pipeline));
+  if(memcache_port > 0) {
+    report("memcache", run(MEMCACHE, memcache_port, clients, seconds, keyspace, 1));
+    report("memcache pipeline " + to_string(pipeline), run(MEMCACHE, memcache_port, clients, seconds, keyspace, pipeline));
+  }
+  return 0;
+}
@@ -0,0 +1,103 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cstdlib>
+
+#include "Router.h"
+
+// Per-request routing cost: httplib's matchers as the server registered
+// them before (std::regex over every pattern in turn, then the key copied
+// out of req.matches) against the Router's trie and prefix dispatch, and
+// the regex PUT route against the route Router::attach registers for it
+// (httplib's "/api/:key" matcher, then dispatch with the body read).
+
+using namespace std;
+
+static volatile size_t sink;
+
+template <typename Fn>
+static double ns_per_call(int iterations, const vector<httplib::Request>& reqs, Fn fn) {
+  auto start = chrono::steady_clock::now();
+  for(int i=0; i<iterations; i++) fn(reqs[i % reqs.size()]);
+  auto elapsed = chrono::steady_clock::now() - start;
+  return chrono::duration_cast<chrono::nanoseconds>(elapsed).count() / (double)iterations;
+}
+
+int main(int argc, char* argv[]) {
+  int iterations = argc >= 2 ? atoi(argv[1]) : 1000000;
+  int keylen = argc >= 3 ? atoi(argv[2]) : 16;
+
+  vector<httplib::Request> reqs(1024);
+  for(size_t i=0; i<reqs.size(); i++) {
+    string key = "key" + to_string(i);
+    key.resize(max<size_t>(key.size(), keylen), 'x');
+    reqs[i].method = "GET";
+    reqs[i].path = "/api/" + key;
+  }
+
+  // Registration order of the GET routes before the router.
+  vector<unique_ptr<httplib::detail::MatcherBase>> regex_routes;
+  for(const char* pattern : {"/hi", "/metrics", "/api/_export", "/api/_rebalance", "/api/_changes", R"(/api/(.+))"}) {
+    regex_routes.emplace_back(new httplib::detail::RegexMatcher(pattern));
+  }
+  double before = ns_per_call(iterations, reqs, [&](const httplib::Request& r) {
+    httplib::Request req = r;
+    for(auto& route : regex_routes) {
+      if(route->match(req)) {
+        string key = req.matches[1];
+        sink += key.size();
+        break;
+      }
+    }
+  });
+
+  Router router("/api/");
+  auto admin = [](const httplib::Request&, httplib::Response&) {};
+  for(const char* path : {"/hi", "/metrics", "/api/_export", "/api/_rebalance", "/api/_changes"}) router.get(path, admin);
+  router.get_key([](const httplib::Request&, httplib::Response&, string_view key) {
+    string copy(key);
+    sink += copy.size();
+  });
+  router.put_key([](const httplib::Request&, httplib::Response&, string_view key) {
+    string copy(key);
+    sink += copy.size();
+  });
+  httplib::Response res;
+  double after = ns_per_call(iterations, reqs, [&](const httplib::Request& r) {
+    httplib::Request req = r;
+    router.dispatch(req, res);
+  });
+
+  // Copying the request is part of both loops; measured on its own.
+  double copy = ns_per_call(iterations, reqs, [&](const httplib::Request& r) {
+    httplib::Request req = r;
+    sink += req.path.size();
+  });
+
+  httplib::detail::RegexMatcher put_regex(R"(/api/(.+))");
+  httplib::detail::PathParamsMatcher put_params("/api/:key");
+  for(auto& req : reqs) req.method = "PUT";
+  double put_before = ns_per_call(iterations, reqs, [&](const httplib::Request& r) {
+    httplib::Request req = r;
+    if(put_regex.match(req)) {
+      string key = req.matches[1];
+      sink += key.size();
+    }
+  });
+  double put_after = ns_per_call(iterations, reqs, [&](const httplib::Request& r) {
+    httplib::Request req = r;
+    if(put_params.match(req)) router.dispatch(req, res, true);
+  });
+
+  cout << "iterations=" << iterations << " keylen=" << keylen << " (ns per request, request copy subtracted)\n";
+  cout << left << setw(10) << "route" << right << setw(14) << "before" << setw(14) << "after" << setw(10) << "speedup" << "\n";
+  cout << fixed << setprecision(1);
+  cout << left << setw(10) << "GET" << right << setw(14) << before - copy << setw(14) << after - copy
+       << setw(9) << (before - copy) / max(1.0, after - copy) << "x\n";
+  cout << left << setw(10) << "PUT" << right << setw(14) << put_before - copy << setw(14) << put_after - copy
+       << setw(9) << (put_before - copy) / max(1.0, put_after - copy) << "x\n";
+  return 0;
+}
@@ -0,0 +1,109 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cstdlib>
+#include <libpq-fe.h>
+
+#include "DBConnectionPool.h"
+#include "SchemaProfile.h"
+
+// Upsert throughput across storage schema profiles.
+// Each profile gets its own scratch table (kvbench_<n>), dropped before and after.
+
+using namespace std;
+
+atomic<bool> done(false);
+
+static void exec_all(const string& conn_string, const vector<string>& stmts) {
+  PGconn* conn = PQconnectdb(conn_string.c_str());
+  if(PQstatus(conn) != CONNECTION_OK) {
+    string err = PQerrorMessage(conn);
+    PQfinish(conn);
+    throw Exception_("Postgres", "Fail to connect: " + err);
+  }
+  for(const string& stmt : stmts) PQclear(PQexec(conn, stmt.c_str()));
+  PQfinish(conn);
+}
+
+int main(int argc, char* argv[]) {
+  int threads = argc >= 2 ? max(1, atoi(argv[1])) : 16;
+  int seconds = argc >= 3 ? max(1, atoi(argv[2])) : 10;
+  int keyspace = argc >= 4 ? max(1, atoi(argv[3])) : 100000;
+
+  const char* db_conn = getenv("DB_CONN");
+  if(!db_conn) {
+    cerr << "Database connection string is not provided!\n";
+    return 1;
+  }
+
+  vector<string> specs = {
+    "", "unlogged", "partitions=8", "hash_index", "fillfactor=70",
+    "unlogged,partitions=8,fillfactor=70"
+  };
+
+  cout << "threads=" << threads << " duration=" << seconds << "s keyspace=" << keyspace << "\n";
+  cout << left << setw(44) << "profile" << right << setw(14) << "upserts/s" << setw(14) << "avg ms" << "\n";
+
+  for(size_t i=0; i<specs.size(); i++) {
+    SchemaProfile profile = SchemaProfile::parse(specs[i] + (specs[i].empty() ? "" : ",") +
+      "table=kvbench_" + to_string(i));
+    try {
+      exec_all(db_conn, profile.drop_statements());
+      DBConnectionPool pool(db_conn, threads, threads, profile);
+      pool.createPool();
+
+      done.store(false);
+      atomic<long long> ops(0), latency_ns(0);
+      // The first worker error ends the run and fails the profile.
+      mutex error_mtx;
+      string error;
+      vector<thread> workers;
+      for(int t=0; t<threads; t++) {
+        workers.emplace_back([&, t]() {
+          unsigned int seed = (unsigned int)(t * 7919 + i);
+          string value(44, 'v');
+          long long local_ops = 0, local_ns = 0;
+          try {
+            while(!done.load(memory_order_relaxed)) {
+              string key = "key_" + to_string(rand_r(&seed) % keyspace);
+              value[rand_r(&seed) % value.size()] = 'a' + rand_r(&seed) % 26;
+              auto start = chrono::steady_clock::now();
+              pool.set(key, value);
+              local_ns += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+              local_ops++;
+            }
+          } catch(const Exception_& e) {
+            lock_guard<mutex> lock(error_mtx);
+            if(error.empty()) error = e.what();
+            done.store(true);
+          }
+          ops += local_ops;
+          latency_ns += local_ns;
+        });
+      }
+      auto until = chrono::steady_clock::now() + chrono::seconds(seconds);
+      while(!done.load() && chrono::steady_clock::now() < until) this_thread::sleep_for(chrono::milliseconds(100));
+      done.store(true);
+      for(auto& w : workers) w.join();
+      if(!error.empty()) throw Exception_("Bench", error);
+
+      double rate = ops.load() / (double)seconds;
+      double avg_ms = ops.load() ? latency_ns.load() / (double)ops.load() / 1e6 : 0;
+      cout << left << setw(44) << profile.describe() << right << setw(14) << fixed << setprecision(0)
+        << rate << setw(14) << setprecision(3) << avg_ms << "\n";
+    } catch(const Exception_& e) {
+      cout << left << setw(44) << profile.describe() << "  failed: " << e.what() << "\n";
+    }
+    try {
+      exec_all(db_conn, profile.drop_statements());
+    } catch(const Exception_& e) {
+      cerr << "Fail to drop " << profile.describe() << ": " << e.what() << "\n";
+    }
+  }
+  return 0;
+}
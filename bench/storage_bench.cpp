@@ -0,0 +1,165 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+#include <cstdlib>
+#include <unistd.h>
+#include <libpq-fe.h>
+
+#include "StorageBackend.h"
+#include "DBConnectionPool.h"
+#include "MemoryBackend.h"
+#include "LSMBackend.h"
+#include "BitcaskBackend.h"
+#include "BTreeBackend.h"
+#include "AofBackend.h"
+#include "FileUtil.h"
+
+// Write throughput and point-lookup latency per storage backend.
+// Backends are given as a comma list (default memory,lsm,bitcask,btree,aof plus
+// postgres when DB_CONN is set); each starts empty and is removed afterwards.
+
+using namespace std;
+
+#define BENCH_DIR "./data/storage_bench"
+#define BENCH_TABLE "kvbench_storage"
+#define BENCH_AOF_BUCKETS 256
+
+atomic<bool> done(false);
+unique_ptr<Cache> aof_cache;  // the store of the aof backend
+
+static void remove_dir(const string& dir) {
+  if(!fileutil::exists(dir)) return;
+  for(const string& name : fileutil::list_dir(dir)) unlink((dir + "/" + name).c_str());
+  rmdir(dir.c_str());
+}
+
+static void drop_table() {
+  PGconn* conn = PQconnectdb(getenv("DB_CONN"));
+  if(PQstatus(conn) == CONNECTION_OK) {
+    for(const string& stmt : SchemaProfile::parse("table=" BENCH_TABLE).drop_statements()) {
+      PQclear(PQexec(conn, stmt.c_str()));
+    }
+  }
+  PQfinish(conn);
+}
+
+static unique_ptr<StorageBackend> open_backend(const string& name, int threads) {
+  if(name == "memory") return unique_ptr<StorageBackend>(new MemoryBackend());
+  if(name == "lsm") {
+    remove_dir(BENCH_DIR);
+    return unique_ptr<StorageBackend>(new LSMBackend(BENCH_DIR));
+  }
+  if(name == "bitcask") {
+    remove_dir(BENCH_DIR);
+    return unique_ptr<StorageBackend>(new BitcaskBackend(BENCH_DIR));
+  }
+  if(name == "btree") {
+    remove_dir(BENCH_DIR);
+    return unique_ptr<StorageBackend>(new BTreeBackend(BENCH_DIR "/data.btree"));
+  }
+  if(name == "aof") {
+    remove_dir(BENCH_DIR);
+    // AOF_FSYNC picks the policy; the default matches the other engines.
+    AofBackend::FsyncPolicy policy = AofBackend::parse_policy(getenv("AOF_FSYNC") ? getenv("AOF_FSYNC") : "always");
+    aof_cache.reset(new Cache(0, BENCH_AOF_BUCKETS));
+    return unique_ptr<StorageBackend>(new AofBackend(*aof_cache, BENCH_DIR, policy, 64ULL << 20, 100));
+  }
+  if(name == "postgres") {
+    const char* db_conn = getenv("DB_CONN");
+    if(!db_conn) throw Exception_("Config", "DB_CONN is not set");
+    drop_table();
+    SchemaProfile profile = SchemaProfile::parse("table=" BENCH_TABLE);
+    DBConnectionPool* pool = new DBConnectionPool(db_conn, threads, threads, profile);
+    unique_ptr<StorageBackend> owned(pool);
+    pool->createPool();
+    return owned;
+  }
+  throw Exception_("Config", "unknown backend " + name);
+}
+
+static void cleanup(const string& name) {
+  if(name == "lsm" || name == "bitcask" || name == "btree" || name == "aof") remove_dir(BENCH_DIR);
+  if(name == "postgres" && getenv("DB_CONN")) drop_table();
+}
+
+// Runs op on every thread for `seconds`; returns ops/s and fills sorted latencies (us).
+template <typename Op>
+static double run_phase(int threads, int seconds, Op op, vector<long long>& latencies) {
+  done.store(false);
+  atomic<long long> ops(0);
+  vector<vector<long long>> samples(threads);
+  vector<thread> workers;
+  for(int t=0; t<threads; t++) {
+    workers.emplace_back([&, t]() {
+      unsigned int seed = (unsigned int)(t * 7919 + 17);
+      long long local_ops = 0;
+      while(!done.load(memory_order_relaxed)) {
+        auto start = chrono::steady_clock::now();
+        op(seed);
+        long long us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+        if((local_ops & 15) == 0) samples[t].push_back(us);
+        local_ops++;
+      }
+      ops += local_ops;
+    });
+  }
+  this_thread::sleep_for(chrono::seconds(seconds));
+  done.store(true);
+  for(auto& w : workers) w.join();
+  latencies.clear();
+  for(auto& s : samples) latencies.insert(latencies.end(), s.begin(), s.end());
+  sort(latencies.begin(), latencies.end());
+  return ops.load() / (double)seconds;
+}
+
+static long long percentile(const vector<long long>& sorted, double p) {
+  if(sorted.empty()) return 0;
+  return sorted[min(sorted.size() - 1, (size_t)(sorted.size() * p))];
+}
+
+int main(int argc, char* argv[]) {
+  int threads = argc >= 2 ? max(1, atoi(argv[1])) : 16;
+  int seconds = argc >= 3 ? max(1, atoi(argv[2])) : 10;
+  int keyspace = argc >= 4 ? max(1, atoi(argv[3])) : 100000;
+  string list = argc >= 5 ? argv[4] : (getenv("DB_CONN") ? "memory,lsm,bitcask,btree,aof,postgres" : "memory,lsm,bitcask,btree,aof");
+
+  vector<string> backends;
+  size_t pos = 0;
+  while(pos <= list.size()) {
+    size_t comma = list.find(',', pos);
+    if(comma == string::npos) comma = list.size();
+    if(comma > pos) backends.push_back(list.substr(pos, comma - pos));
+    pos = comma + 1;
+  }
+
+  cout << "threads=" << threads << " duration=" << seconds << "s per phase keyspace=" << keyspace << "\n";
+  cout << left << setw(12) << "backend" << right << setw(14) << "writes/s" << setw(14) << "reads/s"
+    << setw(12) << "read p50us" << setw(12) << "read p99us" << "\n";
+
+  for(const string& name : backends) {
+    try {
+      unique_ptr<StorageBackend> store = open_backend(name, threads);
+      vector<long long> latencies;
+      double writes = run_phase(threads, seconds, [&](unsigned int& seed) {
+        string value(100, 'a' + rand_r(&seed) % 26);
+        store->set("key_" + to_string(rand_r(&seed) % keyspace), value);
+      }, latencies);
+      double reads = run_phase(threads, seconds, [&](unsigned int& seed) {
+        store->get("key_" + to_string(rand_r(&seed) % keyspace));
+      }, latencies);
+      cout << left << setw(12) << name << right << fixed << setprecision(0) << setw(14) << writes
+        << setw(14) << reads << setw(12) << percentile(latencies, 0.5)
+        << setw(12) << percentile(latencies, 0.99) << "\n";
+    } catch(const Exception_& e) {
+      cout << left << setw(12) << name << "  failed: " << e.what() << "\n";
+    }
+    cleanup(name);
+  }
+  return 0;
+}
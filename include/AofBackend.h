@@ -0,0 +1,104 @@
+#ifndef AOF_BACKEND_H
+#define AOF_BACKEND_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdint>
+#include <sys/types.h>
+#include "StorageBackend.h"
+#include "Cache.h"
+
+// Makes a Cache (built without eviction) the authoritative store, in the
+// style of Redis persistence. Every write updates the cache and is appended
+// to the append-only file; AOF_FSYNC decides when the file is synced: on every
+// write (always, shared by concurrent writers), once a second (everysec) or
+// never (no, left to the OS).
+//
+// Once the AOF has outgrown the last snapshot, writes are paused just long
+// enough to switch to a new AOF and fork(); the child writes the copy-on-write
+// image of the cache as a snapshot while the parent keeps serving. Startup
+// loads the snapshot and replays the AOF files written since it was taken.
+class AofBackend : public StorageBackend {
+public:
+  enum FsyncPolicy { ALWAYS, EVERYSEC, NO };
+
+private:
+  static const int STRIPES = 256;
+
+  Cache& cache;
+  std::string dir;
+  FsyncPolicy policy;
+  uint64_t rewrite_min_bytes;
+  int rewrite_percent;
+
+  // A write holds its key's stripe across the append and the cache update, so
+  // the AOF order of two writes to one key is the order they reach the cache.
+  std::mutex stripes[STRIPES];
+
+  std::mutex aof_mtx;
+  int aof_fd = -1;
+  uint64_t aof_number = 0;
+  // Length of the current file up to its last whole record; a failed append
+  // is cut back to it. Set when a torn record could not be cut: replay
+  // would stop there, so no later write may be acknowledged.
+  uint64_t aof_end = 0;
+  bool aof_broken = false;
+  std::atomic<uint64_t> appended{0};
+  std::mutex sync_mtx;
+  std::atomic<uint64_t> synced{0};
+
+  std::atomic<uint64_t> aof_bytes{0};       // every AOF file newer than the snapshot
+  std::atomic<uint64_t> snapshot_bytes{0};
+
+  std::thread background;
+  std::mutex bg_mtx;
+  std::condition_variable bg_cv;
+  bool stopping = false;
+  pid_t child = -1;
+  uint64_t child_gen = 0;
+
+  std::atomic<unsigned long long> syncs{0};
+  std::atomic<unsigned long long> sync_failures{0};
+  std::atomic<unsigned long long> rewrites{0};
+  std::atomic<unsigned long long> rewrite_failures{0};
+  std::atomic<unsigned long long> fork_pause_us{0};
+
+  std::mutex& stripe_for(const std::string& key);
+  std::string aof_path(uint64_t number) const;
+  std::string snapshot_path() const;
+  std::vector<uint64_t> aof_numbers() const;  // ascending
+
+  void restore();
+  uint64_t load_snapshot();
+  uint64_t replay(const std::string& path);
+  void open_aof(uint64_t number);
+
+  uint64_t append(char op, const std::string& key, const std::string& value);
+  void sync_to(uint64_t position);
+
+  void background_loop();
+  void start_rewrite();
+  void finish_rewrite(int status);
+  // Runs in the forked child: no locks, no exceptions, no stdio.
+  static bool write_snapshot(const Cache& cache, const std::string& path, uint64_t gen);
+
+public:
+  AofBackend(Cache& cache, const std::string& dir, FsyncPolicy policy,
+    uint64_t rewrite_min_bytes, int rewrite_percent);
+  ~AofBackend();
+
+  static FsyncPolicy parse_policy(const std::string& name);
+
+  std::pair<bool, std::string> get(const std::string& key) override;
+  bool set(const std::string& key, const std::string& value) override;
+  bool remove(const std::string& key) override;
+  // The cache is unordered, so a scan sorts every key >= start.
+  std::vector<std::pair<std::string, std::string>> scan(const std::string& start, size_t limit) override;
+  void write_metrics(std::ostream& out) override;
+};
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef BTREE_BACKEND_H
+#define BTREE_BACKEND_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include "StorageBackend.h"
+
+// Single-file copy-on-write B+tree in the style of LMDB.
+//
+// The file is mapped read-only once, with address space reserved up front,
+// so readers walk pages straight out of the page cache: no locks and no
+// syscalls. A reader pins the transaction it started on in a per-thread slot;
+// the writer never reuses a page freed by a transaction newer than the oldest
+// pinned one. Writes are serialised through one writer: queued operations are
+// applied together as one transaction that copies the touched root-to-leaf
+// paths into fresh pages, writes them with pwrite, syncs, and then flips one
+// of the two meta pages. A crash leaves the previous meta, and tree, intact.
+class BTreeBackend : public StorageBackend {
+public:
+  struct ReaderTable;
+
+private:
+  struct Meta {
+    uint64_t txn = 0;
+    uint64_t root = 0;        // 0 = empty tree
+    uint64_t page_count = 0;  // high-water mark, in pages
+    uint64_t freelist = 0;    // head of the persisted free page chain
+    uint64_t entries = 0;
+  };
+
+  struct LeafEntry {
+    std::string key;
+    std::string value;         // inline values only
+    uint64_t overflow = 0;     // first page of an out-of-line value
+    uint32_t vlen = 0;
+  };
+
+  struct BranchEntry {
+    std::string key;           // lower bound of the child; ignored for the first
+    uint64_t child = 0;
+  };
+
+  struct Op {
+    const std::string& key;
+    const std::string& value;
+    bool tombstone;
+    bool existed = false;
+    bool done = false;
+    std::string error;
+    std::condition_variable cv;
+
+    Op(const std::string& key, const std::string& value, bool tombstone)
+      : key(key), value(value), tombstone(tombstone) {}
+  };
+
+  std::string path;
+  bool sync;
+  int fd = -1;
+  char* map = nullptr;
+  size_t map_size = 0;
+
+  // Published state read by lock-free readers: the current transaction and
+  // the root of the last few transactions, indexed by txn % ROOT_RING.
+  static const int ROOT_RING = 4;
+  std::atomic<uint64_t> current_txn{0};
+  std::atomic<uint64_t> roots[ROOT_RING];
+  std::shared_ptr<ReaderTable> readers;
+
+  // Writer queue; the front writer commits the whole queue.
+  std::mutex mtx;
+  std::deque<Op*> queue;
+
+  // Writer-only state.
+  Meta meta;
+  std::vector<uint64_t> ready;                                   // reusable now
+  std::deque<std::pair<uint64_t, std::vector<uint64_t>>> pending;  // freed by txn
+  std::unordered_map<uint64_t, std::string> dirty;
+  std::vector<uint64_t> freed;       // committed pages released by this txn
+  std::vector<uint64_t> dirty_free;  // pages allocated and dropped within this txn
+
+  std::atomic<unsigned long long> commits{0};
+  std::atomic<unsigned long long> commit_ops{0};
+  std::atomic<unsigned long long> free_pages{0};
+  std::atomic<unsigned long long> entries_count{0};
+  std::atomic<unsigned long long> pages_count{0};
+
+  // Pins the current transaction for the lifetime of a read.
+  class ReadTxn;
+
+  const char* page(uint64_t pgno) const;
+
+  // Write transaction.
+  void begin();
+  void apply(Op& op);
+  void commit();
+  uint64_t alloc();
+  void release(uint64_t pgno);
+  char* new_page(uint64_t& pgno);
+  bool modify(uint64_t pgno, Op& op, std::vector<BranchEntry>& out);
+  std::vector<BranchEntry> write_leaf(const std::vector<LeafEntry>& entries);
+  std::vector<BranchEntry> write_branch(const std::vector<BranchEntry>& entries);
+  uint64_t write_overflow(const std::string& value);
+  void release_chain(uint64_t pgno);
+  void write_meta(const Meta& m);
+  bool read_meta(int slot, Meta& m) const;
+
+  void write(const std::string& key, const std::string& value, bool tombstone, bool& existed);
+
+public:
+  explicit BTreeBackend(const std::string& path, bool sync=true, size_t map_size=(size_t)64 << 30);
+  ~BTreeBackend();
+
+  std::pair<bool, std::string> get(const std::string& key) override;
+  bool set(const std::string& key, const std::string& value) override;
+  bool remove(const std::string& key) override;
+  std::vector<std::pair<std::string, std::string>> scan(const std::string& start, size_t limit) override;
+  void write_metrics(std::ostream& out) override;
+};
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef BATCH_CODEC_H
+#define BATCH_CODEC_H
+
+#include <string>
+#include <vector>
+
+// Wire format of the batch endpoints: a body is a sequence of strings, each
+// a 4-byte big-endian length followed by that many bytes. _mget and _mdel
+// send keys, _mset alternating keys and values. _mget answers one string per
+// requested key, in request order, with length -1 (0xFFFFFFFF) and no bytes
+// for a missing key, like a NULL in Postgres' binary COPY.
+namespace batchcodec {
+  // Returns false when the body is truncated.
+  bool parse(const std::string& body, std::vector<std::string>& out);
+  void append(std::string& out, const std::string& s);
+  void append_missing(std::string& out);
+}
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef BITCASK_BACKEND_H
+#define BITCASK_BACKEND_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdint>
+#include "StorageBackend.h"
+
+// Log-structured hash store (Bitcask). Every write is one append to the
+// active data file; an in-memory keydir maps each live key to the record that
+// holds its value, so a read is a single copy out of the mmap'd file.
+//
+// Records carry a sequence number, which is what orders them on recovery, so
+// the background merge can rewrite live records into new files in any order.
+// Every closed data file has a hint file (keys and locations only), so restart
+// rebuilds the keydir without reading values; only the last active file is
+// scanned.
+class BitcaskBackend : public StorageBackend {
+private:
+  struct DataFile {
+    uint32_t id = 0;
+    int fd = -1;
+    char* map = nullptr;
+    size_t map_size = 0;
+    std::atomic<uint64_t> size{0};  // bytes of valid records
+    std::atomic<uint64_t> dead{0};  // bytes of overwritten or deleted records
+    ~DataFile();
+  };
+
+  struct Loc {
+    uint32_t file = 0;
+    uint32_t vlen = 0;
+    uint64_t offset = 0;  // start of the record
+    uint64_t seq = 0;
+  };
+
+  struct Shard {
+    std::shared_mutex mtx;
+    std::unordered_map<std::string, Loc> keys;
+  };
+
+  static const int SHARDS = 64;
+
+  std::string dir;
+  bool sync;
+  Shard shards[SHARDS];
+
+  std::shared_mutex files_mtx;
+  std::unordered_map<uint32_t, std::shared_ptr<DataFile>> files;
+
+  // Appends are serialised by mtx; syncs of the active file are shared by
+  // every writer that appended before the sync started.
+  std::mutex mtx;
+  std::shared_ptr<DataFile> active;
+  std::string active_hint;  // hint entries of the active file, written on rotation
+  uint32_t next_file = 1;
+  uint64_t seq = 0;
+  std::atomic<uint64_t> appended{0};
+  std::mutex sync_mtx;
+  std::atomic<uint64_t> synced{0};
+
+  std::thread merger;
+  std::mutex merge_mtx;
+  std::condition_variable merge_cv;
+  bool stopping = false;
+
+  std::atomic<long long> live_keys{0};
+  std::atomic<unsigned long long> syncs{0};
+  std::atomic<unsigned long long> merges{0};
+  std::atomic<unsigned long long> reclaimed{0};
+
+  Shard& shard_for(const std::string& key);
+  std::string file_path(uint32_t id, const char* ext) const;
+  std::shared_ptr<DataFile> file(uint32_t id);
+  std::shared_ptr<DataFile> open_file(uint32_t id, bool writable, size_t reserve);
+
+  void recover();
+  void scan_file(DataFile& f, std::unordered_map<std::string, Loc>& keydir,
+    std::unordered_map<std::string, uint64_t>& deleted);
+  void load_hints(const std::string& path, uint32_t id, std::unordered_map<std::string, Loc>& keydir,
+    std::unordered_map<std::string, uint64_t>& deleted);
+  // Recovery: keeps whichever of the known and the given version is newer.
+  void replay(const std::string& key, const Loc& loc, bool tombstone,
+    std::unordered_map<std::string, Loc>& keydir, std::unordered_map<std::string, uint64_t>& deleted);
+
+  Loc append(const std::string& key, const std::string& value, bool tombstone);
+  void rotate(size_t need);
+  void commit(uint64_t position);
+  void mark_dead(const Loc& old, size_t klen);
+
+  void merge_loop();
+  bool merge_due();
+  void merge();
+
+public:
+  explicit BitcaskBackend(const std::string& dir, bool sync=true);
+  ~BitcaskBackend();
+
+  std::pair<bool, std::string> get(const std::string& key) override;
+  bool set(const std::string& key, const std::string& value) override;
+  bool remove(const std::string& key) override;
+  // The keydir is unordered, so a scan sorts every key >= start.
+  std::vector<std::pair<std::string, std::string>> scan(const std::string& start, size_t limit) override;
+  void write_metrics(std::ostream& out) override;
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+// Bloom filter over a fixed key set, serialised as its bit array followed by
+// one byte holding the probe count. Probes use double hashing of one 64-bit hash.
+class BloomFilter {
+private:
+  std::string bits;
+  int probes = 0;
+
+  static uint64_t hash(const std::string& key) {
+    uint64_t h = 1469598103934665603ULL;  // FNV-1a, then a final avalanche
+    for(unsigned char c : key) {
+      h ^= c;
+      h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+public:
+  BloomFilter() = default;
+
+  static std::string build(const std::vector<std::string>& keys, int bits_per_key=10) {
+    int k = std::max(1, std::min(30, (int)(bits_per_key * 0.69)));
+    size_t nbits = std::max((size_t)64, keys.size() * bits_per_key);
+    size_t nbytes = (nbits + 7) / 8;
+    nbits = nbytes * 8;
+    std::string out(nbytes, '\0');
+    for(const std::string& key : keys) {
+      uint64_t h = hash(key);
+      uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32);
+      for(int i=0; i<k; i++) {
+        size_t bit = (h1 + (uint64_t)i * h2) % nbits;
+        out[bit / 8] |= (char)(1 << (bit % 8));
+      }
+    }
+    out.push_back((char)k);
+    return out;
+  }
+
+  explicit BloomFilter(const std::string& data) {
+    if(data.size() < 2) return;
+    probes = (unsigned char)data.back();
+    bits = data.substr(0, data.size() - 1);
+  }
+
+  bool may_contain(const std::string& key) const {
+    if(probes == 0) return true;
+    size_t nbits = bits.size() * 8;
+    uint64_t h = hash(key);
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32);
+    for(int i=0; i<probes; i++) {
+      size_t bit = (h1 + (uint64_t)i * h2) % nbits;
+      if(!(bits[bit / 8] & (1 << (bit % 8)))) return false;
+    }
+    return true;
+  }
+};
+
+#endif
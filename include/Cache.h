@@ -9,6 +9,7 @@
 #include <thread>
 #include <string>
 #include <unordered_map>
+#include <functional>
 
 
 class Cache {
@@ -26,14 +27,29 @@ private:
   int buckets_count;
 
   int hash(const std::string &key);
+  void insert_locked(Bucket &bucket, const std::string &key, const std::string &value);
 public:
   Cache() = default;
+  // capacity 0 disables eviction: the cache then holds every key it is given.
   explicit Cache(int capacity, int buckets_count);
   ~Cache();
 
   std::pair<bool, std::string> get(const std::string &key);
+  // Adds the cached ones of `keys` to `found`, one lock per bucket.
+  void get_many(const std::vector<std::string> &keys, std::unordered_map<std::string, std::string> &found);
   bool set(const std::string &key, const std::string &value);
   bool delete_(const std::string &key);
+  void set_many(const std::unordered_map<std::string, std::string> &entries);
+  void clear();
+  size_t size();
+
+  typedef std::function<void(const std::string&, const std::string&)> Visitor;
+  void for_each(const Visitor &visit);
+  // For a point-in-time copy: lock_all() quiesces every bucket (e.g. around
+  // fork()), and the forked child walks its copy with for_each_unlocked().
+  void lock_all();
+  void unlock_all();
+  void for_each_unlocked(const Visitor &visit) const;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,114 @@
+#ifndef CACHE_COHERENCE_H
+#define CACHE_COHERENCE_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdint>
+#include <libpq-fe.h>
+#include "StorageBackend.h"
+#include "Cache.h"
+#include "Metrics.h"
+
+// Keeps the caches of several server instances on one database coherent.
+// Wraps the instance's store: once a write has reached it, the key is queued,
+// and a publisher thread sends the queued keys every flush interval as
+// pg_notify() payloads on the channel. A listener connection in every
+// instance evicts the keys other instances wrote from its cache.
+//
+// A cache fill that read the store before an eviction arrived must not put
+// the old value back afterwards, so fills go through fill(): keys evicted
+// since the fill's read started are skipped. If the listener loses its
+// connection, notifications may have been missed and the cache is cleared.
+class CacheCoherence : public StorageBackend {
+private:
+  StorageBackend& inner;
+  Cache& cache;
+  std::string conn_string;
+  std::string channel;
+  int flush_ms;
+  std::string origin;
+
+  // Keys waiting to be published, and when the oldest of them was written.
+  std::mutex pub_mtx;
+  std::condition_variable pub_cv;
+  std::unordered_set<std::string> queued;
+  bool queued_clear = false;
+  long long queued_since_us = 0;
+  PGconn* pub_conn = nullptr;
+  std::thread publisher;
+
+  // Evictions, numbered; fills compare against the number they started at.
+  std::mutex fill_mtx;
+  std::atomic<uint64_t> seq{0};
+  struct Eviction {
+    long long at_ms;
+    uint64_t number;
+    std::string key;
+  };
+  std::unordered_map<std::string, uint64_t> recent;
+  std::deque<Eviction> recent_order;
+  uint64_t forgotten_through = 0;
+  PGconn* listen_conn = nullptr;
+  std::thread listener;
+
+  std::mutex stop_mtx;
+  std::condition_variable stop_cv;
+  bool stopping = false;
+
+  LatencyHistogram lag;
+  std::atomic<unsigned long long> published_keys{0};
+  std::atomic<unsigned long long> notifications_sent{0};
+  std::atomic<unsigned long long> publish_failures{0};
+  std::atomic<unsigned long long> notifications_received{0};
+  std::atomic<unsigned long long> evicted_keys{0};
+  std::atomic<unsigned long long> clears{0};
+  std::atomic<unsigned long long> skipped_fills{0};
+  std::atomic<unsigned long long> reconnects{0};
+
+  PGconn* connect_listener();
+  void publish(const std::string& key);
+  bool send(const std::vector<std::string>& keys, bool clear, long long since_us);
+  void publish_loop();
+  void listen_loop();
+  void apply(const char* payload);
+  void evict_all();
+  void forget_old();
+
+public:
+  CacheCoherence(StorageBackend& inner, Cache& cache, const std::string& conn_string,
+    const std::string& channel="kv_invalidate", int flush_ms=5);
+  ~CacheCoherence();
+
+  // Number to take before reading the store for a cache fill.
+  uint64_t sequence() const { return seq.load(std::memory_order_acquire); }
+  // Puts rows read from the store into the cache, except keys another
+  // instance wrote since `since`.
+  void fill(const std::unordered_map<std::string, std::string>& rows, uint64_t since);
+  void fill(const std::string& key, const std::string& value, uint64_t since);
+  // Tells the other instances to drop their whole cache (e.g. after a bulk
+  // import whose keys are not tracked).
+  void publish_clear();
+
+  std::pair<bool, std::string> get(const std::string& key) override { return inner.get(key); }
+  std::unordered_map<std::string, std::string> get_many(const std::vector<std::string>& keys) override {
+    return inner.get_many(keys);
+  }
+  bool set(const std::string& key, const std::string& value) override;
+  bool remove(const std::string& key) override;
+  void write_batch(const std::vector<std::pair<std::string, std::string>>& sets,
+    const std::vector<std::string>& removes) override;
+  std::vector<std::pair<std::string, std::string>> scan(const std::string& start, size_t limit) override {
+    return inner.scan(start, limit);
+  }
+  void write_metrics(std::ostream& out) override;
+};
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef CHANGE_LOG_H
+#define CHANGE_LOG_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+// Ordered, bounded in-memory log of the PUT and DELETE events this instance
+// acknowledged, for change streams. Sequence numbers start from the startup
+// time in microseconds, so they keep increasing across restarts and a
+// consumer resuming from a previous run is told it missed events rather than
+// silently skipping ahead. The oldest events are dropped once the log holds
+// max_events or max_bytes; readers never slow writers down.
+class ChangeLog {
+public:
+  struct Event {
+    uint64_t seq;
+    bool removed;
+    std::string key;
+    std::string value;
+  };
+
+  // Events gathered before their writes commit (bulk imports), trimmed to
+  // the log's limits as they come; the older ones become a gap.
+  struct Batch {
+    std::deque<Event> events;
+    size_t bytes = 0;
+    uint64_t skipped = 0;
+  };
+
+private:
+  size_t max_events;
+  size_t max_bytes;
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::deque<Event> events;
+  size_t bytes = 0;
+  uint64_t next_seq;
+
+  std::atomic<unsigned long long> appended{0};
+  std::atomic<unsigned long long> dropped{0};
+  std::atomic<int> streams{0};
+  std::atomic<unsigned long long> resets{0};
+
+public:
+  ChangeLog(size_t max_events, size_t max_bytes);
+
+  // Callers append with the key's writes serialised (KeyService stripes),
+  // so events for one key are logged in the order the store applied them.
+  uint64_t append(bool removed, const std::string& key, const std::string& value);
+  void hold(Batch& batch, bool removed, const std::string& key, const std::string& value);
+  // Appends a batch after its gap, which streams behind it are told they
+  // missed.
+  void append(Batch& batch);
+  uint64_t last_seq();
+  // Whether every event after `since` is still held.
+  bool covers(uint64_t since);
+  // Copies up to `limit` events after `since` into `out`, waiting up to
+  // wait_ms for the first one. Returns false when some of them were dropped.
+  bool read(uint64_t since, size_t limit, std::vector<Event>& out, int wait_ms);
+
+  // Stream slots, since every open stream holds a server thread.
+  bool open_stream(int max_streams);
+  void close_stream() { streams.fetch_sub(1); }
+  void count_reset() { resets.fetch_add(1, std::memory_order_relaxed); }
+  void write_metrics(std::ostream& out);
+};
+
+#endif
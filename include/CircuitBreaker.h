@@ -0,0 +1,95 @@
+#ifndef CIRCUIT_BREAKER_H
+#define CIRCUIT_BREAKER_H
+
+#include <ostream>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <exception>
+#include "Exceptions.h"
+
+// Fail-fast guard around a store. Closed, it counts the outcome and latency
+// of every call over a sliding window and opens once enough of them failed
+// or were slow. Open, calls are rejected at once with a 503 instead of each
+// waiting out a dead or saturated database. After open_ms it turns half-open
+// and admits one probe call at a time; `probes` probes in a row that succeed
+// in time close it again, any failed or slow probe reopens it.
+class CircuitBreaker {
+public:
+  typedef std::chrono::steady_clock Clock;
+  enum State { CLOSED = 0, OPEN = 1, HALF_OPEN = 2 };
+
+  struct Config {
+    bool enabled = true;
+    int window_ms = 10000;
+    int min_calls = 20;
+    int error_percent = 50;
+    int slow_ms = 1000;      // 0 ignores latency
+    int slow_percent = 80;
+    int open_ms = 5000;
+    int probes = 3;
+  };
+
+  // RAII admission of one call: throws when the breaker rejects it, and
+  // records the call as failed if it is left by an exception. A call that
+  // failed because the request ran out of time only counts by its latency,
+  // so clients sending short deadlines cannot trip the breaker; a probe that
+  // runs out of time has failed.
+  class Call {
+  private:
+    CircuitBreaker& breaker;
+    bool probe = false;
+    int exceptions;
+    Clock::time_point start;
+  public:
+    explicit Call(CircuitBreaker& breaker);
+    ~Call();
+    Call(const Call&) = delete;
+    Call& operator=(const Call&) = delete;
+  };
+
+private:
+  static const int BUCKETS = 10;
+
+  struct Bucket {
+    long long epoch = -1;
+    unsigned long long calls = 0;
+    unsigned long long errors = 0;
+    unsigned long long slow = 0;
+  };
+
+  Config config;
+  long long bucket_ms;
+  std::mutex mtx;
+  // Written under mtx; read without it on the closed fast path.
+  std::atomic<int> state{CLOSED};
+  Bucket buckets[BUCKETS];
+  Clock::time_point opened_at;
+  bool probing = false;
+  int probe_successes = 0;
+
+  std::atomic<unsigned long long> trips{0};
+  std::atomic<unsigned long long> rejected{0};
+  std::atomic<unsigned long long> probes{0};
+
+  void open(Clock::time_point now);
+  void close();
+
+public:
+  CircuitBreaker();
+  explicit CircuitBreaker(const Config& config);
+
+  const Config& settings() const { return config; }
+  State current() const { return (State)state.load(std::memory_order_acquire); }
+
+  // Returns false when the call must be rejected; `probe` is set when the
+  // call is the half-open probe.
+  bool admit(bool& probe);
+  // Whether a call now would be admitted as the half-open probe.
+  bool probe_due();
+  void record(bool probe, bool failed, Clock::duration elapsed);
+  void write_metrics(std::ostream& out, const std::string& prefix);
+};
+
+#endif
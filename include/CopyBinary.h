@@ -0,0 +1,34 @@
+#ifndef COPY_BINARY_H
+#define COPY_BINARY_H
+
+#include <string>
+#include <functional>
+#include "Exceptions.h"
+
+// Incremental parser for the Postgres binary COPY format restricted to
+// (key TEXT, value TEXT) tuples. Bytes may arrive in arbitrary chunks; only
+// the tail of an incomplete tuple is buffered between feed() calls.
+class CopyBinaryParser {
+public:
+  typedef std::function<void(const char* key, size_t key_len, const char* value, size_t value_len)> RowHandler;
+
+private:
+  RowHandler on_row;
+  std::string pending;
+  bool header_done = false;
+  bool finished = false;
+  size_t rows_seen = 0;
+
+  size_t parse(const char* data, size_t len);
+
+public:
+  explicit CopyBinaryParser(RowHandler on_row) : on_row(std::move(on_row)) {}
+
+  void feed(const char* data, size_t len);
+  bool done() const { return finished; }
+  size_t rows() const { return rows_seen; }
+
+  static const char SIGNATURE[11];
+};
+
+#endif
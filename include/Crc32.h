@@ -0,0 +1,24 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <cstdint>
+#include <cstddef>
+
+// CRC-32 (IEEE 802.3, reflected) used to detect torn or corrupt log records.
+inline uint32_t crc32(const char* data, size_t len, uint32_t crc=0) {
+  static uint32_t table[256];
+  static bool ready = [](){
+    for(uint32_t i=0; i<256; i++) {
+      uint32_t c = i;
+      for(int k=0; k<8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+    return true;
+  }();
+  (void)ready;
+  crc = ~crc;
+  for(size_t i=0; i<len; i++) crc = table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+#endif
@@ -3,33 +3,132 @@
 
 #include <iostream>
 #include <string>
-#include <queue>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
 #include <libpq-fe.h>
 #include <condition_variable>
 #include <mutex>
+#include "MPMCRing.h"
+#include "Metrics.h"
+#include "SchemaProfile.h"
+#include "CircuitBreaker.h"
+#include "StorageBackend.h"
 #include "Exceptions.h"
 
-class DBConnectionPool {
+class DBConnectionPool : public StorageBackend {
 private:
-  std::queue<PGconn*> conn_queue;
-  int size;
+  // A pooled connection. `busy` is the ownership flag claimed with a CAS;
+  // `queued` records whether the free ring currently holds an entry for it,
+  // so a connection taken through thread affinity is never enqueued twice.
+  struct Conn {
+    PGconn* pg = nullptr;
+    std::atomic<bool> busy{true};
+    std::atomic<bool> queued{false};
+    std::atomic<long long> last_used{0};
+    // Owned by the maintenance thread while the connection is broken.
+    int backoff_ms = 0;
+    std::chrono::steady_clock::time_point next_retry;
+  };
+
+  // RAII handle on a pooled connection: always hands it back to the pool,
+  // including when the query in between throws. The breaker admits the call
+  // before a connection is waited for, and sees how the lease ended.
+  class ConnLease {
+  private:
+    DBConnectionPool& pool;
+    CircuitBreaker::Call call;
+    Conn* conn;
+    bool discarded = false;
+  public:
+    explicit ConnLease(DBConnectionPool& pool) : pool(pool), call(pool.breaker), conn(pool.acquire_conn()) {}
+    ~ConnLease() { pool.release_conn(conn, discarded); }
+    ConnLease(const ConnLease&) = delete;
+    ConnLease& operator=(const ConnLease&) = delete;
+
+    PGconn* pg() const { return conn->pg; }
+    // The connection is left mid-query: reconnect it instead of reusing it.
+    void discard() { discarded = true; }
+    bool is_discarded() const { return discarded; }
+  };
+
+  // Slots [0, size) are live; the pool grows and shrinks at the top slot
+  // between min_size and max_size.
+  Conn* conns = nullptr;
+  std::atomic<int> size{0};
+  int min_size = 0;
+  int max_size = 0;
+  MPMCRing<Conn*> ring;
+  std::atomic<int> waiters{0};
+  std::atomic<bool> grow_requested{false};
   std::mutex mtx;
   std::condition_variable cv;
   std::string conn_string;
 
-  PGconn* acquire_conn();
+  SchemaProfile schema;
+  CircuitBreaker breaker;
+  std::string q_get, q_get_many, q_set, q_remove, q_scan, q_set_many, q_remove_many;
+
+  // Background reconnect and idle health probing.
+  std::vector<Conn*> broken;
+  std::mutex maint_mtx;
+  std::condition_variable maint_cv;
+  std::thread maint_thread;
+  bool stopping = false;
+
+  LatencyHistogram acquire_wait;
+  std::atomic<unsigned long long> grown{0};
+  std::atomic<unsigned long long> shrunk{0};
+  std::atomic<unsigned long long> acquire_timeouts{0};
+  std::atomic<unsigned long long> cancels{0};
+  unsigned long long last_wait_count = 0;
+  unsigned long long last_wait_sum = 0;
+
+  bool try_claim(Conn* conn);
+  Conn* acquire_conn();
+  void release_conn(Conn* conn, bool discard=false);
+  void return_conn(Conn* conn);
+  void mark_broken(Conn* conn);
+  void maintenance_loop();
+  void reconnect_broken();
+  void probe_idle();
+  void probe_breaker();
+  void resize();
+  PGconn* connect();
+  // Honours the calling thread's request deadline (see Deadline.h).
+  PGresult* exec_params(ConnLease& conn, const std::string& query, int nparams, const char* const* params);
 
 public:
 
   DBConnectionPool() = default;
-  explicit DBConnectionPool(const std::string& conn_string, int n=8);
+  explicit DBConnectionPool(const std::string& conn_string, int min_size=8, int max_size=8,
+    const SchemaProfile& schema=SchemaProfile(),
+    const CircuitBreaker::Config& breaker=CircuitBreaker::Config());
   ~DBConnectionPool();
 
-  void createPool();
-  std::pair<bool, std::string> get(std::string key);
-  bool set(std::string key, std::string value);
-  bool remove(std::string key);
+  void createPool(bool create_schema=true);
+  const SchemaProfile& profile() const { return schema; }
+  const CircuitBreaker::Config& breaker_config() const { return breaker.settings(); }
+  void write_metrics(std::ostream& out, const std::string& prefix);
+  void write_metrics(std::ostream& out) override { write_metrics(out, "db_pool"); }
+  std::pair<bool, std::string> get(const std::string& key) override;
+  std::unordered_map<std::string, std::string> get_many(const std::vector<std::string>& keys) override;
+  bool set(const std::string& key, const std::string& value) override;
+  bool remove(const std::string& key) override;
+  void write_batch(const std::vector<std::pair<std::string, std::string>>& sets,
+    const std::vector<std::string>& removes) override;
+  std::vector<std::pair<std::string, std::string>> scan(const std::string& start, size_t limit) override;
+
+  // Streaming bulk transfer in Postgres binary COPY format. `read_body` pulls
+  // the request body and passes every chunk to the given feed; `write`
+  // receives export chunks and returns false to abort.
+  typedef std::function<bool(const char*, size_t)> ChunkSink;
+  size_t import_copy(const std::function<bool(const ChunkSink&)>& read_body, bool upsert=true);
+  bool export_copy(const ChunkSink& write);
 };
- 
+
 
 #endif
\ No newline at end of file
@@ -0,0 +1,43 @@
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include <chrono>
+
+// Deadline of the request being served on this thread. The HTTP handlers set
+// it with a Scope; the storage layers below read it to bound their waits, so
+// it needs no parameter on every StorageBackend call. Threads that work on
+// behalf of a request (batch dispatchers, shard fan-out) carry it over.
+namespace deadline {
+  typedef std::chrono::steady_clock Clock;
+
+  inline Clock::time_point& current() {
+    static thread_local Clock::time_point at = Clock::time_point::max();
+    return at;
+  }
+
+  inline bool bounded() {
+    return current() != Clock::time_point::max();
+  }
+
+  inline bool expired() {
+    return bounded() && Clock::now() >= current();
+  }
+
+  // Milliseconds left, 0 once expired; only meaningful when bounded().
+  inline long long remaining_ms() {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(current() - Clock::now()).count();
+    return left > 0 ? left : 0;
+  }
+
+  class Scope {
+  private:
+    Clock::time_point saved;
+  public:
+    explicit Scope(Clock::time_point at) : saved(current()) { current() = at; }
+    ~Scope() { current() = saved; }
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+  };
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef FILE_UTIL_H
+#define FILE_UTIL_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "Exceptions.h"
+
+// Small POSIX file helpers shared by the embedded storage engines.
+// All failures throw Exception_ with the errno text.
+namespace fileutil {
+  void make_dirs(const std::string& path);
+  std::vector<std::string> list_dir(const std::string& dir);
+  bool exists(const std::string& path);
+  std::string read_file(const std::string& path);
+  // Writes path.tmp, syncs it, renames over path and syncs the directory.
+  void write_file_atomic(const std::string& path, const std::string& contents);
+  void sync_dir(const std::string& dir);
+  std::string dir_of(const std::string& path);
+
+  void write_all(int fd, const char* data, size_t len, const std::string& what);
+  void pwrite_all(int fd, const char* data, size_t len, uint64_t off, const std::string& what);
+  void pread_all(int fd, char* buf, size_t len, uint64_t off, const std::string& what);
+}
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef HASH_RING_H
+#define HASH_RING_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Consistent-hash ring over nodes 0..n-1, each placed at `vnodes` points.
+// A node's points depend only on its index, so appending a node moves only
+// the keys that now fall on its points (about 1/n of them).
+class HashRing {
+private:
+  std::vector<std::pair<uint64_t, int>> points;  // sorted by hash
+  int count;
+
+public:
+  HashRing(int nodes, int vnodes);
+
+  int owner(const std::string& key) const;
+  int nodes() const { return count; }
+
+  static uint64_t hash(const char* data, size_t len);
+};
+
+#endif
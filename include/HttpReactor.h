@@ -0,0 +1,162 @@
+#ifndef HTTP_REACTOR_H
+#define HTTP_REACTOR_H
+
+#include <iostream>
+#include <string>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+
+#include "httplib.h"
+
+// HTTP/1.1 front end on one edge-triggered epoll thread. Sockets are
+// non-blocking and each connection only holds its buffers and parser state;
+// a request goes to a worker once it has been read completely, so idle
+// keep-alive connections cost memory, not threads. Pipelined requests on a
+// connection are answered in order, one at a time.
+//
+// With io_uring the same thread drives one ring instead: a multishot accept,
+// a multishot recv per connection into a registered ring of provided
+// buffers, sockets in the registered file table, and the sends queued while
+// reaping submitted together with the next wait, so a busy loop makes one
+// system call for many requests. Kernels without it (before 6.0) get epoll.
+//
+// Responses with a content provider (streams) are written by their worker,
+// which holds the connection until the stream ends.
+class HttpReactor {
+public:
+  typedef std::function<void(const httplib::Request&, httplib::Response&)> Handler;
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Connection {
+    int fd;
+    uint64_t id;
+    std::string in;
+    size_t pos = 0;
+    std::string out;
+    size_t sent = 0;
+    Clock::time_point active;
+
+    // Parser state of the request at `pos`.
+    size_t scanned = 0;
+    size_t body_at = 0;
+    size_t body_length = 0;
+    bool chunked = false;
+    bool headers_done = false;
+    httplib::Request req;
+
+    // A request is with a worker, which owns the socket's write side.
+    bool busy = false;
+    // Close once the requests already read are answered.
+    bool closing = false;
+    // A write failed while busy; close when the worker is done.
+    bool broken = false;
+    // Reading stopped at REACTOR_PIPELINE_MAX until the worker is done.
+    bool paused = false;
+
+    // io_uring: `out` is only appended to when empty, so a send in flight
+    // owns it. Operations in flight keep the descriptor open.
+    bool sending = false;
+    bool recv_armed = false;
+    bool dead = false;
+    int inflight = 0;
+  };
+  struct UringState;
+
+  struct Completion {
+    int fd;
+    uint64_t id;
+    std::string out;
+    bool close;
+  };
+
+  Handler handler;
+  size_t workers_count;
+  size_t max_connections;
+  int idle_timeout_ms;
+  size_t max_body;
+  bool use_uring;
+
+  int epoll_fd = -1;
+  int listen_fd = -1;
+  int wake_fd = -1;
+  std::atomic<bool> stopping{false};
+  bool accept_pending = false;
+
+  std::unique_ptr<UringState> uring;
+  std::unique_ptr<httplib::ThreadPool> workers;
+  std::unordered_map<int, std::unique_ptr<Connection>> connections;
+  uint64_t next_id = 1;
+
+  std::mutex completions_mtx;
+  std::vector<Completion> completions;
+
+  std::atomic<size_t> open_count{0};
+  std::atomic<unsigned long long> accepted{0};
+  std::atomic<unsigned long long> rejected{0};
+  std::atomic<unsigned long long> requests{0};
+  std::atomic<unsigned long long> idle_closed{0};
+  std::atomic<bool> ring_active{false};
+  std::atomic<unsigned long long> ring_enters{0};
+
+  void run_epoll();
+  bool start_uring();
+  void run_uring();
+  // Takes an accepted socket; null when it was refused.
+  Connection* add_connection(int fd);
+  void accept_all();
+  void on_readable(Connection& conn);
+  // Reads again after a pause.
+  void resume(Connection& conn);
+  // Returns false when the socket failed.
+  bool write_out(Connection& conn);
+  // Writes what is queued, then dispatches the next complete request or
+  // closes the connection.
+  void settle(Connection& conn);
+  void close_connection(int fd);
+
+  // io_uring submissions; `op` tags the completion.
+  uint64_t tag(const Connection& conn, unsigned op) const;
+  void arm(unsigned op);
+  void arm_recv(Connection& conn);
+  void send_out(Connection& conn);
+  // Cancels the connection's `op`, or everything on it for 0.
+  void cancel(Connection& conn, unsigned op);
+  // Closes a dead connection once nothing is in flight.
+  void finalize(Connection& conn);
+  void on_completion(uint64_t user_data, int res, unsigned flags);
+
+  // 0 when more bytes are needed, 1 when the request is complete, otherwise
+  // the status of the error response.
+  int parse(Connection& conn);
+  void fail(Connection& conn, int status);
+  void dispatch(Connection& conn);
+  void serve(int fd, uint64_t id, httplib::Request& req);
+  void complete(Completion completion);
+  void drain_completions();
+  void close_idle();
+
+public:
+  // `workers` threads run the handler; max_body bounds a request body
+  // (chunked or not) and idle_timeout_ms closes quiet keep-alive connections
+  // (0 keeps them). io_uring asks for the io_uring loop.
+  HttpReactor(Handler handler, size_t workers, size_t max_connections, int idle_timeout_ms, size_t max_body,
+    bool io_uring=false);
+  ~HttpReactor();
+
+  // Binds and serves on the calling thread until stop(); returns false when
+  // the port cannot be bound.
+  bool listen(const std::string& host, int port);
+  void stop();
+  void write_metrics(std::ostream& out);
+};
+
+#endif
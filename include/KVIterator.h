@@ -0,0 +1,43 @@
+#ifndef KV_ITERATOR_H
+#define KV_ITERATOR_H
+
+#include <string>
+#include <vector>
+#include <memory>
+
+// Ordered cursor over (key, value) entries; deletions surface as tombstones
+// so that newer sources can shadow older ones when merged.
+class KVIterator {
+public:
+  virtual ~KVIterator() = default;
+  virtual bool valid() const = 0;
+  virtual void seek_to_first() = 0;
+  virtual void seek(const std::string& target) = 0;  // first key >= target
+  virtual void next() = 0;
+  virtual const std::string& key() const = 0;
+  virtual const std::string& value() const = 0;
+  virtual bool tombstone() const = 0;
+};
+
+// Merges child iterators given newest first. Each key appears once, taken
+// from the newest child that has it; tombstones are passed through.
+class MergingIterator : public KVIterator {
+private:
+  std::vector<std::unique_ptr<KVIterator>> children;
+  int current = -1;
+
+  void pick();
+
+public:
+  explicit MergingIterator(std::vector<std::unique_ptr<KVIterator>> children);
+
+  bool valid() const override { return current >= 0; }
+  void seek_to_first() override;
+  void seek(const std::string& target) override;
+  void next() override;
+  const std::string& key() const override { return children[current]->key(); }
+  const std::string& value() const override { return children[current]->value(); }
+  bool tombstone() const override { return children[current]->tombstone(); }
+};
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef KEY_SERVICE_H
+#define KEY_SERVICE_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdint>
+#include "StorageBackend.h"
+#include "Cache.h"
+#include "CacheCoherence.h"
+#include "ChangeLog.h"
+#include "MissBatcher.h"
+
+// The key operations every front end (HTTP, RESP) serves: reads from the
+// cache with coalesced miss fetches, writes through the store with the
+// cache, coherence and change-log bookkeeping, and key expiry. Operations
+// throw Exception_ like the store and run under the caller's deadline.
+//
+// Expiry times live in memory only: they do not survive a restart and other
+// instances do not see them. Expired keys are removed when next read and by
+// a sweeper thread. The 32-bit client flags memcached clients store with a
+// value are kept the same way, next to it rather than in the store; any
+// write that does not carry them resets them to 0.
+class KeyService {
+private:
+  static const int STRIPES = 256;
+
+  StorageBackend& store;
+  Cache& cache;
+  bool cache_authoritative;
+  CacheCoherence* coherence;
+  ChangeLog* changes;
+  MissBatcher misses;
+
+  // Held around a key's store write and its bookkeeping, so the change log
+  // sees one key's writes in the order the store applied them and an expiry
+  // never removes a newer write.
+  std::mutex stripes[STRIPES];
+
+  // Steady-clock milliseconds when each key expires.
+  std::mutex expiry_mtx;
+  std::unordered_map<std::string, int64_t> expiry;
+  std::set<std::pair<int64_t, std::string>> expiry_order;
+  std::atomic<size_t> expiring{0};
+
+  // Non-zero client flags by key.
+  std::mutex flags_mtx;
+  std::unordered_map<std::string, uint32_t> client_flags;
+  std::atomic<size_t> flagged{0};
+
+  std::thread sweeper;
+  std::mutex sweeper_mtx;
+  std::condition_variable sweeper_cv;
+  bool stopping = false;
+
+  std::atomic<unsigned long long> expired{0};
+
+  static int64_t now_ms();
+  std::mutex& stripe(const std::string& key);
+  // The stripes of several keys, each once, locked in a fixed order so two
+  // batches cannot deadlock.
+  std::vector<std::unique_lock<std::mutex>> lock_many(const std::vector<std::string>& keys);
+
+  std::unordered_map<std::string, std::string> fetch(const std::vector<std::string>& keys);
+  bool due(const std::string& key);
+  // Drops the expiry of keys just written; call with their stripes held.
+  void drop_expiry(const std::vector<std::string>& keys);
+  void drop_expiry(const std::string& key);
+  // With the key's stripe held; `at` in now_ms() time.
+  void put_expiry(const std::string& key, int64_t at);
+  // With the key's stripe held.
+  void put_flags(const std::string& key, uint32_t flags);
+  // With the key's stripe held.
+  std::pair<bool, std::string> read_locked(const std::string& key);
+  void set_locked(const std::string& key, const std::string& value, uint32_t flags, long long ttl_ms);
+  bool remove_locked(const std::string& key);
+  // Removes the key if it is still due.
+  bool expire_now(const std::string& key);
+  void sweep_loop();
+
+public:
+  enum Condition { IF_ABSENT, IF_PRESENT, IF_VERSION };
+  enum Outcome { WRITTEN, FAILED, MISSING };
+  // The ttl_ms of a write: 0 drops the key's expiry, a positive value sets
+  // it, a negative one stores the key already expired (removes it), and
+  // KEEP_TTL leaves it as it was.
+  static constexpr long long KEEP_TTL = INT64_MIN;
+
+  KeyService(StorageBackend& store, Cache& cache, bool cache_authoritative,
+    CacheCoherence* coherence, ChangeLog* changes,
+    int batch_inflight, size_t batch_max, int batch_window_us);
+  ~KeyService();
+
+  std::pair<bool, std::string> get(const std::string& key);
+  void set(const std::string& key, const std::string& value, uint32_t flags=0, long long ttl_ms=0);
+  // Returns false when the key did not exist.
+  bool remove(const std::string& key);
+
+  // Found keys only; keys may repeat.
+  std::unordered_map<std::string, std::string> get_many(const std::vector<std::string>& keys);
+  // One write_batch each; keys are distinct.
+  void set_many(const std::unordered_map<std::string, std::string>& entries);
+  void remove_many(const std::vector<std::string>& keys);
+
+  // Version of a value for compare-and-set: a hash of its bytes, never 0,
+  // so a compare-and-set only fails when the value itself changed.
+  static uint64_t version_of(const std::string& value);
+  // Writes decided under the key's stripe. IF_ABSENT fails when the key
+  // exists; IF_PRESENT and IF_VERSION are MISSING when it does not, and
+  // IF_VERSION fails when the current value is not at `version`.
+  Outcome set_if(const std::string& key, const std::string& value, Condition condition, uint64_t version=0,
+    uint32_t flags=0, long long ttl_ms=0);
+  // Removes the key only when its value is at `version`.
+  Outcome remove_if(const std::string& key, uint64_t version);
+
+  // Expires an existing key after `ms` (at once when ms <= 0); returns false
+  // when the key does not exist. Writing the key drops its expiry.
+  bool expire(const std::string& key, long long ms);
+  // Drops the key's expiry; returns false when the key does not exist.
+  bool persist(const std::string& key);
+  // Milliseconds left, -1 without an expiry, -2 when the key does not exist.
+  long long ttl(const std::string& key);
+  // Client flags the key was last written with.
+  uint32_t flags_of(const std::string& key);
+
+  // For writes that bypass the service (bulk imports): whether the key has
+  // an expiry or client flags, and dropping those of keys once written.
+  bool tracks(const std::string& key);
+  void forget(const std::vector<std::string>& keys);
+
+  void write_metrics(std::ostream& out);
+};
+
+#endif
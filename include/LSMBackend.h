@@ -0,0 +1,107 @@
+#ifndef LSM_BACKEND_H
+#define LSM_BACKEND_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdint>
+#include "StorageBackend.h"
+#include "MemTable.h"
+#include "SSTable.h"
+
+// Embedded log-structured merge tree.
+//
+// Writes are appended to a write-ahead log (group commit: one leader writes
+// and syncs the records of every queued writer) and then inserted into the
+// skiplist memtable. A full memtable becomes immutable and is flushed to a
+// level-0 SSTable by the background thread, which also runs leveled
+// compaction: L0 merges into L1 once it holds L0_COMPACT_TRIGGER files, and
+// level N merges one file at a time into N+1 once it outgrows its byte budget.
+// The live file set is recorded in MANIFEST, rewritten atomically on change.
+class LSMBackend : public StorageBackend {
+private:
+  static const int LEVELS = 7;
+
+  // Immutable snapshot of the table set. L0 is newest first and may overlap;
+  // L1+ are sorted by key range and disjoint.
+  struct Version {
+    std::vector<std::shared_ptr<SSTable>> files[LEVELS];
+  };
+
+  struct Writer {
+    const std::string& key;
+    const std::string& value;
+    bool tombstone;
+    bool done = false;
+    std::string error;
+    std::condition_variable cv;
+
+    Writer(const std::string& key, const std::string& value, bool tombstone)
+      : key(key), value(value), tombstone(tombstone) {}
+  };
+
+  std::string dir;
+  bool sync;
+
+  std::mutex mtx;
+  std::condition_variable bg_cv;
+  std::condition_variable room_cv;
+  std::deque<Writer*> writers;
+  std::shared_ptr<MemTable> mem;
+  std::shared_ptr<MemTable> imm;
+  std::shared_ptr<const Version> version;
+  uint64_t next_file = 1;
+  uint64_t wal_number = 0;
+  uint64_t manifest_log = 0;  // oldest WAL not yet flushed to a table
+  uint64_t seq = 0;
+  int wal_fd = -1;
+  size_t compact_pointer[LEVELS] = {0};
+  std::thread bg;
+  bool stopping = false;
+  std::string bg_error;
+
+  std::atomic<unsigned long long> wal_syncs{0};
+  std::atomic<unsigned long long> wal_records{0};
+  std::atomic<unsigned long long> flushes{0};
+  std::atomic<unsigned long long> compactions{0};
+  std::atomic<unsigned long long> compaction_bytes{0};
+
+  std::string file_path(uint64_t number, const char* ext) const;
+  void recover();
+  void replay_wal(const std::string& path, MemTable& target);
+  void open_wal();
+  void write_manifest(const Version& v, uint64_t log_number);
+  // Writes entries from `it` until it is exhausted or the table reaches
+  // max_bytes; returns null when nothing was written.
+  std::shared_ptr<SSTable> write_table(KVIterator& it, uint64_t number, bool drop_tombstones,
+    uint64_t max_bytes);
+
+  void write(const std::string& key, const std::string& value, bool tombstone);
+  void make_room(std::unique_lock<std::mutex>& lock);
+
+  void background_loop();
+  void flush_imm();
+  int pick_compaction(const Version& v) const;
+  void compact(int level);
+  void install(std::shared_ptr<const Version> v);
+
+  void snapshot(std::shared_ptr<MemTable>& m, std::shared_ptr<MemTable>& im,
+    std::shared_ptr<const Version>& v);
+
+public:
+  explicit LSMBackend(const std::string& dir, bool sync=true);
+  ~LSMBackend();
+
+  std::pair<bool, std::string> get(const std::string& key) override;
+  bool set(const std::string& key, const std::string& value) override;
+  bool remove(const std::string& key) override;
+  std::vector<std::pair<std::string, std::string>> scan(const std::string& start, size_t limit) override;
+  void write_metrics(std::ostream& out) override;
+};
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef MPMC_RING_H
+#define MPMC_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Bounded lock-free multi-producer/multi-consumer ring (Vyukov sequence cells).
+// Capacity is rounded up to a power of two; push fails when full, pop when empty.
+template <typename T>
+class MPMCRing {
+private:
+  struct Cell {
+    std::atomic<size_t> seq;
+    T data;
+  };
+
+  Cell* cells;
+  size_t mask;
+  alignas(64) std::atomic<size_t> enqueue_pos;
+  alignas(64) std::atomic<size_t> dequeue_pos;
+
+public:
+  explicit MPMCRing(size_t capacity=1) : enqueue_pos(0), dequeue_pos(0) {
+    size_t cap = 1;
+    while(cap < capacity) cap <<= 1;
+    mask = cap - 1;
+    cells = new Cell[cap];
+    for(size_t i=0; i<cap; i++) cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  ~MPMCRing() {
+    delete [] cells;
+    cells = nullptr;
+  }
+
+  MPMCRing(const MPMCRing&) = delete;
+  MPMCRing& operator=(const MPMCRing&) = delete;
+
+  size_t capacity() const { return mask + 1; }
+
+  bool push(const T& value) {
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    for(;;) {
+      Cell& cell = cells[pos & mask];
+      size_t seq = cell.seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if(diff == 0) {
+        if(enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          cell.data = value;
+          cell.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if(diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool pop(T& value) {
+    size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    for(;;) {
+      Cell& cell = cells[pos & mask];
+      size_t seq = cell.seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if(diff == 0) {
+        if(dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          value = cell.data;
+          cell.seq.store(pos + mask + 1, std::memory_order_release);
+          return true;
+        }
+      } else if(diff < 0) {
+        return false;
+      } else {
+        pos = dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+};
+
+#endif
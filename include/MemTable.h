@@ -0,0 +1,47 @@
+#ifndef MEM_TABLE_H
+#define MEM_TABLE_H
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include "SkipList.h"
+#include "KVIterator.h"
+
+// In-memory write buffer of the LSM tree. Every write is a new skiplist entry
+// ordered by (key ascending, sequence descending), so the newest version of a
+// key is always found first and readers never see an entry change.
+class MemTable : public std::enable_shared_from_this<MemTable> {
+private:
+  struct Entry {
+    std::string key;
+    uint64_t seq = 0;
+    bool tombstone = false;
+    std::string value;
+  };
+
+  struct Compare {
+    int operator()(const Entry& a, const Entry& b) const {
+      int c = a.key.compare(b.key);
+      if(c != 0) return c;
+      return a.seq > b.seq ? -1 : (a.seq < b.seq ? 1 : 0);
+    }
+  };
+
+  SkipList<Entry, Compare> list;
+  std::atomic<size_t> bytes{0};
+  std::atomic<size_t> count{0};
+
+  class Iterator;
+
+public:
+  // Single writer; concurrent get() and iterators are safe.
+  void add(uint64_t seq, const std::string& key, const std::string& value, bool tombstone);
+  bool get(const std::string& key, std::string& value, bool& tombstone) const;
+  std::unique_ptr<KVIterator> iterator() const;
+
+  size_t memory() const { return bytes.load(std::memory_order_relaxed); }
+  size_t entries() const { return count.load(std::memory_order_relaxed); }
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef MEMCACHE_SERVER_H
+#define MEMCACHE_SERVER_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include "KeyService.h"
+#include "TcpServer.h"
+
+// memcached text protocol listener over the same KeyService as the HTTP
+// routes. Serves the classic commands (get, gets, gat, gats, set, add,
+// replace, cas, delete, touch, version, verbosity, quit) and the meta
+// commands (mg, ms, md, mn), so quiet meta gets can be pipelined and
+// closed with mn.
+//
+// Client flags are kept in the KeyService's memory next to the value, not in
+// the store (append, prepend, incr and decr keep them, and the expiry too).
+// CAS values are KeyService versions,
+// derived from the value itself.
+// The binary protocol is not spoken; such connections are closed.
+class MemcacheServer {
+private:
+  class Connection;
+
+  KeyService& keys;
+  int timeout_ms;
+
+  std::atomic<unsigned long long> commands{0};
+  std::atomic<unsigned long long> errors{0};
+
+  // Last, so its connections are gone before the members they use.
+  TcpServer listener;
+
+  // Appends the reply to `out`; `data` is the value block of a storage
+  // command. Returns false when the connection closes.
+  bool execute(std::vector<std::string>& tokens, const std::string& data, std::string& out);
+  void meta_get(const std::vector<std::string>& tokens, std::string& out);
+  void meta_set(const std::vector<std::string>& tokens, const std::string& data, std::string& out);
+  void meta_delete(const std::vector<std::string>& tokens, std::string& out);
+  // Expires the key after `ms`, removes it when ms < 0, leaves it for 0.
+  void apply_ttl(const std::string& key, long long ms);
+  // Rewrites an existing value by compare-and-set, retrying when another
+  // write got in between. FAILED when `change` refuses the current value.
+  // The key keeps its expiry unless ttl_ms (as in KeyService::set) replaces it.
+  KeyService::Outcome modify(const std::string& key, const std::function<bool(std::string&)>& change,
+    long long ttl_ms=KeyService::KEEP_TTL);
+
+public:
+  // timeout_ms bounds every command like REQUEST_TIMEOUT_MS does a request;
+  // 0 means unbounded.
+  MemcacheServer(KeyService& keys, int port, int max_clients=1024, int timeout_ms=5000);
+
+  // Binds the port and starts accepting; throws Exception_ on failure.
+  void start() { listener.start(); }
+  void write_metrics(std::ostream& out);
+};
+
+#endif
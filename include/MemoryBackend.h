@@ -0,0 +1,37 @@
+#ifndef MEMORY_BACKEND_H
+#define MEMORY_BACKEND_H
+
+#include <map>
+#include <atomic>
+#include <shared_mutex>
+#include "StorageBackend.h"
+
+// In-process backend with no external dependencies: hash-sharded ordered
+// maps, each behind a reader/writer lock. Contents live only as long as the
+// process; it lets the server run (and be benchmarked) without Postgres.
+class MemoryBackend : public StorageBackend {
+private:
+  struct Shard {
+    std::shared_mutex mtx;
+    std::map<std::string, std::string> data;
+  };
+
+  Shard* shards;
+  int shards_count;
+  std::atomic<long long> entries{0};
+
+  Shard& shard_for(const std::string& key);
+
+public:
+  explicit MemoryBackend(int shards_count=16);
+  ~MemoryBackend();
+
+  std::pair<bool, std::string> get(const std::string& key) override;
+  bool set(const std::string& key, const std::string& value) override;
+  bool remove(const std::string& key) override;
+  std::unordered_map<std::string, std::string> get_many(const std::vector<std::string>& keys) override;
+  std::vector<std::pair<std::string, std::string>> scan(const std::string& start, size_t limit) override;
+  void write_metrics(std::ostream& out) override;
+};
+
+#endif
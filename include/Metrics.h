@@ -0,0 +1,48 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <string>
+#include <ostream>
+
+// Lock-free latency histogram with power-of-two microsecond buckets,
+// rendered in the Prometheus text exposition format.
+class LatencyHistogram {
+private:
+  static const int BUCKETS = 24;  // upper bounds 1us .. ~8.4s
+  std::atomic<unsigned long long> counts[BUCKETS + 1];
+  std::atomic<unsigned long long> total{0};
+  std::atomic<unsigned long long> sum_us{0};
+
+public:
+  LatencyHistogram() {
+    for(int i=0; i<=BUCKETS; i++) counts[i].store(0, std::memory_order_relaxed);
+  }
+
+  void record(long long us) {
+    if(us < 0) us = 0;
+    int b = 0;
+    while(b < BUCKETS && us > (1LL << b)) b++;
+    counts[b].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    sum_us.fetch_add((unsigned long long)us, std::memory_order_relaxed);
+  }
+
+  unsigned long long count() const { return total.load(std::memory_order_relaxed); }
+  unsigned long long sum() const { return sum_us.load(std::memory_order_relaxed); }
+
+  void render(std::ostream& out, const std::string& name) const {
+    out << "# TYPE " << name << " histogram\n";
+    unsigned long long cumulative = 0;
+    for(int i=0; i<BUCKETS; i++) {
+      cumulative += counts[i].load(std::memory_order_relaxed);
+      out << name << "_bucket{le=\"" << (1LL << i) << "\"} " << cumulative << "\n";
+    }
+    cumulative += counts[BUCKETS].load(std::memory_order_relaxed);
+    out << name << "_bucket{le=\"+Inf\"} " << cumulative << "\n";
+    out << name << "_sum " << sum() << "\n";
+    out << name << "_count " << count() << "\n";
+  }
+};
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef MISS_BATCHER_H
+#define MISS_BATCHER_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+#include <unordered_map>
+#include "Cache.h"
+#include "Exceptions.h"
+#include "Deadline.h"
+
+// Coalesces concurrent cache-miss reads into one multi-key fetch.
+// A miss arriving while fewer than max_inflight fetches are running is sent
+// at once (no added latency on an idle DB); otherwise it queues and is picked
+// up by the next free dispatcher together with every other queued miss, up to
+// max_batch keys. Dispatchers that start while others are in flight linger up
+// to window_us for the batch to fill.
+//
+// A waiter gives up at its request deadline, even while its batch runs; the
+// batch itself runs under the latest deadline of the requests in it.
+class MissBatcher {
+public:
+  typedef std::function<std::unordered_map<std::string, std::string>(const std::vector<std::string>&)> Fetch;
+
+private:
+  struct Waiter {
+    std::string key;
+    deadline::Clock::time_point until;
+    std::condition_variable cv;
+    bool done = false;
+    bool found = false;
+    std::string value;
+    bool failed = false;
+    std::string error;
+    int code = 500;
+
+    Waiter(const std::string& key, deadline::Clock::time_point until) : key(key), until(until) {}
+  };
+
+  Fetch fetch;
+  Cache* cache;
+  int max_inflight;
+  size_t max_batch;
+  int window_us;
+
+  std::mutex mtx;
+  std::condition_variable full_cv;
+  std::deque<std::shared_ptr<Waiter>> pending;
+  int active = 0;
+
+  std::atomic<unsigned long long> batches{0};
+  std::atomic<unsigned long long> keys{0};
+  std::atomic<unsigned long long> requests{0};
+  std::atomic<unsigned long long> timeouts{0};
+
+  void dispatch(std::unique_lock<std::mutex>& lock);
+
+public:
+  MissBatcher(Fetch fetch, Cache* cache, int max_inflight=4, size_t max_batch=128, int window_us=200);
+
+  std::pair<bool, std::string> get(const std::string& key);
+  void write_metrics(std::ostream& out);
+};
+
+#endif
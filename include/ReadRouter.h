@@ -0,0 +1,67 @@
+#ifndef READ_ROUTER_H
+#define READ_ROUTER_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include "DBConnectionPool.h"
+#include "StorageBackend.h"
+
+// Postgres storage backend fronting the primary pool. Reads are routed to
+// streaming-replication standbys while writes stay on the primary; keys
+// written within the read-your-writes window are read from the primary so a
+// client never observes replica lag on its own write.
+class ReadRouter : public StorageBackend {
+public:
+  enum Policy { ROUND_ROBIN, LEAST_OUTSTANDING };
+
+private:
+  struct Replica {
+    std::unique_ptr<DBConnectionPool> pool;
+    std::atomic<int> outstanding{0};
+    std::atomic<unsigned long long> reads{0};
+    std::atomic<unsigned long long> errors{0};
+  };
+
+  struct WriteShard {
+    std::mutex mtx;
+    std::unordered_map<std::string, long long> written_at;
+  };
+
+  static const int WRITE_SHARDS = 16;
+
+  DBConnectionPool& primary;
+  std::vector<std::unique_ptr<Replica>> replicas;
+  Policy policy;
+  long long ryw_window_ms;
+  std::atomic<unsigned> next_replica{0};
+  WriteShard write_shards[WRITE_SHARDS];
+  std::atomic<unsigned long long> primary_reads{0};
+
+  Replica* pick();
+  WriteShard& shard_for(const std::string& key);
+  bool written_since(const std::string& key, long long since_ms);
+
+public:
+  ReadRouter(DBConnectionPool& primary, const std::vector<std::string>& replica_conns,
+    int pool_min, int pool_max, Policy policy=ROUND_ROBIN, int ryw_window_ms=1000);
+
+  void createPools();
+  std::pair<bool, std::string> get(const std::string& key) override;
+  std::unordered_map<std::string, std::string> get_many(const std::vector<std::string>& keys) override;
+  bool set(const std::string& key, const std::string& value) override;
+  bool remove(const std::string& key) override;
+  void write_batch(const std::vector<std::pair<std::string, std::string>>& sets,
+    const std::vector<std::string>& removes) override;
+  std::vector<std::pair<std::string, std::string>> scan(const std::string& start, size_t limit) override;
+  void note_write(const std::string& key);
+  void write_metrics(std::ostream& out) override;
+
+  static std::vector<std::string> split_conn_list(const std::string& list);
+};
+
+#endif
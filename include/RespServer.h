@@ -0,0 +1,49 @@
+#ifndef RESP_SERVER_H
+#define RESP_SERVER_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include "KeyService.h"
+#include "TcpServer.h"
+
+// Redis protocol listener on its own port, over the same KeyService as the
+// HTTP routes. Speaks RESP2, and RESP3 after HELLO 3; serves GET, SET (EX,
+// PX), DEL, MGET, MSET, EXISTS, EXPIRE, PEXPIRE, TTL, PTTL and PING plus the
+// connection commands clients send on connect (HELLO, SELECT 0, CLIENT,
+// COMMAND, CONFIG GET, ECHO, QUIT).
+class RespServer {
+private:
+  struct Session {
+    uint64_t id;
+    int proto = 2;
+    std::string name;
+  };
+  class Connection;
+
+  KeyService& keys;
+  int timeout_ms;
+  std::atomic<uint64_t> next_id{1};
+
+  std::atomic<unsigned long long> commands{0};
+  std::atomic<unsigned long long> errors{0};
+
+  // Last, so its connections are gone before the members they use.
+  TcpServer listener;
+
+  // Appends the reply to `out`; returns false when the connection closes.
+  bool execute(Session& session, std::vector<std::string>& args, std::string& out);
+
+public:
+  // timeout_ms bounds every command like REQUEST_TIMEOUT_MS does a request;
+  // 0 means unbounded.
+  RespServer(KeyService& keys, int port, int max_clients=1024, int timeout_ms=5000);
+
+  // Binds the port and starts accepting; throws Exception_ on failure.
+  void start() { listener.start(); }
+  void write_metrics(std::ostream& out);
+};
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+
+#include "httplib.h"
+
+// Request dispatch without std::regex. Fixed paths (admin endpoints) live in
+// a character trie; everything else under the key prefix goes to the key
+// handler of its method with the key as a view into the request path.
+// Attached to httplib it takes requests without a body as the pre-routing
+// handler (before httplib reads one) and the rest through catch-all routes
+// once their body is read. The epoll front end (HttpReactor)
+// dispatches every request here with its body read.
+class Router {
+public:
+  typedef std::function<void(const httplib::Request&, httplib::Response&)> Handler;
+  typedef std::function<void(const httplib::Request&, httplib::Response&, std::string_view)> KeyHandler;
+
+  // The part of `path` after the key prefix, or an empty view when `path`
+  // does not start with it.
+  static std::string_view key_of(const std::string& path, const std::string& prefix);
+
+private:
+  enum Method { M_GET, M_PUT, M_POST, M_DELETE, METHODS };
+
+  struct Node {
+    std::vector<std::pair<char, int>> children;
+    Handler handlers[METHODS];
+  };
+
+  std::vector<Node> nodes;
+  std::string prefix;
+  KeyHandler key_handlers[METHODS];
+
+  static int method_of(const std::string& method);
+  void add(Method method, const std::string& path, Handler handler);
+
+public:
+  explicit Router(const std::string& key_prefix="/api/");
+
+  void get(const std::string& path, Handler handler) { add(M_GET, path, std::move(handler)); }
+  void post(const std::string& path, Handler handler) { add(M_POST, path, std::move(handler)); }
+  void get_key(KeyHandler handler) { key_handlers[M_GET] = std::move(handler); }
+  void put_key(KeyHandler handler) { key_handlers[M_PUT] = std::move(handler); }
+  void delete_key(KeyHandler handler) { key_handlers[M_DELETE] = std::move(handler); }
+
+  // Returns whether the request was handled. Unless body_read, requests
+  // announcing a body are left unhandled.
+  bool dispatch(const httplib::Request& req, httplib::Response& res, bool body_read=false) const;
+
+  // Installs the pre-routing handler and the routes for requests with a body
+  // together: httplib's "<prefix>:key" matcher, then ".*" (404 when nothing
+  // matches). The routes go last, so call it after svr's own.
+  void attach(httplib::Server& svr) const;
+};
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef SSTABLE_H
+#define SSTABLE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include "BloomFilter.h"
+#include "KVIterator.h"
+#include "Exceptions.h"
+
+// Immutable sorted table file:
+//   data blocks   entries [u32 klen][u32 vlen][u8 tombstone][key][value], ~4KB each
+//   index block   per data block [u32 klen][last key][u64 offset][u32 size]
+//   bloom filter  over every key in the table
+//   footer        u64 index_off, index_size, bloom_off, bloom_size, magic
+// Integers are stored in host byte order; tables are local to one machine.
+class SSTableBuilder {
+private:
+  int fd = -1;
+  std::string path;
+  std::string block;
+  std::string index;
+  std::vector<std::string> keys;
+  std::string last_key;
+  uint64_t offset = 0;
+  bool finished = false;
+
+  void flush_block();
+  void write(const std::string& data);
+
+public:
+  explicit SSTableBuilder(const std::string& path);
+  ~SSTableBuilder();
+
+  // Keys must be added in strictly increasing order.
+  void add(const std::string& key, const std::string& value, bool tombstone);
+  void finish();
+
+  uint64_t file_size() const { return offset + block.size(); }
+  size_t entries() const { return keys.size(); }
+};
+
+class SSTable : public std::enable_shared_from_this<SSTable> {
+private:
+  struct IndexEntry {
+    std::string last_key;
+    uint64_t offset;
+    uint32_t size;
+  };
+
+  int fd = -1;
+  std::string path;
+  uint64_t number;
+  uint64_t size = 0;
+  std::vector<IndexEntry> index;
+  BloomFilter bloom;
+  std::string smallest_key, largest_key;
+  std::atomic<bool> obsolete{false};
+
+  SSTable(const std::string& path, uint64_t number) : path(path), number(number) {}
+  void read_block(size_t i, std::string& out) const;
+
+  class Iterator;
+
+public:
+  static std::shared_ptr<SSTable> open(const std::string& path, uint64_t number);
+  ~SSTable();
+
+  SSTable(const SSTable&) = delete;
+  SSTable& operator=(const SSTable&) = delete;
+
+  // True when the table holds an entry (value or tombstone) for key.
+  bool get(const std::string& key, std::string& value, bool& tombstone) const;
+  std::unique_ptr<KVIterator> iterator() const;
+
+  // The file is unlinked once the last reader drops its reference.
+  void mark_obsolete() { obsolete.store(true); }
+
+  uint64_t file_number() const { return number; }
+  uint64_t file_size() const { return size; }
+  const std::string& smallest() const { return smallest_key; }
+  const std::string& largest() const { return largest_key; }
+};
+
+#endif
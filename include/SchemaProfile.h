@@ -0,0 +1,45 @@
+#ifndef SCHEMA_PROFILE_H
+#define SCHEMA_PROFILE_H
+
+#include <string>
+#include <vector>
+#include "Exceptions.h"
+
+// Storage layout of the key-value table, selected at startup with a spec
+// such as "unlogged,partitions=8,fillfactor=80" (DB_SCHEMA). The empty spec
+// is the original single B-tree table kvstore(key TEXT PRIMARY KEY, value TEXT).
+//
+//   unlogged      no WAL; contents are truncated after a crash
+//   partitions=N  N-way HASH partitioning on key
+//   hash_index    hash index instead of the B-tree primary key; upserts go
+//                 through <table>_upsert(), serialised per key with an
+//                 advisory lock since a hash index cannot be unique
+//   fillfactor=N  leave free space in heap pages for HOT updates
+//   table=NAME    table name (default kvstore)
+struct SchemaProfile {
+  std::string table = "kvstore";
+  bool unlogged = false;
+  int partitions = 0;
+  bool hash_index = false;
+  int fillfactor = 0;
+
+  static SchemaProfile parse(const std::string& spec);
+
+  std::string describe() const;
+  std::vector<std::string> create_statements() const;
+  std::vector<std::string> drop_statements() const;
+
+  // Statements used by DBConnectionPool, with the table name filled in.
+  std::string get_query() const;
+  std::string get_many_query() const;
+  std::string set_query() const;
+  std::string remove_query() const;
+  std::string set_many_query() const;     // $1 keys, $2 values as text[]
+  std::string remove_many_query() const;  // $1 keys as text[]
+  std::string scan_query() const;
+  std::string copy_in_query() const;
+  std::string copy_out_query() const;
+  std::vector<std::string> import_merge_statements() const;
+};
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef SHARD_ROUTER_H
+#define SHARD_ROUTER_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include "HashRing.h"
+#include "StorageBackend.h"
+
+// Spreads keys over independent stores (one Postgres database and pool
+// each) with a consistent-hash ring. Multi-key calls are split per shard and
+// the parts run in parallel, on worker threads each shard keeps for that.
+//
+// When shards are appended, the router is built knowing how many there were
+// (`previous`). Until a rebalance has moved every key to its new owner, a
+// miss on the new owner falls back to the previous one, and writes to keys
+// whose owner changed hold a per-key stripe lock that the migration takes
+// around moving that key, so a migrated copy never overwrites a newer write.
+class ShardRouter : public StorageBackend {
+private:
+  struct Shard {
+    StorageBackend* store;
+    std::atomic<unsigned long long> reads{0};
+    std::atomic<unsigned long long> writes{0};
+    std::atomic<unsigned long long> errors{0};
+
+    // Parts of multi-shard calls waiting for one of `workers`.
+    std::mutex tasks_mtx;
+    std::condition_variable tasks_cv;
+    std::deque<std::function<void()>> tasks;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+  };
+
+  static const int STRIPES = 256;
+
+  std::vector<std::unique_ptr<Shard>> shards;
+  HashRing ring;
+  std::unique_ptr<HashRing> previous_ring;
+  std::atomic<bool> moving{false};
+  std::mutex stripes[STRIPES];
+
+  std::mutex rebalance_mtx;
+  std::thread migrator;
+  std::string rebalance_state = "idle";
+  std::atomic<unsigned long long> scanned{0};
+  std::atomic<unsigned long long> moved{0};
+
+  bool moves(const std::string& key, int& from, int& to) const;
+  std::mutex& stripe_for(const std::string& key);
+  std::vector<std::unique_lock<std::mutex>> lock_keys(const std::vector<std::string>& keys);
+  std::pair<bool, std::string> read(int shard, const std::string& key);
+  void work(Shard& shard);
+  // Runs fn(shard) for every listed shard, all but the first on that shard's
+  // workers; the first failure is rethrown once every part has finished.
+  void in_parallel(const std::vector<int>& ids, const std::function<void(int)>& fn);
+  void migrate();
+  void migrate_page(int from, const std::vector<std::string>& keys);
+
+public:
+  // `fanout` workers per shard run the parts of multi-shard calls, so up to
+  // that many such calls proceed at once on each shard.
+  ShardRouter(const std::vector<StorageBackend*>& stores, int vnodes, int fanout, int previous=0);
+  ~ShardRouter();
+
+  int shard_of(const std::string& key) const { return ring.owner(key); }
+
+  // Starts moving keys to their new owners in the background. Returns false
+  // when there is nothing to rebalance or a rebalance is already running.
+  bool start_rebalance();
+  std::string rebalance_status();
+
+  std::pair<bool, std::string> get(const std::string& key) override;
+  std::unordered_map<std::string, std::string> get_many(const std::vector<std::string>& keys) override;
+  bool set(const std::string& key, const std::string& value) override;
+  bool remove(const std::string& key) override;
+  void write_batch(const std::vector<std::pair<std::string, std::string>>& sets,
+    const std::vector<std::string>& removes) override;
+  std::vector<std::pair<std::string, std::string>> scan(const std::string& start, size_t limit) override;
+  void write_metrics(std::ostream& out) override;
+};
+
+#endif
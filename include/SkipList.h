@@ -0,0 +1,99 @@
+#ifndef SKIP_LIST_H
+#define SKIP_LIST_H
+
+#include <atomic>
+#include <random>
+
+// Ordered skiplist with a single writer and lock-free concurrent readers.
+// Nodes are never removed or modified after insertion; links are published
+// with release stores so a reader always sees fully built nodes.
+template <typename Key, class Compare>
+class SkipList {
+private:
+  static const int MAX_HEIGHT = 12;
+
+  struct Node {
+    Key key;
+    int height;
+    std::atomic<Node*>* next;
+
+    Node(const Key& key, int height) : key(key), height(height), next(new std::atomic<Node*>[height]) {
+      for(int i=0; i<height; i++) next[i].store(nullptr, std::memory_order_relaxed);
+    }
+    ~Node() { delete [] next; }
+  };
+
+  Compare cmp;
+  Node* head;
+  std::atomic<int> max_height{1};
+  std::mt19937 rng{0xdecafbad};
+
+  int random_height() {
+    int h = 1;
+    while(h < MAX_HEIGHT && (rng() & 3) == 0) h++;
+    return h;
+  }
+
+  // First node >= key; fills prev[] with the predecessor at every level.
+  Node* find_greater_or_equal(const Key& key, Node** prev) const {
+    Node* x = head;
+    int level = max_height.load(std::memory_order_relaxed) - 1;
+    for(;;) {
+      Node* next = x->next[level].load(std::memory_order_acquire);
+      if(next && cmp(next->key, key) < 0) {
+        x = next;
+      } else {
+        if(prev) prev[level] = x;
+        if(level == 0) return next;
+        level--;
+      }
+    }
+  }
+
+public:
+  explicit SkipList(Compare cmp=Compare()) : cmp(cmp), head(new Node(Key(), MAX_HEIGHT)) {}
+
+  ~SkipList() {
+    Node* x = head;
+    while(x) {
+      Node* next = x->next[0].load(std::memory_order_relaxed);
+      delete x;
+      x = next;
+    }
+  }
+
+  SkipList(const SkipList&) = delete;
+  SkipList& operator=(const SkipList&) = delete;
+
+  // Writer side; callers serialise inserts. Keys must be unique.
+  void insert(const Key& key) {
+    Node* prev[MAX_HEIGHT];
+    find_greater_or_equal(key, prev);
+    int height = random_height();
+    int current = max_height.load(std::memory_order_relaxed);
+    if(height > current) {
+      for(int i=current; i<height; i++) prev[i] = head;
+      max_height.store(height, std::memory_order_relaxed);
+    }
+    Node* node = new Node(key, height);
+    for(int i=0; i<height; i++) {
+      node->next[i].store(prev[i]->next[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+      prev[i]->next[i].store(node, std::memory_order_release);
+    }
+  }
+
+  class Iterator {
+  private:
+    const SkipList* list;
+    Node* node = nullptr;
+  public:
+    explicit Iterator(const SkipList* list) : list(list) {}
+    bool valid() const { return node != nullptr; }
+    const Key& key() const { return node->key; }
+    void next() { node = node->next[0].load(std::memory_order_acquire); }
+    void seek(const Key& target) { node = list->find_greater_or_equal(target, nullptr); }
+    void seek_to_first() { node = list->head->next[0].load(std::memory_order_acquire); }
+  };
+};
+
+#endif
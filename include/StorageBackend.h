@@ -0,0 +1,45 @@
+#ifndef STORAGE_BACKEND_H
+#define STORAGE_BACKEND_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "Exceptions.h"
+
+// Persistent tier behind the cache. Implementations throw Exception_ on
+// storage failures, like DBConnectionPool always has.
+class StorageBackend {
+public:
+  virtual ~StorageBackend() = default;
+
+  virtual std::pair<bool, std::string> get(const std::string& key) = 0;
+  virtual bool set(const std::string& key, const std::string& value) = 0;
+  // Returns false when the key did not exist.
+  virtual bool remove(const std::string& key) = 0;
+
+  // Found keys only; the default issues one get() per key.
+  virtual std::unordered_map<std::string, std::string> get_many(const std::vector<std::string>& keys) {
+    std::unordered_map<std::string, std::string> result;
+    for(const std::string& key : keys) {
+      std::pair<bool, std::string> row = get(key);
+      if(row.first) result.emplace(key, std::move(row.second));
+    }
+    return result;
+  }
+
+  // Applies the upserts and deletes together, as one transaction where the
+  // backend has them; keys are distinct. The default issues one call per key.
+  virtual void write_batch(const std::vector<std::pair<std::string, std::string>>& sets,
+    const std::vector<std::string>& removes) {
+    for(const auto& entry : sets) set(entry.first, entry.second);
+    for(const std::string& key : removes) remove(key);
+  }
+
+  // Up to `limit` entries with key >= start, in key order.
+  virtual std::vector<std::pair<std::string, std::string>> scan(const std::string& start, size_t limit) = 0;
+
+  virtual void write_metrics(std::ostream&) {}
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef TCP_SERVER_H
+#define TCP_SERVER_H
+
+#include <iostream>
+#include <string>
+#include <memory>
+#include <functional>
+#include <unordered_set>
+#include <unordered_map>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+// Loopback TCP listener for the non-HTTP protocols. Every connection has a
+// thread, like an HTTP keep-alive connection has one of the server's; its
+// protocol object is fed what has been read and answers pipelined requests
+// in one write once the bytes read so far hold no further complete request.
+class TcpServer {
+public:
+  class Connection {
+  public:
+    virtual ~Connection() = default;
+    // Consumes the complete requests in in[pos..], advancing pos and
+    // appending the replies to out. Returns false to close the connection
+    // once out is sent.
+    virtual bool feed(const std::string& in, size_t& pos, std::string& out) = 0;
+  };
+  typedef std::function<std::unique_ptr<Connection>()> Factory;
+
+private:
+  std::string name;
+  int port;
+  int max_clients;
+  std::string busy_reply;
+  Factory factory;
+
+  int listen_fd = -1;
+  std::thread acceptor;
+  std::atomic<bool> stopping{false};
+
+  std::mutex clients_mtx;
+  std::unordered_set<int> client_fds;
+  // Connection threads by connection number; the acceptor joins the ones
+  // listed in `finished`, the destructor all of them.
+  std::unordered_map<unsigned long long, std::thread> workers;
+  std::vector<unsigned long long> finished;
+
+  std::atomic<unsigned long long> connections{0};
+  std::atomic<unsigned long long> rejected{0};
+
+  void accept_loop();
+  void serve(int fd);
+  void reap();
+
+public:
+  // `name` prefixes the metrics; `busy_reply` is sent to connections
+  // refused beyond max_clients.
+  TcpServer(const std::string& name, int port, int max_clients, const std::string& busy_reply, Factory factory);
+  ~TcpServer();
+
+  // Binds the port and starts accepting; throws Exception_ on failure.
+  void start();
+  void write_metrics(std::ostream& out);
+};
+
+#endif
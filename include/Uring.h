@@ -0,0 +1,65 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <cstddef>
+#include <cstdint>
+
+// io_uring over its raw system calls: the mapped submission and completion
+// rings, SQE allocation, submission and resource registration. One thread
+// submits and reaps (the ring is set up single-issuer).
+class Uring {
+private:
+  int ring_fd = -1;
+  void* ring_ptr = nullptr;
+  size_t ring_size = 0;
+  io_uring_sqe* sqes = nullptr;
+  size_t sqes_size = 0;
+
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  // SQEs handed out but not yet published to the kernel end at sqe_tail.
+  unsigned sqe_tail = 0;
+
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  io_uring_cqe* cqes;
+
+  unsigned long long enters = 0;
+
+public:
+  Uring() = default;
+  Uring(const Uring&) = delete;
+  Uring& operator=(const Uring&) = delete;
+  ~Uring();
+
+  // False, with errno set, when the kernel lacks io_uring or the features
+  // the callers rely on (single-issuer rings, Linux 6.0).
+  bool init(unsigned entries, unsigned cq_entries);
+
+  // A zeroed SQE; pending ones are submitted first when the ring is full.
+  io_uring_sqe* sqe();
+  // Submits the pending SQEs and waits for `wait` completions; -errno on
+  // failure.
+  int submit(unsigned wait);
+  int register_resource(unsigned opcode, void* arg, unsigned count);
+
+  // Calls fn on every completion available, then consumes them. fn may
+  // queue new SQEs.
+  template<class F> unsigned reap(F fn) {
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    unsigned count = 0;
+    for(; head != tail; head++, count++) fn(cqes[head & cq_mask]);
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    return count;
+  }
+
+  // io_uring_enter calls made so far.
+  unsigned long long enter_count() const { return enters; }
+};
+
+#endif
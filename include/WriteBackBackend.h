@@ -0,0 +1,108 @@
+#ifndef WRITE_BACK_BACKEND_H
+#define WRITE_BACK_BACKEND_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdint>
+#include "StorageBackend.h"
+#include "Cache.h"
+
+// Write-back layer in front of a slower store (Postgres). A write is
+// acknowledged once it is in the dirty table and in the fsync'd local
+// journal; a flusher thread takes the dirty table every flush interval, so
+// repeated writes to one key reach the store once, and pushes it with
+// write_batch(). Dirty entries live outside the cache's LRU, so eviction can
+// never drop a write that is not yet in the store; reads consult the dirty
+// and in-flight entries before the store.
+//
+// The journal is split in segments: taking the dirty table starts a new one,
+// and every segment older than it is deleted once the batch is in the store.
+// Startup replays the remaining segments into the dirty table.
+class WriteBackBackend : public StorageBackend {
+private:
+  struct Entry {
+    std::string value;
+    bool tombstone = false;
+  };
+
+  StorageBackend& inner;
+  Cache* cache;
+  std::string dir;
+  int flush_ms;
+  size_t batch_size;
+  size_t max_dirty;
+
+  // dirty takes new writes; flushing is the batch being written to the store
+  // (kept across failed attempts, with newer dirty entries merged over it).
+  std::mutex mtx;
+  std::condition_variable space_cv;
+  std::unordered_map<std::string, Entry> dirty;
+  std::unordered_map<std::string, Entry> flushing;
+
+  int journal_fd = -1;
+  uint64_t journal_number = 0;
+  std::atomic<uint64_t> appended{0};
+  std::mutex sync_mtx;
+  std::atomic<uint64_t> synced{0};
+  // A sealed segment whose sync failed: kept open and synced again before
+  // anything after it counts as synced.
+  int unsynced_fd = -1;
+
+  // Serialises flush cycles between the flusher and flush().
+  std::mutex flush_mtx;
+  std::thread flusher;
+  std::mutex flusher_mtx;
+  std::condition_variable flusher_cv;
+  bool stopping = false;
+
+  std::atomic<unsigned long long> writes{0};
+  std::atomic<unsigned long long> coalesced{0};
+  std::atomic<unsigned long long> flushes{0};
+  std::atomic<unsigned long long> flushed_keys{0};
+  std::atomic<unsigned long long> flush_failures{0};
+  std::atomic<unsigned long long> syncs{0};
+  std::atomic<unsigned long long> stalls{0};
+  std::atomic<uint64_t> journal_bytes{0};
+
+  std::string journal_path(uint64_t number) const;
+  std::vector<uint64_t> journal_numbers() const;  // ascending
+  void replay(const std::string& path);
+  void open_journal(uint64_t number);
+
+  // Returns whether the key has a pending entry, and that entry.
+  bool pending(const std::string& key, Entry& out);
+  uint64_t write(const std::string& key, const std::string& value, bool tombstone);
+  void sync_to(uint64_t position);
+  // Under sync_mtx; throws while the sealed segment still fails to sync.
+  void sync_unsynced();
+
+  void flush_loop();
+  // One flush cycle; returns the number of keys written to the store.
+  size_t flush_once();
+
+public:
+  WriteBackBackend(StorageBackend& inner, Cache* cache, const std::string& dir,
+    int flush_ms=50, size_t batch_size=1000, size_t max_dirty=1000000);
+  ~WriteBackBackend();
+
+  // Writes every pending entry to the store before returning; throws if the
+  // store fails.
+  void flush();
+
+  std::pair<bool, std::string> get(const std::string& key) override;
+  std::unordered_map<std::string, std::string> get_many(const std::vector<std::string>& keys) override;
+  bool set(const std::string& key, const std::string& value) override;
+  bool remove(const std::string& key) override;
+  // Journals every entry, then syncs once.
+  void write_batch(const std::vector<std::pair<std::string, std::string>>& sets,
+    const std::vector<std::string>& removes) override;
+  std::vector<std::pair<std::string, std::string>> scan(const std::string& start, size_t limit) override;
+  void write_metrics(std::ostream& out) override;
+};
+
+#endif
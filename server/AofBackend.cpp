@@ -0,0 +1,430 @@
+#include "AofBackend.h"
+#include "FileUtil.h"
+#include "Crc32.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+#define AOF_HEADER_SIZE 13
+#define AOF_OP_SET 'S'
+#define AOF_OP_DEL 'D'
+#define AOF_TICK_MS 100
+#define AOF_EVERYSEC_MS 1000
+#define SNAPSHOT_MAGIC "KVSNAP01"
+#define SNAPSHOT_HEADER_SIZE 16
+#define SNAPSHOT_WRITE_BUFFER (1 << 20)
+
+// Record: [u32 crc][u8 op][u32 klen][u32 vlen][key][value], the crc covering
+// everything after itself. The snapshot is [magic][u64 gen] followed by one
+// set record per key, where gen is the first AOF file it does not contain.
+
+template <typename T>
+static void put(string& out, T v) {
+  out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+template <typename T>
+static T take(const char* p) {
+  T v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static void put_record(string& out, char op, const string& key, const string& value) {
+  size_t start = out.size();
+  put<uint32_t>(out, 0);
+  out.push_back(op);
+  put<uint32_t>(out, (uint32_t)key.size());
+  put<uint32_t>(out, (uint32_t)value.size());
+  out += key;
+  out += value;
+  uint32_t crc = crc32(out.data() + start + 4, out.size() - start - 4);
+  memcpy(&out[start], &crc, sizeof(crc));
+}
+
+static void raise_to(atomic<uint64_t>& target, uint64_t value) {
+  uint64_t current = target.load();
+  while(current < value && !target.compare_exchange_weak(current, value)) {}
+}
+
+static uint64_t file_size(const string& path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+AofBackend::AofBackend(Cache& cache, const string& dir, FsyncPolicy policy,
+  uint64_t rewrite_min_bytes, int rewrite_percent)
+  : cache(cache), dir(dir), policy(policy),
+    rewrite_min_bytes(rewrite_min_bytes), rewrite_percent(rewrite_percent) {
+  fileutil::make_dirs(dir);
+  restore();
+  background = thread(&AofBackend::background_loop, this);
+}
+
+AofBackend::~AofBackend() {
+  {
+    lock_guard<mutex> lock(bg_mtx);
+    stopping = true;
+  }
+  bg_cv.notify_all();
+  if(background.joinable()) background.join();
+  try {
+    // Let a running snapshot finish so the next start replays less.
+    if(child > 0) {
+      int status = 0;
+      while(waitpid(child, &status, 0) < 0 && errno == EINTR) {}
+      finish_rewrite(status);
+    }
+    if(policy != NO && fdatasync(aof_fd) != 0) {
+      throw Exception_("AOF", string("Fail to sync: ") + strerror(errno), 500);
+    }
+  } catch(const Exception_& e) {
+    cerr << e.what() << endl;
+  }
+  if(aof_fd >= 0) ::close(aof_fd);
+}
+
+AofBackend::FsyncPolicy AofBackend::parse_policy(const string& name) {
+  if(name == "always") return ALWAYS;
+  if(name == "everysec") return EVERYSEC;
+  if(name == "no") return NO;
+  throw Exception_("Config", "AOF_FSYNC must be always, everysec or no");
+}
+
+mutex& AofBackend::stripe_for(const string& key) {
+  return stripes[hash<string>()(key) % STRIPES];
+}
+
+string AofBackend::aof_path(uint64_t number) const {
+  return dir + "/appendonly." + to_string(number) + ".aof";
+}
+
+string AofBackend::snapshot_path() const {
+  return dir + "/snapshot.kvs";
+}
+
+vector<uint64_t> AofBackend::aof_numbers() const {
+  const string prefix = "appendonly.", suffix = ".aof";
+  vector<uint64_t> numbers;
+  for(const string& name : fileutil::list_dir(dir)) {
+    if(name.size() <= prefix.size() + suffix.size()) continue;
+    if(name.compare(0, prefix.size(), prefix) != 0) continue;
+    if(name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) continue;
+    string digits = name.substr(prefix.size(), name.size() - prefix.size() - suffix.size());
+    if(digits.find_first_not_of("0123456789") != string::npos) continue;
+    numbers.push_back(stoull(digits));
+  }
+  sort(numbers.begin(), numbers.end());
+  return numbers;
+}
+
+void AofBackend::restore() {
+  ::unlink((snapshot_path() + ".tmp").c_str());
+  uint64_t gen = load_snapshot();
+
+  vector<uint64_t> numbers = aof_numbers();
+  uint64_t next = max<uint64_t>(gen, 1);
+  for(uint64_t n : numbers) {
+    // Files older than the snapshot are left over from a rewrite that was
+    // interrupted after the rename.
+    if(n < gen) {
+      ::unlink(aof_path(n).c_str());
+      continue;
+    }
+    aof_bytes += replay(aof_path(n));
+    next = n;
+  }
+  open_aof(next);
+}
+
+uint64_t AofBackend::load_snapshot() {
+  string path = snapshot_path();
+  if(!fileutil::exists(path)) return 0;
+  string data = fileutil::read_file(path);
+  if(data.size() < SNAPSHOT_HEADER_SIZE || data.compare(0, 8, SNAPSHOT_MAGIC) != 0) {
+    throw Exception_("AOF", "Corrupt snapshot " + path, 500);
+  }
+  uint64_t gen = take<uint64_t>(data.data() + 8);
+  size_t pos = SNAPSHOT_HEADER_SIZE;
+  while(pos < data.size()) {
+    const char* p = data.data() + pos;
+    if(pos + AOF_HEADER_SIZE > data.size()) throw Exception_("AOF", "Corrupt snapshot " + path, 500);
+    uint32_t klen = take<uint32_t>(p + 5);
+    uint32_t vlen = take<uint32_t>(p + 9);
+    size_t size = AOF_HEADER_SIZE + (size_t)klen + vlen;
+    if(pos + size > data.size() || crc32(p + 4, size - 4) != take<uint32_t>(p)) {
+      throw Exception_("AOF", "Corrupt snapshot " + path, 500);
+    }
+    cache.set(string(p + AOF_HEADER_SIZE, klen), string(p + AOF_HEADER_SIZE + klen, vlen));
+    pos += size;
+  }
+  snapshot_bytes = data.size();
+  return gen;
+}
+
+uint64_t AofBackend::replay(const string& path) {
+  string data = fileutil::read_file(path);
+  size_t pos = 0;
+  // Stops at the first torn record, which a crash mid-append leaves behind.
+  while(pos + AOF_HEADER_SIZE <= data.size()) {
+    const char* p = data.data() + pos;
+    uint32_t klen = take<uint32_t>(p + 5);
+    uint32_t vlen = take<uint32_t>(p + 9);
+    size_t size = AOF_HEADER_SIZE + (size_t)klen + vlen;
+    if(pos + size > data.size() || crc32(p + 4, size - 4) != take<uint32_t>(p)) break;
+    string key(p + AOF_HEADER_SIZE, klen);
+    if(p[4] == AOF_OP_SET) cache.set(key, string(p + AOF_HEADER_SIZE + klen, vlen));
+    else cache.delete_(key);
+    pos += size;
+  }
+  if(pos < data.size()) {
+    cerr << "AOF: dropping " << data.size() - pos << " torn bytes at the end of " << path << endl;
+    if(truncate(path.c_str(), pos) != 0) {
+      throw Exception_("AOF", "Fail to truncate " + path + ": " + strerror(errno), 500);
+    }
+  }
+  return pos;
+}
+
+void AofBackend::open_aof(uint64_t number) {
+  string path = aof_path(number);
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if(fd < 0) throw Exception_("AOF", "Fail to open " + path + ": " + strerror(errno), 500);
+  struct stat st;
+  if(fstat(fd, &st) != 0) {
+    string err = strerror(errno);
+    ::close(fd);
+    throw Exception_("AOF", "Fail to stat " + path + ": " + err, 500);
+  }
+  fileutil::sync_dir(dir);
+  aof_fd = fd;
+  aof_number = number;
+  aof_end = st.st_size;
+}
+
+uint64_t AofBackend::append(char op, const string& key, const string& value) {
+  string record;
+  record.reserve(AOF_HEADER_SIZE + key.size() + value.size());
+  put_record(record, op, key, value);
+  lock_guard<mutex> lock(aof_mtx);
+  if(aof_broken) throw Exception_("AOF", "The append-only file holds a torn record; restart to recover", 500);
+  try {
+    fileutil::write_all(aof_fd, record.data(), record.size(), aof_path(aof_number));
+  } catch(const Exception_&) {
+    // Replay stops at a torn record, so nothing may follow it.
+    if(ftruncate(aof_fd, aof_end) != 0) aof_broken = true;
+    throw;
+  }
+  aof_end += record.size();
+  aof_bytes += record.size();
+  return appended += record.size();
+}
+
+void AofBackend::sync_to(uint64_t position) {
+  lock_guard<mutex> lock(sync_mtx);
+  if(synced.load() >= position) return;
+  uint64_t target;
+  int fd;
+  {
+    lock_guard<mutex> append_lock(aof_mtx);
+    target = appended.load();
+    fd = aof_fd;
+  }
+  if(fdatasync(fd) != 0) {
+    sync_failures.fetch_add(1, memory_order_relaxed);
+    throw Exception_("AOF", string("Fail to sync: ") + strerror(errno), 500);
+  }
+  syncs.fetch_add(1, memory_order_relaxed);
+  raise_to(synced, target);
+}
+
+pair<bool, string> AofBackend::get(const string& key) {
+  return cache.get(key);
+}
+
+bool AofBackend::set(const string& key, const string& value) {
+  uint64_t position;
+  {
+    lock_guard<mutex> lock(stripe_for(key));
+    position = append(AOF_OP_SET, key, value);
+    cache.set(key, value);
+  }
+  if(policy == ALWAYS) sync_to(position);
+  return true;
+}
+
+bool AofBackend::remove(const string& key) {
+  uint64_t position;
+  {
+    lock_guard<mutex> lock(stripe_for(key));
+    if(!cache.get(key).first) return false;
+    position = append(AOF_OP_DEL, key, "");
+    cache.delete_(key);
+  }
+  if(policy == ALWAYS) sync_to(position);
+  return true;
+}
+
+vector<pair<string, string>> AofBackend::scan(const string& start, size_t limit) {
+  vector<pair<string, string>> out;
+  cache.for_each([&](const string& key, const string& value) {
+    if(key >= start) out.emplace_back(key, value);
+  });
+  sort(out.begin(), out.end());
+  if(out.size() > limit) out.resize(limit);
+  return out;
+}
+
+void AofBackend::background_loop() {
+  auto last_sync = chrono::steady_clock::now();
+  unique_lock<mutex> lock(bg_mtx);
+  while(!stopping) {
+    bg_cv.wait_for(lock, chrono::milliseconds(AOF_TICK_MS));
+    if(stopping) break;
+    lock.unlock();
+    try {
+      auto now = chrono::steady_clock::now();
+      if(policy == EVERYSEC && now - last_sync >= chrono::milliseconds(AOF_EVERYSEC_MS)) {
+        last_sync = now;
+        sync_to(appended.load());
+      }
+      if(child > 0) {
+        int status = 0;
+        if(waitpid(child, &status, WNOHANG) == child) finish_rewrite(status);
+      } else if(rewrite_min_bytes > 0 && aof_bytes.load() >= rewrite_min_bytes &&
+          aof_bytes.load() * 100 >= snapshot_bytes.load() * rewrite_percent) {
+        start_rewrite();
+      }
+    } catch(const exception& e) {
+      cerr << "AOF: " << e.what() << endl;
+    }
+    lock.lock();
+  }
+}
+
+// Switches writes to a new AOF and forks with every stripe and cache bucket
+// held, so the child's copy of the cache is exactly the state before the
+// first record of the new file.
+void AofBackend::start_rewrite() {
+  for(int i=0; i<STRIPES; i++) stripes[i].lock();
+  lock_guard<mutex> sync_lock(sync_mtx);
+  cache.lock_all();
+  auto started = chrono::steady_clock::now();
+  pid_t pid = -1;
+  uint64_t gen = 0;
+  string error;
+  {
+    lock_guard<mutex> lock(aof_mtx);
+    int old_fd = aof_fd;
+    uint64_t old_number = aof_number;
+    try {
+      open_aof(old_number + 1);
+      gen = aof_number;
+      // The everysec thread only ever syncs the newest file.
+      if(policy != NO && fdatasync(old_fd) != 0) {
+        cerr << "AOF: fail to sync " << aof_path(old_number) << ": " << strerror(errno) << endl;
+      } else if(policy != NO) {
+        raise_to(synced, appended.load());
+      }
+      ::close(old_fd);
+      pid = fork();
+      if(pid == 0) _exit(write_snapshot(cache, snapshot_path() + ".tmp", gen) ? 0 : 1);
+      if(pid < 0) error = string("Fail to fork: ") + strerror(errno);
+    } catch(const Exception_& e) {
+      error = e.what();
+    }
+  }
+  fork_pause_us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started).count();
+  cache.unlock_all();
+  for(int i=STRIPES-1; i>=0; i--) stripes[i].unlock();
+
+  if(pid < 0) {
+    rewrite_failures.fetch_add(1, memory_order_relaxed);
+    throw Exception_("AOF", error, 500);
+  }
+  child = pid;
+  child_gen = gen;
+}
+
+void AofBackend::finish_rewrite(int status) {
+  pid_t pid = child;
+  child = -1;
+  string tmp = snapshot_path() + ".tmp";
+  if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    ::unlink(tmp.c_str());
+    rewrite_failures.fetch_add(1, memory_order_relaxed);
+    throw Exception_("AOF", "Snapshot child " + to_string(pid) + " failed", 500);
+  }
+  if(rename(tmp.c_str(), snapshot_path().c_str()) != 0) {
+    rewrite_failures.fetch_add(1, memory_order_relaxed);
+    throw Exception_("AOF", "Fail to install snapshot: " + string(strerror(errno)), 500);
+  }
+  fileutil::sync_dir(dir);
+  snapshot_bytes = file_size(snapshot_path());
+
+  for(uint64_t n : aof_numbers()) {
+    if(n >= child_gen) continue;
+    aof_bytes -= file_size(aof_path(n));
+    ::unlink(aof_path(n).c_str());
+  }
+  rewrites.fetch_add(1, memory_order_relaxed);
+}
+
+bool AofBackend::write_snapshot(const Cache& cache, const string& path, uint64_t gen) {
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(fd < 0) return false;
+  bool ok = true;
+  string buf;
+  auto flush = [&]() {
+    size_t off = 0;
+    while(ok && off < buf.size()) {
+      ssize_t n = ::write(fd, buf.data() + off, buf.size() - off);
+      if(n < 0 && errno == EINTR) continue;
+      if(n < 0) ok = false;
+      else off += n;
+    }
+    buf.clear();
+  };
+  buf.append(SNAPSHOT_MAGIC, 8);
+  put<uint64_t>(buf, gen);
+  cache.for_each_unlocked([&](const string& key, const string& value) {
+    put_record(buf, AOF_OP_SET, key, value);
+    if(buf.size() >= SNAPSHOT_WRITE_BUFFER) flush();
+  });
+  flush();
+  if(ok && fsync(fd) != 0) ok = false;
+  ::close(fd);
+  return ok;
+}
+
+void AofBackend::write_metrics(ostream& out) {
+  out << "# TYPE aof_keys gauge\n";
+  out << "aof_keys " << cache.size() << "\n";
+  out << "# TYPE aof_bytes gauge\n";
+  out << "aof_bytes " << aof_bytes.load() << "\n";
+  out << "# TYPE aof_snapshot_bytes gauge\n";
+  out << "aof_snapshot_bytes " << snapshot_bytes.load() << "\n";
+  out << "# TYPE aof_fsyncs_total counter\n";
+  out << "aof_fsyncs_total " << syncs.load() << "\n";
+  out << "# TYPE aof_fsync_failures_total counter\n";
+  out << "aof_fsync_failures_total " << sync_failures.load() << "\n";
+  out << "# TYPE aof_rewrites_total counter\n";
+  out << "aof_rewrites_total " << rewrites.load() << "\n";
+  out << "# TYPE aof_rewrite_failures_total counter\n";
+  out << "aof_rewrite_failures_total " << rewrite_failures.load() << "\n";
+  out << "# TYPE aof_broken gauge\n";
+  {
+    lock_guard<mutex> lock(aof_mtx);
+    out << "aof_broken " << aof_broken << "\n";
+  }
+  out << "# TYPE aof_last_fork_pause_us gauge\n";
+  out << "aof_last_fork_pause_us " << fork_pause_us.load() << "\n";
+}
@@ -0,0 +1,718 @@
+#include "BTreeBackend.h"
+#include "FileUtil.h"
+#include "Crc32.h"
+
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+#define BTREE_PAGE_SIZE 4096
+#define BTREE_HEADER_SIZE 16
+#define BTREE_MAGIC 0x42545245454b56ULL
+#define BTREE_VERSION 1
+#define BTREE_MAX_KEY 1024
+#define BTREE_MAX_INLINE_VALUE 1024
+#define BTREE_READER_SLOTS 512
+#define BTREE_BATCH_OPS 1024
+
+#define PAGE_LEAF 1
+#define PAGE_BRANCH 2
+#define PAGE_OVERFLOW 3
+#define PAGE_FREELIST 4
+
+#define LEAF_ENTRY_HEADER 7
+#define BRANCH_ENTRY_HEADER 10
+
+// Page:   [u32 type][u32 count][u64 next] then, for leaves and branches, a
+//         u16 offset per entry followed by the entries in key order.
+// Leaf entry:   [u16 klen][u32 vlen][u8 overflow][key][value | u64 first page]
+// Branch entry: [u16 klen][u64 child][key]
+// Overflow and freelist pages chain through `next`; a freelist page holds
+// `count` (u64 txn, u64 page) pairs, txn 0 meaning reusable right away.
+// Meta pages 0 and 1: [u64 magic][u32 version][u32 page size][u64 txn]
+//         [u64 root][u64 page count][u64 freelist][u64 entries][u32 crc].
+
+template <typename T>
+static void put_at(char* p, T v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+template <typename T>
+static T take(const char* p) {
+  T v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t page_type(const char* p) { return take<uint32_t>(p); }
+static uint32_t page_count(const char* p) { return take<uint32_t>(p + 4); }
+static uint64_t page_next(const char* p) { return take<uint64_t>(p + 8); }
+
+static void put_header(char* p, uint32_t type, uint32_t count, uint64_t next) {
+  put_at<uint32_t>(p, type);
+  put_at<uint32_t>(p + 4, count);
+  put_at<uint64_t>(p + 8, next);
+}
+
+static const char* entry_at(const char* p, uint32_t i) {
+  return p + take<uint16_t>(p + BTREE_HEADER_SIZE + 2 * i);
+}
+
+static int compare_key(const char* k, size_t klen, const string& key) {
+  int c = memcmp(k, key.data(), min(klen, key.size()));
+  if(c != 0) return c;
+  return klen < key.size() ? -1 : (klen > key.size() ? 1 : 0);
+}
+
+static string leaf_key(const char* e) {
+  return string(e + LEAF_ENTRY_HEADER, take<uint16_t>(e));
+}
+
+// First leaf entry with key >= target.
+static uint32_t leaf_lower_bound(const char* p, const string& target) {
+  uint32_t lo = 0, hi = page_count(p);
+  while(lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    const char* e = entry_at(p, mid);
+    if(compare_key(e + LEAF_ENTRY_HEADER, take<uint16_t>(e), target) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// Child whose range holds target: the last entry with key <= target, where
+// the first entry counts as minus infinity.
+static uint32_t branch_child_index(const char* p, const string& target) {
+  uint32_t lo = 1, hi = page_count(p);
+  while(lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    const char* e = entry_at(p, mid);
+    if(compare_key(e + BRANCH_ENTRY_HEADER, take<uint16_t>(e), target) <= 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo - 1;
+}
+
+static uint64_t branch_child(const char* p, uint32_t i) {
+  return take<uint64_t>(entry_at(p, i) + 2);
+}
+
+// Splits entries of the given encoded sizes into runs that each fit a page,
+// spreading them evenly rather than leaving a nearly empty last page.
+static vector<pair<size_t, size_t>> split_runs(const vector<size_t>& sizes) {
+  const size_t capacity = BTREE_PAGE_SIZE - BTREE_HEADER_SIZE;
+  size_t total = 0;
+  for(size_t s : sizes) total += s;
+  size_t pages = (total + capacity - 1) / capacity;
+  size_t target = pages ? (total + pages - 1) / pages : capacity;
+  vector<pair<size_t, size_t>> runs;
+  size_t begin = 0, used = 0;
+  for(size_t i=0; i<sizes.size(); i++) {
+    if(i > begin && (used + sizes[i] > capacity || used >= target)) {
+      runs.emplace_back(begin, i);
+      begin = i;
+      used = 0;
+    }
+    used += sizes[i];
+  }
+  if(begin < sizes.size()) runs.emplace_back(begin, sizes.size());
+  return runs;
+}
+
+// Reader slots: each thread claims one slot per tree on first use and
+// publishes the transaction it reads in it; 0 marks an idle slot.
+struct BTreeBackend::ReaderTable {
+  atomic<uint64_t> txn[BTREE_READER_SLOTS];
+  atomic<bool> used[BTREE_READER_SLOTS];
+
+  ReaderTable() {
+    for(int i=0; i<BTREE_READER_SLOTS; i++) {
+      txn[i].store(0);
+      used[i].store(false);
+    }
+  }
+};
+
+namespace {
+struct HeldSlots {
+  vector<pair<shared_ptr<BTreeBackend::ReaderTable>, int>> held;
+
+  ~HeldSlots() {
+    for(auto& h : held) {
+      h.first->txn[h.second].store(0);
+      h.first->used[h.second].store(false);
+    }
+  }
+
+  atomic<uint64_t>& slot(const shared_ptr<BTreeBackend::ReaderTable>& table) {
+    for(auto& h : held) {
+      if(h.first == table) return table->txn[h.second];
+    }
+    for(int i=0; i<BTREE_READER_SLOTS; i++) {
+      bool expected = false;
+      if(!table->used[i].load(memory_order_relaxed) && table->used[i].compare_exchange_strong(expected, true)) {
+        held.emplace_back(table, i);
+        return table->txn[i];
+      }
+    }
+    throw Exception_("BTree", "Too many concurrent reader threads", 503);
+  }
+};
+
+thread_local HeldSlots held_slots;
+}
+
+class BTreeBackend::ReadTxn {
+private:
+  atomic<uint64_t>& slot;
+public:
+  uint64_t root = 0;
+
+  explicit ReadTxn(BTreeBackend& tree) : slot(held_slots.slot(tree.readers)) {
+    // Publish the snapshot, then confirm it is still current: once it is, the
+    // writer's next scan of the slots sees it before reusing any of its pages.
+    for(;;) {
+      uint64_t txn = tree.current_txn.load(memory_order_acquire);
+      slot.store(txn, memory_order_seq_cst);
+      root = tree.roots[txn % ROOT_RING].load(memory_order_acquire);
+      if(tree.current_txn.load(memory_order_seq_cst) == txn) break;
+    }
+  }
+
+  ~ReadTxn() { slot.store(0, memory_order_release); }
+
+  ReadTxn(const ReadTxn&) = delete;
+  ReadTxn& operator=(const ReadTxn&) = delete;
+};
+
+BTreeBackend::BTreeBackend(const string& path, bool sync, size_t map_size)
+  : path(path), sync(sync), map_size(map_size), readers(make_shared<ReaderTable>()) {
+  fileutil::make_dirs(fileutil::dir_of(path));
+  fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if(fd < 0) throw Exception_("BTree", "Fail to open " + path + ": " + strerror(errno), 500);
+  struct stat st;
+  if(fstat(fd, &st) != 0) throw Exception_("BTree", "Fail to stat " + path + ": " + strerror(errno), 500);
+
+  if(st.st_size < 2 * BTREE_PAGE_SIZE) {
+    string zero(BTREE_PAGE_SIZE, '\0');
+    fileutil::pwrite_all(fd, zero.data(), zero.size(), 0, path);
+    Meta initial;
+    initial.txn = 1;
+    initial.page_count = 2;
+    write_meta(initial);
+  }
+
+  void* p = mmap(nullptr, map_size, PROT_READ, MAP_SHARED | MAP_NORESERVE, fd, 0);
+  if(p == MAP_FAILED) throw Exception_("BTree", "Fail to map " + path + ": " + strerror(errno), 500);
+  map = static_cast<char*>(p);
+
+  Meta a, b;
+  bool a_ok = read_meta(0, a), b_ok = read_meta(1, b);
+  if(!a_ok && !b_ok) throw Exception_("BTree", "No valid meta page in " + path, 500);
+  meta = (a_ok && (!b_ok || a.txn > b.txn)) ? a : b;
+
+  // No reader is older than the open transaction, so every listed page is free.
+  for(uint64_t pgno = meta.freelist; pgno; ) {
+    const char* fp = page(pgno);
+    for(uint32_t i=0; i<page_count(fp); i++) {
+      ready.push_back(take<uint64_t>(fp + BTREE_HEADER_SIZE + 16 * i + 8));
+    }
+    pgno = page_next(fp);
+  }
+
+  for(int i=0; i<ROOT_RING; i++) roots[i].store(0);
+  roots[meta.txn % ROOT_RING].store(meta.root);
+  current_txn.store(meta.txn);
+  free_pages = ready.size();
+  entries_count = meta.entries;
+  pages_count = meta.page_count;
+}
+
+BTreeBackend::~BTreeBackend() {
+  if(map) munmap(map, map_size);
+  if(fd >= 0) ::close(fd);
+}
+
+const char* BTreeBackend::page(uint64_t pgno) const {
+  auto it = dirty.find(pgno);
+  if(it != dirty.end()) return it->second.data();
+  return map + pgno * BTREE_PAGE_SIZE;
+}
+
+bool BTreeBackend::read_meta(int slot, Meta& m) const {
+  const char* p = map + slot * BTREE_PAGE_SIZE;
+  if(take<uint64_t>(p) != BTREE_MAGIC) return false;
+  if(take<uint32_t>(p + 8) != BTREE_VERSION || take<uint32_t>(p + 12) != BTREE_PAGE_SIZE) return false;
+  if(crc32(p, 56) != take<uint32_t>(p + 56)) return false;
+  m.txn = take<uint64_t>(p + 16);
+  m.root = take<uint64_t>(p + 24);
+  m.page_count = take<uint64_t>(p + 32);
+  m.freelist = take<uint64_t>(p + 40);
+  m.entries = take<uint64_t>(p + 48);
+  return true;
+}
+
+void BTreeBackend::write_meta(const Meta& m) {
+  char p[64] = {0};
+  put_at<uint64_t>(p, BTREE_MAGIC);
+  put_at<uint32_t>(p + 8, BTREE_VERSION);
+  put_at<uint32_t>(p + 12, BTREE_PAGE_SIZE);
+  put_at<uint64_t>(p + 16, m.txn);
+  put_at<uint64_t>(p + 24, m.root);
+  put_at<uint64_t>(p + 32, m.page_count);
+  put_at<uint64_t>(p + 40, m.freelist);
+  put_at<uint64_t>(p + 48, m.entries);
+  put_at<uint32_t>(p + 56, crc32(p, 56));
+  fileutil::pwrite_all(fd, p, sizeof(p), (m.txn % 2) * BTREE_PAGE_SIZE, path);
+  if(sync && fdatasync(fd) != 0) throw Exception_("BTree", string("Fail to sync meta: ") + strerror(errno), 500);
+}
+
+pair<bool, string> BTreeBackend::get(const string& key) {
+  ReadTxn txn(*this);
+  uint64_t pgno = txn.root;
+  if(pgno == 0) return {false, ""};
+  for(;;) {
+    const char* p = map + pgno * BTREE_PAGE_SIZE;
+    if(page_type(p) == PAGE_BRANCH) {
+      pgno = branch_child(p, branch_child_index(p, key));
+      continue;
+    }
+    uint32_t i = leaf_lower_bound(p, key);
+    if(i >= page_count(p)) return {false, ""};
+    const char* e = entry_at(p, i);
+    uint16_t klen = take<uint16_t>(e);
+    if(compare_key(e + LEAF_ENTRY_HEADER, klen, key) != 0) return {false, ""};
+    uint32_t vlen = take<uint32_t>(e + 2);
+    const char* v = e + LEAF_ENTRY_HEADER + klen;
+    if(!e[6]) return {true, string(v, vlen)};
+    string value;
+    value.reserve(vlen);
+    for(uint64_t o = take<uint64_t>(v); o; ) {
+      const char* op = map + o * BTREE_PAGE_SIZE;
+      value.append(op + BTREE_HEADER_SIZE, page_count(op));
+      o = page_next(op);
+    }
+    return {true, value};
+  }
+}
+
+vector<pair<string, string>> BTreeBackend::scan(const string& start, size_t limit) {
+  vector<pair<string, string>> out;
+  ReadTxn txn(*this);
+  if(txn.root == 0 || limit == 0) return out;
+
+  // Leaves have no sibling links (copy-on-write would have to rewrite them),
+  // so iteration keeps the branch path on a stack.
+  vector<pair<const char*, uint32_t>> path;
+  const char* p = map + txn.root * BTREE_PAGE_SIZE;
+  bool leftmost = false;
+  for(;;) {
+    while(page_type(p) == PAGE_BRANCH) {
+      uint32_t i = leftmost ? 0 : branch_child_index(p, start);
+      path.emplace_back(p, i);
+      p = map + branch_child(p, i) * BTREE_PAGE_SIZE;
+    }
+    for(uint32_t i = leftmost ? 0 : leaf_lower_bound(p, start); i < page_count(p); i++) {
+      const char* e = entry_at(p, i);
+      uint16_t klen = take<uint16_t>(e);
+      uint32_t vlen = take<uint32_t>(e + 2);
+      const char* v = e + LEAF_ENTRY_HEADER + klen;
+      string value;
+      if(!e[6]) {
+        value.assign(v, vlen);
+      } else {
+        for(uint64_t o = take<uint64_t>(v); o; ) {
+          const char* op = map + o * BTREE_PAGE_SIZE;
+          value.append(op + BTREE_HEADER_SIZE, page_count(op));
+          o = page_next(op);
+        }
+      }
+      out.emplace_back(leaf_key(e), move(value));
+      if(out.size() >= limit) return out;
+    }
+    while(!path.empty() && path.back().second + 1 >= page_count(path.back().first)) path.pop_back();
+    if(path.empty()) return out;
+    uint32_t next = ++path.back().second;
+    p = map + branch_child(path.back().first, next) * BTREE_PAGE_SIZE;
+    leftmost = true;
+  }
+}
+
+bool BTreeBackend::set(const string& key, const string& value) {
+  bool existed;
+  write(key, value, false, existed);
+  return true;
+}
+
+bool BTreeBackend::remove(const string& key) {
+  bool existed;
+  write(key, string(), true, existed);
+  return existed;
+}
+
+void BTreeBackend::write(const string& key, const string& value, bool tombstone, bool& existed) {
+  if(key.size() > BTREE_MAX_KEY) {
+    throw Exception_("BTree", "Key longer than " + to_string(BTREE_MAX_KEY) + " bytes", 400);
+  }
+  Op op(key, value, tombstone);
+  unique_lock<mutex> lock(mtx);
+  queue.push_back(&op);
+  while(!op.done && &op != queue.front()) op.cv.wait(lock);
+  if(op.done) {
+    if(!op.error.empty()) throw Exception_("BTree", op.error, 500);
+    existed = op.existed;
+    return;
+  }
+
+  // Leader: run every queued operation as one write transaction.
+  vector<Op*> group(queue.begin(), queue.begin() + min<size_t>(queue.size(), BTREE_BATCH_OPS));
+  lock.unlock();
+
+  string error;
+  begin();
+  Meta saved_meta = meta;
+  vector<uint64_t> saved_ready = ready;
+  try {
+    for(Op* o : group) apply(*o);
+    commit();
+    commits.fetch_add(1, memory_order_relaxed);
+    commit_ops.fetch_add(group.size(), memory_order_relaxed);
+  } catch(const Exception_& e) {
+    error = e.what();
+    meta = saved_meta;
+    ready = saved_ready;
+    dirty.clear();
+    freed.clear();
+    dirty_free.clear();
+  }
+
+  lock.lock();
+  for(Op* o : group) {
+    queue.pop_front();
+    if(o == &op) continue;
+    o->error = error;
+    o->done = true;
+    o->cv.notify_one();
+  }
+  if(!queue.empty()) queue.front()->cv.notify_one();
+  if(!error.empty()) throw Exception_("BTree", error, 500);
+  existed = op.existed;
+}
+
+void BTreeBackend::begin() {
+  uint64_t oldest = meta.txn;
+  for(int i=0; i<BTREE_READER_SLOTS; i++) {
+    uint64_t t = readers->txn[i].load(memory_order_seq_cst);
+    if(t != 0 && t < oldest) oldest = t;
+  }
+  // Pages freed by txn T were last visible to snapshot T-1.
+  while(!pending.empty() && pending.front().first <= oldest) {
+    ready.insert(ready.end(), pending.front().second.begin(), pending.front().second.end());
+    pending.pop_front();
+  }
+  dirty.clear();
+  freed.clear();
+  dirty_free.clear();
+}
+
+uint64_t BTreeBackend::alloc() {
+  uint64_t pgno;
+  if(!dirty_free.empty()) {
+    pgno = dirty_free.back();
+    dirty_free.pop_back();
+  } else if(!ready.empty()) {
+    pgno = ready.back();
+    ready.pop_back();
+  } else {
+    pgno = meta.page_count++;
+    if(meta.page_count * BTREE_PAGE_SIZE > map_size) {
+      throw Exception_("BTree", "Database reached the map size of " + to_string(map_size >> 20) + " MB", 507);
+    }
+  }
+  return pgno;
+}
+
+void BTreeBackend::release(uint64_t pgno) {
+  if(dirty.erase(pgno)) dirty_free.push_back(pgno);
+  else freed.push_back(pgno);
+}
+
+char* BTreeBackend::new_page(uint64_t& pgno) {
+  pgno = alloc();
+  string& buf = dirty[pgno];
+  buf.assign(BTREE_PAGE_SIZE, '\0');
+  return &buf[0];
+}
+
+uint64_t BTreeBackend::write_overflow(const string& value) {
+  const size_t room = BTREE_PAGE_SIZE - BTREE_HEADER_SIZE;
+  size_t pages = (value.size() + room - 1) / room;
+  vector<uint64_t> pgnos(pages);
+  vector<char*> bufs(pages);
+  for(size_t i=0; i<pages; i++) bufs[i] = new_page(pgnos[i]);
+  for(size_t i=0; i<pages; i++) {
+    size_t len = min(room, value.size() - i * room);
+    put_header(bufs[i], PAGE_OVERFLOW, (uint32_t)len, i + 1 < pages ? pgnos[i + 1] : 0);
+    memcpy(bufs[i] + BTREE_HEADER_SIZE, value.data() + i * room, len);
+  }
+  return pgnos[0];
+}
+
+// Releases a chain of overflow or freelist pages.
+void BTreeBackend::release_chain(uint64_t pgno) {
+  while(pgno) {
+    uint64_t next = page_next(page(pgno));
+    release(pgno);
+    pgno = next;
+  }
+}
+
+vector<BTreeBackend::BranchEntry> BTreeBackend::write_leaf(const vector<LeafEntry>& entries) {
+  vector<size_t> sizes;
+  for(const LeafEntry& e : entries) {
+    sizes.push_back(2 + LEAF_ENTRY_HEADER + e.key.size() + (e.overflow ? 8 : e.value.size()));
+  }
+  vector<BranchEntry> out;
+  for(auto& run : split_runs(sizes)) {
+    BranchEntry ref;
+    char* p = new_page(ref.child);
+    uint32_t count = run.second - run.first;
+    put_header(p, PAGE_LEAF, count, 0);
+    uint16_t off = BTREE_HEADER_SIZE + 2 * count;
+    for(uint32_t i=0; i<count; i++) {
+      const LeafEntry& e = entries[run.first + i];
+      put_at<uint16_t>(p + BTREE_HEADER_SIZE + 2 * i, off);
+      char* w = p + off;
+      put_at<uint16_t>(w, (uint16_t)e.key.size());
+      put_at<uint32_t>(w + 2, e.vlen);
+      w[6] = e.overflow ? 1 : 0;
+      memcpy(w + LEAF_ENTRY_HEADER, e.key.data(), e.key.size());
+      w += LEAF_ENTRY_HEADER + e.key.size();
+      if(e.overflow) {
+        put_at<uint64_t>(w, e.overflow);
+        w += 8;
+      } else {
+        memcpy(w, e.value.data(), e.value.size());
+        w += e.value.size();
+      }
+      off = w - p;
+    }
+    ref.key = entries[run.first].key;
+    out.push_back(move(ref));
+  }
+  return out;
+}
+
+vector<BTreeBackend::BranchEntry> BTreeBackend::write_branch(const vector<BranchEntry>& entries) {
+  vector<size_t> sizes;
+  for(const BranchEntry& e : entries) sizes.push_back(2 + BRANCH_ENTRY_HEADER + e.key.size());
+  vector<BranchEntry> out;
+  for(auto& run : split_runs(sizes)) {
+    BranchEntry ref;
+    char* p = new_page(ref.child);
+    uint32_t count = run.second - run.first;
+    put_header(p, PAGE_BRANCH, count, 0);
+    uint16_t off = BTREE_HEADER_SIZE + 2 * count;
+    for(uint32_t i=0; i<count; i++) {
+      const BranchEntry& e = entries[run.first + i];
+      put_at<uint16_t>(p + BTREE_HEADER_SIZE + 2 * i, off);
+      put_at<uint16_t>(p + off, (uint16_t)e.key.size());
+      put_at<uint64_t>(p + off + 2, e.child);
+      memcpy(p + off + BRANCH_ENTRY_HEADER, e.key.data(), e.key.size());
+      off += BRANCH_ENTRY_HEADER + e.key.size();
+    }
+    ref.key = entries[run.first].key;
+    out.push_back(move(ref));
+  }
+  return out;
+}
+
+// Copy-on-write update of the subtree at pgno. Returns false when nothing
+// changed; otherwise `out` lists the pages replacing it (none if it emptied).
+bool BTreeBackend::modify(uint64_t pgno, Op& op, vector<BranchEntry>& out) {
+  const char* p = page(pgno);
+  uint32_t count = page_count(p);
+
+  if(page_type(p) == PAGE_BRANCH) {
+    vector<BranchEntry> entries(count);
+    for(uint32_t i=0; i<count; i++) {
+      const char* e = entry_at(p, i);
+      entries[i].key.assign(e + BRANCH_ENTRY_HEADER, take<uint16_t>(e));
+      entries[i].child = take<uint64_t>(e + 2);
+    }
+    uint32_t idx = branch_child_index(p, op.key);
+    vector<BranchEntry> sub;
+    if(!modify(entries[idx].child, op, sub)) return false;
+    if(!sub.empty()) sub[0].key = entries[idx].key;
+    entries.erase(entries.begin() + idx);
+    entries.insert(entries.begin() + idx, sub.begin(), sub.end());
+    release(pgno);
+    if(!entries.empty()) out = write_branch(entries);
+    return true;
+  }
+
+  uint32_t i = leaf_lower_bound(p, op.key);
+  bool found = false;
+  if(i < count) {
+    const char* e = entry_at(p, i);
+    found = compare_key(e + LEAF_ENTRY_HEADER, take<uint16_t>(e), op.key) == 0;
+  }
+  op.existed = found;
+  if(op.tombstone && !found) return false;
+
+  vector<LeafEntry> entries(count);
+  for(uint32_t j=0; j<count; j++) {
+    const char* e = entry_at(p, j);
+    uint16_t klen = take<uint16_t>(e);
+    entries[j].key.assign(e + LEAF_ENTRY_HEADER, klen);
+    entries[j].vlen = take<uint32_t>(e + 2);
+    const char* v = e + LEAF_ENTRY_HEADER + klen;
+    if(e[6]) entries[j].overflow = take<uint64_t>(v);
+    else entries[j].value.assign(v, entries[j].vlen);
+  }
+  if(found && entries[i].overflow) release_chain(entries[i].overflow);
+
+  if(op.tombstone) {
+    entries.erase(entries.begin() + i);
+  } else {
+    if(!found) {
+      entries.insert(entries.begin() + i, LeafEntry());
+      entries[i].key = op.key;
+    }
+    LeafEntry& e = entries[i];
+    e.vlen = (uint32_t)op.value.size();
+    if(op.value.size() > BTREE_MAX_INLINE_VALUE) {
+      e.value.clear();
+      e.overflow = write_overflow(op.value);
+    } else {
+      e.value = op.value;
+      e.overflow = 0;
+    }
+  }
+  release(pgno);
+  if(!entries.empty()) out = write_leaf(entries);
+  return true;
+}
+
+void BTreeBackend::apply(Op& op) {
+  vector<BranchEntry> out;
+  bool changed;
+  if(meta.root == 0) {
+    op.existed = false;
+    changed = !op.tombstone;
+    if(changed) {
+      LeafEntry e;
+      e.key = op.key;
+      e.vlen = (uint32_t)op.value.size();
+      if(op.value.size() > BTREE_MAX_INLINE_VALUE) e.overflow = write_overflow(op.value);
+      else e.value = op.value;
+      out = write_leaf({e});
+    }
+  } else {
+    changed = modify(meta.root, op, out);
+  }
+  if(!changed) return;
+
+  while(out.size() > 1) out = write_branch(out);
+  meta.root = out.empty() ? 0 : out[0].child;
+  // Collapse single-child branches left behind by deletes.
+  while(meta.root && page_type(page(meta.root)) == PAGE_BRANCH && page_count(page(meta.root)) == 1) {
+    uint64_t child = branch_child(page(meta.root), 0);
+    release(meta.root);
+    meta.root = child;
+  }
+  if(op.tombstone && op.existed) meta.entries--;
+  if(!op.tombstone && !op.existed) meta.entries++;
+}
+
+void BTreeBackend::commit() {
+  if(dirty.empty() && freed.empty()) return;
+  uint64_t txn = meta.txn + 1;
+
+  // Persist the free state. The previous freelist chain is itself freed by
+  // this transaction; the new chain takes its pages from the free pool first,
+  // which only shrinks the list it has to hold.
+  release_chain(meta.freelist);
+  size_t listed = ready.size() + dirty_free.size() + freed.size();
+  for(auto& entry : pending) listed += entry.second.size();
+  const size_t per_page = (BTREE_PAGE_SIZE - BTREE_HEADER_SIZE) / 16;
+  size_t list_pages = (listed + per_page - 1) / per_page;
+  vector<uint64_t> chain(list_pages);
+  vector<char*> bufs(list_pages);
+  for(size_t i=0; i<list_pages; i++) bufs[i] = new_page(chain[i]);
+
+  vector<pair<uint64_t, uint64_t>> list;
+  for(uint64_t pgno : ready) list.emplace_back(0, pgno);
+  for(uint64_t pgno : dirty_free) list.emplace_back(0, pgno);
+  for(auto& entry : pending) {
+    for(uint64_t pgno : entry.second) list.emplace_back(entry.first, pgno);
+  }
+  for(uint64_t pgno : freed) list.emplace_back(txn, pgno);
+  for(size_t i=0; i<list_pages; i++) {
+    size_t begin = min(list.size(), i * per_page), end = min(list.size(), begin + per_page);
+    put_header(bufs[i], PAGE_FREELIST, (uint32_t)(end - begin), i + 1 < list_pages ? chain[i + 1] : 0);
+    for(size_t j=begin; j<end; j++) {
+      put_at<uint64_t>(bufs[i] + BTREE_HEADER_SIZE + 16 * (j - begin), list[j].first);
+      put_at<uint64_t>(bufs[i] + BTREE_HEADER_SIZE + 16 * (j - begin) + 8, list[j].second);
+    }
+  }
+  meta.freelist = list_pages ? chain[0] : 0;
+
+  // Write dirty pages in file order, coalescing adjacent ones.
+  vector<uint64_t> pgnos;
+  for(auto& entry : dirty) pgnos.push_back(entry.first);
+  sort(pgnos.begin(), pgnos.end());
+  string run;
+  for(size_t i=0; i<pgnos.size(); i++) {
+    run += dirty[pgnos[i]];
+    if(i + 1 == pgnos.size() || pgnos[i + 1] != pgnos[i] + 1) {
+      uint64_t first = pgnos[i] + 1 - run.size() / BTREE_PAGE_SIZE;
+      fileutil::pwrite_all(fd, run.data(), run.size(), first * BTREE_PAGE_SIZE, path);
+      run.clear();
+    }
+  }
+  if(sync && fdatasync(fd) != 0) throw Exception_("BTree", string("Fail to sync pages: ") + strerror(errno), 500);
+
+  meta.txn = txn;
+  write_meta(meta);
+
+  if(!freed.empty()) pending.emplace_back(txn, move(freed));
+  ready.insert(ready.end(), dirty_free.begin(), dirty_free.end());
+  dirty.clear();
+  freed.clear();
+  dirty_free.clear();
+
+  roots[txn % ROOT_RING].store(meta.root, memory_order_release);
+  current_txn.store(txn, memory_order_seq_cst);
+
+  size_t free_total = ready.size();
+  for(auto& entry : pending) free_total += entry.second.size();
+  free_pages = free_total;
+  entries_count = meta.entries;
+  pages_count = meta.page_count;
+}
+
+void BTreeBackend::write_metrics(ostream& out) {
+  int active = 0;
+  for(int i=0; i<BTREE_READER_SLOTS; i++) {
+    if(readers->used[i].load(memory_order_relaxed)) active++;
+  }
+  out << "# TYPE btree_entries gauge\n";
+  out << "btree_entries " << entries_count.load() << "\n";
+  out << "# TYPE btree_pages gauge\n";
+  out << "btree_pages " << pages_count.load() << "\n";
+  out << "# TYPE btree_free_pages gauge\n";
+  out << "btree_free_pages " << free_pages.load() << "\n";
+  out << "# TYPE btree_commits_total counter\n";
+  out << "btree_commits_total " << commits.load() << "\n";
+  out << "# TYPE btree_commit_ops_total counter\n";
+  out << "btree_commit_ops_total " << commit_ops.load() << "\n";
+  out << "# TYPE btree_reader_slots gauge\n";
+  out << "btree_reader_slots " << active << "\n";
+}
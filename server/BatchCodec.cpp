@@ -0,0 +1,37 @@
+#include "BatchCodec.h"
+
+#include <cstdint>
+
+using namespace std;
+
+#define MISSING_LENGTH 0xFFFFFFFFu
+
+static void put_length(string& out, uint32_t len) {
+  out.push_back((char)(len >> 24));
+  out.push_back((char)(len >> 16));
+  out.push_back((char)(len >> 8));
+  out.push_back((char)len);
+}
+
+bool batchcodec::parse(const string& body, vector<string>& out) {
+  const unsigned char* p = (const unsigned char*)body.data();
+  size_t at = 0;
+  while(at < body.size()) {
+    if(body.size() - at < 4) return false;
+    uint32_t len = (uint32_t)p[at] << 24 | (uint32_t)p[at+1] << 16 | (uint32_t)p[at+2] << 8 | p[at+3];
+    at += 4;
+    if(len == MISSING_LENGTH || body.size() - at < len) return false;
+    out.emplace_back(body, at, len);
+    at += len;
+  }
+  return true;
+}
+
+void batchcodec::append(string& out, const string& s) {
+  put_length(out, (uint32_t)s.size());
+  out += s;
+}
+
+void batchcodec::append_missing(string& out) {
+  put_length(out, MISSING_LENGTH);
+}
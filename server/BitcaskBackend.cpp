@@ -0,0 +1,608 @@
+#include "BitcaskBackend.h"
+#include "FileUtil.h"
+#include "Crc32.h"
+
+#include <algorithm>
+#include <functional>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+#define BITCASK_FILE_BYTES (64ULL << 20)
+#define BITCASK_HEADER_SIZE 21
+#define BITCASK_HINT_HEADER_SIZE 25
+#define MERGE_CHECK_INTERVAL_MS 1000
+#define MERGE_MIN_DEAD_BYTES (32ULL << 20)
+#define MERGE_DEAD_PERCENT 50
+#define MERGE_WRITE_BUFFER (1 << 20)
+
+// Record: [u32 crc][u64 seq][u32 klen][u32 vlen][u8 tombstone][key][value],
+// the crc covering everything after itself.
+// Hint:   [u64 seq][u32 klen][u32 vlen][u64 offset][u8 tombstone][key].
+
+template <typename T>
+static void put(string& out, T v) {
+  out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+template <typename T>
+static T take(const char* p) {
+  T v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint64_t record_size(size_t klen, size_t vlen) {
+  return BITCASK_HEADER_SIZE + klen + vlen;
+}
+
+static void put_hint(string& out, const string& key, uint64_t seq, uint32_t vlen, uint64_t offset, bool tombstone) {
+  put<uint64_t>(out, seq);
+  put<uint32_t>(out, (uint32_t)key.size());
+  put<uint32_t>(out, vlen);
+  put<uint64_t>(out, offset);
+  out.push_back(tombstone ? 1 : 0);
+  out += key;
+}
+
+static void raise_to(atomic<uint64_t>& target, uint64_t value) {
+  uint64_t current = target.load();
+  while(current < value && !target.compare_exchange_weak(current, value)) {}
+}
+
+BitcaskBackend::DataFile::~DataFile() {
+  if(map) munmap(map, map_size);
+  if(fd >= 0) ::close(fd);
+}
+
+BitcaskBackend::BitcaskBackend(const string& dir, bool sync) : dir(dir), sync(sync) {
+  fileutil::make_dirs(dir);
+  recover();
+  {
+    lock_guard<mutex> lock(mtx);
+    rotate(0);
+  }
+  merger = thread(&BitcaskBackend::merge_loop, this);
+}
+
+BitcaskBackend::~BitcaskBackend() {
+  {
+    lock_guard<mutex> lock(merge_mtx);
+    stopping = true;
+  }
+  merge_cv.notify_all();
+  if(merger.joinable()) merger.join();
+  // Seal the active file so a clean restart loads hints only.
+  try {
+    lock_guard<mutex> lock(mtx);
+    if(ftruncate(active->fd, active->size.load()) != 0 || fdatasync(active->fd) != 0) {
+      throw Exception_("Bitcask", string("Fail to seal data file: ") + strerror(errno), 500);
+    }
+    fileutil::write_file_atomic(file_path(active->id, ".hint"), active_hint);
+  } catch(const Exception_& e) {
+    cerr << e.what() << endl;
+  }
+}
+
+BitcaskBackend::Shard& BitcaskBackend::shard_for(const string& key) {
+  return shards[hash<string>()(key) % SHARDS];
+}
+
+string BitcaskBackend::file_path(uint32_t id, const char* ext) const {
+  return dir + "/" + to_string(id) + ext;
+}
+
+shared_ptr<BitcaskBackend::DataFile> BitcaskBackend::file(uint32_t id) {
+  shared_lock<shared_mutex> lock(files_mtx);
+  auto it = files.find(id);
+  return it == files.end() ? nullptr : it->second;
+}
+
+// A writable file is preallocated to `reserve` bytes and mapped whole, so
+// appends become readable through the same mapping without remapping.
+shared_ptr<BitcaskBackend::DataFile> BitcaskBackend::open_file(uint32_t id, bool writable, size_t reserve) {
+  string path = file_path(id, ".data");
+  shared_ptr<DataFile> f = make_shared<DataFile>();
+  f->id = id;
+  f->fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC | (writable ? O_CREAT | O_TRUNC : 0), 0644);
+  if(f->fd < 0) throw Exception_("Bitcask", "Fail to open " + path + ": " + strerror(errno), 500);
+  if(writable) {
+    if(ftruncate(f->fd, reserve) != 0) throw Exception_("Bitcask", "Fail to size " + path + ": " + strerror(errno), 500);
+    f->map_size = reserve;
+  } else {
+    struct stat st;
+    if(fstat(f->fd, &st) != 0) throw Exception_("Bitcask", "Fail to stat " + path + ": " + strerror(errno), 500);
+    f->map_size = st.st_size;
+    f->size = st.st_size;
+  }
+  if(f->map_size > 0) {
+    void* p = mmap(nullptr, f->map_size, PROT_READ, MAP_SHARED, f->fd, 0);
+    if(p == MAP_FAILED) throw Exception_("Bitcask", "Fail to map " + path + ": " + strerror(errno), 500);
+    f->map = static_cast<char*>(p);
+  }
+  return f;
+}
+
+void BitcaskBackend::recover() {
+  // A merge that recorded its inputs had finished writing its outputs; it
+  // only remains to delete the inputs.
+  string marker = dir + "/MERGE";
+  if(fileutil::exists(marker)) {
+    string text = fileutil::read_file(marker);
+    size_t pos = 0;
+    while(pos < text.size()) {
+      size_t eol = text.find('\n', pos);
+      if(eol == string::npos) eol = text.size();
+      if(eol > pos) {
+        uint32_t id = (uint32_t)stoul(text.substr(pos, eol - pos));
+        ::unlink(file_path(id, ".data").c_str());
+        ::unlink(file_path(id, ".hint").c_str());
+      }
+      pos = eol + 1;
+    }
+    ::unlink(marker.c_str());
+  }
+
+  vector<uint32_t> ids;
+  for(const string& name : fileutil::list_dir(dir)) {
+    size_t dot = name.find('.');
+    if(dot == string::npos || dot == 0 || !isdigit((unsigned char)name[0])) continue;
+    string ext = name.substr(dot);
+    if(ext == ".data") ids.push_back((uint32_t)stoul(name.substr(0, dot)));
+    else if(ext != ".hint") ::unlink((dir + "/" + name).c_str());
+  }
+  sort(ids.begin(), ids.end());
+
+  unordered_map<string, Loc> keydir;
+  unordered_map<string, uint64_t> deleted;
+  for(uint32_t id : ids) {
+    next_file = max(next_file, id + 1);
+    shared_ptr<DataFile> f = open_file(id, false, 0);
+    string hint = file_path(id, ".hint");
+    if(fileutil::exists(hint)) load_hints(hint, id, keydir, deleted);
+    else scan_file(*f, keydir, deleted);
+    if(f->size.load() == 0) {
+      ::unlink(file_path(id, ".data").c_str());
+      ::unlink(hint.c_str());
+      continue;
+    }
+    files[id] = f;
+  }
+
+  unordered_map<uint32_t, uint64_t> live;
+  for(auto& entry : keydir) {
+    live[entry.second.file] += record_size(entry.first.size(), entry.second.vlen);
+    shards[hash<string>()(entry.first) % SHARDS].keys.emplace(entry.first, entry.second);
+  }
+  for(auto& entry : files) entry.second->dead = entry.second->size.load() - live[entry.first];
+  live_keys = keydir.size();
+}
+
+void BitcaskBackend::replay(const string& key, const Loc& loc, bool tombstone,
+  unordered_map<string, Loc>& keydir, unordered_map<string, uint64_t>& deleted) {
+  auto d = deleted.find(key);
+  auto k = keydir.find(key);
+  if(d != deleted.end() && d->second > loc.seq) return;
+  if(k != keydir.end() && k->second.seq > loc.seq) return;
+  if(tombstone) {
+    deleted[key] = loc.seq;
+    if(k != keydir.end()) keydir.erase(k);
+  } else {
+    keydir[key] = loc;
+    if(d != deleted.end()) deleted.erase(d);
+  }
+  seq = max(seq, loc.seq);
+}
+
+void BitcaskBackend::scan_file(DataFile& f, unordered_map<string, Loc>& keydir,
+  unordered_map<string, uint64_t>& deleted) {
+  uint64_t pos = 0;
+  // Stops at the first torn or zeroed record (the preallocated tail).
+  while(pos + BITCASK_HEADER_SIZE <= f.map_size) {
+    const char* p = f.map + pos;
+    uint32_t crc = take<uint32_t>(p);
+    uint32_t klen = take<uint32_t>(p + 12);
+    uint32_t vlen = take<uint32_t>(p + 16);
+    uint64_t size = record_size(klen, vlen);
+    if(pos + size > f.map_size) break;
+    if(crc32(p + 4, size - 4) != crc) break;
+
+    Loc loc;
+    loc.file = f.id;
+    loc.vlen = vlen;
+    loc.offset = pos;
+    loc.seq = take<uint64_t>(p + 4);
+    replay(string(p + BITCASK_HEADER_SIZE, klen), loc, p[20] != 0, keydir, deleted);
+    pos += size;
+  }
+  f.size = pos;
+  if(pos < f.map_size && ftruncate(f.fd, pos) != 0) {
+    throw Exception_("Bitcask", "Fail to trim data file " + to_string(f.id) + ": " + strerror(errno), 500);
+  }
+}
+
+void BitcaskBackend::load_hints(const string& path, uint32_t id, unordered_map<string, Loc>& keydir,
+  unordered_map<string, uint64_t>& deleted) {
+  string data = fileutil::read_file(path);
+  size_t pos = 0;
+  while(pos + BITCASK_HINT_HEADER_SIZE <= data.size()) {
+    const char* p = data.data() + pos;
+    uint32_t klen = take<uint32_t>(p + 8);
+    if(pos + BITCASK_HINT_HEADER_SIZE + klen > data.size()) break;
+    Loc loc;
+    loc.file = id;
+    loc.seq = take<uint64_t>(p);
+    loc.vlen = take<uint32_t>(p + 12);
+    loc.offset = take<uint64_t>(p + 16);
+    replay(string(p + BITCASK_HINT_HEADER_SIZE, klen), loc, p[24] != 0, keydir, deleted);
+    pos += BITCASK_HINT_HEADER_SIZE + klen;
+  }
+}
+
+// Called with mtx held.
+BitcaskBackend::Loc BitcaskBackend::append(const string& key, const string& value, bool tombstone) {
+  uint64_t size = record_size(key.size(), value.size());
+  if(active->size.load() + size > active->map_size) rotate(size);
+
+  string record;
+  record.reserve(size);
+  put<uint32_t>(record, 0);
+  put<uint64_t>(record, ++seq);
+  put<uint32_t>(record, (uint32_t)key.size());
+  put<uint32_t>(record, (uint32_t)value.size());
+  record.push_back(tombstone ? 1 : 0);
+  record += key;
+  record += value;
+  uint32_t crc = crc32(record.data() + 4, record.size() - 4);
+  memcpy(&record[0], &crc, sizeof(crc));
+
+  Loc loc;
+  loc.file = active->id;
+  loc.vlen = (uint32_t)value.size();
+  loc.offset = active->size.load();
+  loc.seq = seq;
+  const char* p = record.data();
+  size_t left = record.size();
+  uint64_t off = loc.offset;
+  while(left > 0) {
+    ssize_t n = pwrite(active->fd, p, left, off);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0) throw Exception_("Bitcask", string("Fail to append: ") + strerror(errno), 500);
+    p += n;
+    left -= n;
+    off += n;
+  }
+  active->size += size;
+  appended += size;
+  put_hint(active_hint, key, loc.seq, loc.vlen, loc.offset, tombstone);
+  return loc;
+}
+
+// Called with mtx held: seals the active file (trimmed, synced, hinted) and
+// starts a new one large enough for `need` bytes.
+void BitcaskBackend::rotate(size_t need) {
+  if(active) {
+    if(ftruncate(active->fd, active->size.load()) != 0 || fdatasync(active->fd) != 0) {
+      throw Exception_("Bitcask", string("Fail to seal data file: ") + strerror(errno), 500);
+    }
+    raise_to(synced, appended.load());
+    fileutil::write_file_atomic(file_path(active->id, ".hint"), active_hint);
+    active_hint.clear();
+  }
+  shared_ptr<DataFile> f = open_file(next_file++, true, max<size_t>(BITCASK_FILE_BYTES, need));
+  fileutil::sync_dir(dir);
+  {
+    unique_lock<shared_mutex> lock(files_mtx);
+    files[f->id] = f;
+  }
+  active = f;
+  merge_cv.notify_one();
+}
+
+// Group commit: one fdatasync covers every append made before it started.
+void BitcaskBackend::commit(uint64_t position) {
+  if(!sync) return;
+  lock_guard<mutex> lock(sync_mtx);
+  if(synced.load() >= position) return;
+  uint64_t target;
+  shared_ptr<DataFile> f;
+  {
+    lock_guard<mutex> append_lock(mtx);
+    target = appended.load();
+    f = active;
+  }
+  if(fdatasync(f->fd) != 0) throw Exception_("Bitcask", string("Fail to sync: ") + strerror(errno), 500);
+  syncs.fetch_add(1, memory_order_relaxed);
+  raise_to(synced, target);
+}
+
+void BitcaskBackend::mark_dead(const Loc& old, size_t klen) {
+  shared_ptr<DataFile> f = file(old.file);
+  if(f) f->dead += record_size(klen, old.vlen);
+}
+
+pair<bool, string> BitcaskBackend::get(const string& key) {
+  Shard& shard = shard_for(key);
+  // A merge may retire the file between the keydir lookup and the read;
+  // the keydir then already points at the rewritten record.
+  for(;;) {
+    Loc loc;
+    {
+      shared_lock<shared_mutex> lock(shard.mtx);
+      auto it = shard.keys.find(key);
+      if(it == shard.keys.end()) return {false, ""};
+      loc = it->second;
+    }
+    shared_ptr<DataFile> f = file(loc.file);
+    if(!f) continue;
+    return {true, string(f->map + loc.offset + BITCASK_HEADER_SIZE + key.size(), loc.vlen)};
+  }
+}
+
+bool BitcaskBackend::set(const string& key, const string& value) {
+  uint64_t position;
+  {
+    lock_guard<mutex> lock(mtx);
+    Loc loc = append(key, value, false);
+    position = appended.load();
+    Shard& shard = shard_for(key);
+    Loc old;
+    bool existed;
+    {
+      unique_lock<shared_mutex> shard_lock(shard.mtx);
+      auto it = shard.keys.find(key);
+      existed = it != shard.keys.end();
+      if(existed) {
+        old = it->second;
+        it->second = loc;
+      } else {
+        shard.keys.emplace(key, loc);
+      }
+    }
+    if(existed) mark_dead(old, key.size());
+    else live_keys.fetch_add(1, memory_order_relaxed);
+  }
+  commit(position);
+  return true;
+}
+
+bool BitcaskBackend::remove(const string& key) {
+  uint64_t position;
+  {
+    lock_guard<mutex> lock(mtx);
+    Shard& shard = shard_for(key);
+    {
+      shared_lock<shared_mutex> shard_lock(shard.mtx);
+      if(shard.keys.find(key) == shard.keys.end()) return false;
+    }
+    Loc tomb = append(key, string(), true);
+    position = appended.load();
+    Loc old;
+    {
+      unique_lock<shared_mutex> shard_lock(shard.mtx);
+      auto it = shard.keys.find(key);
+      old = it->second;
+      shard.keys.erase(it);
+    }
+    mark_dead(old, key.size());
+    // The tombstone itself only matters until the next merge.
+    mark_dead(tomb, key.size());
+    live_keys.fetch_sub(1, memory_order_relaxed);
+  }
+  commit(position);
+  return true;
+}
+
+vector<pair<string, string>> BitcaskBackend::scan(const string& start, size_t limit) {
+  vector<string> candidates;
+  for(int i=0; i<SHARDS; i++) {
+    shared_lock<shared_mutex> lock(shards[i].mtx);
+    for(auto& entry : shards[i].keys) {
+      if(entry.first >= start) candidates.push_back(entry.first);
+    }
+  }
+  sort(candidates.begin(), candidates.end());
+  vector<pair<string, string>> out;
+  for(const string& key : candidates) {
+    if(out.size() >= limit) break;
+    pair<bool, string> row = get(key);
+    if(row.first) out.emplace_back(key, move(row.second));
+  }
+  return out;
+}
+
+void BitcaskBackend::merge_loop() {
+  unique_lock<mutex> lock(merge_mtx);
+  while(!stopping) {
+    merge_cv.wait_for(lock, chrono::milliseconds(MERGE_CHECK_INTERVAL_MS));
+    if(stopping || !merge_due()) continue;
+    lock.unlock();
+    try {
+      merge();
+    } catch(const exception& e) {
+      cerr << "Bitcask merge failed: " << e.what() << endl;
+    }
+    lock.lock();
+  }
+}
+
+bool BitcaskBackend::merge_due() {
+  uint32_t active_id;
+  {
+    lock_guard<mutex> lock(mtx);
+    active_id = active->id;
+  }
+  uint64_t total = 0, dead = 0;
+  shared_lock<shared_mutex> lock(files_mtx);
+  for(auto& entry : files) {
+    if(entry.first == active_id) continue;
+    total += entry.second->size.load();
+    dead += entry.second->dead.load();
+  }
+  return dead >= MERGE_MIN_DEAD_BYTES && dead * 100 >= total * MERGE_DEAD_PERCENT;
+}
+
+// Rewrites the live records of every sealed file into new files, then
+// retires the old ones. Writers keep appending to the active file meanwhile;
+// a keydir entry is repointed only if it still names the copied record.
+// Dropping tombstones is safe because every older file is part of the merge.
+void BitcaskBackend::merge() {
+  uint32_t active_id;
+  {
+    lock_guard<mutex> lock(mtx);
+    active_id = active->id;
+  }
+  vector<shared_ptr<DataFile>> inputs;
+  {
+    shared_lock<shared_mutex> lock(files_mtx);
+    for(auto& entry : files) {
+      if(entry.first != active_id) inputs.push_back(entry.second);
+    }
+  }
+  sort(inputs.begin(), inputs.end(), [](const shared_ptr<DataFile>& a, const shared_ptr<DataFile>& b) {
+    return a->id < b->id;
+  });
+
+  struct Moved {
+    string key;
+    Loc from, to;
+  };
+  int out_fd = -1;
+  uint32_t out_id = 0;
+  uint64_t out_size = 0;
+  string buffer, hint;
+  vector<Moved> moved;
+  uint64_t input_bytes = 0, output_bytes = 0;
+
+  auto flush_buffer = [&]() {
+    fileutil::write_all(out_fd, buffer.data(), buffer.size(), file_path(out_id, ".data"));
+    buffer.clear();
+  };
+  auto seal_output = [&]() {
+    if(out_fd < 0) return;
+    flush_buffer();
+    if(fsync(out_fd) != 0) {
+      ::close(out_fd);
+      throw Exception_("Bitcask", string("Fail to sync merge output: ") + strerror(errno), 500);
+    }
+    ::close(out_fd);
+    out_fd = -1;
+    fileutil::write_file_atomic(file_path(out_id, ".hint"), hint);
+    hint.clear();
+    shared_ptr<DataFile> f = open_file(out_id, false, 0);
+    {
+      unique_lock<shared_mutex> lock(files_mtx);
+      files[out_id] = f;
+    }
+    for(Moved& m : moved) {
+      Shard& shard = shard_for(m.key);
+      unique_lock<shared_mutex> lock(shard.mtx);
+      auto it = shard.keys.find(m.key);
+      if(it != shard.keys.end() && it->second.file == m.from.file && it->second.offset == m.from.offset) {
+        it->second = m.to;
+      } else {
+        f->dead += record_size(m.key.size(), m.to.vlen);
+      }
+    }
+    moved.clear();
+    output_bytes += out_size;
+  };
+
+  for(const shared_ptr<DataFile>& in : inputs) {
+    uint64_t end = in->size.load();
+    input_bytes += end;
+    uint64_t pos = 0;
+    while(pos + BITCASK_HEADER_SIZE <= end) {
+      const char* p = in->map + pos;
+      uint32_t klen = take<uint32_t>(p + 12);
+      uint32_t vlen = take<uint32_t>(p + 16);
+      uint64_t size = record_size(klen, vlen);
+      string key(p + BITCASK_HEADER_SIZE, klen);
+      bool live = false;
+      {
+        Shard& shard = shard_for(key);
+        shared_lock<shared_mutex> lock(shard.mtx);
+        auto it = shard.keys.find(key);
+        live = it != shard.keys.end() && it->second.file == in->id && it->second.offset == pos;
+      }
+      if(live) {
+        if(out_fd >= 0 && out_size + size > BITCASK_FILE_BYTES) seal_output();
+        if(out_fd < 0) {
+          {
+            lock_guard<mutex> lock(mtx);
+            out_id = next_file++;
+          }
+          string path = file_path(out_id, ".data");
+          out_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+          if(out_fd < 0) throw Exception_("Bitcask", "Fail to create " + path + ": " + strerror(errno), 500);
+          out_size = 0;
+        }
+        Moved m;
+        m.key = key;
+        m.from.file = in->id;
+        m.from.offset = pos;
+        m.to.file = out_id;
+        m.to.vlen = vlen;
+        m.to.offset = out_size;
+        m.to.seq = take<uint64_t>(p + 4);
+        put_hint(hint, key, m.to.seq, vlen, out_size, false);
+        buffer.append(p, size);
+        out_size += size;
+        moved.push_back(move(m));
+        if(buffer.size() >= MERGE_WRITE_BUFFER) flush_buffer();
+      }
+      pos += size;
+    }
+  }
+  seal_output();
+
+  // Once the marker is durable the merge is complete: a crash from here on
+  // only has to finish deleting the inputs.
+  string marker;
+  for(const shared_ptr<DataFile>& in : inputs) marker += to_string(in->id) + "\n";
+  fileutil::write_file_atomic(dir + "/MERGE", marker);
+  {
+    unique_lock<shared_mutex> lock(files_mtx);
+    for(const shared_ptr<DataFile>& in : inputs) files.erase(in->id);
+  }
+  for(const shared_ptr<DataFile>& in : inputs) {
+    ::unlink(file_path(in->id, ".data").c_str());
+    ::unlink(file_path(in->id, ".hint").c_str());
+  }
+  ::unlink((dir + "/MERGE").c_str());
+  fileutil::sync_dir(dir);
+  merges.fetch_add(1, memory_order_relaxed);
+  if(input_bytes > output_bytes) reclaimed.fetch_add(input_bytes - output_bytes, memory_order_relaxed);
+}
+
+void BitcaskBackend::write_metrics(ostream& out) {
+  uint64_t total = 0, dead = 0;
+  size_t count;
+  {
+    shared_lock<shared_mutex> lock(files_mtx);
+    count = files.size();
+    for(auto& entry : files) {
+      total += entry.second->size.load();
+      dead += entry.second->dead.load();
+    }
+  }
+  out << "# TYPE bitcask_keys gauge\n";
+  out << "bitcask_keys " << live_keys.load() << "\n";
+  out << "# TYPE bitcask_files gauge\n";
+  out << "bitcask_files " << count << "\n";
+  out << "# TYPE bitcask_bytes gauge\n";
+  out << "bitcask_bytes " << total << "\n";
+  out << "# TYPE bitcask_dead_bytes gauge\n";
+  out << "bitcask_dead_bytes " << dead << "\n";
+  out << "# TYPE bitcask_syncs_total counter\n";
+  out << "bitcask_syncs_total " << syncs.load() << "\n";
+  out << "# TYPE bitcask_merges_total counter\n";
+  out << "bitcask_merges_total " << merges.load() << "\n";
+  out << "# TYPE bitcask_merge_reclaimed_bytes_total counter\n";
+  out << "bitcask_merge_reclaimed_bytes_total " << reclaimed.load() << "\n";
+}
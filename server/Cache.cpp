@@ -3,7 +3,7 @@
 using namespace std;
 
 Cache::Cache(int capacity, int buckets_count): buckets_count(max(1, buckets_count)) {
-  int buc_capacity = max(1, capacity/buckets_count);
+  int buc_capacity = capacity > 0 ? max(1, capacity/buckets_count) : 0;
 
   buckets = new Bucket[buckets_count];
   for(int i=0; i<buckets_count; i++) {
@@ -41,27 +41,59 @@ pair<bool, string> Cache::get(const string &key) {
   return {true, itr->second->second};
 }
 
-bool Cache::set(const string &key, const string &value) {
-  // cout << "Accessing cache" << endl;
-  int b = hash(key);
-  Bucket& bucket = buckets[b];
-  lock_guard<mutex> lock(bucket.mtx);
+void Cache::get_many(const vector<string> &keys, unordered_map<string, string> &found) {
+  vector<vector<const string*>> grouped(buckets_count);
+  for(const string& key : keys) grouped[hash(key)].push_back(&key);
+  for(int b=0; b<buckets_count; b++) {
+    if(grouped[b].empty()) continue;
+    Bucket& bucket = buckets[b];
+    lock_guard<mutex> lock(bucket.mtx);
+    for(const string* key : grouped[b]) {
+      auto itr = bucket.idx_map.find(*key);
+      if(itr == bucket.idx_map.end()) continue;
+      bucket.lru.splice(bucket.lru.begin(), bucket.lru, itr->second);
+      found.emplace(*key, itr->second->second);
+    }
+  }
+}
+
+void Cache::insert_locked(Bucket &bucket, const string &key, const string &value) {
   auto itr = bucket.idx_map.find(key);
   if(itr != bucket.idx_map.end()){
     itr->second->second = value;
     bucket.lru.splice(bucket.lru.begin(), bucket.lru, itr->second);
-    return 1;
+    return;
   }
-  if(bucket.lru.size() == bucket.capacity) {
+  if(bucket.capacity > 0 && (int)bucket.lru.size() == bucket.capacity) {
     auto back = bucket.lru.back();
     bucket.idx_map.erase(back.first);
     bucket.lru.pop_back();
   }
   bucket.lru.emplace_front(key, value);
   bucket.idx_map[key] = bucket.lru.begin();
+}
+
+bool Cache::set(const string &key, const string &value) {
+  // cout << "Accessing cache" << endl;
+  int b = hash(key);
+  Bucket& bucket = buckets[b];
+  lock_guard<mutex> lock(bucket.mtx);
+  insert_locked(bucket, key, value);
   return 1;
 }
 
+// Groups entries by bucket so each bucket lock is taken once per call.
+void Cache::set_many(const unordered_map<string, string> &entries) {
+  vector<vector<const pair<const string, string>*>> grouped(buckets_count);
+  for(const auto& entry : entries) grouped[hash(entry.first)].push_back(&entry);
+  for(int b=0; b<buckets_count; b++) {
+    if(grouped[b].empty()) continue;
+    Bucket& bucket = buckets[b];
+    lock_guard<mutex> lock(bucket.mtx);
+    for(auto* entry : grouped[b]) insert_locked(bucket, entry->first, entry->second);
+  }
+}
+
 bool Cache::delete_(const string& key) {
   // cout << "Accessing cache" << endl;
   int b = hash(key);
@@ -72,4 +104,42 @@ bool Cache::delete_(const string& key) {
   bucket.lru.erase(itr->second);
   bucket.idx_map.erase(itr);
   return 1;
-}
\ No newline at end of file
+}
+
+void Cache::clear() {
+  for(int b=0; b<buckets_count; b++) {
+    Bucket& bucket = buckets[b];
+    lock_guard<mutex> lock(bucket.mtx);
+    bucket.idx_map.clear();
+    bucket.lru.clear();
+  }
+}
+size_t Cache::size() {
+  size_t total = 0;
+  for(int b=0; b<buckets_count; b++) {
+    lock_guard<mutex> lock(buckets[b].mtx);
+    total += buckets[b].idx_map.size();
+  }
+  return total;
+}
+
+void Cache::for_each(const Visitor &visit) {
+  for(int b=0; b<buckets_count; b++) {
+    lock_guard<mutex> lock(buckets[b].mtx);
+    for(const auto& entry : buckets[b].lru) visit(entry.first, entry.second);
+  }
+}
+
+void Cache::lock_all() {
+  for(int b=0; b<buckets_count; b++) buckets[b].mtx.lock();
+}
+
+void Cache::unlock_all() {
+  for(int b=buckets_count-1; b>=0; b--) buckets[b].mtx.unlock();
+}
+
+void Cache::for_each_unlocked(const Visitor &visit) const {
+  for(int b=0; b<buckets_count; b++) {
+    for(const auto& entry : buckets[b].lru) visit(entry.first, entry.second);
+  }
+}
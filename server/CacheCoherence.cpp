@@ -0,0 +1,416 @@
+#include "CacheCoherence.h"
+
+#include <chrono>
+#include <sstream>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define NOTIFY_PAYLOAD_MAX 7900
+#define COHERENCE_QUEUE_MAX 100000
+#define COHERENCE_TICK_MS 100
+#define COHERENCE_RETRY_MS 500
+#define COHERENCE_HEALTH_MS 5000
+#define COHERENCE_RECENT_MS 10000
+#define COHERENCE_RECENT_MAX 1000000
+
+// Payload: "<origin> <oldest write, unix us>[ *]" then one escaped key per
+// line; " *" asks the listeners to clear their whole cache.
+
+static long long wall_us() {
+  return chrono::duration_cast<chrono::microseconds>(
+    chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static long long now_ms() {
+  return chrono::duration_cast<chrono::milliseconds>(
+    chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static string escape_key(const string& key) {
+  string out;
+  out.reserve(key.size());
+  for(char c : key) {
+    if(c == '\\') out += "\\\\";
+    else if(c == '\n') out += "\\n";
+    else out.push_back(c);
+  }
+  return out;
+}
+
+static string unescape_key(const char* p, size_t len) {
+  string out;
+  out.reserve(len);
+  for(size_t i=0; i<len; i++) {
+    if(p[i] == '\\' && i + 1 < len) {
+      i++;
+      out.push_back(p[i] == 'n' ? '\n' : p[i]);
+    } else {
+      out.push_back(p[i]);
+    }
+  }
+  return out;
+}
+
+CacheCoherence::CacheCoherence(StorageBackend& inner, Cache& cache, const string& conn_string,
+  const string& channel, int flush_ms)
+  : inner(inner), cache(cache), conn_string(conn_string), channel(channel), flush_ms(max(1, flush_ms)) {
+  char host[256] = {0};
+  gethostname(host, sizeof(host) - 1);
+  origin = string(host) + ":" + to_string(getpid()) + ":" + to_string(wall_us());
+
+  listen_conn = connect_listener();
+  if(!listen_conn) throw Exception_("Postgres", "Fail to LISTEN on " + channel);
+  pub_conn = PQconnectdb(conn_string.c_str());
+  if(PQstatus(pub_conn) != CONNECTION_OK) {
+    string err = PQerrorMessage(pub_conn);
+    PQfinish(pub_conn);
+    PQfinish(listen_conn);
+    throw Exception_("Postgres", "Fail to connect: " + err);
+  }
+  publisher = thread(&CacheCoherence::publish_loop, this);
+  listener = thread(&CacheCoherence::listen_loop, this);
+}
+
+CacheCoherence::~CacheCoherence() {
+  {
+    lock_guard<mutex> lock(pub_mtx);
+    lock_guard<mutex> stop_lock(stop_mtx);
+    stopping = true;
+  }
+  pub_cv.notify_all();
+  stop_cv.notify_all();
+  if(publisher.joinable()) publisher.join();
+  if(listener.joinable()) listener.join();
+  if(pub_conn) PQfinish(pub_conn);
+  if(listen_conn) PQfinish(listen_conn);
+}
+
+PGconn* CacheCoherence::connect_listener() {
+  PGconn* pg = PQconnectdb(conn_string.c_str());
+  if(PQstatus(pg) != CONNECTION_OK) {
+    PQfinish(pg);
+    return nullptr;
+  }
+  char* ident = PQescapeIdentifier(pg, channel.c_str(), channel.size());
+  string sql = "LISTEN " + string(ident ? ident : "");
+  if(ident) PQfreemem(ident);
+  PGresult* res = PQexec(pg, sql.c_str());
+  bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+  PQclear(res);
+  if(!ok) {
+    PQfinish(pg);
+    return nullptr;
+  }
+  return pg;
+}
+
+// Queued even when the write threw: it may have committed anyway (e.g. the
+// reply was lost), and a needless eviction only costs a miss.
+void CacheCoherence::publish(const string& key) {
+  {
+    lock_guard<mutex> lock(pub_mtx);
+    if(queued.empty() && !queued_clear) queued_since_us = wall_us();
+    if(queued_clear) return;
+    if(queued.size() >= COHERENCE_QUEUE_MAX) {
+      queued.clear();
+      queued_clear = true;
+      return;
+    }
+    queued.insert(key);
+  }
+}
+
+void CacheCoherence::publish_clear() {
+  lock_guard<mutex> lock(pub_mtx);
+  if(queued.empty() && !queued_clear) queued_since_us = wall_us();
+  queued.clear();
+  queued_clear = true;
+}
+
+bool CacheCoherence::set(const string& key, const string& value) {
+  bool result;
+  try {
+    result = inner.set(key, value);
+  } catch(...) {
+    publish(key);
+    throw;
+  }
+  publish(key);
+  return result;
+}
+
+bool CacheCoherence::remove(const string& key) {
+  bool result;
+  try {
+    result = inner.remove(key);
+  } catch(...) {
+    publish(key);
+    throw;
+  }
+  if(result) publish(key);
+  return result;
+}
+
+void CacheCoherence::write_batch(const vector<pair<string, string>>& sets, const vector<string>& removes) {
+  auto publish_all = [&]() {
+    for(const auto& entry : sets) publish(entry.first);
+    for(const string& key : removes) publish(key);
+  };
+  try {
+    inner.write_batch(sets, removes);
+  } catch(...) {
+    publish_all();
+    throw;
+  }
+  publish_all();
+}
+
+// Keys too long for a payload, and payloads the server refuses, are sent as a
+// request to clear everything instead.
+bool CacheCoherence::send(const vector<string>& keys, bool clear, long long since_us) {
+  if(!pub_conn || PQstatus(pub_conn) != CONNECTION_OK) {
+    if(pub_conn) PQfinish(pub_conn);
+    pub_conn = PQconnectdb(conn_string.c_str());
+    if(PQstatus(pub_conn) != CONNECTION_OK) {
+      PQfinish(pub_conn);
+      pub_conn = nullptr;
+      return false;
+    }
+  }
+
+  string header = origin + " " + to_string(since_us);
+  vector<string> payloads;
+  if(clear) payloads.push_back(header + " *");
+  string payload = header;
+  for(const string& key : keys) {
+    string escaped = escape_key(key);
+    if(header.size() + 1 + escaped.size() > NOTIFY_PAYLOAD_MAX) {
+      payloads.push_back(header + " *");
+      continue;
+    }
+    if(payload.size() + 1 + escaped.size() > NOTIFY_PAYLOAD_MAX) {
+      payloads.push_back(payload);
+      payload = header;
+    }
+    payload.push_back('\n');
+    payload += escaped;
+  }
+  if(payload.size() > header.size()) payloads.push_back(payload);
+
+  for(string& p : payloads) {
+    const char* params[2] = {channel.c_str(), p.c_str()};
+    PGresult* res = PQexecParams(pub_conn, "SELECT pg_notify($1, $2)", 2, nullptr, params, nullptr, nullptr, 0);
+    bool ok = PQresultStatus(res) == PGRES_TUPLES_OK;
+    PQclear(res);
+    if(!ok && PQstatus(pub_conn) == CONNECTION_OK) {
+      string fallback = header + " *";
+      params[1] = fallback.c_str();
+      res = PQexecParams(pub_conn, "SELECT pg_notify($1, $2)", 2, nullptr, params, nullptr, nullptr, 0);
+      ok = PQresultStatus(res) == PGRES_TUPLES_OK;
+      PQclear(res);
+    }
+    if(!ok) return false;
+  }
+  notifications_sent.fetch_add(payloads.size(), memory_order_relaxed);
+  published_keys.fetch_add(keys.size(), memory_order_relaxed);
+  return true;
+}
+
+// Every flush interval, sends what was queued; a failed send keeps the keys
+// for the next attempt, collapsing them into a clear if too many pile up.
+void CacheCoherence::publish_loop() {
+  unique_lock<mutex> lock(pub_mtx);
+  while(true) {
+    pub_cv.wait_for(lock, chrono::milliseconds(flush_ms), [&](){return stopping;});
+    if(queued.empty() && !queued_clear) {
+      if(stopping) break;
+      continue;
+    }
+    vector<string> keys(queued.begin(), queued.end());
+    bool clear = queued_clear;
+    long long since = queued_since_us;
+    queued.clear();
+    queued_clear = false;
+    lock.unlock();
+    bool ok = send(keys, clear, since);
+    lock.lock();
+    if(ok) continue;
+
+    publish_failures.fetch_add(1, memory_order_relaxed);
+    queued_since_us = since;
+    if(clear || queued_clear || queued.size() + keys.size() > COHERENCE_QUEUE_MAX) {
+      queued.clear();
+      queued_clear = true;
+    } else {
+      queued.insert(keys.begin(), keys.end());
+    }
+    if(stopping) break;
+    pub_cv.wait_for(lock, chrono::milliseconds(COHERENCE_RETRY_MS), [&](){return stopping;});
+  }
+}
+
+void CacheCoherence::listen_loop() {
+  long long next_check = now_ms() + COHERENCE_HEALTH_MS;
+  while(true) {
+    {
+      lock_guard<mutex> lock(stop_mtx);
+      if(stopping) break;
+    }
+    if(!listen_conn) {
+      listen_conn = connect_listener();
+      if(!listen_conn) {
+        unique_lock<mutex> lock(stop_mtx);
+        stop_cv.wait_for(lock, chrono::milliseconds(COHERENCE_RETRY_MS), [&](){return stopping;});
+        continue;
+      }
+      // Whatever was published while we were away is lost.
+      evict_all();
+      reconnects.fetch_add(1, memory_order_relaxed);
+    }
+
+    struct pollfd pfd = {PQsocket(listen_conn), POLLIN, 0};
+    poll(&pfd, 1, COHERENCE_TICK_MS);
+    bool ok = PQconsumeInput(listen_conn) && PQstatus(listen_conn) == CONNECTION_OK;
+    if(ok && now_ms() >= next_check) {
+      // A dead peer may never close the socket; a round trip notices.
+      PGresult* res = PQexec(listen_conn, "SELECT 1");
+      ok = PQresultStatus(res) == PGRES_TUPLES_OK;
+      PQclear(res);
+      next_check = now_ms() + COHERENCE_HEALTH_MS;
+    }
+    while(PGnotify* note = PQnotifies(listen_conn)) {
+      apply(note->extra);
+      PQfreemem(note);
+    }
+    if(!ok) {
+      PQfinish(listen_conn);
+      listen_conn = nullptr;
+    }
+    forget_old();
+  }
+}
+
+void CacheCoherence::apply(const char* payload) {
+  notifications_received.fetch_add(1, memory_order_relaxed);
+  const char* end = payload + strlen(payload);
+  const char* line_end = strchr(payload, '\n');
+  if(!line_end) line_end = end;
+
+  istringstream header(string(payload, line_end));
+  string from, flag;
+  long long since_us = 0;
+  header >> from >> since_us >> flag;
+  // Own writes are measured too: the lag then covers the full round trip.
+  if(since_us > 0) lag.record(wall_us() - since_us);
+  if(from == origin) return;
+  if(flag == "*") {
+    evict_all();
+    return;
+  }
+
+  vector<string> keys;
+  for(const char* p = line_end; p < end; ) {
+    p++;
+    const char* q = strchr(p, '\n');
+    if(!q) q = end;
+    keys.push_back(unescape_key(p, q - p));
+    p = q;
+  }
+
+  lock_guard<mutex> lock(fill_mtx);
+  uint64_t number = seq.load(memory_order_relaxed) + 1;
+  long long now = now_ms();
+  for(const string& key : keys) {
+    recent[key] = number;
+    recent_order.push_back({now, number, key});
+    cache.delete_(key);
+  }
+  seq.store(number, memory_order_release);
+  evicted_keys.fetch_add(keys.size(), memory_order_relaxed);
+}
+
+void CacheCoherence::evict_all() {
+  lock_guard<mutex> lock(fill_mtx);
+  uint64_t number = seq.load(memory_order_relaxed) + 1;
+  recent.clear();
+  recent_order.clear();
+  forgotten_through = number;
+  cache.clear();
+  seq.store(number, memory_order_release);
+  clears.fetch_add(1, memory_order_relaxed);
+}
+
+// Evictions are remembered for COHERENCE_RECENT_MS, longer than a fill's
+// store read normally takes; a fill that started before a forgotten one is
+// dropped whole.
+void CacheCoherence::forget_old() {
+  lock_guard<mutex> lock(fill_mtx);
+  long long cutoff = now_ms() - COHERENCE_RECENT_MS;
+  while(!recent_order.empty() &&
+      (recent_order.front().at_ms < cutoff || recent_order.size() > COHERENCE_RECENT_MAX)) {
+    const Eviction& old = recent_order.front();
+    forgotten_through = max(forgotten_through, old.number);
+    auto it = recent.find(old.key);
+    if(it != recent.end() && it->second == old.number) recent.erase(it);
+    recent_order.pop_front();
+  }
+}
+
+void CacheCoherence::fill(const unordered_map<string, string>& rows, uint64_t since) {
+  if(rows.empty()) return;
+  lock_guard<mutex> lock(fill_mtx);
+  if(since < forgotten_through) {
+    skipped_fills.fetch_add(rows.size(), memory_order_relaxed);
+    return;
+  }
+  if(recent.empty()) {
+    cache.set_many(rows);
+    return;
+  }
+  unordered_map<string, string> fresh;
+  for(const auto& row : rows) {
+    auto it = recent.find(row.first);
+    if(it != recent.end() && it->second > since) skipped_fills.fetch_add(1, memory_order_relaxed);
+    else fresh.insert(row);
+  }
+  cache.set_many(fresh);
+}
+
+void CacheCoherence::fill(const string& key, const string& value, uint64_t since) {
+  lock_guard<mutex> lock(fill_mtx);
+  auto it = recent.find(key);
+  if(since < forgotten_through || (it != recent.end() && it->second > since)) {
+    skipped_fills.fetch_add(1, memory_order_relaxed);
+    return;
+  }
+  cache.set(key, value);
+}
+
+void CacheCoherence::write_metrics(ostream& out) {
+  inner.write_metrics(out);
+  out << "# TYPE cache_coherence_published_keys_total counter\n";
+  out << "cache_coherence_published_keys_total " << published_keys.load() << "\n";
+  out << "# TYPE cache_coherence_notifications_sent_total counter\n";
+  out << "cache_coherence_notifications_sent_total " << notifications_sent.load() << "\n";
+  out << "# TYPE cache_coherence_publish_failures_total counter\n";
+  out << "cache_coherence_publish_failures_total " << publish_failures.load() << "\n";
+  out << "# TYPE cache_coherence_notifications_received_total counter\n";
+  out << "cache_coherence_notifications_received_total " << notifications_received.load() << "\n";
+  out << "# TYPE cache_coherence_evicted_keys_total counter\n";
+  out << "cache_coherence_evicted_keys_total " << evicted_keys.load() << "\n";
+  out << "# TYPE cache_coherence_clears_total counter\n";
+  out << "cache_coherence_clears_total " << clears.load() << "\n";
+  out << "# TYPE cache_coherence_skipped_fills_total counter\n";
+  out << "cache_coherence_skipped_fills_total " << skipped_fills.load() << "\n";
+  out << "# TYPE cache_coherence_listener_reconnects_total counter\n";
+  out << "cache_coherence_listener_reconnects_total " << reconnects.load() << "\n";
+  {
+    lock_guard<mutex> lock(fill_mtx);
+    out << "# TYPE cache_coherence_recent_keys gauge\n";
+    out << "cache_coherence_recent_keys " << recent.size() << "\n";
+  }
+  lag.render(out, "cache_coherence_lag_us");
+}
@@ -0,0 +1,117 @@
+#include "ChangeLog.h"
+
+#include <chrono>
+#include <algorithm>
+
+using namespace std;
+
+#define EVENT_OVERHEAD 64
+
+ChangeLog::ChangeLog(size_t max_events, size_t max_bytes)
+  : max_events(max<size_t>(1, max_events)), max_bytes(max<size_t>(1, max_bytes)) {
+  next_seq = chrono::duration_cast<chrono::microseconds>(
+    chrono::system_clock::now().time_since_epoch()).count();
+}
+
+uint64_t ChangeLog::append(bool removed, const string& key, const string& value) {
+  uint64_t seq;
+  {
+    lock_guard<mutex> lock(mtx);
+    seq = next_seq++;
+    events.push_back({seq, removed, key, value});
+    bytes += key.size() + value.size() + EVENT_OVERHEAD;
+    while(events.size() > max_events || (bytes > max_bytes && events.size() > 1)) {
+      bytes -= events.front().key.size() + events.front().value.size() + EVENT_OVERHEAD;
+      events.pop_front();
+      dropped.fetch_add(1, memory_order_relaxed);
+    }
+  }
+  appended.fetch_add(1, memory_order_relaxed);
+  cv.notify_all();
+  return seq;
+}
+
+void ChangeLog::hold(Batch& batch, bool removed, const string& key, const string& value) {
+  batch.events.push_back({0, removed, key, value});
+  batch.bytes += key.size() + value.size() + EVENT_OVERHEAD;
+  while(batch.events.size() > max_events || (batch.bytes > max_bytes && batch.events.size() > 1)) {
+    batch.bytes -= batch.events.front().key.size() + batch.events.front().value.size() + EVENT_OVERHEAD;
+    batch.events.pop_front();
+    batch.skipped++;
+  }
+}
+
+void ChangeLog::append(Batch& batch) {
+  if(batch.events.empty() && batch.skipped == 0) return;
+  {
+    lock_guard<mutex> lock(mtx);
+    if(batch.skipped > 0) {
+      // Held events stay contiguous: those before the gap go with it.
+      dropped.fetch_add(events.size() + batch.skipped, memory_order_relaxed);
+      events.clear();
+      bytes = 0;
+      next_seq += batch.skipped;
+    }
+    for(Event& event : batch.events) {
+      event.seq = next_seq++;
+      bytes += event.key.size() + event.value.size() + EVENT_OVERHEAD;
+      events.push_back(move(event));
+    }
+    while(events.size() > max_events || (bytes > max_bytes && events.size() > 1)) {
+      bytes -= events.front().key.size() + events.front().value.size() + EVENT_OVERHEAD;
+      events.pop_front();
+      dropped.fetch_add(1, memory_order_relaxed);
+    }
+  }
+  appended.fetch_add(batch.events.size() + batch.skipped, memory_order_relaxed);
+  batch.events.clear();
+  batch.bytes = 0;
+  batch.skipped = 0;
+  cv.notify_all();
+}
+
+uint64_t ChangeLog::last_seq() {
+  lock_guard<mutex> lock(mtx);
+  return next_seq - 1;
+}
+
+bool ChangeLog::covers(uint64_t since) {
+  lock_guard<mutex> lock(mtx);
+  uint64_t oldest = events.empty() ? next_seq : events.front().seq;
+  return since + 1 >= oldest && since < next_seq;
+}
+
+bool ChangeLog::read(uint64_t since, size_t limit, vector<Event>& out, int wait_ms) {
+  unique_lock<mutex> lock(mtx);
+  cv.wait_for(lock, chrono::milliseconds(wait_ms), [&](){return next_seq - 1 > since;});
+  uint64_t oldest = events.empty() ? next_seq : events.front().seq;
+  if(since + 1 < oldest || since >= next_seq) return false;
+  for(size_t i = since + 1 - oldest; i < events.size() && out.size() < limit; i++) out.push_back(events[i]);
+  return true;
+}
+
+bool ChangeLog::open_stream(int max_streams) {
+  int current = streams.load();
+  do {
+    if(current >= max_streams) return false;
+  } while(!streams.compare_exchange_weak(current, current + 1));
+  return true;
+}
+
+void ChangeLog::write_metrics(ostream& out) {
+  out << "# TYPE changes_appended_total counter\n";
+  out << "changes_appended_total " << appended.load() << "\n";
+  out << "# TYPE changes_dropped_total counter\n";
+  out << "changes_dropped_total " << dropped.load() << "\n";
+  out << "# TYPE changes_streams gauge\n";
+  out << "changes_streams " << streams.load() << "\n";
+  out << "# TYPE changes_stream_resets_total counter\n";
+  out << "changes_stream_resets_total " << resets.load() << "\n";
+  lock_guard<mutex> lock(mtx);
+  out << "# TYPE changes_held gauge\n";
+  out << "changes_held " << events.size() << "\n";
+  out << "# TYPE changes_held_bytes gauge\n";
+  out << "changes_held_bytes " << bytes << "\n";
+  out << "# TYPE changes_last_seq gauge\n";
+  out << "changes_last_seq " << next_seq - 1 << "\n";
+}
@@ -0,0 +1,122 @@
+#include "CircuitBreaker.h"
+#include "Deadline.h"
+
+#include <algorithm>
+
+using namespace std;
+
+CircuitBreaker::Call::Call(CircuitBreaker& breaker)
+  : breaker(breaker), exceptions(uncaught_exceptions()), start(Clock::now()) {
+  if(!breaker.admit(probe)) throw Exception_("Unavailable", "Database circuit breaker is open", 503);
+}
+
+CircuitBreaker::Call::~Call() {
+  bool failed = uncaught_exceptions() > exceptions && (probe || !deadline::expired());
+  breaker.record(probe, failed, Clock::now() - start);
+}
+
+CircuitBreaker::CircuitBreaker() : CircuitBreaker(Config()) {}
+
+CircuitBreaker::CircuitBreaker(const Config& config)
+  : config(config), bucket_ms(max(1, config.window_ms / BUCKETS)) {
+  this->config.min_calls = max(1, config.min_calls);
+  this->config.probes = max(1, config.probes);
+  this->config.error_percent = max(1, config.error_percent);
+  this->config.slow_percent = max(1, config.slow_percent);
+}
+
+void CircuitBreaker::open(Clock::time_point now) {
+  state.store(OPEN, memory_order_release);
+  opened_at = now;
+  probing = false;
+  trips.fetch_add(1, memory_order_relaxed);
+}
+
+void CircuitBreaker::close() {
+  state.store(CLOSED, memory_order_release);
+  for(Bucket& b : buckets) b = Bucket();
+}
+
+bool CircuitBreaker::probe_due() {
+  if(current() == CLOSED) return false;
+  lock_guard<mutex> lock(mtx);
+  if(state.load(memory_order_relaxed) == OPEN) return Clock::now() >= opened_at + chrono::milliseconds(config.open_ms);
+  return !probing;
+}
+
+bool CircuitBreaker::admit(bool& probe) {
+  probe = false;
+  if(!config.enabled || current() == CLOSED) return true;
+
+  lock_guard<mutex> lock(mtx);
+  Clock::time_point now = Clock::now();
+  if(state.load(memory_order_relaxed) == OPEN) {
+    if(now < opened_at + chrono::milliseconds(config.open_ms)) {
+      rejected.fetch_add(1, memory_order_relaxed);
+      return false;
+    }
+    state.store(HALF_OPEN, memory_order_release);
+    probe_successes = 0;
+  }
+  if(state.load(memory_order_relaxed) == HALF_OPEN) {
+    if(probing) {
+      rejected.fetch_add(1, memory_order_relaxed);
+      return false;
+    }
+    probing = true;
+    probe = true;
+    probes.fetch_add(1, memory_order_relaxed);
+  }
+  return true;
+}
+
+void CircuitBreaker::record(bool probe, bool failed, Clock::duration elapsed) {
+  if(!config.enabled) return;
+  bool slow = config.slow_ms > 0 && elapsed >= chrono::milliseconds(config.slow_ms);
+  Clock::time_point now = Clock::now();
+
+  lock_guard<mutex> lock(mtx);
+  if(probe) {
+    probing = false;
+    if(state.load(memory_order_relaxed) != HALF_OPEN) return;
+    if(failed || slow) open(now);
+    else if(++probe_successes >= config.probes) close();
+    return;
+  }
+  // Calls admitted before the breaker opened still finish afterwards.
+  if(state.load(memory_order_relaxed) != CLOSED) return;
+
+  long long epoch = chrono::duration_cast<chrono::milliseconds>(now.time_since_epoch()).count() / bucket_ms;
+  Bucket& bucket = buckets[epoch % BUCKETS];
+  if(bucket.epoch != epoch) {
+    bucket = Bucket();
+    bucket.epoch = epoch;
+  }
+  bucket.calls++;
+  if(failed) bucket.errors++;
+  if(slow) bucket.slow++;
+
+  unsigned long long calls = 0, errors = 0, slows = 0;
+  for(const Bucket& b : buckets) {
+    if(b.epoch <= epoch - BUCKETS) continue;
+    calls += b.calls;
+    errors += b.errors;
+    slows += b.slow;
+  }
+  if(calls < (unsigned long long)config.min_calls) return;
+  if(errors * 100 >= (unsigned long long)config.error_percent * calls ||
+     (config.slow_ms > 0 && slows * 100 >= (unsigned long long)config.slow_percent * calls)) {
+    open(now);
+  }
+}
+
+void CircuitBreaker::write_metrics(ostream& out, const string& prefix) {
+  out << "# TYPE " << prefix << "_state gauge\n";
+  out << prefix << "_state " << current() << "\n";
+  out << "# TYPE " << prefix << "_trips_total counter\n";
+  out << prefix << "_trips_total " << trips.load() << "\n";
+  out << "# TYPE " << prefix << "_rejected_total counter\n";
+  out << prefix << "_rejected_total " << rejected.load() << "\n";
+  out << "# TYPE " << prefix << "_probes_total counter\n";
+  out << prefix << "_probes_total " << probes.load() << "\n";
+}
@@ -0,0 +1,69 @@
+#include "CopyBinary.h"
+
+#include <cstring>
+#include <cstdint>
+
+using namespace std;
+
+const char CopyBinaryParser::SIGNATURE[11] = {'P', 'G', 'C', 'O', 'P', 'Y', '\n', '\377', '\r', '\n', '\0'};
+
+static uint32_t read_u32(const char* p) {
+  const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+  return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | u[3];
+}
+
+static int16_t read_i16(const char* p) {
+  const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+  return (int16_t)(((uint16_t)u[0] << 8) | u[1]);
+}
+
+void CopyBinaryParser::feed(const char* data, size_t len) {
+  if(finished || len == 0) return;
+  if(pending.empty()) {
+    size_t used = parse(data, len);
+    if(used < len && !finished) pending.assign(data + used, len - used);
+    return;
+  }
+  pending.append(data, len);
+  size_t used = parse(pending.data(), pending.size());
+  pending.erase(0, used);
+}
+
+// Returns the number of bytes consumed; stops at the first incomplete unit.
+size_t CopyBinaryParser::parse(const char* data, size_t len) {
+  size_t pos = 0;
+  if(!header_done) {
+    if(len < 19) return 0;
+    if(memcmp(data, SIGNATURE, sizeof(SIGNATURE)) != 0) {
+      throw Exception_("Import", "Invalid COPY binary signature");
+    }
+    uint32_t ext_len = read_u32(data + 15);
+    if(len < 19 + (size_t)ext_len) return 0;
+    pos = 19 + ext_len;
+    header_done = true;
+  }
+
+  while(pos + 2 <= len) {
+    int16_t fields = read_i16(data + pos);
+    if(fields == -1) {
+      finished = true;
+      return pos + 2;
+    }
+    if(fields != 2) throw Exception_("Import", "Expected (key, value) tuples");
+
+    size_t p = pos + 2;
+    if(p + 4 > len) break;
+    int32_t key_len = (int32_t)read_u32(data + p);
+    if(key_len < 0) throw Exception_("Import", "NULL key");
+    if(p + 4 + (size_t)key_len + 4 > len) break;
+    const char* key = data + p + 4;
+    p += 4 + key_len;
+    int32_t value_len = (int32_t)read_u32(data + p);
+    size_t value_bytes = value_len < 0 ? 0 : (size_t)value_len;
+    if(p + 4 + value_bytes > len) break;
+    on_row(key, key_len, data + p + 4, value_bytes);
+    rows_seen++;
+    pos = p + 4 + value_bytes;
+  }
+  return pos;
+}
@@ -1,78 +1,441 @@
 #include "DBConnectionPool.h"
+#include "Deadline.h"
+
+#include <poll.h>
 
 using namespace std;
 
-inline PGconn* DBConnectionPool::acquire_conn() {
-  unique_lock<mutex> lock(mtx);
-  cv.wait(lock, [&](){return !conn_queue.empty();});
-  PGconn* conn = conn_queue.front(); conn_queue.pop();
-  return conn;
+#define ACQUIRE_SPINS 64
+#define MAINTENANCE_TICK_MS 200
+#define HEALTH_CHECK_INTERVAL_MS 5000
+#define RECONNECT_BACKOFF_MIN_MS 100
+#define RECONNECT_BACKOFF_MAX_MS 5000
+#define POOL_GROW_WAIT_US 1000
+#define POOL_GROW_QUEUE_DEPTH 2
+#define POOL_IDLE_TIMEOUT_MS 30000
+#define GET_MANY_CHUNK 1000
+#define WRITE_BATCH_CHUNK 1000
+#define EXPORT_CHUNK_BYTES (64 * 1024)
+#define CANCEL_GRACE_MS 1000
+#define BREAKER_PROBE_TIMEOUT_MS 1000
+
+static atomic<unsigned> next_thread_slot(0);
+
+// Every thread gets a stable ordinal; its affinity connection is ordinal % size,
+// so threads spread evenly over the pool and keep reusing the same connection.
+static unsigned thread_slot() {
+  static thread_local unsigned slot = next_thread_slot.fetch_add(1);
+  return slot;
 }
 
-DBConnectionPool::DBConnectionPool(const std::string& conn_string, int n)
-  : size(n), conn_string(conn_string) {}
+// Appends keys[begin, end) as a Postgres text[] literal: {"k1","k2",...}.
+static void append_text_array(string& out, const vector<string>& keys, size_t begin, size_t end) {
+  out.push_back('{');
+  for(size_t i=begin; i<end; i++) {
+    if(i != begin) out.push_back(',');
+    out.push_back('"');
+    for(char c : keys[i]) {
+      if(c == '"' || c == '\\') out.push_back('\\');
+      out.push_back(c);
+    }
+    out.push_back('"');
+  }
+  out.push_back('}');
+}
 
-void DBConnectionPool::createPool() {
-  lock_guard<mutex> lock(mtx);
+static void exec_command(PGconn* conn, const char* sql, const string& what) {
+  PGresult* res = PQexec(conn, sql);
+  if(PQresultStatus(res) != PGRES_COMMAND_OK) {
+    string err = PQerrorMessage(conn);
+    PQclear(res);
+    throw Exception_("Postgres", what + ": " + err);
+  }
+  PQclear(res);
+}
+
+static void drain_results(PGconn* conn) {
+  while(PGresult* res = PQgetResult(conn)) PQclear(res);
+}
+
+static long long now_ms() {
+  return chrono::duration_cast<chrono::milliseconds>(
+    chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline bool DBConnectionPool::try_claim(Conn* conn) {
+  bool expected = false;
+  return !conn->busy.load(memory_order_relaxed) &&
+    conn->busy.compare_exchange_strong(expected, true, memory_order_acquire);
+}
+
+// Only acquisitions that miss their affinity connection are timed: the sticky
+// path stays free of shared writes, and the ring path is where waiting happens.
+DBConnectionPool::Conn* DBConnectionPool::acquire_conn() {
+  if(deadline::expired()) throw Exception_("Timeout", "Request deadline exceeded", 504);
+  Conn* conn = &conns[thread_slot() % size.load(memory_order_relaxed)];
+  if(try_claim(conn)) return conn;
+
+  auto start = chrono::steady_clock::now();
+  auto claimed = [&](Conn* c) {
+    if(!try_claim(c)) return false;
+    acquire_wait.record(chrono::duration_cast<chrono::microseconds>(
+      chrono::steady_clock::now() - start).count());
+    return true;
+  };
+
+  for(;;) {
+    for(int i=0; i<ACQUIRE_SPINS; i++) {
+      if(ring.pop(conn)) {
+        conn->queued.store(false);
+        if(claimed(conn)) return conn;
+        // Stale entry: the connection is held through affinity and will be
+        // re-enqueued by its holder on release.
+      }
+    }
+
+    conn = nullptr;
+    {
+      unique_lock<mutex> lock(mtx);
+      int depth = waiters.fetch_add(1) + 1;
+      if(depth >= POOL_GROW_QUEUE_DEPTH && size.load() < max_size &&
+          !grow_requested.exchange(true)) {
+        maint_cv.notify_one();
+      }
+      bool got = true;
+      if(deadline::bounded()) got = cv.wait_until(lock, deadline::current(), [&](){return ring.pop(conn);});
+      else cv.wait(lock, [&](){return ring.pop(conn);});
+      waiters.fetch_sub(1);
+      if(!got) {
+        acquire_timeouts.fetch_add(1, memory_order_relaxed);
+        throw Exception_("Pool", "No database connection before the request deadline", 503);
+      }
+    }
+    conn->queued.store(false);
+    if(claimed(conn)) return conn;
+  }
+}
+
+void DBConnectionPool::release_conn(Conn* conn, bool discard) {
+  if(discard || PQstatus(conn->pg) != CONNECTION_OK) {
+    mark_broken(conn);
+    return;
+  }
+  conn->last_used.store(now_ms(), memory_order_relaxed);
+  return_conn(conn);
+}
+
+inline void DBConnectionPool::return_conn(Conn* conn) {
+  conn->busy.store(false, memory_order_release);
+  if(!conn->queued.exchange(true)) ring.push(conn);
+  atomic_thread_fence(memory_order_seq_cst);
+  if(waiters.load() > 0) {
+    lock_guard<mutex> lock(mtx);
+    cv.notify_one();
+  }
+}
+
+// A broken connection stays claimed (busy) so neither affinity nor the ring
+// can hand it out; the maintenance thread owns it until PQreset succeeds.
+void DBConnectionPool::mark_broken(Conn* conn) {
+  conn->backoff_ms = 0;
+  conn->next_retry = chrono::steady_clock::now();
+  {
+    lock_guard<mutex> lock(maint_mtx);
+    broken.push_back(conn);
+  }
+  maint_cv.notify_one();
+}
+
+void DBConnectionPool::maintenance_loop() {
+  auto next_probe = chrono::steady_clock::now() + chrono::milliseconds(HEALTH_CHECK_INTERVAL_MS);
+  unique_lock<mutex> lock(maint_mtx);
+  while(!stopping) {
+    maint_cv.wait_for(lock, chrono::milliseconds(MAINTENANCE_TICK_MS));
+    if(stopping) break;
+
+    lock.unlock();
+    reconnect_broken();
+    resize();
+    probe_breaker();
+    if(chrono::steady_clock::now() >= next_probe) {
+      probe_idle();
+      next_probe = chrono::steady_clock::now() + chrono::milliseconds(HEALTH_CHECK_INTERVAL_MS);
+    }
+    lock.lock();
+  }
+}
+
+void DBConnectionPool::reconnect_broken() {
+  vector<Conn*> pending;
+  {
+    lock_guard<mutex> lock(maint_mtx);
+    pending.swap(broken);
+  }
+  if(pending.empty()) return;
+
+  vector<Conn*> still_broken;
+  auto now = chrono::steady_clock::now();
+  for(Conn* conn : pending) {
+    if(conn->next_retry > now) {
+      still_broken.push_back(conn);
+      continue;
+    }
+    PQreset(conn->pg);
+    if(PQstatus(conn->pg) == CONNECTION_OK) {
+      conn->last_used.store(now_ms(), memory_order_relaxed);
+      return_conn(conn);
+      continue;
+    }
+    conn->backoff_ms = conn->backoff_ms == 0 ? RECONNECT_BACKOFF_MIN_MS
+      : min(conn->backoff_ms * 2, RECONNECT_BACKOFF_MAX_MS);
+    conn->next_retry = chrono::steady_clock::now() + chrono::milliseconds(conn->backoff_ms);
+    still_broken.push_back(conn);
+  }
+
+  lock_guard<mutex> lock(maint_mtx);
+  broken.insert(broken.end(), still_broken.begin(), still_broken.end());
+}
+
+// Round-trips a trivial query on connections that sat idle for a full probe
+// interval, so a server restart is noticed before a request hits the socket.
+void DBConnectionPool::probe_idle() {
+  long long idle_since = now_ms() - HEALTH_CHECK_INTERVAL_MS;
+  int live = size.load();
+  for(int i=0; i<live; i++) {
+    Conn* conn = &conns[i];
+    if(conn->last_used.load(memory_order_relaxed) > idle_since) continue;
+    if(!try_claim(conn)) continue;
+
+    PGresult* res = PQexec(conn->pg, "SELECT 1");
+    bool ok = res && PQresultStatus(res) == PGRES_TUPLES_OK;
+    PQclear(res);
+    if(!ok) {
+      // Dead socket or a failed query on a live one: reset it either way.
+      mark_broken(conn);
+      continue;
+    }
+    conn->last_used.store(now_ms(), memory_order_relaxed);
+    return_conn(conn);
+  }
+}
+
+// Once an open breaker's wait is over, probes it with a trivial query so it
+// can close again without a request having to be the probe.
+void DBConnectionPool::probe_breaker() {
+  if(!breaker.probe_due()) return;
+  deadline::Scope scope(deadline::Clock::now() + chrono::milliseconds(BREAKER_PROBE_TIMEOUT_MS));
+  try {
+    ConnLease conn(*this);
+    PGresult* res = exec_params(conn, "SELECT 1", 0, nullptr);
+    ExecStatusType status = PQresultStatus(res);
+    PQclear(res);
+    if(status != PGRES_TUPLES_OK) throw Exception_("Postgres", "Breaker probe failed");
+  } catch(const Exception_&) {}
+}
+
+// Grows by the number of parked waiters when acquire latency or queue depth
+// crossed its threshold since the last tick; otherwise retires the top
+// connection once it has been idle for POOL_IDLE_TIMEOUT_MS.
+void DBConnectionPool::resize() {
+  unsigned long long count = acquire_wait.count(), sum = acquire_wait.sum();
+  unsigned long long dcount = count - last_wait_count, dsum = sum - last_wait_sum;
+  last_wait_count = count;
+  last_wait_sum = sum;
+
+  int depth = waiters.load();
+  bool pressure = grow_requested.exchange(false) || depth >= POOL_GROW_QUEUE_DEPTH ||
+    (dcount > 0 && dsum / dcount >= POOL_GROW_WAIT_US);
+
+  int live = size.load();
+  if(pressure && live < max_size) {
+    int target = min(max_size, live + max(1, depth));
+    for(int i=live; i<target; i++) {
+      PGconn* pg = connect();
+      if(!pg) break;
+      Conn* conn = &conns[i];
+      conn->pg = pg;
+      conn->last_used.store(now_ms(), memory_order_relaxed);
+      size.store(i + 1);
+      grown.fetch_add(1, memory_order_relaxed);
+      return_conn(conn);
+    }
+    return;
+  }
+
+  if(pressure || live <= min_size) return;
+  Conn* top = &conns[live - 1];
+  if(top->last_used.load(memory_order_relaxed) > now_ms() - POOL_IDLE_TIMEOUT_MS) return;
+  if(!try_claim(top)) return;
+  // Shrink first so new affinity lookups stop landing on the slot; the slot
+  // stays claimed while closed, which makes stale ring entries harmless.
+  size.store(live - 1);
+  PQfinish(top->pg);
+  top->pg = nullptr;
+  shrunk.fetch_add(1, memory_order_relaxed);
+}
+
+PGconn* DBConnectionPool::connect() {
   PGconn* conn = PQconnectdb(conn_string.c_str());
   if(PQstatus(conn) != CONNECTION_OK) {
-    string err = PQerrorMessage(conn);
     PQfinish(conn);
-    throw Exception_("Postgres", "Fail to connect: " + err);
+    return nullptr;
+  }
+  return conn;
+}
+
+void DBConnectionPool::write_metrics(ostream& out, const string& prefix) {
+  out << "# TYPE " << prefix << "_size gauge\n";
+  out << prefix << "_size " << size.load() << "\n";
+  out << "# TYPE " << prefix << "_min_size gauge\n";
+  out << prefix << "_min_size " << min_size << "\n";
+  out << "# TYPE " << prefix << "_max_size gauge\n";
+  out << prefix << "_max_size " << max_size << "\n";
+  out << "# TYPE " << prefix << "_waiters gauge\n";
+  out << prefix << "_waiters " << waiters.load() << "\n";
+  {
+    lock_guard<mutex> lock(maint_mtx);
+    out << "# TYPE " << prefix << "_broken gauge\n";
+    out << prefix << "_broken " << broken.size() << "\n";
   }
+  out << "# TYPE " << prefix << "_grown_total counter\n";
+  out << prefix << "_grown_total " << grown.load() << "\n";
+  out << "# TYPE " << prefix << "_shrunk_total counter\n";
+  out << prefix << "_shrunk_total " << shrunk.load() << "\n";
+  out << "# TYPE " << prefix << "_acquire_timeouts_total counter\n";
+  out << prefix << "_acquire_timeouts_total " << acquire_timeouts.load() << "\n";
+  out << "# TYPE " << prefix << "_cancels_total counter\n";
+  out << prefix << "_cancels_total " << cancels.load() << "\n";
+  breaker.write_metrics(out, prefix + "_breaker");
+  acquire_wait.render(out, prefix + "_acquire_wait_us");
+}
 
-  const char* create_query = "CREATE TABLE IF NOT EXISTS kvstore(key TEXT PRIMARY KEY, value TEXT)";
-  PGresult *res = PQexec(conn, create_query); 
-  if(PQresultStatus(res) !=  PGRES_COMMAND_OK) {
-    string err = PQerrorMessage(conn);
+static void send_cancel(PGconn* pg) {
+  PGcancel* cancel = PQgetCancel(pg);
+  if(!cancel) return;
+  char err[256];
+  PQcancel(cancel, err, sizeof(err));
+  PQfreeCancel(cancel);
+}
+
+// Without a request deadline this is PQexecParams. With one, the query is
+// sent asynchronously and the socket polled until the deadline, at which
+// point the statement is cancelled on the server. A connection that does not
+// answer within CANCEL_GRACE_MS after that is discarded and reconnected.
+PGresult* DBConnectionPool::exec_params(ConnLease& conn, const string& query, int nparams, const char* const* params) {
+  PGconn* pg = conn.pg();
+  if(!deadline::bounded()) return PQexecParams(pg, query.c_str(), nparams, nullptr, params, nullptr, nullptr, 0);
+  if(!PQsendQueryParams(pg, query.c_str(), nparams, nullptr, params, nullptr, nullptr, 0)) return nullptr;
+
+  bool cancelled = false;
+  deadline::Clock::time_point until = deadline::current();
+  while(PQconsumeInput(pg) && PQisBusy(pg)) {
+    auto left = chrono::duration_cast<chrono::microseconds>(until - deadline::Clock::now()).count();
+    if(left <= 0) {
+      if(cancelled) {
+        conn.discard();
+        throw Exception_("Timeout", "Query ignored the cancel at the request deadline", 504);
+      }
+      send_cancel(pg);
+      cancels.fetch_add(1, memory_order_relaxed);
+      cancelled = true;
+      until = deadline::Clock::now() + chrono::milliseconds(CANCEL_GRACE_MS);
+      continue;
+    }
+    struct pollfd pfd = {PQsocket(pg), POLLIN, 0};
+    poll(&pfd, 1, (int)((left + 999) / 1000));
+  }
+
+  PGresult* res = PQgetResult(pg);
+  drain_results(pg);
+  ExecStatusType status = PQresultStatus(res);
+  if(cancelled && status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK) {
     PQclear(res);
-    PQfinish(conn);
-    throw Exception_("Postgres", "Fail to create table: " + err);
-    return;
+    throw Exception_("Timeout", "Query cancelled at the request deadline", 504);
   }
-  PQclear(res);
-  PQfinish(conn);
+  return res;
+}
+
+DBConnectionPool::DBConnectionPool(const std::string& conn_string, int min_size, int max_size,
+  const SchemaProfile& schema, const CircuitBreaker::Config& breaker)
+  : min_size(max(1, min_size)), max_size(max(max(1, min_size), max_size)),
+    ring(max(max(1, min_size), max_size)), conn_string(conn_string), schema(schema), breaker(breaker),
+    q_get(schema.get_query()), q_get_many(schema.get_many_query()),
+    q_set(schema.set_query()), q_remove(schema.remove_query()), q_scan(schema.scan_query()),
+    q_set_many(schema.set_many_query()), q_remove_many(schema.remove_many_query()) {}
 
-  for(int i=0; i<size; i++) {
+void DBConnectionPool::createPool(bool create_schema) {
+  lock_guard<mutex> lock(mtx);
+  if(create_schema) {
     PGconn* conn = PQconnectdb(conn_string.c_str());
     if(PQstatus(conn) != CONNECTION_OK) {
       string err = PQerrorMessage(conn);
       PQfinish(conn);
-      while(conn_queue.size()) {
-        PGconn* conn = conn_queue.front();conn_queue.pop();
+      throw Exception_("Postgres", "Fail to connect: " + err);
+    }
+
+    for(const string& stmt : schema.create_statements()) {
+      PGresult *res = PQexec(conn, stmt.c_str());
+      if(PQresultStatus(res) !=  PGRES_COMMAND_OK) {
+        string err = PQerrorMessage(conn);
+        PQclear(res);
         PQfinish(conn);
+        throw Exception_("Postgres", "Fail to create table: " + err);
       }
+      PQclear(res);
+    }
+    PQfinish(conn);
+  }
+
+  conns = new Conn[max_size];
+  for(int i=0; i<min_size; i++) {
+    PGconn* conn = PQconnectdb(conn_string.c_str());
+    if(PQstatus(conn) != CONNECTION_OK) {
+      string err = PQerrorMessage(conn);
+      PQfinish(conn);
+      for(int j=0; j<i; j++) PQfinish(conns[j].pg);
+      delete [] conns;
+      conns = nullptr;
       throw Exception_("Postgres", "Connection failure:" + err);
-    } else {
-      conn_queue.push(conn);
     }
-    
+    conns[i].pg = conn;
   }
-  cv.notify_all();
+  size.store(min_size);
+  for(int i=0; i<min_size; i++) {
+    conns[i].queued.store(true);
+    conns[i].busy.store(false);
+    conns[i].last_used.store(now_ms());
+    ring.push(&conns[i]);
+  }
+  maint_thread = thread(&DBConnectionPool::maintenance_loop, this);
 }
 
 DBConnectionPool::~DBConnectionPool() {
-  lock_guard<mutex> lock(mtx);
-  while(conn_queue.size()) {
-    PGconn* conn = conn_queue.front(); conn_queue.pop();
-    PQfinish(conn);
+  {
+    lock_guard<mutex> lock(maint_mtx);
+    stopping = true;
+  }
+  maint_cv.notify_all();
+  if(maint_thread.joinable()) maint_thread.join();
+
+  if(!conns) return;
+  for(int i=0; i<max_size; i++) {
+    if(conns[i].pg) PQfinish(conns[i].pg);
   }
+  delete [] conns;
+  conns = nullptr;
 }
 
 
 
-pair<bool, string> DBConnectionPool::get(string key){
+pair<bool, string> DBConnectionPool::get(const string& key){
   // cout << "Accessing DB" << endl;
-  PGconn* conn = acquire_conn();
+  ConnLease conn(*this);
   const char* param[1] = {key.c_str()};
-  PGresult *res = PQexecParams(conn,
-    "SELECT value from kvstore where key = $1;",
-    1, nullptr, param, nullptr, nullptr, 0
-  );
+  PGresult *res = exec_params(conn, q_get, 1, param);
 
   pair<bool, string> result;
   if(PQresultStatus(res) != PGRES_TUPLES_OK){
-    string err = PQerrorMessage(conn);
+    string err = PQerrorMessage(conn.pg());
     PQclear(res);
     throw Exception_("Postgres", "Fail to access: " + err);
   } else if (PQntuples(res) == 0){
@@ -84,52 +447,67 @@ pair<bool, string> DBConnectionPool::get(string key){
     PQclear(res);
   }
 
-  {
-    lock_guard<mutex> lock(mtx);
-    conn_queue.push(conn);
+  return result;
+}
+
+// One round trip per GET_MANY_CHUNK keys; missing keys are simply absent
+// from the returned map.
+unordered_map<string, string> DBConnectionPool::get_many(const vector<string>& keys) {
+  unordered_map<string, string> result;
+  if(keys.empty()) return result;
+  result.reserve(keys.size());
+
+  ConnLease conn(*this);
+  string array;
+  for(size_t begin=0; begin<keys.size(); begin+=GET_MANY_CHUNK) {
+    size_t end = min(keys.size(), begin + GET_MANY_CHUNK);
+    array.clear();
+    append_text_array(array, keys, begin, end);
+    const char* param[1] = {array.c_str()};
+    PGresult *res = exec_params(conn, q_get_many, 1, param);
+
+    if(PQresultStatus(res) != PGRES_TUPLES_OK){
+      string err = PQerrorMessage(conn.pg());
+      PQclear(res);
+      throw Exception_("Postgres", "Fail to access: " + err);
+    }
+    int rows = PQntuples(res);
+    for(int i=0; i<rows; i++) {
+      result.emplace(string(PQgetvalue(res, i, 0), PQgetlength(res, i, 0)),
+        string(PQgetvalue(res, i, 1), PQgetlength(res, i, 1)));
+    }
+    PQclear(res);
   }
-  cv.notify_one();
   return result;
 }
 
-bool DBConnectionPool::set(string key, string value) {
+bool DBConnectionPool::set(const string& key, const string& value) {
   // cout << "Accessing DB" << endl;
-  PGconn* conn = acquire_conn();
+  ConnLease conn(*this);
   const char* param[2] = {key.c_str(), value.c_str()};
-  PGresult *res = PQexecParams(conn,
-    "INSERT INTO kvstore (key, value) VALUES ($1, $2) "
-    "ON CONFLICT (key) DO UPDATE SET value = EXCLUDED.value;",
-    2, nullptr, param, nullptr, nullptr, 0
-  );
+  PGresult *res = exec_params(conn, q_set, 2, param);
 
   bool result = true;
-  if(PQresultStatus(res) != PGRES_COMMAND_OK){
-    string err = PQerrorMessage(conn);
+  // The hash_index profile upserts through a function, which returns a row.
+  ExecStatusType status = PQresultStatus(res);
+  if(status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK){
+    string err = PQerrorMessage(conn.pg());
     PQclear(res);
     throw Exception_("Postgres", "Fail to set: " + err);
   }
   PQclear(res);
 
-  {
-    lock_guard<mutex> lock(mtx);
-    conn_queue.push(conn);
-  }
-  cv.notify_one();
-
   return result;
 }
 
-bool DBConnectionPool::remove(string key) {
+bool DBConnectionPool::remove(const string& key) {
   // cout << "Accessing DB" << endl;
-  PGconn* conn = acquire_conn();
+  ConnLease conn(*this);
   const char* param[1] = {key.c_str()};
-  PGresult *res = PQexecParams(conn,
-    "DELETE FROM kvstore WHERE key = $1; ",
-    1, nullptr, param, nullptr, nullptr, 0
-  );
+  PGresult *res = exec_params(conn, q_remove, 1, param);
 
   if(PQresultStatus(res) != PGRES_COMMAND_OK){
-    string err = PQerrorMessage(conn);
+    string err = PQerrorMessage(conn.pg());
     PQclear(res);
     throw Exception_("Postgres", "Fail to remove: " + err);
   }
@@ -138,12 +516,200 @@ bool DBConnectionPool::remove(string key) {
   bool result = (str && atoi(str) > 0);
   PQclear(res);
 
-  {
-    lock_guard<mutex> lock(mtx);
-    conn_queue.push(conn);
+  return result;
+}
+
+
+
+// One transaction; upserts and deletes go as text[] parameters,
+// WRITE_BATCH_CHUNK keys per statement.
+void DBConnectionPool::write_batch(const vector<pair<string, string>>& sets, const vector<string>& removes) {
+  if(sets.empty() && removes.empty()) return;
+  ConnLease conn(*this);
+  PGconn* pg = conn.pg();
+  auto run = [&](const string& query, int nparams, const char* const* params) {
+    PGresult *res = exec_params(conn, query, nparams, params);
+    ExecStatusType status = PQresultStatus(res);
+    if(status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK) {
+      string err = PQerrorMessage(pg);
+      PQclear(res);
+      throw Exception_("Postgres", "Fail to write batch: " + err);
+    }
+    PQclear(res);
+  };
+
+  bool in_tx = false;
+  try {
+    exec_command(pg, "BEGIN", "Fail to write batch");
+    in_tx = true;
+    vector<string> keys, values;
+    string key_array, value_array;
+    for(size_t begin=0; begin<sets.size(); begin+=WRITE_BATCH_CHUNK) {
+      size_t end = min(sets.size(), begin + WRITE_BATCH_CHUNK);
+      keys.clear();
+      values.clear();
+      for(size_t i=begin; i<end; i++) {
+        keys.push_back(sets[i].first);
+        values.push_back(sets[i].second);
+      }
+      key_array.clear();
+      value_array.clear();
+      append_text_array(key_array, keys, 0, keys.size());
+      append_text_array(value_array, values, 0, values.size());
+      const char* param[2] = {key_array.c_str(), value_array.c_str()};
+      run(q_set_many, 2, param);
+    }
+    for(size_t begin=0; begin<removes.size(); begin+=WRITE_BATCH_CHUNK) {
+      size_t end = min(removes.size(), begin + WRITE_BATCH_CHUNK);
+      key_array.clear();
+      append_text_array(key_array, removes, begin, end);
+      const char* param[1] = {key_array.c_str()};
+      run(q_remove_many, 1, param);
+    }
+    exec_command(pg, "COMMIT", "Fail to write batch");
+  } catch(...) {
+    if(in_tx && !conn.is_discarded() && PQstatus(pg) == CONNECTION_OK) {
+      PGresult* res = PQexec(pg, "ROLLBACK");
+      PQclear(res);
+    }
+    throw;
   }
-  cv.notify_one();
+}
+
+vector<pair<string, string>> DBConnectionPool::scan(const string& start, size_t limit) {
+  ConnLease conn(*this);
+  string limit_str = to_string(limit);
+  const char* param[2] = {start.c_str(), limit_str.c_str()};
+  PGresult *res = exec_params(conn, q_scan, 2, param);
 
+  if(PQresultStatus(res) != PGRES_TUPLES_OK){
+    string err = PQerrorMessage(conn.pg());
+    PQclear(res);
+    throw Exception_("Postgres", "Fail to scan: " + err);
+  }
+  vector<pair<string, string>> result;
+  int rows = PQntuples(res);
+  result.reserve(rows);
+  for(int i=0; i<rows; i++) {
+    result.emplace_back(string(PQgetvalue(res, i, 0), PQgetlength(res, i, 0)),
+      string(PQgetvalue(res, i, 1), PQgetlength(res, i, 1)));
+  }
+  PQclear(res);
   return result;
 }
 
+// With upsert the stream lands in a temp staging table and is merged into the
+// store in the same transaction (last duplicate wins); without it the COPY
+// goes straight into the table, which is fastest for seeding an empty store.
+size_t DBConnectionPool::import_copy(const function<bool(const ChunkSink&)>& read_body, bool upsert) {
+  ConnLease conn(*this);
+  PGconn* pg = conn.pg();
+  bool in_tx = false;
+  try {
+    if(upsert) {
+      exec_command(pg, "BEGIN", "Fail to import");
+      in_tx = true;
+      exec_command(pg, "CREATE TEMP TABLE kv_import (key TEXT, value TEXT) ON COMMIT DROP",
+        "Fail to import");
+    }
+
+    PGresult* res = PQexec(pg, upsert ? "COPY kv_import FROM STDIN (FORMAT binary)"
+      : schema.copy_in_query().c_str());
+    if(PQresultStatus(res) != PGRES_COPY_IN) {
+      string err = PQerrorMessage(pg);
+      PQclear(res);
+      throw Exception_("Postgres", "Fail to import: " + err);
+    }
+    PQclear(res);
+
+    bool sent = false;
+    try {
+      sent = read_body([&](const char* data, size_t len) {
+        return PQputCopyData(pg, data, (int)len) == 1;
+      });
+    } catch(const Exception_& e) {
+      PQputCopyEnd(pg, e.what());
+      drain_results(pg);
+      throw;
+    }
+    PQputCopyEnd(pg, sent ? nullptr : "import aborted");
+
+    res = PQgetResult(pg);
+    bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+    string err = ok ? "" : PQerrorMessage(pg);
+    const char* tuples = PQcmdTuples(res);
+    size_t rows = (tuples && *tuples) ? strtoull(tuples, nullptr, 10) : 0;
+    PQclear(res);
+    drain_results(pg);
+    if(!sent) throw Exception_("Import", "Request body ended early");
+    if(!ok) throw Exception_("Postgres", "Fail to import: " + err);
+
+    if(upsert) {
+      for(const string& stmt : schema.import_merge_statements()) {
+        exec_command(pg, stmt.c_str(), "Fail to import");
+      }
+      exec_command(pg, "COMMIT", "Fail to import");
+      in_tx = false;
+    }
+    return rows;
+  } catch(...) {
+    if(in_tx && PQstatus(pg) == CONNECTION_OK) {
+      PGresult* res = PQexec(pg, "ROLLBACK");
+      PQclear(res);
+    }
+    throw;
+  }
+}
+
+// Rows are re-chunked into EXPORT_CHUNK_BYTES writes. If the sink gives up
+// (client went away) the COPY is cancelled and the rest of the stream drained.
+bool DBConnectionPool::export_copy(const ChunkSink& write) {
+  ConnLease conn(*this);
+  PGconn* pg = conn.pg();
+  PGresult* res = PQexec(pg, schema.copy_out_query().c_str());
+  if(PQresultStatus(res) != PGRES_COPY_OUT) {
+    string err = PQerrorMessage(pg);
+    PQclear(res);
+    throw Exception_("Postgres", "Fail to export: " + err);
+  }
+  PQclear(res);
+
+  string chunk;
+  chunk.reserve(EXPORT_CHUNK_BYTES + 4096);
+  bool writing = true;
+  for(;;) {
+    char* row = nullptr;
+    int n = PQgetCopyData(pg, &row, 0);
+    if(n > 0) {
+      if(writing) chunk.append(row, n);
+      PQfreemem(row);
+      if(writing && chunk.size() >= EXPORT_CHUNK_BYTES) {
+        if(!write(chunk.data(), chunk.size())) {
+          writing = false;
+          if(PGcancel* cancel = PQgetCancel(pg)) {
+            char errbuf[256];
+            PQcancel(cancel, errbuf, sizeof(errbuf));
+            PQfreeCancel(cancel);
+          }
+        }
+        chunk.clear();
+      }
+      continue;
+    }
+    if(n == -2) {
+      string err = PQerrorMessage(pg);
+      drain_results(pg);
+      throw Exception_("Postgres", "Fail to export: " + err);
+    }
+    break;
+  }
+  res = PQgetResult(pg);
+  bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+  string err = ok ? "" : PQerrorMessage(pg);
+  PQclear(res);
+  drain_results(pg);
+  if(!writing) return false;
+  if(!ok) throw Exception_("Postgres", "Fail to export: " + err);
+  if(!chunk.empty()) writing = write(chunk.data(), chunk.size());
+  return writing;
+}
@@ -0,0 +1,131 @@
+#include "FileUtil.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace fileutil {
+
+static Exception_ io_error(const string& what) {
+  return Exception_("IO", what + ": " + strerror(errno));
+}
+
+void make_dirs(const string& path) {
+  string partial;
+  size_t pos = 0;
+  while(pos != string::npos) {
+    pos = path.find('/', pos + 1);
+    partial = path.substr(0, pos);
+    if(partial.empty()) continue;
+    if(mkdir(partial.c_str(), 0755) != 0 && errno != EEXIST) throw io_error("Fail to create " + partial);
+  }
+}
+
+vector<string> list_dir(const string& dir) {
+  vector<string> out;
+  DIR* d = opendir(dir.c_str());
+  if(!d) throw io_error("Fail to list " + dir);
+  while(struct dirent* e = readdir(d)) {
+    string name = e->d_name;
+    if(name != "." && name != "..") out.push_back(name);
+  }
+  closedir(d);
+  return out;
+}
+
+bool exists(const string& path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0;
+}
+
+string read_file(const string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if(fd < 0) throw io_error("Fail to open " + path);
+  string out;
+  char buf[65536];
+  for(;;) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0) {
+      close(fd);
+      throw io_error("Fail to read " + path);
+    }
+    if(n == 0) break;
+    out.append(buf, n);
+  }
+  close(fd);
+  return out;
+}
+
+string dir_of(const string& path) {
+  size_t slash = path.rfind('/');
+  if(slash == string::npos) return ".";
+  if(slash == 0) return "/";
+  return path.substr(0, slash);
+}
+
+void sync_dir(const string& dir) {
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(fd < 0) throw io_error("Fail to open " + dir);
+  fsync(fd);
+  close(fd);
+}
+
+void write_file_atomic(const string& path, const string& contents) {
+  string tmp = path + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(fd < 0) throw io_error("Fail to create " + tmp);
+  try {
+    write_all(fd, contents.data(), contents.size(), tmp);
+  } catch(...) {
+    close(fd);
+    throw;
+  }
+  if(fsync(fd) != 0) {
+    close(fd);
+    throw io_error("Fail to sync " + tmp);
+  }
+  close(fd);
+  if(rename(tmp.c_str(), path.c_str()) != 0) throw io_error("Fail to rename " + tmp);
+  sync_dir(dir_of(path));
+}
+
+void write_all(int fd, const char* data, size_t len, const string& what) {
+  while(len > 0) {
+    ssize_t n = write(fd, data, len);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0) throw io_error("Fail to write " + what);
+    data += n;
+    len -= n;
+  }
+}
+
+void pwrite_all(int fd, const char* data, size_t len, uint64_t off, const string& what) {
+  while(len > 0) {
+    ssize_t n = pwrite(fd, data, len, off);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0) throw io_error("Fail to write " + what);
+    data += n;
+    len -= n;
+    off += n;
+  }
+}
+
+void pread_all(int fd, char* buf, size_t len, uint64_t off, const string& what) {
+  while(len > 0) {
+    ssize_t n = pread(fd, buf, len, off);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0) throw io_error("Fail to read " + what);
+    if(n == 0) throw Exception_("IO", "Unexpected end of file in " + what);
+    buf += n;
+    len -= n;
+    off += n;
+  }
+}
+
+}
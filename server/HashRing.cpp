@@ -0,0 +1,41 @@
+#include "HashRing.h"
+
+#include <algorithm>
+
+using namespace std;
+
+HashRing::HashRing(int nodes, int vnodes) : count(max(1, nodes)) {
+  vnodes = max(1, vnodes);
+  points.reserve((size_t)count * vnodes);
+  for(int node=0; node<count; node++) {
+    for(int v=0; v<vnodes; v++) {
+      string label = "shard" + to_string(node) + "#" + to_string(v);
+      points.emplace_back(hash(label.data(), label.size()), node);
+    }
+  }
+  sort(points.begin(), points.end());
+}
+
+// The first point at or after the key's hash, wrapping around.
+int HashRing::owner(const string& key) const {
+  uint64_t h = hash(key.data(), key.size());
+  auto it = lower_bound(points.begin(), points.end(), make_pair(h, 0));
+  if(it == points.end()) it = points.begin();
+  return it->second;
+}
+
+// FNV-1a, finished with the MurmurHash3 mixer so that similar labels
+// ("shard0#1", "shard0#2") land far apart.
+uint64_t HashRing::hash(const char* data, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  for(size_t i=0; i<len; i++) {
+    h ^= (unsigned char)data[i];
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb3fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
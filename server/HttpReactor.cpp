@@ -0,0 +1,859 @@
+#include "HttpReactor.h"
+#include "Uring.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <strings.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+#define REACTOR_EVENTS 256
+#define REACTOR_READ_SIZE 16384
+#define REACTOR_HEADER_MAX 16384
+#define REACTOR_HEADER_COUNT 100
+// Unread pipelined bytes buffered while a request is with a worker; reading
+// resumes once it is answered.
+#define REACTOR_PIPELINE_MAX (1 << 20)
+#define REACTOR_COMPACT_AT 65536
+#define REACTOR_WRITE_TIMEOUT_MS 5000
+#define REACTOR_TICK_MS 1000
+
+#define REACTOR_RING_ENTRIES 4096
+#define REACTOR_RING_CQ_ENTRIES 16384
+// Provided receive buffers of REACTOR_READ_SIZE bytes; a power of two.
+#define REACTOR_RECV_BUFFERS 512
+#define REACTOR_FILES_MAX (1 << 20)
+
+// Completion tags: connection operations also carry the descriptor and id.
+#define URING_ACCEPT 1
+#define URING_WAKE 2
+#define URING_TICK 3
+#define URING_RECV 4
+#define URING_SEND 5
+#define URING_IGNORE 6
+
+static const char BUSY_RESPONSE[] =
+  "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+// Blocking write on a non-blocking socket, for streamed responses.
+static bool send_all(int fd, const char* data, size_t len, const atomic<bool>& stopping) {
+  size_t sent = 0;
+  while(sent < len) {
+    ssize_t n = send(fd, data + sent, len - sent, MSG_NOSIGNAL);
+    if(n > 0) {
+      sent += n;
+      continue;
+    }
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      pollfd p = {fd, POLLOUT, 0};
+      int ready = poll(&p, 1, REACTOR_WRITE_TIMEOUT_MS);
+      if(ready <= 0 || stopping) return false;
+      continue;
+    }
+    return false;
+  }
+  return true;
+}
+
+static bool iequals(const string& a, const char* b) {
+  return strcasecmp(a.c_str(), b) == 0;
+}
+
+// The ring and what is registered with it, used by the reactor thread only.
+struct HttpReactor::UringState {
+  Uring ring;
+  io_uring_buf_ring* buffers = nullptr;
+  size_t buffers_size = 0;
+  vector<char> memory;
+  unsigned short buffer_tail = 0;
+  // Registered file slots; a socket sits in the slot of its descriptor.
+  unsigned files = 0;
+  int cleared = -1;
+  uint64_t wake_value = 0;
+  __kernel_timespec tick = {REACTOR_TICK_MS / 1000, 0};
+
+  ~UringState() {
+    if(buffers) munmap(buffers, buffers_size);
+  }
+
+  const char* buffer(unsigned short bid) const {
+    return memory.data() + (size_t)bid * REACTOR_READ_SIZE;
+  }
+
+  // Hands a receive buffer back to the kernel. The ring is an array of
+  // io_uring_buf whose first entry holds the tail; C++ lays the header's
+  // flexible `bufs` out 8 bytes late, so it is not used.
+  void recycle(unsigned short bid) {
+    io_uring_buf& buf = ((io_uring_buf*)buffers)[buffer_tail & (REACTOR_RECV_BUFFERS - 1)];
+    buf.addr = (uint64_t)buffer(bid);
+    buf.len = REACTOR_READ_SIZE;
+    buf.bid = bid;
+    buffer_tail++;
+    __atomic_store_n(&buffers->tail, buffer_tail, __ATOMIC_RELEASE);
+  }
+};
+
+HttpReactor::HttpReactor(Handler handler, size_t workers, size_t max_connections, int idle_timeout_ms, size_t max_body,
+  bool io_uring)
+  : handler(move(handler)), workers_count(max<size_t>(1, workers)), max_connections(max<size_t>(1, max_connections)),
+    idle_timeout_ms(max(0, idle_timeout_ms)), max_body(max_body), use_uring(io_uring) {}
+
+HttpReactor::~HttpReactor() {
+  if(workers) workers->shutdown();
+  for(auto& entry : connections) close(entry.first);
+  if(listen_fd >= 0) close(listen_fd);
+  if(wake_fd >= 0) close(wake_fd);
+  if(epoll_fd >= 0) close(epoll_fd);
+}
+
+bool HttpReactor::listen(const string& host, int port) {
+  // Every connection is a descriptor; allow max_connections of them.
+  rlimit limit;
+  if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < max_connections + 64) {
+    limit.rlim_cur = min<rlim_t>(limit.rlim_max, max_connections + 64);
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  addrinfo hints, *found;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if(getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &found) != 0) return false;
+  for(addrinfo* at = found; at && listen_fd < 0; at = at->ai_next) {
+    listen_fd = socket(at->ai_family, at->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, at->ai_protocol);
+    if(listen_fd < 0) continue;
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(::bind(listen_fd, at->ai_addr, at->ai_addrlen) != 0 || ::listen(listen_fd, SOMAXCONN) != 0) {
+      close(listen_fd);
+      listen_fd = -1;
+    }
+  }
+  freeaddrinfo(found);
+  if(listen_fd < 0) return false;
+
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(wake_fd < 0) return false;
+  if(use_uring && !start_uring()) {
+    cerr << "io_uring unavailable (" << strerror(errno) << "), serving HTTP with epoll" << endl;
+    uring.reset();
+  }
+  if(!uring) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(epoll_fd < 0) return false;
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    ev.data.fd = wake_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+  }
+  ring_active = (bool)uring;
+
+  workers.reset(new httplib::ThreadPool(workers_count));
+  if(uring) run_uring();
+  else run_epoll();
+
+  // Unblock workers still streaming, then wait for them.
+  for(auto& entry : connections) shutdown(entry.first, SHUT_RDWR);
+  workers->shutdown();
+  workers.reset();
+  return true;
+}
+
+void HttpReactor::run_epoll() {
+  epoll_event events[REACTOR_EVENTS];
+  Clock::time_point next_tick = Clock::now() + chrono::milliseconds(REACTOR_TICK_MS);
+  while(!stopping) {
+    int n = epoll_wait(epoll_fd, events, REACTOR_EVENTS, accept_pending ? 10 : REACTOR_TICK_MS);
+    if(n < 0 && errno != EINTR) break;
+    for(int i=0; i<n; i++) {
+      int fd = events[i].data.fd;
+      if(fd == listen_fd) {
+        accept_all();
+      } else if(fd == wake_fd) {
+        uint64_t count;
+        if(read(wake_fd, &count, sizeof(count)) < 0) {}
+        drain_completions();
+      } else {
+        auto it = connections.find(fd);
+        if(it == connections.end()) continue;
+        if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) on_readable(*it->second);
+        else settle(*it->second);
+      }
+    }
+    if(accept_pending) accept_all();
+    if(Clock::now() >= next_tick) {
+      close_idle();
+      next_tick = Clock::now() + chrono::milliseconds(REACTOR_TICK_MS);
+    }
+  }
+}
+
+bool HttpReactor::start_uring() {
+  uring.reset(new UringState());
+  UringState& u = *uring;
+  if(!u.ring.init(REACTOR_RING_ENTRIES, REACTOR_RING_CQ_ENTRIES)) return false;
+
+  rlimit limit;
+  u.files = getrlimit(RLIMIT_NOFILE, &limit) == 0 ? min<rlim_t>(limit.rlim_cur, REACTOR_FILES_MAX) : 1024;
+  io_uring_rsrc_register files;
+  memset(&files, 0, sizeof(files));
+  files.nr = u.files;
+  files.flags = IORING_RSRC_REGISTER_SPARSE;
+  int err = u.ring.register_resource(IORING_REGISTER_FILES2, &files, sizeof(files));
+  if(err < 0) {
+    errno = -err;
+    return false;
+  }
+
+  u.buffers_size = REACTOR_RECV_BUFFERS * sizeof(io_uring_buf);
+  void* ring = mmap(nullptr, u.buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(ring == MAP_FAILED) return false;
+  u.buffers = (io_uring_buf_ring*)ring;
+  io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)ring;
+  reg.ring_entries = REACTOR_RECV_BUFFERS;
+  reg.bgid = 0;
+  err = u.ring.register_resource(IORING_REGISTER_PBUF_RING, &reg, 1);
+  if(err < 0) {
+    errno = -err;
+    return false;
+  }
+  u.memory.resize((size_t)REACTOR_RECV_BUFFERS * REACTOR_READ_SIZE);
+  for(unsigned bid=0; bid<REACTOR_RECV_BUFFERS; bid++) u.recycle(bid);
+
+  arm(URING_ACCEPT);
+  arm(URING_WAKE);
+  arm(URING_TICK);
+  return true;
+}
+
+void HttpReactor::run_uring() {
+  Uring& ring = uring->ring;
+  while(!stopping) {
+    // Everything queued since the last wait goes in with it.
+    int n = ring.submit(1);
+    if(n < 0 && n != -EINTR && n != -EAGAIN && n != -EBUSY) {
+      cerr << "io_uring_enter: " << strerror(-n) << endl;
+      break;
+    }
+    ring.reap([this](const io_uring_cqe& cqe) { on_completion(cqe.user_data, cqe.res, cqe.flags); });
+    ring_enters.store(ring.enter_count(), memory_order_relaxed);
+  }
+}
+
+uint64_t HttpReactor::tag(const Connection& conn, unsigned op) const {
+  return ((uint64_t)conn.fd << 40) | ((conn.id & 0xFFFFFFFF) << 8) | op;
+}
+
+void HttpReactor::arm(unsigned op) {
+  io_uring_sqe* sqe = uring->ring.sqe();
+  if(!sqe) return;
+  sqe->user_data = op;
+  if(op == URING_ACCEPT) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  } else if(op == URING_WAKE) {
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wake_fd;
+    sqe->addr = (uint64_t)&uring->wake_value;
+    sqe->len = sizeof(uring->wake_value);
+  } else {
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)&uring->tick;
+    sqe->len = 1;
+  }
+}
+
+void HttpReactor::arm_recv(Connection& conn) {
+  io_uring_sqe* sqe = uring->ring.sqe();
+  if(!sqe) return;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn.fd;
+  sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->buf_group = 0;
+  sqe->user_data = tag(conn, URING_RECV);
+  conn.recv_armed = true;
+  conn.inflight++;
+}
+
+void HttpReactor::send_out(Connection& conn) {
+  io_uring_sqe* sqe = uring->ring.sqe();
+  if(!sqe) return;
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = conn.fd;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->addr = (uint64_t)(conn.out.data() + conn.sent);
+  sqe->len = conn.out.size() - conn.sent;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = tag(conn, URING_SEND);
+  conn.sending = true;
+  conn.inflight++;
+}
+
+void HttpReactor::cancel(Connection& conn, unsigned op) {
+  io_uring_sqe* sqe = uring->ring.sqe();
+  if(!sqe) return;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->user_data = URING_IGNORE;
+  if(op) {
+    sqe->addr = tag(conn, op);
+  } else {
+    sqe->fd = conn.fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_FD_FIXED | IORING_ASYNC_CANCEL_ALL;
+  }
+}
+
+void HttpReactor::finalize(Connection& conn) {
+  if(conn.inflight > 0) return;
+  // The slot holds its own reference to the socket.
+  io_uring_sqe* sqe = uring->ring.sqe();
+  if(sqe) {
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->addr = (uint64_t)&uring->cleared;
+    sqe->len = 1;
+    sqe->off = conn.fd;
+    sqe->user_data = URING_IGNORE;
+  }
+  int fd = conn.fd;
+  close(fd);
+  connections.erase(fd);
+  open_count.store(connections.size(), memory_order_relaxed);
+  if(accept_pending) {
+    accept_pending = false;
+    arm(URING_ACCEPT);
+  }
+}
+
+void HttpReactor::on_completion(uint64_t user_data, int res, unsigned flags) {
+  unsigned op = user_data & 0xFF;
+  bool more = flags & IORING_CQE_F_MORE;
+  if(op == URING_ACCEPT) {
+    if(res >= 0) {
+      Connection* conn = add_connection(res);
+      io_uring_sqe* sqe = conn ? uring->ring.sqe() : nullptr;
+      if(sqe) {
+        // Into the file table first; the receive is linked behind it.
+        sqe->opcode = IORING_OP_FILES_UPDATE;
+        sqe->addr = (uint64_t)&conn->fd;
+        sqe->len = 1;
+        sqe->off = conn->fd;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = URING_IGNORE;
+        arm_recv(*conn);
+      }
+    }
+    if(!more) {
+      // Out of descriptors: accept again after a close or on the tick.
+      if(res == -EMFILE || res == -ENFILE || res == -ENOBUFS || res == -ENOMEM) accept_pending = true;
+      else arm(URING_ACCEPT);
+    }
+    return;
+  }
+  if(op == URING_WAKE) {
+    drain_completions();
+    arm(URING_WAKE);
+    return;
+  }
+  if(op == URING_TICK) {
+    close_idle();
+    if(accept_pending) {
+      accept_pending = false;
+      arm(URING_ACCEPT);
+    }
+    arm(URING_TICK);
+    return;
+  }
+  if(op != URING_RECV && op != URING_SEND) return;
+
+  auto it = connections.find((int)(user_data >> 40));
+  if(it == connections.end() || (it->second->id & 0xFFFFFFFF) != ((user_data >> 8) & 0xFFFFFFFF)) {
+    if(flags & IORING_CQE_F_BUFFER) uring->recycle(flags >> IORING_CQE_BUFFER_SHIFT);
+    return;
+  }
+  Connection& conn = *it->second;
+
+  if(op == URING_SEND) {
+    conn.sending = false;
+    conn.inflight--;
+    if(conn.dead) {
+      finalize(conn);
+      return;
+    }
+    if(res <= 0) {
+      conn.out.clear();
+      conn.sent = 0;
+      close_connection(conn.fd);
+      return;
+    }
+    conn.sent += res;
+    if(conn.sent == conn.out.size()) {
+      conn.out.clear();
+      conn.sent = 0;
+    }
+    settle(conn);
+    return;
+  }
+
+  if(flags & IORING_CQE_F_BUFFER) {
+    unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    // After a final response the rest of the stream is dropped.
+    if(res > 0 && !conn.dead && !conn.closing) conn.in.append(uring->buffer(bid), res);
+    uring->recycle(bid);
+  }
+  if(!more) {
+    conn.recv_armed = false;
+    conn.inflight--;
+  }
+  if(conn.dead) {
+    finalize(conn);
+    return;
+  }
+  if(res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED)) {
+    // End of stream or error: answer what was read, then close.
+    conn.closing = true;
+  } else if(!more && !conn.paused && !conn.closing) {
+    arm_recv(conn);
+  }
+  if(conn.busy && conn.recv_armed && !conn.paused && conn.in.size() - conn.pos > REACTOR_PIPELINE_MAX) {
+    conn.paused = true;
+    cancel(conn, URING_RECV);
+  }
+  conn.active = Clock::now();
+  settle(conn);
+}
+
+void HttpReactor::stop() {
+  stopping = true;
+  if(wake_fd >= 0) {
+    uint64_t one = 1;
+    if(write(wake_fd, &one, sizeof(one)) < 0) {}
+  }
+}
+
+HttpReactor::Connection* HttpReactor::add_connection(int fd) {
+  // With io_uring the socket also needs a file slot of its own number.
+  if(connections.size() >= max_connections || (uring && (unsigned)fd >= uring->files)) {
+    rejected.fetch_add(1, memory_order_relaxed);
+    if(send(fd, BUSY_RESPONSE, sizeof(BUSY_RESPONSE) - 1, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {}
+    close(fd);
+    return nullptr;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  unique_ptr<Connection> conn(new Connection());
+  conn->fd = fd;
+  conn->id = next_id++;
+  conn->active = Clock::now();
+  Connection* added = conn.get();
+  connections.emplace(fd, move(conn));
+  accepted.fetch_add(1, memory_order_relaxed);
+  open_count.store(connections.size(), memory_order_relaxed);
+  return added;
+}
+
+void HttpReactor::accept_all() {
+  accept_pending = false;
+  for(;;) {
+    int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(fd < 0) {
+      if(errno == EINTR) continue;
+      // Out of descriptors: the backlog stays readable but the edge is gone,
+      // so retry on a short timeout.
+      if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) accept_pending = true;
+      return;
+    }
+    if(!add_connection(fd)) continue;
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = fd;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) close_connection(fd);
+  }
+}
+
+void HttpReactor::close_connection(int fd) {
+  if(uring) {
+    // Closed once the kernel is done with it.
+    Connection& conn = *connections[fd];
+    if(conn.dead) return;
+    conn.dead = true;
+    if(conn.inflight > 0) cancel(conn, 0);
+    finalize(conn);
+    return;
+  }
+  close(fd);
+  connections.erase(fd);
+  open_count.store(connections.size(), memory_order_relaxed);
+}
+
+void HttpReactor::on_readable(Connection& conn) {
+  char buf[REACTOR_READ_SIZE];
+  conn.paused = false;
+  for(;;) {
+    if(conn.busy && conn.in.size() - conn.pos > REACTOR_PIPELINE_MAX) {
+      conn.paused = true;
+      break;
+    }
+    ssize_t n = recv(conn.fd, buf, sizeof(buf), 0);
+    if(n > 0) {
+      // After a final response the rest of the stream is dropped.
+      if(!conn.closing) conn.in.append(buf, n);
+      continue;
+    }
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    // End of stream or error: answer what was read, then close.
+    conn.closing = true;
+    break;
+  }
+  conn.active = Clock::now();
+  settle(conn);
+}
+
+bool HttpReactor::write_out(Connection& conn) {
+  if(uring) {
+    // Failures arrive with the send's completion.
+    if(!conn.sending && conn.sent < conn.out.size()) send_out(conn);
+    return true;
+  }
+  while(conn.sent < conn.out.size()) {
+    ssize_t n = send(conn.fd, conn.out.data() + conn.sent, conn.out.size() - conn.sent, MSG_NOSIGNAL);
+    if(n > 0) {
+      conn.sent += n;
+      continue;
+    }
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+    return false;
+  }
+  conn.out.clear();
+  conn.sent = 0;
+  return true;
+}
+
+void HttpReactor::settle(Connection& conn) {
+  for(;;) {
+    if(!write_out(conn)) {
+      // A worker may still be writing to it; close once it is done.
+      if(conn.busy) {
+        conn.broken = true;
+        conn.out.clear();
+        conn.sent = 0;
+        return;
+      }
+      close_connection(conn.fd);
+      return;
+    }
+    // A streamed response is written by its worker, after what is queued.
+    if(conn.busy || !conn.out.empty()) return;
+    int parsed = parse(conn);
+    if(parsed == 1) {
+      dispatch(conn);
+      return;
+    }
+    if(parsed == 0) {
+      if(conn.out.empty() && conn.closing) {
+        close_connection(conn.fd);
+        return;
+      }
+      // Only a 100 Continue can be pending here.
+      if(!conn.out.empty()) continue;
+      return;
+    }
+    fail(conn, parsed);
+  }
+}
+
+void HttpReactor::fail(Connection& conn, int status) {
+  conn.out += "HTTP/1.1 " + to_string(status) + " " + httplib::status_message(status) +
+    "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+  conn.closing = true;
+  conn.in.clear();
+  conn.pos = 0;
+}
+
+int HttpReactor::parse(Connection& conn) {
+  string& in = conn.in;
+  if(conn.closing && conn.pos == in.size()) return 0;
+  if(!conn.headers_done) {
+    size_t from = max(conn.pos, conn.scanned >= 3 ? conn.scanned - 3 : 0);
+    size_t end = in.find("\r\n\r\n", from);
+    if(end == string::npos) {
+      conn.scanned = in.size();
+      if(in.size() - conn.pos > REACTOR_HEADER_MAX) return 431;
+      return 0;
+    }
+    if(end - conn.pos > REACTOR_HEADER_MAX) return 431;
+
+    httplib::Request& req = conn.req;
+    req = httplib::Request();
+    size_t eol = in.find("\r\n", conn.pos);
+    size_t first = in.find(' ', conn.pos);
+    size_t second = first < eol ? in.find(' ', first + 1) : string::npos;
+    if(first >= eol || second >= eol || in.find(' ', second + 1) < eol) return 400;
+    req.method.assign(in, conn.pos, first - conn.pos);
+    req.target.assign(in, first + 1, second - first - 1);
+    req.version.assign(in, second + 1, eol - second - 1);
+    if(req.method.empty() || req.target.empty()) return 400;
+    if(req.version != "HTTP/1.1" && req.version != "HTTP/1.0") return 505;
+    size_t fragment = req.target.find('#');
+    if(fragment != string::npos) req.target.erase(fragment);
+    size_t query = req.target.find('?');
+    req.path = httplib::decode_path_component(req.target.substr(0, query));
+    if(query != string::npos) httplib::detail::parse_query_text(req.target.substr(query + 1), req.params);
+
+    int count = 0;
+    for(size_t at = eol + 2; at < end + 2; ) {
+      size_t next = in.find("\r\n", at);
+      size_t colon = in.find(':', at);
+      if(colon >= next || colon == at) return 400;
+      if(++count > REACTOR_HEADER_COUNT) return 431;
+      size_t value = colon + 1, value_end = next;
+      while(value < value_end && (in[value] == ' ' || in[value] == '\t')) value++;
+      while(value_end > value && (in[value_end - 1] == ' ' || in[value_end - 1] == '\t')) value_end--;
+      req.headers.emplace(in.substr(at, colon - at), in.substr(value, value_end - value));
+      at = next + 2;
+    }
+
+    conn.chunked = false;
+    conn.body_length = 0;
+    if(req.has_header("Transfer-Encoding")) {
+      if(!iequals(req.get_header_value("Transfer-Encoding"), "chunked")) return 501;
+      conn.chunked = true;
+    } else if(req.has_header("Content-Length")) {
+      const string length = req.get_header_value("Content-Length");
+      if(length.empty() || length.size() > 19 || length.find_first_not_of("0123456789") != string::npos) return 400;
+      conn.body_length = stoull(length);
+      if(conn.body_length > max_body) return 413;
+    }
+    conn.headers_done = true;
+    conn.body_at = end + 4;
+    bool waiting = conn.chunked ? in.size() == conn.body_at : in.size() - conn.body_at < conn.body_length;
+    if(waiting && iequals(req.get_header_value("Expect"), "100-continue")) {
+      conn.out += "HTTP/1.1 100 Continue\r\n\r\n";
+    }
+  }
+
+  size_t done;
+  if(!conn.chunked) {
+    if(in.size() - conn.body_at < conn.body_length) return 0;
+    conn.req.body.assign(in, conn.body_at, conn.body_length);
+    done = conn.body_at + conn.body_length;
+  } else {
+    // body_at advances over the chunks already copied into the body.
+    for(;;) {
+      size_t eol = in.find("\r\n", conn.body_at);
+      if(eol == string::npos) return in.size() - conn.body_at > REACTOR_HEADER_MAX ? 400 : 0;
+      char* parsed_end;
+      errno = 0;
+      unsigned long long size = strtoull(in.c_str() + conn.body_at, &parsed_end, 16);
+      if(parsed_end == in.c_str() + conn.body_at || errno != 0
+          || (*parsed_end != '\r' && *parsed_end != ';' && *parsed_end != ' ')) return 400;
+      if(size == 0) {
+        // Trailers, if any, end with an empty line.
+        size_t trailer_end = in.compare(eol + 2, 2, "\r\n") == 0 ? eol + 2 : in.find("\r\n\r\n", eol);
+        if(trailer_end == string::npos || in.size() < trailer_end + 2) {
+          return in.size() - conn.body_at > REACTOR_HEADER_MAX ? 431 : 0;
+        }
+        done = trailer_end + (trailer_end == eol + 2 ? 2 : 4);
+        break;
+      }
+      if(size > max_body || conn.req.body.size() + size > max_body) return 413;
+      if(in.size() - (eol + 2) < size + 2) return 0;
+      if(in.compare(eol + 2 + size, 2, "\r\n") != 0) return 400;
+      conn.req.body.append(in, eol + 2, size);
+      conn.body_at = eol + 2 + size + 2;
+    }
+  }
+
+  conn.pos = done;
+  conn.headers_done = false;
+  if(conn.pos == in.size()) {
+    in.clear();
+    conn.pos = 0;
+  } else if(conn.pos >= REACTOR_COMPACT_AT) {
+    in.erase(0, conn.pos);
+    conn.pos = 0;
+  }
+  conn.scanned = conn.pos;
+  return 1;
+}
+
+void HttpReactor::dispatch(Connection& conn) {
+  conn.busy = true;
+  requests.fetch_add(1, memory_order_relaxed);
+  shared_ptr<httplib::Request> req = make_shared<httplib::Request>(move(conn.req));
+  conn.req = httplib::Request();
+  int fd = conn.fd;
+  uint64_t id = conn.id;
+  workers->enqueue([this, fd, id, req]() { serve(fd, id, *req); });
+}
+
+void HttpReactor::serve(int fd, uint64_t id, httplib::Request& req) {
+  httplib::Response res;
+  try {
+    handler(req, res);
+  } catch(const exception& e) {
+    res = httplib::Response();
+    res.status = 500;
+    res.set_content(string("Internal Server Error: ") + e.what(), "text/plain");
+  }
+  if(res.status == -1) res.status = 200;
+
+  const string connection = req.get_header_value("Connection");
+  bool close_after = iequals(connection, "close") || (req.version == "HTTP/1.0" && !iequals(connection, "keep-alive"))
+    || iequals(res.get_header_value("Connection"), "close") || stopping;
+  bool head = req.method == "HEAD";
+  bool stream = res.content_provider_ && !head;
+  // A stream without a length or chunking ends with the connection.
+  if(stream && !res.is_chunked_content_provider_ && res.content_length_ == 0) close_after = true;
+
+  string out = "HTTP/1.1 " + to_string(res.status) + " " + httplib::status_message(res.status) + "\r\n";
+  for(const auto& header : res.headers) {
+    if(iequals(header.first, "Connection")) continue;
+    out += header.first + ": " + header.second + "\r\n";
+  }
+  if(stream && res.is_chunked_content_provider_) out += "Transfer-Encoding: chunked\r\n";
+  else if(stream || !res.content_provider_) {
+    out += "Content-Length: " + to_string(stream ? res.content_length_ : res.body.size()) + "\r\n";
+  }
+  if(close_after) out += "Connection: close\r\n";
+  else if(req.version == "HTTP/1.0") out += "Connection: keep-alive\r\n";
+  out += "\r\n";
+
+  if(!stream) {
+    if(!head) out += res.body;
+    complete(Completion{fd, id, move(out), close_after});
+    return;
+  }
+
+  // Headers go out first; the reactor leaves the socket to this worker
+  // while the connection is busy.
+  bool ok = send_all(fd, out.data(), out.size(), stopping);
+  bool finished = false;
+  size_t offset = 0;
+  bool chunked = res.is_chunked_content_provider_;
+  httplib::DataSink sink;
+  sink.write = [&](const char* data, size_t len) {
+    if(!ok) return false;
+    if(chunked) {
+      if(len == 0) return true;
+      char size[24];
+      int n = snprintf(size, sizeof(size), "%zx\r\n", len);
+      ok = send_all(fd, size, n, stopping) && send_all(fd, data, len, stopping) && send_all(fd, "\r\n", 2, stopping);
+    } else {
+      ok = send_all(fd, data, len, stopping);
+    }
+    offset += len;
+    return ok;
+  };
+  sink.is_writable = [&]() { return ok; };
+  sink.done = [&]() { finished = true; };
+  sink.done_with_trailer = [&](const httplib::Headers&) { finished = true; };
+  out.clear();
+  while(ok && !finished && !stopping) {
+    size_t length = res.content_length_ > offset ? res.content_length_ - offset : 0;
+    if(!res.content_provider_(offset, length, sink)) {
+      ok = false;
+      break;
+    }
+    if(!chunked && res.content_length_ > 0 && offset >= res.content_length_) finished = true;
+  }
+  if(ok && finished && chunked) ok = send_all(fd, "0\r\n\r\n", 5, stopping);
+  res.content_provider_success_ = ok && finished;
+  complete(Completion{fd, id, string(), close_after || !res.content_provider_success_});
+}
+
+void HttpReactor::complete(Completion completion) {
+  {
+    lock_guard<mutex> lock(completions_mtx);
+    completions.push_back(move(completion));
+  }
+  uint64_t one = 1;
+  if(write(wake_fd, &one, sizeof(one)) < 0) {}
+}
+
+void HttpReactor::resume(Connection& conn) {
+  if(!uring) {
+    on_readable(conn);
+    return;
+  }
+  conn.paused = false;
+  if(!conn.recv_armed && !conn.closing) arm_recv(conn);
+  settle(conn);
+}
+
+void HttpReactor::drain_completions() {
+  vector<Completion> done;
+  {
+    lock_guard<mutex> lock(completions_mtx);
+    done.swap(completions);
+  }
+  for(Completion& c : done) {
+    auto it = connections.find(c.fd);
+    if(it == connections.end() || it->second->id != c.id || it->second->dead) continue;
+    Connection& conn = *it->second;
+    conn.busy = false;
+    conn.active = Clock::now();
+    if(conn.broken) {
+      close_connection(conn.fd);
+      continue;
+    }
+    conn.out += c.out;
+    if(c.close) {
+      conn.closing = true;
+      conn.in.clear();
+      conn.pos = 0;
+      conn.headers_done = false;
+    }
+    if(conn.paused) resume(conn);
+    else settle(conn);
+  }
+}
+
+void HttpReactor::close_idle() {
+  if(idle_timeout_ms == 0) return;
+  Clock::time_point cutoff = Clock::now() - chrono::milliseconds(idle_timeout_ms);
+  vector<int> idle;
+  for(auto& entry : connections) {
+    const Connection& conn = *entry.second;
+    if(!conn.busy && !conn.dead && conn.active < cutoff) idle.push_back(entry.first);
+  }
+  for(int fd : idle) close_connection(fd);
+  idle_closed.fetch_add(idle.size(), memory_order_relaxed);
+}
+
+void HttpReactor::write_metrics(ostream& out) {
+  out << "# TYPE http_connections gauge\n";
+  out << "http_connections " << open_count.load() << "\n";
+  out << "# TYPE http_connections_total counter\n";
+  out << "http_connections_total " << accepted.load() << "\n";
+  out << "# TYPE http_rejected_total counter\n";
+  out << "http_rejected_total " << rejected.load() << "\n";
+  out << "# TYPE http_requests_total counter\n";
+  out << "http_requests_total " << requests.load() << "\n";
+  out << "# TYPE http_idle_closed_total counter\n";
+  out << "http_idle_closed_total " << idle_closed.load() << "\n";
+  out << "# TYPE http_io_uring gauge\n";
+  out << "http_io_uring " << (ring_active ? 1 : 0) << "\n";
+  out << "# TYPE http_io_uring_enters_total counter\n";
+  out << "http_io_uring_enters_total " << ring_enters.load() << "\n";
+}
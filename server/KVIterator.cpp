@@ -0,0 +1,34 @@
+#include "KVIterator.h"
+
+using namespace std;
+
+MergingIterator::MergingIterator(vector<unique_ptr<KVIterator>> children)
+  : children(move(children)) {}
+
+// Smallest key wins; on ties the lowest index (newest child) wins.
+void MergingIterator::pick() {
+  current = -1;
+  for(size_t i=0; i<children.size(); i++) {
+    if(!children[i]->valid()) continue;
+    if(current < 0 || children[i]->key() < children[current]->key()) current = (int)i;
+  }
+}
+
+void MergingIterator::seek_to_first() {
+  for(auto& child : children) child->seek_to_first();
+  pick();
+}
+
+void MergingIterator::seek(const string& target) {
+  for(auto& child : children) child->seek(target);
+  pick();
+}
+
+// Advances every child positioned on the current key, dropping older versions.
+void MergingIterator::next() {
+  string key = children[current]->key();
+  for(auto& child : children) {
+    if(child->valid() && child->key() == key) child->next();
+  }
+  pick();
+}
@@ -0,0 +1,335 @@
+#include "KeyService.h"
+
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include "Deadline.h"
+
+using namespace std;
+
+#define EXPIRY_SWEEP_MS 100
+#define EXPIRY_SWEEP_BATCH 1000
+#define EXPIRY_SWEEP_TIMEOUT_MS 1000
+
+KeyService::KeyService(StorageBackend& store, Cache& cache, bool cache_authoritative,
+  CacheCoherence* coherence, ChangeLog* changes, int batch_inflight, size_t batch_max, int batch_window_us)
+  : store(store), cache(cache), cache_authoritative(cache_authoritative), coherence(coherence), changes(changes),
+    misses([this](const vector<string>& keys) { return fetch(keys); },
+      coherence ? nullptr : &cache, batch_inflight, batch_max, batch_window_us) {
+  sweeper = thread(&KeyService::sweep_loop, this);
+}
+
+KeyService::~KeyService() {
+  {
+    lock_guard<mutex> lock(sweeper_mtx);
+    stopping = true;
+  }
+  sweeper_cv.notify_all();
+  sweeper.join();
+}
+
+int64_t KeyService::now_ms() {
+  return chrono::duration_cast<chrono::milliseconds>(deadline::Clock::now().time_since_epoch()).count();
+}
+
+mutex& KeyService::stripe(const string& key) {
+  return stripes[hash<string>()(key) % STRIPES];
+}
+
+vector<unique_lock<mutex>> KeyService::lock_many(const vector<string>& keys) {
+  vector<size_t> indexes;
+  indexes.reserve(keys.size());
+  for(const string& key : keys) indexes.push_back(hash<string>()(key) % STRIPES);
+  sort(indexes.begin(), indexes.end());
+  indexes.erase(unique(indexes.begin(), indexes.end()), indexes.end());
+  vector<unique_lock<mutex>> locks;
+  locks.reserve(indexes.size());
+  for(size_t i : indexes) locks.emplace_back(stripes[i]);
+  return locks;
+}
+
+// With a coherent cache, fills skip keys another instance wrote meanwhile.
+unordered_map<string, string> KeyService::fetch(const vector<string>& keys) {
+  if(!coherence) return store.get_many(keys);
+  uint64_t since = coherence->sequence();
+  unordered_map<string, string> rows = store.get_many(keys);
+  coherence->fill(rows, since);
+  return rows;
+}
+
+bool KeyService::due(const string& key) {
+  lock_guard<mutex> lock(expiry_mtx);
+  auto it = expiry.find(key);
+  return it != expiry.end() && it->second <= now_ms();
+}
+
+void KeyService::drop_expiry(const string& key) {
+  if(expiring.load(memory_order_relaxed) == 0) return;
+  lock_guard<mutex> lock(expiry_mtx);
+  auto it = expiry.find(key);
+  if(it == expiry.end()) return;
+  expiry_order.erase({it->second, key});
+  expiry.erase(it);
+  expiring.fetch_sub(1);
+}
+
+void KeyService::drop_expiry(const vector<string>& keys) {
+  if(expiring.load(memory_order_relaxed) == 0) return;
+  for(const string& key : keys) drop_expiry(key);
+}
+
+void KeyService::put_flags(const string& key, uint32_t flags) {
+  if(flags == 0 && flagged.load(memory_order_relaxed) == 0) return;
+  lock_guard<mutex> lock(flags_mtx);
+  if(flags != 0) client_flags[key] = flags;
+  else client_flags.erase(key);
+  flagged.store(client_flags.size(), memory_order_relaxed);
+}
+
+uint32_t KeyService::flags_of(const string& key) {
+  if(flagged.load(memory_order_relaxed) == 0) return 0;
+  lock_guard<mutex> lock(flags_mtx);
+  auto it = client_flags.find(key);
+  return it == client_flags.end() ? 0 : it->second;
+}
+
+bool KeyService::tracks(const string& key) {
+  if(expiring.load(memory_order_relaxed) > 0) {
+    lock_guard<mutex> lock(expiry_mtx);
+    if(expiry.count(key)) return true;
+  }
+  return flags_of(key) != 0;
+}
+
+void KeyService::forget(const vector<string>& keys) {
+  if(keys.empty()) return;
+  auto locks = lock_many(keys);
+  drop_expiry(keys);
+  for(const string& key : keys) put_flags(key, 0);
+}
+
+bool KeyService::remove_locked(const string& key) {
+  bool existed = store.remove(key);
+  if(existed) {
+    if(!cache_authoritative) cache.delete_(key);
+    if(changes) changes->append(true, key, "");
+  }
+  drop_expiry(key);
+  put_flags(key, 0);
+  return existed;
+}
+
+bool KeyService::expire_now(const string& key) {
+  lock_guard<mutex> order(stripe(key));
+  if(!due(key)) return false;
+  remove_locked(key);
+  expired.fetch_add(1, memory_order_relaxed);
+  return true;
+}
+
+pair<bool, string> KeyService::read_locked(const string& key) {
+  if(expiring.load(memory_order_relaxed) > 0 && due(key)) {
+    remove_locked(key);
+    expired.fetch_add(1, memory_order_relaxed);
+    return {false, ""};
+  }
+  pair<bool, string> result = cache.get(key);
+  if(!result.first && !cache_authoritative) result = misses.get(key);
+  return result;
+}
+
+void KeyService::sweep_loop() {
+  unique_lock<mutex> lock(sweeper_mtx);
+  while(!stopping) {
+    sweeper_cv.wait_for(lock, chrono::milliseconds(EXPIRY_SWEEP_MS));
+    if(stopping || expiring.load() == 0) continue;
+    vector<string> keys;
+    {
+      lock_guard<mutex> expiry_lock(expiry_mtx);
+      int64_t now = now_ms();
+      for(auto it = expiry_order.begin(); it != expiry_order.end() && it->first <= now && keys.size() < EXPIRY_SWEEP_BATCH; ++it) {
+        keys.push_back(it->second);
+      }
+    }
+    lock.unlock();
+    // A key the store fails to remove keeps its expiry for the next sweep.
+    deadline::Scope scope(deadline::Clock::now() + chrono::milliseconds(EXPIRY_SWEEP_TIMEOUT_MS));
+    for(const string& key : keys) {
+      try {
+        expire_now(key);
+      } catch(const Exception_&) {
+        break;
+      }
+    }
+    lock.lock();
+  }
+}
+
+pair<bool, string> KeyService::get(const string& key) {
+  if(expiring.load(memory_order_relaxed) > 0 && due(key) && expire_now(key)) return {false, ""};
+  pair<bool, string> result = cache.get(key);
+  if(!result.first && !cache_authoritative) result = misses.get(key);
+  return result;
+}
+
+void KeyService::set(const string& key, const string& value, uint32_t flags, long long ttl_ms) {
+  lock_guard<mutex> order(stripe(key));
+  set_locked(key, value, flags, ttl_ms);
+}
+
+// The expiry is set under the stripe with the value, so the key is never
+// readable without it.
+void KeyService::set_locked(const string& key, const string& value, uint32_t flags, long long ttl_ms) {
+  if(ttl_ms < 0 && ttl_ms != KEEP_TTL) {
+    remove_locked(key);
+    return;
+  }
+  uint64_t since = coherence ? coherence->sequence() : 0;
+  store.set(key, value);
+  if(coherence) coherence->fill(key, value, since);
+  else if(!cache_authoritative) cache.set(key, value);
+  if(changes) changes->append(false, key, value);
+  if(ttl_ms > 0) put_expiry(key, now_ms() + ttl_ms);
+  else if(ttl_ms == 0) drop_expiry(key);
+  put_flags(key, flags);
+}
+
+bool KeyService::remove(const string& key) {
+  lock_guard<mutex> order(stripe(key));
+  return remove_locked(key);
+}
+
+// Cache hits are taken bucket by bucket; all misses go to the store in one
+// get_many (one ANY($1) query per shard), bypassing the miss batcher.
+unordered_map<string, string> KeyService::get_many(const vector<string>& keys) {
+  if(expiring.load(memory_order_relaxed) > 0) {
+    for(const string& key : keys) {
+      if(due(key)) expire_now(key);
+    }
+  }
+  unordered_map<string, string> found;
+  cache.get_many(keys, found);
+  if(cache_authoritative || found.size() == keys.size()) return found;
+
+  vector<string> missed;
+  for(const string& key : keys) {
+    if(!found.count(key)) missed.push_back(key);
+  }
+  sort(missed.begin(), missed.end());
+  missed.erase(unique(missed.begin(), missed.end()), missed.end());
+  if(missed.empty()) return found;
+  unordered_map<string, string> rows = fetch(missed);
+  if(!coherence) cache.set_many(rows);
+  found.insert(rows.begin(), rows.end());
+  return found;
+}
+
+void KeyService::set_many(const unordered_map<string, string>& entries) {
+  vector<pair<string, string>> sets(entries.begin(), entries.end());
+  vector<string> keys;
+  keys.reserve(sets.size());
+  for(const auto& entry : sets) keys.push_back(entry.first);
+
+  vector<unique_lock<mutex>> order = lock_many(keys);
+  uint64_t since = coherence ? coherence->sequence() : 0;
+  store.write_batch(sets, {});
+  if(coherence) coherence->fill(entries, since);
+  else if(!cache_authoritative) cache.set_many(entries);
+  if(changes) {
+    for(const auto& entry : sets) changes->append(false, entry.first, entry.second);
+  }
+  drop_expiry(keys);
+  for(const string& key : keys) put_flags(key, 0);
+}
+
+// Absent keys are not told apart: every key is gone afterwards.
+void KeyService::remove_many(const vector<string>& keys) {
+  vector<unique_lock<mutex>> order = lock_many(keys);
+  store.write_batch({}, keys);
+  for(const string& key : keys) {
+    if(!cache_authoritative) cache.delete_(key);
+    if(changes) changes->append(true, key, "");
+  }
+  drop_expiry(keys);
+  for(const string& key : keys) put_flags(key, 0);
+}
+
+// FNV-1a.
+uint64_t KeyService::version_of(const string& value) {
+  uint64_t h = 14695981039346656037ULL;
+  for(unsigned char c : value) {
+    h ^= c;
+    h *= 1099511628211ULL;
+  }
+  return h ? h : 1;
+}
+
+KeyService::Outcome KeyService::set_if(const string& key, const string& value, Condition condition, uint64_t version,
+    uint32_t flags, long long ttl_ms) {
+  lock_guard<mutex> order(stripe(key));
+  pair<bool, string> current = read_locked(key);
+  if(condition == IF_ABSENT && current.first) return FAILED;
+  if(condition != IF_ABSENT && !current.first) return MISSING;
+  if(condition == IF_VERSION && version_of(current.second) != version) return FAILED;
+  set_locked(key, value, flags, ttl_ms);
+  return WRITTEN;
+}
+
+KeyService::Outcome KeyService::remove_if(const string& key, uint64_t version) {
+  lock_guard<mutex> order(stripe(key));
+  pair<bool, string> current = read_locked(key);
+  if(!current.first) return MISSING;
+  if(version_of(current.second) != version) return FAILED;
+  remove_locked(key);
+  return WRITTEN;
+}
+
+// Existence and the expiry change are decided under the key's stripe, so a
+// concurrent delete cannot leave an expiry behind on a missing key.
+bool KeyService::expire(const string& key, long long ms) {
+  lock_guard<mutex> order(stripe(key));
+  if(!read_locked(key).first) return false;
+  if(ms <= 0) {
+    remove_locked(key);
+    return true;
+  }
+  put_expiry(key, now_ms() + ms);
+  return true;
+}
+
+void KeyService::put_expiry(const string& key, int64_t at) {
+  lock_guard<mutex> lock(expiry_mtx);
+  auto it = expiry.find(key);
+  if(it != expiry.end()) {
+    expiry_order.erase({it->second, key});
+    it->second = at;
+  } else {
+    expiry.emplace(key, at);
+    expiring.fetch_add(1);
+  }
+  expiry_order.emplace(at, key);
+}
+
+bool KeyService::persist(const string& key) {
+  lock_guard<mutex> order(stripe(key));
+  if(!read_locked(key).first) return false;
+  drop_expiry(key);
+  return true;
+}
+
+long long KeyService::ttl(const string& key) {
+  lock_guard<mutex> order(stripe(key));
+  if(!read_locked(key).first) return -2;
+  lock_guard<mutex> lock(expiry_mtx);
+  auto it = expiry.find(key);
+  if(it == expiry.end()) return -1;
+  return max<int64_t>(0, it->second - now_ms());
+}
+
+void KeyService::write_metrics(ostream& out) {
+  misses.write_metrics(out);
+  out << "# TYPE keys_expiring gauge\n";
+  out << "keys_expiring " << expiring.load() << "\n";
+  out << "# TYPE keys_expired_total counter\n";
+  out << "keys_expired_total " << expired.load() << "\n";
+}
@@ -0,0 +1,529 @@
+#include "LSMBackend.h"
+#include "FileUtil.h"
+#include "Crc32.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define MEMTABLE_BYTES (4 << 20)
+#define WAL_GROUP_BYTES (1 << 20)
+#define WAL_HEADER_SIZE 13
+#define L0_COMPACT_TRIGGER 4
+#define L0_STOP_TRIGGER 12
+#define LEVEL1_BYTES (10ULL << 20)
+#define LEVEL_MULTIPLIER 10
+#define TARGET_FILE_BYTES (2ULL << 20)
+
+template <typename T>
+static void put(string& out, T v) {
+  out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+template <typename T>
+static T take(const char* p) {
+  T v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint64_t level_budget(int level) {
+  uint64_t budget = LEVEL1_BYTES;
+  for(int i=1; i<level; i++) budget *= LEVEL_MULTIPLIER;
+  return budget;
+}
+
+static uint64_t level_bytes(const vector<shared_ptr<SSTable>>& files) {
+  uint64_t total = 0;
+  for(const shared_ptr<SSTable>& f : files) total += f->file_size();
+  return total;
+}
+
+static bool overlaps(const SSTable& f, const string& lo, const string& hi) {
+  return !(f.largest() < lo || hi < f.smallest());
+}
+
+LSMBackend::LSMBackend(const string& dir, bool sync) : dir(dir), sync(sync) {
+  fileutil::make_dirs(dir);
+  recover();
+  bg = thread(&LSMBackend::background_loop, this);
+}
+
+LSMBackend::~LSMBackend() {
+  {
+    lock_guard<mutex> lock(mtx);
+    stopping = true;
+  }
+  bg_cv.notify_all();
+  if(bg.joinable()) bg.join();
+  // The live memtable stays in its WAL and is replayed on the next open.
+  if(wal_fd >= 0) ::close(wal_fd);
+}
+
+string LSMBackend::file_path(uint64_t number, const char* ext) const {
+  return dir + "/" + to_string(number) + ext;
+}
+
+void LSMBackend::recover() {
+  string manifest = dir + "/MANIFEST";
+  shared_ptr<Version> v = make_shared<Version>();
+  uint64_t max_seen = 0;
+  vector<uint64_t> referenced;
+
+  if(fileutil::exists(manifest)) {
+    string text = fileutil::read_file(manifest);
+    size_t pos = 0;
+    while(pos < text.size()) {
+      size_t eol = text.find('\n', pos);
+      if(eol == string::npos) eol = text.size();
+      string line = text.substr(pos, eol - pos);
+      pos = eol + 1;
+      if(line.empty()) continue;
+      size_t space = line.find(' ');
+      if(space == string::npos) throw Exception_("LSM", "Corrupt MANIFEST line: " + line, 500);
+      string tag = line.substr(0, space);
+      uint64_t number = stoull(line.substr(space + 1));
+      if(tag == "log") {
+        manifest_log = number;
+      } else {
+        int level = stoi(tag);
+        if(level < 0 || level >= LEVELS) throw Exception_("LSM", "Corrupt MANIFEST line: " + line, 500);
+        v->files[level].push_back(SSTable::open(file_path(number, ".sst"), number));
+        referenced.push_back(number);
+      }
+      max_seen = max(max_seen, number);
+    }
+  }
+
+  // Drop tables left behind by an interrupted flush or compaction, and find
+  // the WALs that still hold unflushed writes.
+  vector<uint64_t> wals;
+  for(const string& name : fileutil::list_dir(dir)) {
+    size_t dot = name.find('.');
+    if(dot == string::npos || dot == 0 || !isdigit((unsigned char)name[0])) continue;
+    uint64_t number = stoull(name.substr(0, dot));
+    string ext = name.substr(dot);
+    max_seen = max(max_seen, number);
+    if(ext == ".sst" && find(referenced.begin(), referenced.end(), number) == referenced.end()) {
+      ::unlink((dir + "/" + name).c_str());
+    } else if(ext == ".wal") {
+      if(number >= manifest_log) wals.push_back(number);
+      else ::unlink((dir + "/" + name).c_str());
+    }
+  }
+  sort(wals.begin(), wals.end());
+  next_file = max_seen + 1;
+
+  shared_ptr<MemTable> replayed = make_shared<MemTable>();
+  for(uint64_t number : wals) replay_wal(file_path(number, ".wal"), *replayed);
+  if(replayed->entries() > 0) {
+    unique_ptr<KVIterator> it = replayed->iterator();
+    it->seek_to_first();
+    shared_ptr<SSTable> table = write_table(*it, next_file++, false, UINT64_MAX);
+    if(table) v->files[0].insert(v->files[0].begin(), table);
+  }
+
+  open_wal();
+  manifest_log = wal_number;
+  write_manifest(*v, manifest_log);
+  for(uint64_t number : wals) ::unlink(file_path(number, ".wal").c_str());
+  version = v;
+  mem = make_shared<MemTable>();
+}
+
+void LSMBackend::replay_wal(const string& path, MemTable& target) {
+  string data = fileutil::read_file(path);
+  size_t pos = 0;
+  // A torn record at the tail is an unacknowledged write; stop there.
+  while(pos + WAL_HEADER_SIZE <= data.size()) {
+    const char* p = data.data() + pos;
+    uint32_t crc = take<uint32_t>(p);
+    uint32_t klen = take<uint32_t>(p + 4);
+    uint32_t vlen = take<uint32_t>(p + 8);
+    bool tombstone = p[12] != 0;
+    size_t body = (size_t)klen + vlen;
+    if(pos + WAL_HEADER_SIZE + body > data.size()) break;
+    if(crc32(p + 4, WAL_HEADER_SIZE - 4 + body) != crc) break;
+    target.add(++seq, string(p + WAL_HEADER_SIZE, klen), string(p + WAL_HEADER_SIZE + klen, vlen), tombstone);
+    pos += WAL_HEADER_SIZE + body;
+  }
+}
+
+void LSMBackend::open_wal() {
+  uint64_t number = next_file++;
+  string path = file_path(number, ".wal");
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if(fd < 0) throw Exception_("LSM", "Fail to create " + path + ": " + strerror(errno), 500);
+  fileutil::sync_dir(dir);
+  if(wal_fd >= 0) ::close(wal_fd);
+  wal_fd = fd;
+  wal_number = number;
+}
+
+void LSMBackend::write_manifest(const Version& v, uint64_t log_number) {
+  string text = "log " + to_string(log_number) + "\n";
+  for(int level=0; level<LEVELS; level++) {
+    for(const shared_ptr<SSTable>& f : v.files[level]) {
+      text += to_string(level) + " " + to_string(f->file_number()) + "\n";
+    }
+  }
+  fileutil::write_file_atomic(dir + "/MANIFEST", text);
+}
+
+shared_ptr<SSTable> LSMBackend::write_table(KVIterator& it, uint64_t number, bool drop_tombstones,
+  uint64_t max_bytes) {
+  string path = file_path(number, ".sst");
+  {
+    SSTableBuilder builder(path);
+    for(; it.valid() && builder.file_size() < max_bytes; it.next()) {
+      if(drop_tombstones && it.tombstone()) continue;
+      builder.add(it.key(), it.value(), it.tombstone());
+    }
+    if(builder.entries() == 0) return nullptr;  // the builder unlinks the empty file
+    builder.finish();
+  }
+  return SSTable::open(path, number);
+}
+
+void LSMBackend::write(const string& key, const string& value, bool tombstone) {
+  Writer w(key, value, tombstone);
+  unique_lock<mutex> lock(mtx);
+  writers.push_back(&w);
+  while(!w.done && &w != writers.front()) w.cv.wait(lock);
+  if(w.done) {
+    if(!w.error.empty()) throw Exception_("LSM", w.error, 500);
+    return;
+  }
+
+  // Leader: commit the queued writes with one WAL append and one sync.
+  string error;
+  vector<Writer*> group;
+  try {
+    make_room(lock);
+  } catch(const Exception_& e) {
+    error = e.what();
+  }
+
+  string batch;
+  if(error.empty()) {
+    for(Writer* other : writers) {
+      if(!group.empty() && batch.size() >= WAL_GROUP_BYTES) break;
+      const string& v = other->value;
+      size_t start = batch.size();
+      put<uint32_t>(batch, 0);
+      put<uint32_t>(batch, (uint32_t)other->key.size());
+      put<uint32_t>(batch, (uint32_t)v.size());
+      batch.push_back(other->tombstone ? 1 : 0);
+      batch += other->key;
+      batch += v;
+      uint32_t crc = crc32(batch.data() + start + 4, batch.size() - start - 4);
+      memcpy(&batch[start], &crc, sizeof(crc));
+      group.push_back(other);
+    }
+  } else {
+    group.push_back(&w);
+  }
+
+  if(error.empty()) {
+    shared_ptr<MemTable> target = mem;
+    int fd = wal_fd;
+    uint64_t base = seq;
+    seq += group.size();
+    lock.unlock();
+    try {
+      fileutil::write_all(fd, batch.data(), batch.size(), "WAL");
+      if(sync && ::fdatasync(fd) != 0) throw Exception_("LSM", string("Fail to sync WAL: ") + strerror(errno), 500);
+      if(sync) wal_syncs.fetch_add(1, memory_order_relaxed);
+      for(size_t i=0; i<group.size(); i++) {
+        target->add(base + i + 1, group[i]->key, group[i]->value, group[i]->tombstone);
+      }
+      wal_records.fetch_add(group.size(), memory_order_relaxed);
+    } catch(const Exception_& e) {
+      error = e.what();
+    }
+    lock.lock();
+  }
+
+  for(Writer* done : group) {
+    writers.pop_front();
+    if(done == &w) continue;
+    done->error = error;
+    done->done = true;
+    done->cv.notify_one();
+  }
+  if(!writers.empty()) writers.front()->cv.notify_one();
+  if(!error.empty()) throw Exception_("LSM", error, 500);
+}
+
+void LSMBackend::make_room(unique_lock<mutex>& lock) {
+  for(;;) {
+    if(!bg_error.empty()) {
+      throw Exception_("LSM", "Background error: " + bg_error, 500);
+    } else if(version->files[0].size() >= L0_STOP_TRIGGER) {
+      room_cv.wait(lock);
+    } else if(mem->memory() < MEMTABLE_BYTES) {
+      return;
+    } else if(imm) {
+      room_cv.wait(lock);
+    } else {
+      open_wal();
+      imm = mem;
+      mem = make_shared<MemTable>();
+      bg_cv.notify_one();
+    }
+  }
+}
+
+void LSMBackend::background_loop() {
+  unique_lock<mutex> lock(mtx);
+  while(!stopping) {
+    if(!bg_error.empty()) {
+      bg_cv.wait(lock);
+      continue;
+    }
+    int level = -1;
+    bool flush = imm != nullptr;
+    if(!flush) level = pick_compaction(*version);
+    if(!flush && level < 0) {
+      bg_cv.wait(lock);
+      continue;
+    }
+    lock.unlock();
+    try {
+      if(flush) flush_imm();
+      else compact(level);
+    } catch(const exception& e) {
+      lock.lock();
+      bg_error = e.what();
+      room_cv.notify_all();
+      continue;
+    }
+    lock.lock();
+  }
+}
+
+// Only the background thread replaces the version, so it can build the next
+// one and write the MANIFEST without holding the lock.
+void LSMBackend::install(shared_ptr<const Version> v) {
+  write_manifest(*v, manifest_log);
+  lock_guard<mutex> lock(mtx);
+  version = v;
+  room_cv.notify_all();
+}
+
+void LSMBackend::flush_imm() {
+  shared_ptr<MemTable> source;
+  shared_ptr<const Version> current;
+  uint64_t number, log;
+  {
+    lock_guard<mutex> lock(mtx);
+    source = imm;
+    current = version;
+    number = next_file++;
+    log = wal_number;
+  }
+
+  unique_ptr<KVIterator> it = source->iterator();
+  it->seek_to_first();
+  shared_ptr<SSTable> table = write_table(*it, number, false, UINT64_MAX);
+
+  shared_ptr<Version> v = make_shared<Version>(*current);
+  if(table) v->files[0].insert(v->files[0].begin(), table);
+  uint64_t old_log = manifest_log;
+  manifest_log = log;
+  write_manifest(*v, manifest_log);
+  {
+    lock_guard<mutex> lock(mtx);
+    version = v;
+    imm.reset();
+  }
+  room_cv.notify_all();
+  for(uint64_t n=old_log; n<log; n++) ::unlink(file_path(n, ".wal").c_str());
+  flushes.fetch_add(1, memory_order_relaxed);
+}
+
+int LSMBackend::pick_compaction(const Version& v) const {
+  if(v.files[0].size() >= L0_COMPACT_TRIGGER) return 0;
+  for(int level=1; level<LEVELS-1; level++) {
+    if(level_bytes(v.files[level]) > level_budget(level)) return level;
+  }
+  return -1;
+}
+
+void LSMBackend::compact(int level) {
+  shared_ptr<const Version> current;
+  {
+    lock_guard<mutex> lock(mtx);
+    current = version;
+  }
+
+  vector<shared_ptr<SSTable>> inputs;
+  if(level == 0) {
+    inputs = current->files[0];
+  } else {
+    const vector<shared_ptr<SSTable>>& files = current->files[level];
+    // Round-robin through the level so every key range gets compacted.
+    inputs.push_back(files[compact_pointer[level]++ % files.size()]);
+  }
+  string lo = inputs[0]->smallest(), hi = inputs[0]->largest();
+  for(const shared_ptr<SSTable>& f : inputs) {
+    lo = min(lo, f->smallest());
+    hi = max(hi, f->largest());
+  }
+  vector<shared_ptr<SSTable>> lower;
+  for(const shared_ptr<SSTable>& f : current->files[level + 1]) {
+    if(overlaps(*f, lo, hi)) lower.push_back(f);
+  }
+  bool bottom = true;
+  for(int deeper=level + 2; deeper<LEVELS && bottom; deeper++) {
+    for(const shared_ptr<SSTable>& f : current->files[deeper]) {
+      if(overlaps(*f, lo, hi)) {
+        bottom = false;
+        break;
+      }
+    }
+  }
+
+  vector<unique_ptr<KVIterator>> children;
+  uint64_t input_bytes = 0;
+  for(const shared_ptr<SSTable>& f : inputs) {
+    children.push_back(f->iterator());
+    input_bytes += f->file_size();
+  }
+  for(const shared_ptr<SSTable>& f : lower) {
+    children.push_back(f->iterator());
+    input_bytes += f->file_size();
+  }
+  MergingIterator it(move(children));
+  it.seek_to_first();
+
+  vector<shared_ptr<SSTable>> outputs;
+  while(it.valid()) {
+    uint64_t number;
+    {
+      lock_guard<mutex> lock(mtx);
+      number = next_file++;
+    }
+    shared_ptr<SSTable> table = write_table(it, number, bottom, TARGET_FILE_BYTES);
+    if(table) outputs.push_back(table);
+  }
+
+  shared_ptr<Version> v = make_shared<Version>(*current);
+  auto removed = [&](const shared_ptr<SSTable>& f) {
+    return find(inputs.begin(), inputs.end(), f) != inputs.end() ||
+      find(lower.begin(), lower.end(), f) != lower.end();
+  };
+  for(int l : {level, level + 1}) {
+    vector<shared_ptr<SSTable>>& files = v->files[l];
+    files.erase(remove_if(files.begin(), files.end(), removed), files.end());
+  }
+  vector<shared_ptr<SSTable>>& target = v->files[level + 1];
+  target.insert(target.end(), outputs.begin(), outputs.end());
+  sort(target.begin(), target.end(), [](const shared_ptr<SSTable>& a, const shared_ptr<SSTable>& b) {
+    return a->smallest() < b->smallest();
+  });
+
+  install(v);
+  for(const shared_ptr<SSTable>& f : inputs) f->mark_obsolete();
+  for(const shared_ptr<SSTable>& f : lower) f->mark_obsolete();
+  compactions.fetch_add(1, memory_order_relaxed);
+  compaction_bytes.fetch_add(input_bytes, memory_order_relaxed);
+}
+
+void LSMBackend::snapshot(shared_ptr<MemTable>& m, shared_ptr<MemTable>& im,
+  shared_ptr<const Version>& v) {
+  lock_guard<mutex> lock(mtx);
+  m = mem;
+  im = imm;
+  v = version;
+}
+
+pair<bool, string> LSMBackend::get(const string& key) {
+  shared_ptr<MemTable> m, im;
+  shared_ptr<const Version> v;
+  snapshot(m, im, v);
+
+  string value;
+  bool tombstone = false;
+  if(m->get(key, value, tombstone) || (im && im->get(key, value, tombstone))) {
+    return tombstone ? make_pair(false, string()) : make_pair(true, value);
+  }
+  for(const shared_ptr<SSTable>& f : v->files[0]) {
+    if(f->get(key, value, tombstone)) return tombstone ? make_pair(false, string()) : make_pair(true, value);
+  }
+  for(int level=1; level<LEVELS; level++) {
+    const vector<shared_ptr<SSTable>>& files = v->files[level];
+    auto it = lower_bound(files.begin(), files.end(), key, [](const shared_ptr<SSTable>& f, const string& k) {
+      return f->largest() < k;
+    });
+    if(it == files.end() || key < (*it)->smallest()) continue;
+    if((*it)->get(key, value, tombstone)) return tombstone ? make_pair(false, string()) : make_pair(true, value);
+  }
+  return make_pair(false, string());
+}
+
+bool LSMBackend::set(const string& key, const string& value) {
+  write(key, value, false);
+  return true;
+}
+
+bool LSMBackend::remove(const string& key) {
+  // Existence is checked before the tombstone is logged, so a racing set of
+  // the same key may report the wrong result but never loses the delete.
+  bool existed = get(key).first;
+  write(key, string(), true);
+  return existed;
+}
+
+vector<pair<string, string>> LSMBackend::scan(const string& start, size_t limit) {
+  shared_ptr<MemTable> m, im;
+  shared_ptr<const Version> v;
+  snapshot(m, im, v);
+
+  vector<unique_ptr<KVIterator>> children;
+  children.push_back(m->iterator());
+  if(im) children.push_back(im->iterator());
+  for(int level=0; level<LEVELS; level++) {
+    for(const shared_ptr<SSTable>& f : v->files[level]) {
+      if(!(f->largest() < start)) children.push_back(f->iterator());
+    }
+  }
+  MergingIterator it(move(children));
+  vector<pair<string, string>> out;
+  for(it.seek(start); it.valid() && out.size() < limit; it.next()) {
+    if(!it.tombstone()) out.emplace_back(it.key(), it.value());
+  }
+  return out;
+}
+
+void LSMBackend::write_metrics(ostream& out) {
+  shared_ptr<MemTable> m, im;
+  shared_ptr<const Version> v;
+  snapshot(m, im, v);
+
+  out << "# TYPE lsm_wal_records_total counter\n";
+  out << "lsm_wal_records_total " << wal_records.load() << "\n";
+  out << "# TYPE lsm_wal_syncs_total counter\n";
+  out << "lsm_wal_syncs_total " << wal_syncs.load() << "\n";
+  out << "# TYPE lsm_flushes_total counter\n";
+  out << "lsm_flushes_total " << flushes.load() << "\n";
+  out << "# TYPE lsm_compactions_total counter\n";
+  out << "lsm_compactions_total " << compactions.load() << "\n";
+  out << "# TYPE lsm_compaction_bytes_total counter\n";
+  out << "lsm_compaction_bytes_total " << compaction_bytes.load() << "\n";
+  out << "# TYPE lsm_memtable_bytes gauge\n";
+  out << "lsm_memtable_bytes " << (m->memory() + (im ? im->memory() : 0)) << "\n";
+  out << "# TYPE lsm_level_files gauge\n";
+  for(int level=0; level<LEVELS; level++) {
+    out << "lsm_level_files{level=\"" << level << "\"} " << v->files[level].size() << "\n";
+  }
+  out << "# TYPE lsm_level_bytes gauge\n";
+  for(int level=0; level<LEVELS; level++) {
+    out << "lsm_level_bytes{level=\"" << level << "\"} " << level_bytes(v->files[level]) << "\n";
+  }
+}
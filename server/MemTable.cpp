@@ -0,0 +1,63 @@
+#include "MemTable.h"
+
+using namespace std;
+
+#define MEMTABLE_ENTRY_OVERHEAD 64
+
+void MemTable::add(uint64_t seq, const string& key, const string& value, bool tombstone) {
+  Entry entry;
+  entry.key = key;
+  entry.seq = seq;
+  entry.tombstone = tombstone;
+  if(!tombstone) entry.value = value;
+  list.insert(entry);
+  bytes.fetch_add(key.size() + value.size() + MEMTABLE_ENTRY_OVERHEAD, memory_order_relaxed);
+  count.fetch_add(1, memory_order_relaxed);
+}
+
+bool MemTable::get(const string& key, string& value, bool& tombstone) const {
+  Entry probe;
+  probe.key = key;
+  probe.seq = UINT64_MAX;
+  SkipList<Entry, Compare>::Iterator it(&list);
+  it.seek(probe);
+  if(!it.valid() || it.key().key != key) return false;
+  tombstone = it.key().tombstone;
+  if(!tombstone) value = it.key().value;
+  return true;
+}
+
+// Yields only the newest entry of each key.
+class MemTable::Iterator : public KVIterator {
+private:
+  shared_ptr<const MemTable> table;
+  SkipList<Entry, Compare>::Iterator it;
+
+public:
+  explicit Iterator(shared_ptr<const MemTable> table) : table(table), it(&table->list) {}
+
+  bool valid() const override { return it.valid(); }
+  void seek_to_first() override { it.seek_to_first(); }
+
+  void seek(const string& target) override {
+    Entry probe;
+    probe.key = target;
+    probe.seq = UINT64_MAX;
+    it.seek(probe);
+  }
+
+  void next() override {
+    const string current = it.key().key;
+    do {
+      it.next();
+    } while(it.valid() && it.key().key == current);
+  }
+
+  const string& key() const override { return it.key().key; }
+  const string& value() const override { return it.key().value; }
+  bool tombstone() const override { return it.key().tombstone; }
+};
+
+unique_ptr<KVIterator> MemTable::iterator() const {
+  return unique_ptr<KVIterator>(new Iterator(shared_from_this()));
+}
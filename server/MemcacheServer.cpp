@@ -0,0 +1,490 @@
+#include "MemcacheServer.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <ctime>
+#include <chrono>
+#include <algorithm>
+#include "Deadline.h"
+
+using namespace std;
+
+#define MEMCACHE_MAX_LINE 65536
+#define MEMCACHE_MAX_KEY 250
+#define MEMCACHE_MAX_ITEM (1LL << 20)
+#define MEMCACHE_VERSION "1.6.21"
+// Expiry times beyond 30 days are unix times, as in memcached.
+#define MEMCACHE_RELATIVE_MAX 2592000LL
+#define MEMCACHE_MAX_TTL_S (1LL << 40)
+
+static void tokenize(const string& in, size_t from, size_t to, vector<string>& tokens) {
+  tokens.clear();
+  while(from < to) {
+    while(from < to && in[from] == ' ') from++;
+    size_t at = from;
+    while(at < to && in[at] != ' ') at++;
+    if(at > from) tokens.emplace_back(in, from, at - from);
+    from = at;
+  }
+}
+
+static bool parse_uint(const string& s, unsigned long long& value) {
+  if(s.empty() || s[0] == '-' || s[0] == '+') return false;
+  char* end;
+  errno = 0;
+  value = strtoull(s.c_str(), &end, 10);
+  return errno == 0 && *end == '\0';
+}
+
+// memcached expiry: 0 never, negative already expired, up to 30 days seconds
+// from now, beyond that a unix time. `ms` is 0 for none, -1 when expired.
+static bool parse_exptime(const string& s, long long& ms) {
+  if(s.empty()) return false;
+  char* end;
+  errno = 0;
+  long long t = strtoll(s.c_str(), &end, 10);
+  if(errno != 0 || *end != '\0' || t > MEMCACHE_MAX_TTL_S) return false;
+  if(t > MEMCACHE_RELATIVE_MAX) t -= time(nullptr);
+  else if(t == 0) {
+    ms = 0;
+    return true;
+  }
+  ms = t > 0 ? t * 1000 : -1;
+  return true;
+}
+
+static bool valid_key(const string& key) {
+  if(key.empty() || key.size() > MEMCACHE_MAX_KEY) return false;
+  for(char c : key) if((unsigned char)c <= ' ' || c == 0x7f) return false;
+  return true;
+}
+
+static bool storage_command(const string& name) {
+  return name == "set" || name == "add" || name == "replace" || name == "append" || name == "prepend";
+}
+
+// Length of the value block following the command line: -1 when it has
+// none, -2 when the line is malformed.
+static long long data_length(const vector<string>& tokens) {
+  const string& name = tokens[0];
+  size_t at;
+  if(storage_command(name)) {
+    if(tokens.size() != 5 && tokens.size() != 6) return -2;
+    at = 4;
+  } else if(name == "cas") {
+    if(tokens.size() != 6 && tokens.size() != 7) return -2;
+    at = 4;
+  } else if(name == "ms") {
+    if(tokens.size() < 3) return -2;
+    at = 2;
+  } else {
+    return -1;
+  }
+  unsigned long long n;
+  if(!parse_uint(tokens[at], n) || n > (1ULL << 40)) return -2;
+  return n;
+}
+
+class MemcacheServer::Connection : public TcpServer::Connection {
+private:
+  MemcacheServer& server;
+  std::vector<std::string> tokens;
+  std::string data;
+  // Bytes of a refused value block still to be discarded.
+  size_t skip = 0;
+
+public:
+  explicit Connection(MemcacheServer& server) : server(server) {}
+
+  bool feed(const string& in, size_t& pos, string& out) override {
+    for(;;) {
+      if(skip > 0) {
+        size_t n = min(skip, in.size() - pos);
+        pos += n;
+        skip -= n;
+        if(skip > 0) return true;
+      }
+      if(pos >= in.size()) return true;
+      // Binary protocol request magic.
+      if((unsigned char)in[pos] == 0x80) return false;
+      size_t nl = in.find('\n', pos);
+      if(nl == string::npos) {
+        if(in.size() - pos > MEMCACHE_MAX_LINE) {
+          out += "CLIENT_ERROR line too long\r\n";
+          return false;
+        }
+        return true;
+      }
+      size_t end = nl > pos && in[nl - 1] == '\r' ? nl - 1 : nl;
+      tokenize(in, pos, end, tokens);
+      if(tokens.empty()) {
+        pos = nl + 1;
+        out += "ERROR\r\n";
+        continue;
+      }
+      long long bytes = data_length(tokens);
+      if(bytes == -2) {
+        pos = nl + 1;
+        out += "CLIENT_ERROR bad command line format\r\n";
+        continue;
+      }
+      if(bytes > MEMCACHE_MAX_ITEM) {
+        pos = nl + 1;
+        skip = bytes + 2;
+        server.errors.fetch_add(1, memory_order_relaxed);
+        out += "SERVER_ERROR object too large for cache\r\n";
+        continue;
+      }
+      data.clear();
+      if(bytes >= 0) {
+        size_t from = nl + 1;
+        if(in.size() - from < (size_t)bytes + 2) return true;
+        if(in.compare(from + bytes, 2, "\r\n") != 0) {
+          out += "CLIENT_ERROR bad data chunk\r\n";
+          return false;
+        }
+        data.assign(in, from, bytes);
+        pos = from + bytes + 2;
+      } else {
+        pos = nl + 1;
+      }
+      server.commands.fetch_add(1, memory_order_relaxed);
+      if(!server.execute(tokens, data, out)) return false;
+    }
+  }
+};
+
+MemcacheServer::MemcacheServer(KeyService& keys, int port, int max_clients, int timeout_ms)
+  : keys(keys), timeout_ms(max(0, timeout_ms)),
+    listener("memcache", port, max_clients, "SERVER_ERROR out of connections\r\n",
+      [this]() { return unique_ptr<TcpServer::Connection>(new Connection(*this)); }) {}
+
+void MemcacheServer::apply_ttl(const string& key, long long ms) {
+  if(ms > 0) keys.expire(key, ms);
+  else if(ms < 0) keys.remove(key);
+}
+
+KeyService::Outcome MemcacheServer::modify(const string& key, const function<bool(string&)>& change, long long ttl_ms) {
+  for(;;) {
+    pair<bool, string> current = keys.get(key);
+    if(!current.first) return KeyService::MISSING;
+    uint64_t version = KeyService::version_of(current.second);
+    uint32_t flags = keys.flags_of(key);
+    if(!change(current.second)) return KeyService::FAILED;
+    KeyService::Outcome outcome = keys.set_if(key, current.second, KeyService::IF_VERSION, version, flags, ttl_ms);
+    if(outcome != KeyService::FAILED) return outcome;
+  }
+}
+
+bool MemcacheServer::execute(vector<string>& tokens, const string& data, string& out) {
+  const string name = tokens[0];
+  if(name == "quit") return false;
+  if(name == "version") {
+    out += "VERSION " MEMCACHE_VERSION "\r\n";
+    return true;
+  }
+  if(name == "mn") {
+    out += "MN\r\n";
+    return true;
+  }
+
+  bool noreply = false;
+  if((storage_command(name) || name == "cas" || name == "delete" || name == "touch" || name == "incr"
+      || name == "decr" || name == "verbosity") && tokens.size() > 1 && tokens.back() == "noreply") {
+    noreply = true;
+    tokens.pop_back();
+  }
+  size_t mark = out.size();
+  auto bad_format = [&]() { out += "CLIENT_ERROR bad command line format\r\n"; };
+
+  deadline::Scope scope(timeout_ms > 0 ? deadline::Clock::now() + chrono::milliseconds(timeout_ms)
+    : deadline::Clock::time_point::max());
+  try {
+    if(name == "get" || name == "gets" || name == "gat" || name == "gats") {
+      bool touch = name == "gat" || name == "gats";
+      size_t first = touch ? 2 : 1;
+      long long ms = 0;
+      if(tokens.size() <= first || (touch && !parse_exptime(tokens[1], ms))) {
+        out += "ERROR\r\n";
+        return true;
+      }
+      vector<string> wanted(tokens.begin() + first, tokens.end());
+      for(const string& key : wanted) {
+        if(!valid_key(key)) {
+          bad_format();
+          return true;
+        }
+      }
+      unordered_map<string, string> found = keys.get_many(wanted);
+      bool cas = name == "gets" || name == "gats";
+      for(const string& key : wanted) {
+        auto it = found.find(key);
+        if(it == found.end()) continue;
+        if(touch) {
+          if(ms == 0) keys.persist(key);
+          else apply_ttl(key, ms);
+        }
+        out += "VALUE " + key + " " + to_string(keys.flags_of(key)) + " " + to_string(it->second.size());
+        if(cas) out += " " + to_string(KeyService::version_of(it->second));
+        out += "\r\n";
+        out += it->second;
+        out += "\r\n";
+      }
+      out += "END\r\n";
+    } else if(storage_command(name) || name == "cas") {
+      unsigned long long flags, version = 0;
+      long long ms;
+      if(tokens.size() != (name == "cas" ? 6u : 5u) || !valid_key(tokens[1]) || !parse_uint(tokens[2], flags)
+          || flags > 0xFFFFFFFFULL || !parse_exptime(tokens[3], ms) || (name == "cas" && !parse_uint(tokens[5], version))) {
+        bad_format();
+        return true;
+      }
+      const string& key = tokens[1];
+      KeyService::Outcome outcome;
+      if(name == "set") {
+        keys.set(key, data, flags, ms);
+        outcome = KeyService::WRITTEN;
+      } else if(name == "add") {
+        outcome = keys.set_if(key, data, KeyService::IF_ABSENT, 0, flags, ms);
+      } else if(name == "replace") {
+        outcome = keys.set_if(key, data, KeyService::IF_PRESENT, 0, flags, ms);
+      } else if(name == "cas") {
+        outcome = keys.set_if(key, data, KeyService::IF_VERSION, version, flags, ms);
+      } else {
+        // The flags and expiry given to append and prepend are ignored, as
+        // in memcached.
+        bool append = name == "append";
+        outcome = modify(key, [&](string& value) {
+          value = append ? value + data : data + value;
+          return true;
+        });
+      }
+      if(outcome == KeyService::WRITTEN) out += "STORED\r\n";
+      else if(name == "cas") out += outcome == KeyService::FAILED ? "EXISTS\r\n" : "NOT_FOUND\r\n";
+      else out += "NOT_STORED\r\n";
+    } else if(name == "delete") {
+      if(tokens.size() == 3 && tokens[2] == "0") tokens.pop_back();
+      if(tokens.size() != 2 || !valid_key(tokens[1])) {
+        bad_format();
+        return true;
+      }
+      out += keys.remove(tokens[1]) ? "DELETED\r\n" : "NOT_FOUND\r\n";
+    } else if(name == "touch") {
+      long long ms;
+      if(tokens.size() != 3 || !valid_key(tokens[1]) || !parse_exptime(tokens[2], ms)) {
+        bad_format();
+        return true;
+      }
+      bool found;
+      if(ms == 0) found = keys.persist(tokens[1]);
+      else if(ms > 0) found = keys.expire(tokens[1], ms);
+      else found = keys.remove(tokens[1]);
+      out += found ? "TOUCHED\r\n" : "NOT_FOUND\r\n";
+    } else if(name == "incr" || name == "decr") {
+      unsigned long long delta, result = 0;
+      if(tokens.size() != 3 || !valid_key(tokens[1])) {
+        bad_format();
+        return true;
+      }
+      if(!parse_uint(tokens[2], delta)) {
+        out += "CLIENT_ERROR invalid numeric delta argument\r\n";
+        return true;
+      }
+      bool incr = name == "incr";
+      KeyService::Outcome outcome = modify(tokens[1], [&](string& value) {
+        unsigned long long n;
+        if(!parse_uint(value, n)) return false;
+        // incr wraps at 2^64 and decr stops at 0, as in memcached.
+        result = incr ? n + delta : n > delta ? n - delta : 0;
+        value = to_string(result);
+        return true;
+      });
+      if(outcome == KeyService::WRITTEN) out += to_string(result) + "\r\n";
+      else if(outcome == KeyService::MISSING) out += "NOT_FOUND\r\n";
+      else out += "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n";
+    } else if(name == "verbosity") {
+      out += "OK\r\n";
+    } else if(name == "mg" || name == "ms" || name == "md") {
+      if(tokens.size() < 2 || !valid_key(tokens[1])) {
+        bad_format();
+        return true;
+      }
+      if(name == "mg") meta_get(tokens, out);
+      else if(name == "ms") meta_set(tokens, data, out);
+      else meta_delete(tokens, out);
+    } else {
+      out += "ERROR\r\n";
+    }
+    if(noreply) out.resize(mark);
+  } catch(const Exception_& e) {
+    errors.fetch_add(1, memory_order_relaxed);
+    string label = e.code_() == 503 ? "Service Unavailable: " : e.code_() == 504 ? "Gateway Timeout: " : "Internal Server Error: ";
+    out += "SERVER_ERROR " + label;
+    for(char c : string(e.what())) out += c == '\r' || c == '\n' ? ' ' : c;
+    out += "\r\n";
+  }
+  return true;
+}
+
+// Appends the requested return flags (k, c, O, plus f, s and t for mg) in
+// request order.
+static void return_flags(const vector<string>& tokens, size_t first, const string& key, const string* value,
+    uint32_t client_flags, long long ttl, string& out) {
+  for(size_t i=first; i<tokens.size(); i++) {
+    const string& flag = tokens[i];
+    switch(flag[0]) {
+    case 'k': out += " k" + key; break;
+    case 'O': out += " " + flag; break;
+    case 'c': if(value) out += " c" + to_string(KeyService::version_of(*value)); break;
+    case 'f': if(value) out += " f" + to_string(client_flags); break;
+    case 's': if(value) out += " s" + to_string(value->size()); break;
+    case 't': if(value) out += " t" + to_string(ttl < 0 ? -1 : (ttl + 999) / 1000); break;
+    }
+  }
+}
+
+void MemcacheServer::meta_get(const vector<string>& tokens, string& out) {
+  bool quiet = false, value = false, touch = false, ttl = false;
+  long long ms = 0;
+  for(size_t i=2; i<tokens.size(); i++) {
+    const string& flag = tokens[i];
+    switch(flag[0]) {
+    case 'q': quiet = true; break;
+    case 'v': value = true; break;
+    case 't': ttl = true; break;
+    case 'k': case 'c': case 'f': case 's': case 'O': break;
+    case 'T':
+      if(!parse_exptime(flag.substr(1), ms)) {
+        out += "CLIENT_ERROR bad token in command line format\r\n";
+        return;
+      }
+      touch = true;
+      break;
+    default:
+      out += "CLIENT_ERROR invalid flag\r\n";
+      return;
+    }
+  }
+  const string& key = tokens[1];
+  pair<bool, string> result = keys.get(key);
+  if(!result.first) {
+    if(!quiet) out += "EN\r\n";
+    return;
+  }
+  if(touch) {
+    if(ms == 0) keys.persist(key);
+    else apply_ttl(key, ms);
+  }
+  string flags;
+  return_flags(tokens, 2, key, &result.second, keys.flags_of(key), ttl ? keys.ttl(key) : -1, flags);
+  if(value) {
+    out += "VA " + to_string(result.second.size()) + flags + "\r\n";
+    out += result.second;
+    out += "\r\n";
+  } else {
+    out += "HD" + flags + "\r\n";
+  }
+}
+
+void MemcacheServer::meta_set(const vector<string>& tokens, const string& data, string& out) {
+  bool quiet = false, compare = false;
+  char mode = 'S';
+  unsigned long long version = 0, flags = 0;
+  long long ms = 0;
+  bool touch = false;
+  for(size_t i=3; i<tokens.size(); i++) {
+    const string& flag = tokens[i];
+    bool ok = true;
+    switch(flag[0]) {
+    case 'q': quiet = true; break;
+    case 'k': case 'c': case 'O': break;
+    case 'F': ok = parse_uint(flag.substr(1), flags) && flags <= 0xFFFFFFFFULL; break;
+    case 'C': ok = compare = parse_uint(flag.substr(1), version); break;
+    case 'T': ok = touch = parse_exptime(flag.substr(1), ms); break;
+    case 'M':
+      mode = flag.size() == 2 ? toupper((unsigned char)flag[1]) : '?';
+      ok = mode == 'S' || mode == 'E' || mode == 'R' || mode == 'A' || mode == 'P';
+      break;
+    default:
+      out += "CLIENT_ERROR invalid flag\r\n";
+      return;
+    }
+    if(!ok) {
+      out += "CLIENT_ERROR bad token in command line format\r\n";
+      return;
+    }
+  }
+  const string& key = tokens[1];
+  KeyService::Outcome outcome;
+  string written = data;
+  if(mode == 'A' || mode == 'P') {
+    // Appending keeps the key's flags, and its expiry unless T is given.
+    outcome = modify(key, [&](string& value) {
+      if(compare && KeyService::version_of(value) != version) return false;
+      value = mode == 'A' ? value + data : data + value;
+      written = value;
+      return true;
+    }, touch ? ms : KeyService::KEEP_TTL);
+    flags = keys.flags_of(key);
+  } else if(mode == 'E') {
+    outcome = keys.set_if(key, data, KeyService::IF_ABSENT, 0, flags, ms);
+  } else if(compare) {
+    outcome = keys.set_if(key, data, KeyService::IF_VERSION, version, flags, ms);
+  } else if(mode == 'R') {
+    outcome = keys.set_if(key, data, KeyService::IF_PRESENT, 0, flags, ms);
+  } else {
+    keys.set(key, data, flags, ms);
+    outcome = KeyService::WRITTEN;
+  }
+
+  string code;
+  if(outcome == KeyService::WRITTEN) code = "HD";
+  else if(mode == 'E' || (!compare && mode != 'S')) code = "NS";
+  else code = outcome == KeyService::FAILED ? "EX" : "NF";
+  if(quiet && code == "HD") return;
+  string returned;
+  // The c flag returns the version just written.
+  return_flags(tokens, 3, key, outcome == KeyService::WRITTEN ? &written : nullptr, flags, -1, returned);
+  out += code + returned + "\r\n";
+}
+
+void MemcacheServer::meta_delete(const vector<string>& tokens, string& out) {
+  bool quiet = false, compare = false;
+  unsigned long long version = 0;
+  for(size_t i=2; i<tokens.size(); i++) {
+    const string& flag = tokens[i];
+    switch(flag[0]) {
+    case 'q': quiet = true; break;
+    case 'k': case 'O': break;
+    case 'C':
+      if(!(compare = parse_uint(flag.substr(1), version))) {
+        out += "CLIENT_ERROR bad token in command line format\r\n";
+        return;
+      }
+      break;
+    default:
+      out += "CLIENT_ERROR invalid flag\r\n";
+      return;
+    }
+  }
+  const string& key = tokens[1];
+  string code;
+  if(compare) {
+    KeyService::Outcome outcome = keys.remove_if(key, version);
+    code = outcome == KeyService::WRITTEN ? "HD" : outcome == KeyService::FAILED ? "EX" : "NF";
+  } else {
+    code = keys.remove(key) ? "HD" : "NF";
+  }
+  if(quiet && code != "EX") return;
+  string returned;
+  return_flags(tokens, 2, key, nullptr, 0, -1, returned);
+  out += code + returned + "\r\n";
+}
+
+void MemcacheServer::write_metrics(ostream& out) {
+  listener.write_metrics(out);
+  out << "# TYPE memcache_commands_total counter\n";
+  out << "memcache_commands_total " << commands.load() << "\n";
+  out << "# TYPE memcache_errors_total counter\n";
+  out << "memcache_errors_total " << errors.load() << "\n";
+}
@@ -0,0 +1,76 @@
+#include "MemoryBackend.h"
+
+#include <algorithm>
+#include <functional>
+#include <mutex>
+
+using namespace std;
+
+MemoryBackend::MemoryBackend(int shards_count) : shards_count(max(1, shards_count)) {
+  shards = new Shard[this->shards_count];
+}
+
+MemoryBackend::~MemoryBackend() {
+  delete [] shards;
+  shards = nullptr;
+}
+
+MemoryBackend::Shard& MemoryBackend::shard_for(const string& key) {
+  return shards[hash<string>()(key) % shards_count];
+}
+
+pair<bool, string> MemoryBackend::get(const string& key) {
+  Shard& shard = shard_for(key);
+  shared_lock<shared_mutex> lock(shard.mtx);
+  auto it = shard.data.find(key);
+  if(it == shard.data.end()) return {false, ""};
+  return {true, it->second};
+}
+
+bool MemoryBackend::set(const string& key, const string& value) {
+  Shard& shard = shard_for(key);
+  unique_lock<shared_mutex> lock(shard.mtx);
+  auto result = shard.data.insert_or_assign(key, value);
+  if(result.second) entries.fetch_add(1, memory_order_relaxed);
+  return true;
+}
+
+bool MemoryBackend::remove(const string& key) {
+  Shard& shard = shard_for(key);
+  unique_lock<shared_mutex> lock(shard.mtx);
+  if(shard.data.erase(key) == 0) return false;
+  entries.fetch_sub(1, memory_order_relaxed);
+  return true;
+}
+
+unordered_map<string, string> MemoryBackend::get_many(const vector<string>& keys) {
+  unordered_map<string, string> result;
+  result.reserve(keys.size());
+  for(const string& key : keys) {
+    Shard& shard = shard_for(key);
+    shared_lock<shared_mutex> lock(shard.mtx);
+    auto it = shard.data.find(key);
+    if(it != shard.data.end()) result.emplace(key, it->second);
+  }
+  return result;
+}
+
+// Takes the first `limit` candidates from every shard, then merges.
+vector<pair<string, string>> MemoryBackend::scan(const string& start, size_t limit) {
+  vector<pair<string, string>> out;
+  for(int i=0; i<shards_count; i++) {
+    shared_lock<shared_mutex> lock(shards[i].mtx);
+    size_t taken = 0;
+    for(auto it = shards[i].data.lower_bound(start); it != shards[i].data.end() && taken < limit; ++it, ++taken) {
+      out.emplace_back(it->first, it->second);
+    }
+  }
+  sort(out.begin(), out.end());
+  if(out.size() > limit) out.resize(limit);
+  return out;
+}
+
+void MemoryBackend::write_metrics(ostream& out) {
+  out << "# TYPE memory_backend_entries gauge\n";
+  out << "memory_backend_entries " << entries.load() << "\n";
+}
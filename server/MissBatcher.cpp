@@ -0,0 +1,118 @@
+#include "MissBatcher.h"
+
+#include <chrono>
+#include <algorithm>
+
+using namespace std;
+
+MissBatcher::MissBatcher(Fetch fetch, Cache* cache, int max_inflight, size_t max_batch, int window_us)
+  : fetch(move(fetch)), cache(cache), max_inflight(max(1, max_inflight)),
+    max_batch(max((size_t)1, max_batch)), window_us(max(0, window_us)) {}
+
+pair<bool, string> MissBatcher::get(const string& key) {
+  requests.fetch_add(1, memory_order_relaxed);
+  // Shared with the dispatcher, which may still fill it in after a timeout.
+  shared_ptr<Waiter> w = make_shared<Waiter>(key, deadline::current());
+  unique_lock<mutex> lock(mtx);
+  pending.push_back(w);
+  if(pending.size() >= max_batch) full_cv.notify_one();
+
+  auto ready = [&](){return w->done || (active < max_inflight && !pending.empty());};
+  while(!w->done) {
+    if(active < max_inflight && !pending.empty()) {
+      dispatch(lock);
+    } else if(!deadline::bounded()) {
+      w->cv.wait(lock, ready);
+    } else if(!w->cv.wait_until(lock, w->until, ready)) {
+      auto it = find(pending.begin(), pending.end(), w);
+      if(it != pending.end()) pending.erase(it);
+      // It may have been the waiter woken to dispatch; pass that on.
+      if(!pending.empty() && active < max_inflight) pending.front()->cv.notify_one();
+      timeouts.fetch_add(1, memory_order_relaxed);
+      throw Exception_("Timeout", "Request deadline exceeded waiting for the database", 504);
+    }
+  }
+  lock.unlock();
+
+  if(w->failed) throw Exception_("Postgres", w->error, w->code);
+  return {w->found, move(w->value)};
+}
+
+// Called with the lock held; runs one batch and returns with the lock held.
+void MissBatcher::dispatch(unique_lock<mutex>& lock) {
+  active++;
+  if(active > 1 && window_us > 0 && pending.size() < max_batch) {
+    full_cv.wait_for(lock, chrono::microseconds(window_us),
+      [&](){return pending.size() >= max_batch;});
+  }
+
+  vector<shared_ptr<Waiter>> batch;
+  while(!pending.empty() && batch.size() < max_batch) {
+    batch.push_back(pending.front());
+    pending.pop_front();
+  }
+  if(batch.empty()) {
+    active--;
+    return;
+  }
+  if(!pending.empty() && active < max_inflight) pending.front()->cv.notify_one();
+  lock.unlock();
+
+  vector<string> batch_keys;
+  batch_keys.reserve(batch.size());
+  deadline::Clock::time_point until = deadline::Clock::time_point::min();
+  {
+    unordered_map<string, bool> seen;
+    seen.reserve(batch.size());
+    for(auto& w : batch) {
+      if(seen.emplace(w->key, true).second) batch_keys.push_back(w->key);
+      until = max(until, w->until);
+    }
+  }
+
+  unordered_map<string, string> rows;
+  bool failed = false;
+  string error;
+  int code = 500;
+  try {
+    deadline::Scope scope(until);
+    rows = fetch(batch_keys);
+    if(cache && !rows.empty()) cache->set_many(rows);
+  } catch(const Exception_& e) {
+    failed = true;
+    error = e.what();
+    code = e.code_();
+  }
+  batches.fetch_add(1, memory_order_relaxed);
+  keys.fetch_add(batch_keys.size(), memory_order_relaxed);
+
+  lock.lock();
+  for(auto& w : batch) {
+    if(failed) {
+      w->failed = true;
+      w->error = error;
+      w->code = code;
+    } else {
+      auto it = rows.find(w->key);
+      if(it != rows.end()) {
+        w->found = true;
+        w->value = it->second;
+      }
+    }
+    w->done = true;
+    w->cv.notify_one();
+  }
+  active--;
+  if(!pending.empty()) pending.front()->cv.notify_one();
+}
+
+void MissBatcher::write_metrics(ostream& out) {
+  out << "# TYPE miss_batch_requests_total counter\n";
+  out << "miss_batch_requests_total " << requests.load() << "\n";
+  out << "# TYPE miss_batch_queries_total counter\n";
+  out << "miss_batch_queries_total " << batches.load() << "\n";
+  out << "# TYPE miss_batch_keys_total counter\n";
+  out << "miss_batch_keys_total " << keys.load() << "\n";
+  out << "# TYPE miss_batch_timeouts_total counter\n";
+  out << "miss_batch_timeouts_total " << timeouts.load() << "\n";
+}
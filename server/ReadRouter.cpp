@@ -0,0 +1,205 @@
+#include "ReadRouter.h"
+
+#include <chrono>
+#include <functional>
+
+using namespace std;
+
+#define RYW_PRUNE_THRESHOLD 4096
+
+static long long now_ms() {
+  return chrono::duration_cast<chrono::milliseconds>(
+    chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ReadRouter::ReadRouter(DBConnectionPool& primary, const vector<string>& replica_conns,
+  int pool_min, int pool_max, Policy policy, int ryw_window_ms)
+  : primary(primary), policy(policy), ryw_window_ms(max(0, ryw_window_ms)) {
+  for(const string& conn : replica_conns) {
+    unique_ptr<Replica> replica(new Replica());
+    replica->pool.reset(new DBConnectionPool(conn, pool_min, pool_max, primary.profile(), primary.breaker_config()));
+    replicas.push_back(move(replica));
+  }
+}
+
+// Standbys are read-only, so their pools skip schema creation.
+void ReadRouter::createPools() {
+  for(auto& replica : replicas) replica->pool->createPool(false);
+}
+
+// Connection strings contain spaces, so the list in DB_READ_CONN is ';'-separated.
+vector<string> ReadRouter::split_conn_list(const string& list) {
+  vector<string> out;
+  size_t start = 0;
+  while(start <= list.size()) {
+    size_t end = list.find(';', start);
+    if(end == string::npos) end = list.size();
+    string item = list.substr(start, end - start);
+    size_t b = item.find_first_not_of(" \t"), e = item.find_last_not_of(" \t");
+    if(b != string::npos) out.push_back(item.substr(b, e - b + 1));
+    start = end + 1;
+  }
+  return out;
+}
+
+ReadRouter::Replica* ReadRouter::pick() {
+  if(policy == ROUND_ROBIN) {
+    return replicas[next_replica.fetch_add(1, memory_order_relaxed) % replicas.size()].get();
+  }
+  // Least outstanding, starting from a rotating offset so ties spread out.
+  size_t n = replicas.size();
+  size_t start = next_replica.fetch_add(1, memory_order_relaxed) % n;
+  Replica* best = replicas[start].get();
+  for(size_t i=1; i<n; i++) {
+    Replica* r = replicas[(start + i) % n].get();
+    if(r->outstanding.load(memory_order_relaxed) < best->outstanding.load(memory_order_relaxed)) best = r;
+  }
+  return best;
+}
+
+ReadRouter::WriteShard& ReadRouter::shard_for(const string& key) {
+  return write_shards[hash<string>()(key) % WRITE_SHARDS];
+}
+
+void ReadRouter::note_write(const string& key) {
+  if(replicas.empty() || ryw_window_ms == 0) return;
+  long long now = now_ms();
+  WriteShard& shard = shard_for(key);
+  lock_guard<mutex> lock(shard.mtx);
+  shard.written_at[key] = now;
+  if(shard.written_at.size() > RYW_PRUNE_THRESHOLD) {
+    for(auto it = shard.written_at.begin(); it != shard.written_at.end(); ) {
+      if(it->second < now - ryw_window_ms) it = shard.written_at.erase(it);
+      else ++it;
+    }
+  }
+}
+
+bool ReadRouter::written_since(const string& key, long long since_ms) {
+  WriteShard& shard = shard_for(key);
+  lock_guard<mutex> lock(shard.mtx);
+  auto it = shard.written_at.find(key);
+  if(it == shard.written_at.end()) return false;
+  if(it->second < now_ms() - ryw_window_ms) {
+    shard.written_at.erase(it);
+    return false;
+  }
+  return it->second >= since_ms;
+}
+
+pair<bool, string> ReadRouter::get(const string& key) {
+  long long start = now_ms();
+  if(replicas.empty() || (ryw_window_ms > 0 && written_since(key, start - ryw_window_ms))) {
+    primary_reads.fetch_add(1, memory_order_relaxed);
+    return primary.get(key);
+  }
+
+  Replica* replica = pick();
+  replica->outstanding.fetch_add(1, memory_order_relaxed);
+  pair<bool, string> result;
+  try {
+    result = replica->pool->get(key);
+  } catch(const Exception_&) {
+    replica->outstanding.fetch_sub(1, memory_order_relaxed);
+    replica->errors.fetch_add(1, memory_order_relaxed);
+    primary_reads.fetch_add(1, memory_order_relaxed);
+    return primary.get(key);
+  }
+  replica->outstanding.fetch_sub(1, memory_order_relaxed);
+  replica->reads.fetch_add(1, memory_order_relaxed);
+
+  // A write that landed while the standby was answering may not have been
+  // replayed there yet; the primary has the authoritative value.
+  if(ryw_window_ms > 0 && written_since(key, start)) {
+    primary_reads.fetch_add(1, memory_order_relaxed);
+    return primary.get(key);
+  }
+  return result;
+}
+
+unordered_map<string, string> ReadRouter::get_many(const vector<string>& keys) {
+  if(replicas.empty()) {
+    primary_reads.fetch_add(1, memory_order_relaxed);
+    return primary.get_many(keys);
+  }
+
+  long long start = now_ms();
+  vector<string> replica_keys, primary_keys;
+  for(const string& key : keys) {
+    if(ryw_window_ms > 0 && written_since(key, start - ryw_window_ms)) primary_keys.push_back(key);
+    else replica_keys.push_back(key);
+  }
+
+  unordered_map<string, string> result;
+  if(!replica_keys.empty()) {
+    Replica* replica = pick();
+    replica->outstanding.fetch_add(1, memory_order_relaxed);
+    try {
+      result = replica->pool->get_many(replica_keys);
+      replica->reads.fetch_add(1, memory_order_relaxed);
+      if(ryw_window_ms > 0) {
+        for(const string& key : replica_keys) {
+          if(written_since(key, start)) {
+            result.erase(key);
+            primary_keys.push_back(key);
+          }
+        }
+      }
+    } catch(const Exception_&) {
+      replica->errors.fetch_add(1, memory_order_relaxed);
+      primary_keys.insert(primary_keys.end(), replica_keys.begin(), replica_keys.end());
+    }
+    replica->outstanding.fetch_sub(1, memory_order_relaxed);
+  }
+
+  if(!primary_keys.empty()) {
+    primary_reads.fetch_add(1, memory_order_relaxed);
+    for(auto& row : primary.get_many(primary_keys)) result[row.first] = move(row.second);
+  }
+  return result;
+}
+
+// Writes are noted before they start, for replica reads racing them, and
+// again once committed, so a slow write still gets the full window.
+bool ReadRouter::set(const string& key, const string& value) {
+  note_write(key);
+  bool created = primary.set(key, value);
+  note_write(key);
+  return created;
+}
+
+bool ReadRouter::remove(const string& key) {
+  note_write(key);
+  bool existed = primary.remove(key);
+  note_write(key);
+  return existed;
+}
+
+void ReadRouter::write_batch(const vector<pair<string, string>>& sets, const vector<string>& removes) {
+  for(const auto& entry : sets) note_write(entry.first);
+  for(const string& key : removes) note_write(key);
+  primary.write_batch(sets, removes);
+  for(const auto& entry : sets) note_write(entry.first);
+  for(const string& key : removes) note_write(key);
+}
+
+vector<pair<string, string>> ReadRouter::scan(const string& start, size_t limit) {
+  return primary.scan(start, limit);
+}
+
+void ReadRouter::write_metrics(ostream& out) {
+  primary.write_metrics(out);
+  out << "# TYPE db_read_primary_total counter\n";
+  out << "db_read_primary_total " << primary_reads.load() << "\n";
+  for(size_t i=0; i<replicas.size(); i++) {
+    Replica& r = *replicas[i];
+    string prefix = "db_replica" + to_string(i);
+    out << "# TYPE " << prefix << "_reads_total counter\n";
+    out << prefix << "_reads_total " << r.reads.load() << "\n";
+    out << "# TYPE " << prefix << "_errors_total counter\n";
+    out << prefix << "_errors_total " << r.errors.load() << "\n";
+    out << "# TYPE " << prefix << "_outstanding gauge\n";
+    out << prefix << "_outstanding " << r.outstanding.load() << "\n";
+    r.pool->write_metrics(out, prefix + "_pool");
+  }
+}
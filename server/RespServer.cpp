@@ -0,0 +1,363 @@
+#include "RespServer.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <chrono>
+#include <algorithm>
+#include "Deadline.h"
+
+using namespace std;
+
+#define RESP_MAX_INLINE 65536
+#define RESP_MAX_BULK (512LL << 20)
+#define RESP_MAX_ARGS (1024 * 1024)
+#define RESP_VERSION "7.0.0"
+#define RESP_MAX_TTL_MS (1LL << 50)
+
+// Parses one command starting at `pos`. Returns 1 and advances `pos` when a
+// whole command was read (`args` is empty for an empty one), 0 when more
+// bytes are needed, -1 on a protocol error. Arguments are only copied once
+// the command is complete, so a large value arriving in pieces is scanned
+// again but not copied again.
+static int parse_command(const string& in, size_t& pos, vector<string>& args, string& error) {
+  args.clear();
+  if(pos >= in.size()) return 0;
+  auto number = [&](size_t from, size_t to, long long& value) {
+    if(from == to) return false;
+    char* end;
+    value = strtoll(in.c_str() + from, &end, 10);
+    return end == in.c_str() + to;
+  };
+
+  if(in[pos] != '*') {
+    size_t nl = in.find('\n', pos);
+    if(nl == string::npos) {
+      if(in.size() - pos > RESP_MAX_INLINE) {
+        error = "too big inline request";
+        return -1;
+      }
+      return 0;
+    }
+    size_t end = nl > pos && in[nl - 1] == '\r' ? nl - 1 : nl;
+    size_t at = pos;
+    while(at < end) {
+      while(at < end && (in[at] == ' ' || in[at] == '\t')) at++;
+      size_t from = at;
+      while(at < end && in[at] != ' ' && in[at] != '\t') at++;
+      if(at > from) args.emplace_back(in, from, at - from);
+    }
+    pos = nl + 1;
+    return 1;
+  }
+
+  size_t eol = in.find("\r\n", pos);
+  if(eol == string::npos) {
+    if(in.size() - pos > RESP_MAX_INLINE) {
+      error = "too big multibulk count";
+      return -1;
+    }
+    return 0;
+  }
+  long long n;
+  if(!number(pos + 1, eol, n) || n > RESP_MAX_ARGS) {
+    error = "invalid multibulk length";
+    return -1;
+  }
+  size_t at = eol + 2;
+  vector<pair<size_t, size_t>> spans;
+  for(long long i=0; i<n; i++) {
+    if(at >= in.size()) return 0;
+    if(in[at] != '$') {
+      error = string("expected '$', got '") + in[at] + "'";
+      return -1;
+    }
+    eol = in.find("\r\n", at);
+    if(eol == string::npos) return 0;
+    long long len;
+    if(!number(at + 1, eol, len) || len < 0 || len > RESP_MAX_BULK) {
+      error = "invalid bulk length";
+      return -1;
+    }
+    if(in.size() - (eol + 2) < (size_t)len + 2) return 0;
+    spans.emplace_back(eol + 2, len);
+    at = eol + 2 + len + 2;
+  }
+  args.reserve(spans.size());
+  for(auto& span : spans) args.emplace_back(in, span.first, span.second);
+  pos = at;
+  return 1;
+}
+
+static void simple(string& out, const string& s) {
+  out += '+';
+  out += s;
+  out += "\r\n";
+}
+
+static void error_reply(string& out, const string& s) {
+  out += '-';
+  for(char c : s) out += c == '\r' || c == '\n' ? ' ' : c;
+  out += "\r\n";
+}
+
+static void integer(string& out, long long n) {
+  out += ':';
+  out += to_string(n);
+  out += "\r\n";
+}
+
+static void bulk(string& out, const string& s) {
+  out += '$';
+  out += to_string(s.size());
+  out += "\r\n";
+  out += s;
+  out += "\r\n";
+}
+
+static void null(string& out, int proto) {
+  out += proto == 3 ? "_\r\n" : "$-1\r\n";
+}
+
+static void array_header(string& out, size_t n) {
+  out += '*';
+  out += to_string(n);
+  out += "\r\n";
+}
+
+// RESP2 has no map type; it gets a flat array of keys and values.
+static void map_header(string& out, size_t n, int proto) {
+  out += proto == 3 ? '%' : '*';
+  out += to_string(proto == 3 ? n : 2 * n);
+  out += "\r\n";
+}
+
+static string upper(const string& s) {
+  string u = s;
+  for(char& c : u) c = toupper((unsigned char)c);
+  return u;
+}
+
+static string lower(const string& s) {
+  string l = s;
+  for(char& c : l) c = tolower((unsigned char)c);
+  return l;
+}
+
+static bool parse_int(const string& s, long long& value) {
+  if(s.empty()) return false;
+  char* end;
+  errno = 0;
+  value = strtoll(s.c_str(), &end, 10);
+  return errno == 0 && *end == '\0';
+}
+
+class RespServer::Connection : public TcpServer::Connection {
+private:
+  RespServer& server;
+  Session session;
+  std::vector<std::string> args;
+  std::string error;
+
+public:
+  explicit Connection(RespServer& server) : server(server) {
+    session.id = server.next_id.fetch_add(1);
+  }
+
+  bool feed(const string& in, size_t& pos, string& out) override {
+    for(;;) {
+      int parsed = parse_command(in, pos, args, error);
+      if(parsed == 0) return true;
+      if(parsed < 0) {
+        error_reply(out, "ERR Protocol error: " + error);
+        return false;
+      }
+      if(args.empty()) continue;
+      server.commands.fetch_add(1, memory_order_relaxed);
+      if(!server.execute(session, args, out)) return false;
+    }
+  }
+};
+
+RespServer::RespServer(KeyService& keys, int port, int max_clients, int timeout_ms)
+  : keys(keys), timeout_ms(max(0, timeout_ms)),
+    listener("resp", port, max_clients, "-ERR max number of clients reached\r\n",
+      [this]() { return unique_ptr<TcpServer::Connection>(new Connection(*this)); }) {}
+
+bool RespServer::execute(Session& session, vector<string>& args, string& out) {
+  string name = upper(args[0]);
+  size_t argc = args.size();
+  auto arity = [&](bool ok) {
+    if(!ok) error_reply(out, "ERR wrong number of arguments for '" + lower(args[0]) + "' command");
+    return ok;
+  };
+
+  if(name == "PING") {
+    if(!arity(argc <= 2)) return true;
+    if(argc == 2) bulk(out, args[1]);
+    else simple(out, "PONG");
+    return true;
+  }
+  if(name == "ECHO") {
+    if(arity(argc == 2)) bulk(out, args[1]);
+    return true;
+  }
+  if(name == "QUIT") {
+    simple(out, "OK");
+    return false;
+  }
+  if(name == "HELLO") {
+    size_t at = 1;
+    if(argc >= 2) {
+      long long proto;
+      if(!parse_int(args[1], proto) || (proto != 2 && proto != 3)) {
+        error_reply(out, "NOPROTO unsupported protocol version");
+        return true;
+      }
+      session.proto = (int)proto;
+      at = 2;
+    }
+    // There are no users; AUTH is accepted as the default user has no password.
+    for(; at < argc; at++) {
+      string option = upper(args[at]);
+      if(option == "AUTH" && at + 2 < argc) at += 2;
+      else if(option == "SETNAME" && at + 1 < argc) session.name = args[++at];
+      else {
+        error_reply(out, "ERR syntax error in HELLO option '" + args[at] + "'");
+        return true;
+      }
+    }
+    map_header(out, 7, session.proto);
+    bulk(out, "server");
+    bulk(out, "kvstore");
+    bulk(out, "version");
+    bulk(out, RESP_VERSION);
+    bulk(out, "proto");
+    integer(out, session.proto);
+    bulk(out, "id");
+    integer(out, session.id);
+    bulk(out, "mode");
+    bulk(out, "standalone");
+    bulk(out, "role");
+    bulk(out, "master");
+    bulk(out, "modules");
+    array_header(out, 0);
+    return true;
+  }
+  if(name == "SELECT") {
+    if(!arity(argc == 2)) return true;
+    if(args[1] == "0") simple(out, "OK");
+    else error_reply(out, "ERR DB index is out of range");
+    return true;
+  }
+  if(name == "CLIENT") {
+    if(!arity(argc >= 2)) return true;
+    string sub = upper(args[1]);
+    if(sub == "SETNAME" && argc == 3) {
+      session.name = args[2];
+      simple(out, "OK");
+    } else if(sub == "GETNAME") {
+      if(session.name.empty()) null(out, session.proto);
+      else bulk(out, session.name);
+    } else if(sub == "ID") {
+      integer(out, session.id);
+    } else if(sub == "SETINFO") {
+      simple(out, "OK");
+    } else {
+      error_reply(out, "ERR unknown subcommand '" + args[1] + "'");
+    }
+    return true;
+  }
+  if(name == "COMMAND") {
+    array_header(out, 0);
+    return true;
+  }
+  if(name == "CONFIG") {
+    if(argc >= 2 && upper(args[1]) == "GET") map_header(out, 0, session.proto);
+    else error_reply(out, "ERR CONFIG supports GET only");
+    return true;
+  }
+
+  deadline::Scope scope(timeout_ms > 0 ? deadline::Clock::now() + chrono::milliseconds(timeout_ms)
+    : deadline::Clock::time_point::max());
+  try {
+    if(name == "GET") {
+      if(!arity(argc == 2)) return true;
+      pair<bool, string> result = keys.get(args[1]);
+      if(result.first) bulk(out, result.second);
+      else null(out, session.proto);
+    } else if(name == "SET") {
+      if(!arity(argc >= 3)) return true;
+      long long ttl = 0;
+      for(size_t at = 3; at < argc; at++) {
+        string option = upper(args[at]);
+        long long n;
+        if((option != "EX" && option != "PX") || at + 1 >= argc) {
+          error_reply(out, "ERR syntax error");
+          return true;
+        }
+        if(!parse_int(args[++at], n) || n <= 0 || n > RESP_MAX_TTL_MS / 1000) {
+          error_reply(out, "ERR invalid expire time in 'set' command");
+          return true;
+        }
+        ttl = option == "EX" ? n * 1000 : n;
+      }
+      keys.set(args[1], args[2], 0, ttl);
+      simple(out, "OK");
+    } else if(name == "DEL") {
+      if(!arity(argc >= 2)) return true;
+      long long removed = 0;
+      for(size_t i=1; i<argc; i++) removed += keys.remove(args[i]);
+      integer(out, removed);
+    } else if(name == "MGET") {
+      if(!arity(argc >= 2)) return true;
+      vector<string> wanted(args.begin() + 1, args.end());
+      unordered_map<string, string> found = keys.get_many(wanted);
+      array_header(out, wanted.size());
+      for(const string& key : wanted) {
+        auto it = found.find(key);
+        if(it == found.end()) null(out, session.proto);
+        else bulk(out, it->second);
+      }
+    } else if(name == "MSET") {
+      if(!arity(argc >= 3 && argc % 2 == 1)) return true;
+      unordered_map<string, string> latest;
+      for(size_t i=1; i<argc; i+=2) latest[args[i]] = move(args[i+1]);
+      keys.set_many(latest);
+      simple(out, "OK");
+    } else if(name == "EXISTS") {
+      if(!arity(argc >= 2)) return true;
+      vector<string> wanted(args.begin() + 1, args.end());
+      unordered_map<string, string> found = keys.get_many(wanted);
+      long long count = 0;
+      for(const string& key : wanted) count += found.count(key);
+      integer(out, count);
+    } else if(name == "EXPIRE" || name == "PEXPIRE") {
+      if(!arity(argc == 3)) return true;
+      long long n;
+      if(!parse_int(args[2], n) || n > RESP_MAX_TTL_MS / 1000 || n < -RESP_MAX_TTL_MS / 1000) {
+        error_reply(out, "ERR value is not an integer or out of range");
+        return true;
+      }
+      integer(out, keys.expire(args[1], name == "EXPIRE" ? n * 1000 : n));
+    } else if(name == "TTL" || name == "PTTL") {
+      if(!arity(argc == 2)) return true;
+      long long ms = keys.ttl(args[1]);
+      integer(out, ms < 0 || name == "PTTL" ? ms : (ms + 500) / 1000);
+    } else {
+      error_reply(out, "ERR unknown command '" + args[0] + "'");
+    }
+  } catch(const Exception_& e) {
+    errors.fetch_add(1, memory_order_relaxed);
+    string label = e.code_() == 503 ? "Service Unavailable: " : e.code_() == 504 ? "Gateway Timeout: " : "Internal Server Error: ";
+    error_reply(out, "ERR " + label + e.what());
+  }
+  return true;
+}
+
+void RespServer::write_metrics(ostream& out) {
+  listener.write_metrics(out);
+  out << "# TYPE resp_commands_total counter\n";
+  out << "resp_commands_total " << commands.load() << "\n";
+  out << "# TYPE resp_errors_total counter\n";
+  out << "resp_errors_total " << errors.load() << "\n";
+}
@@ -0,0 +1,103 @@
+#include "Router.h"
+
+using namespace std;
+
+Router::Router(const string& key_prefix) : nodes(1), prefix(key_prefix) {}
+
+string_view Router::key_of(const string& path, const string& prefix) {
+  if(path.size() < prefix.size() || path.compare(0, prefix.size(), prefix) != 0) return string_view();
+  return string_view(path).substr(prefix.size());
+}
+
+int Router::method_of(const string& method) {
+  switch(method.size()) {
+    case 3:
+      if(method == "GET") return M_GET;
+      if(method == "PUT") return M_PUT;
+      break;
+    case 4:
+      if(method == "HEAD") return M_GET;
+      if(method == "POST") return M_POST;
+      break;
+    case 6:
+      if(method == "DELETE") return M_DELETE;
+      break;
+  }
+  return -1;
+}
+
+void Router::add(Method method, const string& path, Handler handler) {
+  int at = 0;
+  for(char c : path) {
+    int next = -1;
+    for(auto& child : nodes[at].children) {
+      if(child.first == c) {
+        next = child.second;
+        break;
+      }
+    }
+    if(next < 0) {
+      next = (int)nodes.size();
+      nodes[at].children.emplace_back(c, next);
+      nodes.emplace_back();
+    }
+    at = next;
+  }
+  nodes[at].handlers[method] = move(handler);
+}
+
+bool Router::dispatch(const httplib::Request& req, httplib::Response& res, bool body_read) const {
+  int method = method_of(req.method);
+  if(method < 0) return false;
+  // A body has not been read yet; leave such requests to httplib.
+  if(!body_read && (req.get_header_value_u64("Content-Length") > 0 || req.get_header_value("Transfer-Encoding") == "chunked")) {
+    return false;
+  }
+
+  int at = 0;
+  for(char c : req.path) {
+    int next = -1;
+    for(const auto& child : nodes[at].children) {
+      if(child.first == c) {
+        next = child.second;
+        break;
+      }
+    }
+    if(next < 0) {
+      at = -1;
+      break;
+    }
+    at = next;
+  }
+  if(at >= 0 && nodes[at].handlers[method]) {
+    nodes[at].handlers[method](req, res);
+    return true;
+  }
+
+  if(!key_handlers[method]) return false;
+  string_view key = key_of(req.path, prefix);
+  if(key.empty()) return false;
+  key_handlers[method](req, res, key);
+  return true;
+}
+
+void Router::attach(httplib::Server& svr) const {
+  svr.set_pre_routing_handler([this](const httplib::Request& req, httplib::Response& res) {
+    return dispatch(req, res) ? httplib::Server::HandlerResponse::Handled
+      : httplib::Server::HandlerResponse::Unhandled;
+  });
+  auto with_body = [this](const httplib::Request& req, httplib::Response& res) {
+    if(!dispatch(req, res, true)) res.status = 404;
+  };
+  // Single-segment paths under the prefix (keys, PUTs above all, and the
+  // batch endpoints) match without std::regex; ".*" catches the rest.
+  string segment = prefix + ":key";
+  svr.Get(segment, with_body);
+  svr.Put(segment, with_body);
+  svr.Post(segment, with_body);
+  svr.Delete(segment, with_body);
+  svr.Get(".*", with_body);
+  svr.Put(".*", with_body);
+  svr.Post(".*", with_body);
+  svr.Delete(".*", with_body);
+}
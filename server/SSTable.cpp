@@ -0,0 +1,240 @@
+#include "SSTable.h"
+#include "FileUtil.h"
+
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+#define SSTABLE_BLOCK_SIZE 4096
+#define SSTABLE_FOOTER_SIZE 40
+#define SSTABLE_MAGIC 0x4b5653535442ULL
+
+template <typename T>
+static void put(string& out, T v) {
+  out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+template <typename T>
+static T take(const char* p) {
+  T v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+SSTableBuilder::SSTableBuilder(const string& path) : path(path) {
+  fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(fd < 0) throw Exception_("SSTable", "Fail to create " + path + ": " + strerror(errno));
+}
+
+SSTableBuilder::~SSTableBuilder() {
+  if(fd >= 0) ::close(fd);
+  if(!finished) ::unlink(path.c_str());
+}
+
+void SSTableBuilder::write(const string& data) {
+  fileutil::write_all(fd, data.data(), data.size(), path);
+}
+
+void SSTableBuilder::add(const string& key, const string& value, bool tombstone) {
+  put<uint32_t>(block, (uint32_t)key.size());
+  put<uint32_t>(block, tombstone ? 0 : (uint32_t)value.size());
+  put<uint8_t>(block, tombstone ? 1 : 0);
+  block += key;
+  if(!tombstone) block += value;
+  keys.push_back(key);
+  last_key = key;
+  if(block.size() >= SSTABLE_BLOCK_SIZE) flush_block();
+}
+
+void SSTableBuilder::flush_block() {
+  if(block.empty()) return;
+  put<uint32_t>(index, (uint32_t)last_key.size());
+  index += last_key;
+  put<uint64_t>(index, offset);
+  put<uint32_t>(index, (uint32_t)block.size());
+  write(block);
+  offset += block.size();
+  block.clear();
+}
+
+void SSTableBuilder::finish() {
+  flush_block();
+  uint64_t index_off = offset;
+  write(index);
+  offset += index.size();
+
+  string bloom = BloomFilter::build(keys);
+  uint64_t bloom_off = offset;
+  write(bloom);
+  offset += bloom.size();
+
+  string footer;
+  put<uint64_t>(footer, index_off);
+  put<uint64_t>(footer, index.size());
+  put<uint64_t>(footer, bloom_off);
+  put<uint64_t>(footer, bloom.size());
+  put<uint64_t>(footer, SSTABLE_MAGIC);
+  write(footer);
+  offset += footer.size();
+
+  if(fdatasync(fd) != 0) throw Exception_("SSTable", "Fail to sync " + path + ": " + strerror(errno));
+  ::close(fd);
+  fd = -1;
+  finished = true;
+}
+
+shared_ptr<SSTable> SSTable::open(const string& path, uint64_t number) {
+  shared_ptr<SSTable> table(new SSTable(path, number));
+  table->fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if(table->fd < 0) throw Exception_("SSTable", "Fail to open " + path + ": " + strerror(errno));
+
+  struct stat st;
+  if(fstat(table->fd, &st) != 0 || st.st_size < SSTABLE_FOOTER_SIZE) {
+    throw Exception_("SSTable", "Truncated table " + path);
+  }
+  table->size = st.st_size;
+
+  char footer[SSTABLE_FOOTER_SIZE];
+  fileutil::pread_all(table->fd, footer, sizeof(footer), table->size - SSTABLE_FOOTER_SIZE, path);
+  uint64_t index_off = take<uint64_t>(footer), index_size = take<uint64_t>(footer + 8);
+  uint64_t bloom_off = take<uint64_t>(footer + 16), bloom_size = take<uint64_t>(footer + 24);
+  if(take<uint64_t>(footer + 32) != SSTABLE_MAGIC || index_off + index_size > table->size ||
+      bloom_off + bloom_size > table->size) {
+    throw Exception_("SSTable", "Corrupt table " + path);
+  }
+
+  string index(index_size, '\0');
+  fileutil::pread_all(table->fd, &index[0], index_size, index_off, path);
+  for(size_t p=0; p<index.size(); ) {
+    IndexEntry entry;
+    uint32_t klen = take<uint32_t>(&index[p]);
+    entry.last_key.assign(&index[p + 4], klen);
+    p += 4 + klen;
+    entry.offset = take<uint64_t>(&index[p]);
+    entry.size = take<uint32_t>(&index[p + 8]);
+    p += 12;
+    table->index.push_back(move(entry));
+  }
+
+  string bloom(bloom_size, '\0');
+  fileutil::pread_all(table->fd, &bloom[0], bloom_size, bloom_off, path);
+  table->bloom = BloomFilter(bloom);
+
+  if(!table->index.empty()) {
+    string first;
+    table->read_block(0, first);
+    table->smallest_key.assign(&first[9], take<uint32_t>(&first[0]));
+    table->largest_key = table->index.back().last_key;
+  }
+  return table;
+}
+
+SSTable::~SSTable() {
+  if(fd >= 0) ::close(fd);
+  if(obsolete.load()) ::unlink(path.c_str());
+}
+
+void SSTable::read_block(size_t i, string& out) const {
+  out.resize(index[i].size);
+  fileutil::pread_all(fd, &out[0], index[i].size, index[i].offset, path);
+}
+
+// Bloom filter first, then one block read located by binary search on the index.
+bool SSTable::get(const string& key, string& value, bool& tombstone) const {
+  if(index.empty() || key < smallest_key || key > largest_key) return false;
+  if(!bloom.may_contain(key)) return false;
+
+  size_t lo = 0, hi = index.size();
+  while(lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if(index[mid].last_key < key) lo = mid + 1;
+    else hi = mid;
+  }
+  if(lo == index.size()) return false;
+
+  string block;
+  read_block(lo, block);
+  for(size_t p=0; p<block.size(); ) {
+    uint32_t klen = take<uint32_t>(&block[p]), vlen = take<uint32_t>(&block[p + 4]);
+    bool tomb = block[p + 8] != 0;
+    int c = key.compare(0, string::npos, &block[p + 9], klen);
+    if(c == 0) {
+      tombstone = tomb;
+      if(!tomb) value.assign(&block[p + 9 + klen], vlen);
+      return true;
+    }
+    if(c < 0) return false;
+    p += 9 + klen + vlen;
+  }
+  return false;
+}
+
+class SSTable::Iterator : public KVIterator {
+private:
+  shared_ptr<const SSTable> table;
+  size_t block_idx = 0;
+  string block;
+  size_t pos = 0;
+  bool at_end = true;
+  string cur_key, cur_value;
+  bool cur_tomb = false;
+
+  void load(size_t i) {
+    block_idx = i;
+    pos = 0;
+    if(i >= table->index.size()) {
+      at_end = true;
+      return;
+    }
+    table->read_block(i, block);
+    at_end = false;
+    parse();
+  }
+
+  void parse() {
+    if(pos >= block.size()) {
+      load(block_idx + 1);
+      return;
+    }
+    uint32_t klen = take<uint32_t>(&block[pos]), vlen = take<uint32_t>(&block[pos + 4]);
+    cur_tomb = block[pos + 8] != 0;
+    cur_key.assign(&block[pos + 9], klen);
+    cur_value.assign(&block[pos + 9 + klen], vlen);
+  }
+
+  void advance() {
+    uint32_t klen = take<uint32_t>(&block[pos]), vlen = take<uint32_t>(&block[pos + 4]);
+    pos += 9 + klen + vlen;
+    parse();
+  }
+
+public:
+  explicit Iterator(shared_ptr<const SSTable> table) : table(move(table)) {}
+
+  bool valid() const override { return !at_end; }
+  void seek_to_first() override { load(0); }
+
+  void seek(const string& target) override {
+    size_t lo = 0, hi = table->index.size();
+    while(lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if(table->index[mid].last_key < target) lo = mid + 1;
+      else hi = mid;
+    }
+    load(lo);
+    while(!at_end && cur_key < target) advance();
+  }
+
+  void next() override { advance(); }
+  const string& key() const override { return cur_key; }
+  const string& value() const override { return cur_value; }
+  bool tombstone() const override { return cur_tomb; }
+};
+
+unique_ptr<KVIterator> SSTable::iterator() const {
+  return unique_ptr<KVIterator>(new Iterator(shared_from_this()));
+}
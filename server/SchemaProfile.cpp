@@ -0,0 +1,168 @@
+#include "SchemaProfile.h"
+
+#include <cctype>
+
+using namespace std;
+
+static int parse_int(const string& name, const string& value, int lo, int hi) {
+  int n;
+  try {
+    n = stoi(value);
+  } catch(exception&) {
+    throw Exception_("Schema", name + " must be an integer");
+  }
+  if(n < lo || n > hi) {
+    throw Exception_("Schema", name + " must be between " + to_string(lo) + " and " + to_string(hi));
+  }
+  return n;
+}
+
+static bool valid_identifier(const string& name) {
+  if(name.empty() || name.size() > 48) return false;
+  if(!(islower((unsigned char)name[0]) || name[0] == '_')) return false;
+  for(char c : name) {
+    if(!(islower((unsigned char)c) || isdigit((unsigned char)c) || c == '_')) return false;
+  }
+  return true;
+}
+
+SchemaProfile SchemaProfile::parse(const string& spec) {
+  SchemaProfile profile;
+  size_t start = 0;
+  while(start <= spec.size()) {
+    size_t end = spec.find(',', start);
+    if(end == string::npos) end = spec.size();
+    string item = spec.substr(start, end - start);
+    start = end + 1;
+    size_t b = item.find_first_not_of(" \t"), e = item.find_last_not_of(" \t");
+    if(b == string::npos) continue;
+    item = item.substr(b, e - b + 1);
+
+    size_t eq = item.find('=');
+    string name = item.substr(0, eq);
+    string value = eq == string::npos ? "" : item.substr(eq + 1);
+
+    if(name == "default" || name == "logged") continue;
+    else if(name == "unlogged") profile.unlogged = true;
+    else if(name == "hash_index") profile.hash_index = true;
+    else if(name == "partitions") profile.partitions = parse_int(name, value, 0, 1024);
+    else if(name == "fillfactor") profile.fillfactor = parse_int(name, value, 10, 100);
+    else if(name == "table") {
+      if(!valid_identifier(value)) throw Exception_("Schema", "Invalid table name: " + value);
+      profile.table = value;
+    }
+    else throw Exception_("Schema", "Unknown schema option: " + name);
+  }
+  if(profile.partitions == 1) profile.partitions = 0;
+  return profile;
+}
+
+string SchemaProfile::describe() const {
+  string out = unlogged ? "unlogged" : "logged";
+  if(partitions > 0) out += ",partitions=" + to_string(partitions);
+  out += hash_index ? ",hash_index" : ",btree_pk";
+  if(fillfactor > 0) out += ",fillfactor=" + to_string(fillfactor);
+  return out;
+}
+
+// Partitioned parents cannot be UNLOGGED or carry storage parameters, so
+// both go on every partition instead.
+vector<string> SchemaProfile::create_statements() const {
+  vector<string> out;
+  string columns = hash_index ? "(key TEXT NOT NULL, value TEXT)" : "(key TEXT PRIMARY KEY, value TEXT)";
+  string with = fillfactor > 0 ? " WITH (fillfactor=" + to_string(fillfactor) + ")" : "";
+  string logged = unlogged ? "UNLOGGED " : "";
+
+  if(partitions > 0) {
+    out.push_back("CREATE TABLE IF NOT EXISTS " + table + columns + " PARTITION BY HASH (key)");
+    for(int i=0; i<partitions; i++) {
+      out.push_back("CREATE " + logged + "TABLE IF NOT EXISTS " + table + "_p" + to_string(i) +
+        " PARTITION OF " + table + " FOR VALUES WITH (MODULUS " + to_string(partitions) +
+        ", REMAINDER " + to_string(i) + ")" + with);
+    }
+  } else {
+    out.push_back("CREATE " + logged + "TABLE IF NOT EXISTS " + table + columns + with);
+  }
+
+  if(hash_index) {
+    out.push_back("CREATE INDEX IF NOT EXISTS " + table + "_key_hash ON " + table + " USING hash (key)");
+    out.push_back(
+      "CREATE OR REPLACE FUNCTION " + table + "_upsert(k TEXT, v TEXT) RETURNS void AS $$\n"
+      "BEGIN\n"
+      "  PERFORM pg_advisory_xact_lock(hashtext('" + table + "'), hashtext(k));\n"
+      "  UPDATE " + table + " SET value = v WHERE key = k;\n"
+      "  IF NOT FOUND THEN\n"
+      "    INSERT INTO " + table + " (key, value) VALUES (k, v);\n"
+      "  END IF;\n"
+      "END $$ LANGUAGE plpgsql");
+  }
+  return out;
+}
+
+vector<string> SchemaProfile::drop_statements() const {
+  return {
+    "DROP TABLE IF EXISTS " + table + " CASCADE",
+    "DROP FUNCTION IF EXISTS " + table + "_upsert(TEXT, TEXT)"
+  };
+}
+
+string SchemaProfile::get_query() const {
+  return "SELECT value FROM " + table + " WHERE key = $1;";
+}
+
+string SchemaProfile::get_many_query() const {
+  return "SELECT key, value FROM " + table + " WHERE key = ANY($1::text[]);";
+}
+
+string SchemaProfile::set_query() const {
+  if(hash_index) return "SELECT " + table + "_upsert($1, $2);";
+  return "INSERT INTO " + table + " (key, value) VALUES ($1, $2) "
+    "ON CONFLICT (key) DO UPDATE SET value = EXCLUDED.value;";
+}
+
+string SchemaProfile::remove_query() const {
+  return "DELETE FROM " + table + " WHERE key = $1;";
+}
+
+string SchemaProfile::set_many_query() const {
+  string rows = "unnest($1::text[], $2::text[]) AS u(k, v)";
+  // The upsert's advisory locks are taken in hash order (then in arrival
+  // order, so the last duplicate wins): overlapping batches cannot deadlock.
+  if(hash_index) {
+    return "SELECT " + table + "_upsert(k, v) FROM unnest($1::text[], $2::text[]) WITH ORDINALITY AS u(k, v, n) "
+      "ORDER BY hashtext(k), n;";
+  }
+  return "INSERT INTO " + table + " (key, value) SELECT k, v FROM " + rows + " "
+    "ON CONFLICT (key) DO UPDATE SET value = EXCLUDED.value;";
+}
+
+string SchemaProfile::remove_many_query() const {
+  return "DELETE FROM " + table + " WHERE key = ANY($1::text[]);";
+}
+
+string SchemaProfile::scan_query() const {
+  return "SELECT key, value FROM " + table + " WHERE key >= $1 ORDER BY key LIMIT $2;";
+}
+
+string SchemaProfile::copy_in_query() const {
+  return "COPY " + table + " FROM STDIN (FORMAT binary)";
+}
+
+string SchemaProfile::copy_out_query() const {
+  return "COPY " + table + " TO STDOUT (FORMAT binary)";
+}
+
+// Merges the kv_import staging table; the last duplicate in the stream wins.
+vector<string> SchemaProfile::import_merge_statements() const {
+  string latest = "SELECT DISTINCT ON (key) key, value FROM kv_import ORDER BY key, ctid DESC";
+  if(!hash_index) {
+    return {"INSERT INTO " + table + " (key, value) " + latest +
+      " ON CONFLICT (key) DO UPDATE SET value = EXCLUDED.value"};
+  }
+  // No unique index to conflict on: block concurrent upserts, replace rows.
+  return {
+    "LOCK TABLE " + table + " IN SHARE ROW EXCLUSIVE MODE",
+    "DELETE FROM " + table + " t USING (SELECT DISTINCT key FROM kv_import) i WHERE t.key = i.key",
+    "INSERT INTO " + table + " (key, value) " + latest
+  };
+}
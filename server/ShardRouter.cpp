@@ -0,0 +1,407 @@
+#include "ShardRouter.h"
+#include "Deadline.h"
+
+#include <algorithm>
+#include <map>
+#include <exception>
+
+using namespace std;
+
+#define REBALANCE_PAGE 1000
+
+template <typename T>
+static vector<int> ids_of(const map<int, T>& parts) {
+  vector<int> ids;
+  for(auto& part : parts) ids.push_back(part.first);
+  return ids;
+}
+
+ShardRouter::ShardRouter(const vector<StorageBackend*>& stores, int vnodes, int fanout, int previous)
+  : ring((int)stores.size(), vnodes) {
+  if(stores.empty()) throw Exception_("Config", "ShardRouter needs at least one shard");
+  for(StorageBackend* store : stores) {
+    unique_ptr<Shard> shard(new Shard());
+    shard->store = store;
+    shards.push_back(move(shard));
+  }
+  // With one shard nothing is ever split.
+  if(stores.size() > 1) {
+    for(auto& shard : shards) {
+      Shard* s = shard.get();
+      for(int i=0; i<max(1, fanout); i++) s->workers.emplace_back([this, s]() { work(*s); });
+    }
+  }
+  if(previous > 0 && previous < (int)stores.size()) {
+    previous_ring.reset(new HashRing(previous, vnodes));
+    moving = true;
+  }
+}
+
+ShardRouter::~ShardRouter() {
+  if(migrator.joinable()) migrator.join();
+  for(auto& shard : shards) {
+    {
+      lock_guard<mutex> lock(shard->tasks_mtx);
+      shard->stopping = true;
+    }
+    shard->tasks_cv.notify_all();
+    for(thread& t : shard->workers) t.join();
+  }
+}
+
+void ShardRouter::work(Shard& shard) {
+  unique_lock<mutex> lock(shard.tasks_mtx);
+  for(;;) {
+    shard.tasks_cv.wait(lock, [&]() { return shard.stopping || !shard.tasks.empty(); });
+    if(shard.tasks.empty()) return;
+    function<void()> task = move(shard.tasks.front());
+    shard.tasks.pop_front();
+    lock.unlock();
+    task();
+    lock.lock();
+  }
+}
+
+// Parts run under the caller's request deadline. The caller runs the first
+// itself and waits for the rest.
+void ShardRouter::in_parallel(const vector<int>& ids, const function<void(int)>& fn) {
+  if(ids.size() == 1) {
+    fn(ids[0]);
+    return;
+  }
+  vector<exception_ptr> errors(ids.size());
+  mutex done_mtx;
+  condition_variable done_cv;
+  size_t left = ids.size() - 1;
+  deadline::Clock::time_point until = deadline::current();
+  for(size_t i=1; i<ids.size(); i++) {
+    Shard& shard = *shards[ids[i]];
+    {
+      lock_guard<mutex> lock(shard.tasks_mtx);
+      shard.tasks.push_back([&, i]() {
+        {
+          deadline::Scope scope(until);
+          try {
+            fn(ids[i]);
+          } catch(...) {
+            errors[i] = current_exception();
+          }
+        }
+        lock_guard<mutex> lock(done_mtx);
+        if(--left == 0) done_cv.notify_one();
+      });
+    }
+    shard.tasks_cv.notify_one();
+  }
+  try {
+    fn(ids[0]);
+  } catch(...) {
+    errors[0] = current_exception();
+  }
+  {
+    unique_lock<mutex> lock(done_mtx);
+    done_cv.wait(lock, [&]() { return left == 0; });
+  }
+  for(exception_ptr& e : errors) {
+    if(e) rethrow_exception(e);
+  }
+}
+
+bool ShardRouter::moves(const string& key, int& from, int& to) const {
+  if(!moving.load(memory_order_acquire)) return false;
+  to = ring.owner(key);
+  from = previous_ring->owner(key);
+  return from != to;
+}
+
+mutex& ShardRouter::stripe_for(const string& key) {
+  return stripes[HashRing::hash(key.data(), key.size()) % STRIPES];
+}
+
+// Stripes are always taken in index order, so batches cannot deadlock.
+vector<unique_lock<mutex>> ShardRouter::lock_keys(const vector<string>& keys) {
+  vector<int> ids;
+  for(const string& key : keys) ids.push_back(HashRing::hash(key.data(), key.size()) % STRIPES);
+  sort(ids.begin(), ids.end());
+  ids.erase(unique(ids.begin(), ids.end()), ids.end());
+  vector<unique_lock<mutex>> locks;
+  for(int id : ids) locks.emplace_back(stripes[id]);
+  return locks;
+}
+
+pair<bool, string> ShardRouter::read(int shard, const string& key) {
+  Shard& s = *shards[shard];
+  s.reads.fetch_add(1, memory_order_relaxed);
+  try {
+    return s.store->get(key);
+  } catch(...) {
+    s.errors.fetch_add(1, memory_order_relaxed);
+    throw;
+  }
+}
+
+pair<bool, string> ShardRouter::get(const string& key) {
+  int from, to;
+  if(moves(key, from, to)) {
+    lock_guard<mutex> lock(stripe_for(key));
+    pair<bool, string> row = read(to, key);
+    return row.first ? row : read(from, key);
+  }
+  return read(ring.owner(key), key);
+}
+
+unordered_map<string, string> ShardRouter::get_many(const vector<string>& keys) {
+  map<int, vector<string>> parts;
+  vector<string> moving_keys;
+  for(const string& key : keys) {
+    int from, to;
+    if(moves(key, from, to)) moving_keys.push_back(key);
+    else parts[ring.owner(key)].push_back(key);
+  }
+
+  unordered_map<string, string> result;
+  mutex result_mtx;
+  auto fetch = [&](int shard, const vector<string>& part) {
+    Shard& s = *shards[shard];
+    s.reads.fetch_add(part.size(), memory_order_relaxed);
+    unordered_map<string, string> rows;
+    try {
+      rows = s.store->get_many(part);
+    } catch(...) {
+      s.errors.fetch_add(1, memory_order_relaxed);
+      throw;
+    }
+    lock_guard<mutex> lock(result_mtx);
+    for(auto& row : rows) result.emplace(row.first, move(row.second));
+  };
+  if(!parts.empty()) in_parallel(ids_of(parts), [&](int shard) { fetch(shard, parts[shard]); });
+
+  if(!moving_keys.empty()) {
+    vector<unique_lock<mutex>> locks = lock_keys(moving_keys);
+    map<int, vector<string>> new_parts, old_parts;
+    for(const string& key : moving_keys) new_parts[ring.owner(key)].push_back(key);
+    in_parallel(ids_of(new_parts), [&](int shard) { fetch(shard, new_parts[shard]); });
+    for(const string& key : moving_keys) {
+      if(!result.count(key)) old_parts[previous_ring->owner(key)].push_back(key);
+    }
+    if(!old_parts.empty()) in_parallel(ids_of(old_parts), [&](int shard) { fetch(shard, old_parts[shard]); });
+  }
+  return result;
+}
+
+bool ShardRouter::set(const string& key, const string& value) {
+  int from, to;
+  unique_lock<mutex> lock;
+  if(moves(key, from, to)) lock = unique_lock<mutex>(stripe_for(key));
+  else to = ring.owner(key);
+  Shard& s = *shards[to];
+  s.writes.fetch_add(1, memory_order_relaxed);
+  try {
+    return s.store->set(key, value);
+  } catch(...) {
+    s.errors.fetch_add(1, memory_order_relaxed);
+    throw;
+  }
+}
+
+// A key whose owner changed is removed from both shards, so the fallback
+// read cannot bring back a copy the rebalance has not reached yet.
+bool ShardRouter::remove(const string& key) {
+  int from, to;
+  unique_lock<mutex> lock;
+  bool existed = false;
+  if(moves(key, from, to)) {
+    lock = unique_lock<mutex>(stripe_for(key));
+    Shard& s = *shards[from];
+    s.writes.fetch_add(1, memory_order_relaxed);
+    try {
+      existed = s.store->remove(key);
+    } catch(...) {
+      s.errors.fetch_add(1, memory_order_relaxed);
+      throw;
+    }
+  } else {
+    to = ring.owner(key);
+  }
+  Shard& s = *shards[to];
+  s.writes.fetch_add(1, memory_order_relaxed);
+  try {
+    return s.store->remove(key) || existed;
+  } catch(...) {
+    s.errors.fetch_add(1, memory_order_relaxed);
+    throw;
+  }
+}
+
+void ShardRouter::write_batch(const vector<pair<string, string>>& sets, const vector<string>& removes) {
+  struct Part {
+    vector<pair<string, string>> sets;
+    vector<string> removes;
+  };
+  map<int, Part> parts;
+  vector<string> moving_keys;
+  for(const auto& entry : sets) {
+    int from, to;
+    if(moves(entry.first, from, to)) moving_keys.push_back(entry.first);
+    else to = ring.owner(entry.first);
+    parts[to].sets.push_back(entry);
+  }
+  for(const string& key : removes) {
+    int from, to;
+    if(moves(key, from, to)) {
+      moving_keys.push_back(key);
+      parts[from].removes.push_back(key);
+    } else {
+      to = ring.owner(key);
+    }
+    parts[to].removes.push_back(key);
+  }
+  if(parts.empty()) return;
+
+  vector<unique_lock<mutex>> locks;
+  if(!moving_keys.empty()) locks = lock_keys(moving_keys);
+  in_parallel(ids_of(parts), [&](int shard) {
+    Shard& s = *shards[shard];
+    Part& part = parts[shard];
+    s.writes.fetch_add(part.sets.size() + part.removes.size(), memory_order_relaxed);
+    try {
+      s.store->write_batch(part.sets, part.removes);
+    } catch(...) {
+      s.errors.fetch_add(1, memory_order_relaxed);
+      throw;
+    }
+  });
+}
+
+// Each shard returns up to `limit` keys >= start; the smallest `limit` of
+// their union are the answer. While keys move, a key can sit on two shards;
+// the copy on its current owner wins.
+vector<pair<string, string>> ShardRouter::scan(const string& start, size_t limit) {
+  vector<vector<pair<string, string>>> pages(shards.size());
+  vector<int> ids;
+  for(size_t i=0; i<shards.size(); i++) ids.push_back((int)i);
+  in_parallel(ids, [&](int shard) {
+    Shard& s = *shards[shard];
+    s.reads.fetch_add(1, memory_order_relaxed);
+    try {
+      pages[shard] = s.store->scan(start, limit);
+    } catch(...) {
+      s.errors.fetch_add(1, memory_order_relaxed);
+      throw;
+    }
+  });
+
+  map<string, pair<int, string>> merged;
+  for(size_t shard=0; shard<pages.size(); shard++) {
+    for(auto& entry : pages[shard]) {
+      auto it = merged.find(entry.first);
+      if(it == merged.end()) {
+        merged.emplace(move(entry.first), make_pair((int)shard, move(entry.second)));
+      } else if(ring.owner(entry.first) == (int)shard) {
+        it->second = make_pair((int)shard, move(entry.second));
+      }
+    }
+  }
+  vector<pair<string, string>> out;
+  for(auto& entry : merged) {
+    if(out.size() >= limit) break;
+    out.emplace_back(entry.first, move(entry.second.second));
+  }
+  return out;
+}
+
+bool ShardRouter::start_rebalance() {
+  lock_guard<mutex> lock(rebalance_mtx);
+  if(!moving.load() || rebalance_state == "running") return false;
+  if(migrator.joinable()) migrator.join();
+  rebalance_state = "running";
+  migrator = thread(&ShardRouter::migrate, this);
+  return true;
+}
+
+string ShardRouter::rebalance_status() {
+  lock_guard<mutex> lock(rebalance_mtx);
+  string state = rebalance_state;
+  if(state == "idle" && !moving.load()) state = "balanced";
+  return "state=" + state + " scanned=" + to_string(scanned.load()) + " moved=" + to_string(moved.load());
+}
+
+// Walks every shard of the previous ring in key order and moves the keys
+// the current ring places elsewhere. Safe to restart after a failure.
+void ShardRouter::migrate() {
+  try {
+    for(int from=0; from<previous_ring->nodes(); from++) {
+      string last;
+      bool first = true;
+      for(;;) {
+        vector<pair<string, string>> page = shards[from]->store->scan(last, REBALANCE_PAGE + 1);
+        vector<string> keys;
+        size_t fresh = 0;
+        for(auto& entry : page) {
+          if(!first && entry.first <= last) continue;
+          fresh++;
+          if(ring.owner(entry.first) != from) keys.push_back(entry.first);
+        }
+        scanned.fetch_add(fresh, memory_order_relaxed);
+        if(!keys.empty()) migrate_page(from, keys);
+        if(page.size() < REBALANCE_PAGE + 1 || fresh == 0) break;
+        last = page.back().first;
+        first = false;
+      }
+    }
+    lock_guard<mutex> lock(rebalance_mtx);
+    moving = false;
+    rebalance_state = "done";
+  } catch(const exception& e) {
+    cerr << "Rebalance failed: " << e.what() << endl;
+    lock_guard<mutex> lock(rebalance_mtx);
+    rebalance_state = string("failed: ") + e.what();
+  }
+}
+
+// Under the keys' stripe locks: re-read them on the old shard, copy each to
+// its new owner unless a newer write already landed there, then delete the
+// old copies.
+void ShardRouter::migrate_page(int from, const vector<string>& keys) {
+  vector<unique_lock<mutex>> locks = lock_keys(keys);
+  unordered_map<string, string> rows = shards[from]->store->get_many(keys);
+  if(rows.empty()) return;
+
+  map<int, vector<string>> targets;
+  for(auto& row : rows) targets[ring.owner(row.first)].push_back(row.first);
+  in_parallel(ids_of(targets), [&](int to) {
+    StorageBackend* target = shards[to]->store;
+    unordered_map<string, string> present = target->get_many(targets[to]);
+    vector<pair<string, string>> copies;
+    for(const string& key : targets[to]) {
+      if(!present.count(key)) copies.emplace_back(key, rows[key]);
+    }
+    target->write_batch(copies, {});
+  });
+
+  vector<string> removes;
+  for(auto& row : rows) removes.push_back(row.first);
+  shards[from]->store->write_batch({}, removes);
+  moved.fetch_add(rows.size(), memory_order_relaxed);
+}
+
+void ShardRouter::write_metrics(ostream& out) {
+  out << "# TYPE db_shard_count gauge\n";
+  out << "db_shard_count " << shards.size() << "\n";
+  for(size_t i=0; i<shards.size(); i++) {
+    Shard& s = *shards[i];
+    string prefix = "db_shard" + to_string(i);
+    out << "# TYPE " << prefix << "_reads_total counter\n";
+    out << prefix << "_reads_total " << s.reads.load() << "\n";
+    out << "# TYPE " << prefix << "_writes_total counter\n";
+    out << prefix << "_writes_total " << s.writes.load() << "\n";
+    out << "# TYPE " << prefix << "_errors_total counter\n";
+    out << prefix << "_errors_total " << s.errors.load() << "\n";
+  }
+  out << "# TYPE db_rebalance_scanned_keys_total counter\n";
+  out << "db_rebalance_scanned_keys_total " << scanned.load() << "\n";
+  out << "# TYPE db_rebalance_moved_keys_total counter\n";
+  out << "db_rebalance_moved_keys_total " << moved.load() << "\n";
+  out << "# TYPE db_rebalance_pending gauge\n";
+  out << "db_rebalance_pending " << (moving.load() ? 1 : 0) << "\n";
+}
@@ -0,0 +1,150 @@
+#include "TcpServer.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include "Exceptions.h"
+
+using namespace std;
+
+#define TCP_READ_SIZE 16384
+
+static bool send_all(int fd, const string& data) {
+  size_t sent = 0;
+  while(sent < data.size()) {
+    ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return false;
+    sent += n;
+  }
+  return true;
+}
+
+TcpServer::TcpServer(const string& name, int port, int max_clients, const string& busy_reply, Factory factory)
+  : name(name), port(port), max_clients(max(1, max_clients)), busy_reply(busy_reply), factory(move(factory)) {}
+
+TcpServer::~TcpServer() {
+  if(listen_fd < 0) return;
+  stopping = true;
+  shutdown(listen_fd, SHUT_RDWR);
+  acceptor.join();
+  close(listen_fd);
+  unordered_map<unsigned long long, thread> running;
+  {
+    lock_guard<mutex> lock(clients_mtx);
+    for(int fd : client_fds) shutdown(fd, SHUT_RDWR);
+    running.swap(workers);
+  }
+  // Joined rather than waited for, so that no thread still touches the
+  // mutex once the members are gone.
+  for(auto& worker : running) worker.second.join();
+}
+
+void TcpServer::start() {
+  listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(listen_fd < 0) throw Exception_("Tcp", string("Fail to create socket: ") + strerror(errno), 500);
+  int one = 1;
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if(::bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+    string err = strerror(errno);
+    close(listen_fd);
+    listen_fd = -1;
+    throw Exception_("Tcp", "Fail to listen on port " + to_string(port) + ": " + err, 500);
+  }
+  acceptor = thread(&TcpServer::accept_loop, this);
+}
+
+void TcpServer::accept_loop() {
+  while(!stopping) {
+    int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if(fd < 0) {
+      if(stopping) return;
+      // Out of descriptors: back off instead of spinning.
+      if(errno == EMFILE || errno == ENFILE) this_thread::sleep_for(chrono::milliseconds(10));
+      continue;
+    }
+    reap();
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    lock_guard<mutex> lock(clients_mtx);
+    if((int)client_fds.size() >= max_clients) {
+      rejected.fetch_add(1, memory_order_relaxed);
+      send_all(fd, busy_reply);
+      close(fd);
+      continue;
+    }
+    client_fds.insert(fd);
+    unsigned long long id = connections.fetch_add(1, memory_order_relaxed);
+    workers[id] = thread([this, fd, id]() {
+      serve(fd);
+      lock_guard<mutex> lock(clients_mtx);
+      client_fds.erase(fd);
+      close(fd);
+      finished.push_back(id);
+    });
+  }
+}
+
+// Joins the connection threads that have finished since the last accept.
+void TcpServer::reap() {
+  vector<thread> done;
+  {
+    lock_guard<mutex> lock(clients_mtx);
+    for(unsigned long long id : finished) {
+      auto it = workers.find(id);
+      done.push_back(move(it->second));
+      workers.erase(it);
+    }
+    finished.clear();
+  }
+  for(thread& worker : done) worker.join();
+}
+
+void TcpServer::serve(int fd) {
+  unique_ptr<Connection> conn = factory();
+  string in, out;
+  size_t pos = 0;
+  char buf[TCP_READ_SIZE];
+  bool open = true;
+  while(open) {
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return;
+    in.append(buf, n);
+    open = conn->feed(in, pos, out);
+    if(pos == in.size()) {
+      in.clear();
+      pos = 0;
+    } else if(pos >= TCP_READ_SIZE) {
+      in.erase(0, pos);
+      pos = 0;
+    }
+    if(!out.empty()) {
+      if(!send_all(fd, out)) return;
+      out.clear();
+    }
+  }
+}
+
+void TcpServer::write_metrics(ostream& out) {
+  {
+    lock_guard<mutex> lock(clients_mtx);
+    out << "# TYPE " << name << "_clients gauge\n";
+    out << name << "_clients " << client_fds.size() << "\n";
+  }
+  out << "# TYPE " << name << "_connections_total counter\n";
+  out << name << "_connections_total " << connections.load() << "\n";
+  out << "# TYPE " << name << "_rejected_total counter\n";
+  out << name << "_rejected_total " << rejected.load() << "\n";
+}
@@ -0,0 +1,82 @@
+#include "Uring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+Uring::~Uring() {
+  if(sqes) munmap(sqes, sqes_size);
+  if(ring_ptr) munmap(ring_ptr, ring_size);
+  if(ring_fd >= 0) close(ring_fd);
+}
+
+bool Uring::init(unsigned entries, unsigned cq_entries) {
+  io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+  p.cq_entries = cq_entries;
+  ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+  if(ring_fd < 0) return false;
+  if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+    close(ring_fd);
+    ring_fd = -1;
+    errno = ENOSYS;
+    return false;
+  }
+
+  ring_size = max<size_t>(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+    p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe));
+  void* ring = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if(ring == MAP_FAILED) return false;
+  ring_ptr = ring;
+  sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+  void* entries_ptr = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if(entries_ptr == MAP_FAILED) return false;
+  sqes = (io_uring_sqe*)entries_ptr;
+
+  char* base = (char*)ring_ptr;
+  sq_head = (unsigned*)(base + p.sq_off.head);
+  sq_tail = (unsigned*)(base + p.sq_off.tail);
+  sq_mask = *(unsigned*)(base + p.sq_off.ring_mask);
+  sq_entries = p.sq_entries;
+  // SQE i always sits in slot i.
+  unsigned* array = (unsigned*)(base + p.sq_off.array);
+  for(unsigned i=0; i<sq_entries; i++) array[i] = i;
+  sqe_tail = *sq_tail;
+
+  cq_head = (unsigned*)(base + p.cq_off.head);
+  cq_tail = (unsigned*)(base + p.cq_off.tail);
+  cq_mask = *(unsigned*)(base + p.cq_off.ring_mask);
+  cqes = (io_uring_cqe*)(base + p.cq_off.cqes);
+  return true;
+}
+
+io_uring_sqe* Uring::sqe() {
+  if(sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+    submit(0);
+    if(sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) return nullptr;
+  }
+  io_uring_sqe* s = &sqes[sqe_tail & sq_mask];
+  sqe_tail++;
+  memset(s, 0, sizeof(*s));
+  return s;
+}
+
+int Uring::submit(unsigned wait) {
+  __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+  unsigned pending = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  if(pending == 0 && wait == 0) return 0;
+  enters++;
+  int n = syscall(__NR_io_uring_enter, ring_fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+  return n < 0 ? -errno : n;
+}
+
+int Uring::register_resource(unsigned opcode, void* arg, unsigned count) {
+  int n = syscall(__NR_io_uring_register, ring_fd, opcode, arg, count);
+  return n < 0 ? -errno : n;
+}
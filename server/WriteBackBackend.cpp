@@ -0,0 +1,418 @@
+#include "WriteBackBackend.h"
+#include "FileUtil.h"
+#include "Crc32.h"
+#include "Deadline.h"
+
+#include <algorithm>
+#include <map>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+#define JOURNAL_HEADER_SIZE 13
+#define JOURNAL_OP_SET 'S'
+#define JOURNAL_OP_DEL 'D'
+
+// Journal record: [u32 crc][u8 op][u32 klen][u32 vlen][key][value], the crc
+// covering everything after itself.
+
+template <typename T>
+static void put(string& out, T v) {
+  out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+template <typename T>
+static T take(const char* p) {
+  T v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static void raise_to(atomic<uint64_t>& target, uint64_t value) {
+  uint64_t current = target.load();
+  while(current < value && !target.compare_exchange_weak(current, value)) {}
+}
+
+static uint64_t file_size(const string& path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+WriteBackBackend::WriteBackBackend(StorageBackend& inner, Cache* cache, const string& dir,
+  int flush_ms, size_t batch_size, size_t max_dirty)
+  : inner(inner), cache(cache), dir(dir), flush_ms(max(1, flush_ms)),
+    batch_size(max<size_t>(1, batch_size)), max_dirty(max<size_t>(1, max_dirty)) {
+  fileutil::make_dirs(dir);
+  vector<uint64_t> numbers = journal_numbers();
+  for(uint64_t n : numbers) replay(journal_path(n));
+  open_journal(numbers.empty() ? 1 : numbers.back());
+  flusher = thread(&WriteBackBackend::flush_loop, this);
+}
+
+WriteBackBackend::~WriteBackBackend() {
+  {
+    lock_guard<mutex> lock(flusher_mtx);
+    stopping = true;
+  }
+  flusher_cv.notify_all();
+  if(flusher.joinable()) flusher.join();
+  try {
+    flush();
+  } catch(const exception& e) {
+    cerr << "Write-back: pending writes stay in the journal: " << e.what() << endl;
+  }
+  if(journal_fd >= 0) ::close(journal_fd);
+  if(unsynced_fd >= 0) ::close(unsynced_fd);
+}
+
+string WriteBackBackend::journal_path(uint64_t number) const {
+  return dir + "/journal." + to_string(number) + ".log";
+}
+
+vector<uint64_t> WriteBackBackend::journal_numbers() const {
+  const string prefix = "journal.", suffix = ".log";
+  vector<uint64_t> numbers;
+  for(const string& name : fileutil::list_dir(dir)) {
+    if(name.size() <= prefix.size() + suffix.size()) continue;
+    if(name.compare(0, prefix.size(), prefix) != 0) continue;
+    if(name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) continue;
+    string digits = name.substr(prefix.size(), name.size() - prefix.size() - suffix.size());
+    if(digits.find_first_not_of("0123456789") != string::npos) continue;
+    numbers.push_back(stoull(digits));
+  }
+  sort(numbers.begin(), numbers.end());
+  return numbers;
+}
+
+void WriteBackBackend::replay(const string& path) {
+  string data = fileutil::read_file(path);
+  size_t pos = 0;
+  // Stops at the first torn record, which a crash mid-append leaves behind.
+  while(pos + JOURNAL_HEADER_SIZE <= data.size()) {
+    const char* p = data.data() + pos;
+    uint32_t klen = take<uint32_t>(p + 5);
+    uint32_t vlen = take<uint32_t>(p + 9);
+    size_t size = JOURNAL_HEADER_SIZE + (size_t)klen + vlen;
+    if(pos + size > data.size() || crc32(p + 4, size - 4) != take<uint32_t>(p)) break;
+    Entry& entry = dirty[string(p + JOURNAL_HEADER_SIZE, klen)];
+    entry.tombstone = p[4] == JOURNAL_OP_DEL;
+    entry.value.assign(p + JOURNAL_HEADER_SIZE + klen, vlen);
+    pos += size;
+  }
+  if(pos < data.size()) {
+    cerr << "Write-back: dropping " << data.size() - pos << " torn bytes at the end of " << path << endl;
+    if(truncate(path.c_str(), pos) != 0) {
+      throw Exception_("WriteBack", "Fail to truncate " + path + ": " + strerror(errno), 500);
+    }
+  }
+  journal_bytes += pos;
+}
+
+void WriteBackBackend::open_journal(uint64_t number) {
+  string path = journal_path(number);
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if(fd < 0) throw Exception_("WriteBack", "Fail to open " + path + ": " + strerror(errno), 500);
+  fileutil::sync_dir(dir);
+  journal_fd = fd;
+  journal_number = number;
+}
+
+bool WriteBackBackend::pending(const string& key, Entry& out) {
+  lock_guard<mutex> lock(mtx);
+  auto it = dirty.find(key);
+  if(it != dirty.end()) {
+    out = it->second;
+    return true;
+  }
+  it = flushing.find(key);
+  if(it != flushing.end()) {
+    out = it->second;
+    return true;
+  }
+  return false;
+}
+
+// Journal and dirty table are updated under one lock, so the journal order
+// of two writes to a key is the order the dirty table saw them.
+uint64_t WriteBackBackend::write(const string& key, const string& value, bool tombstone) {
+  string record;
+  record.reserve(JOURNAL_HEADER_SIZE + key.size() + value.size());
+  put<uint32_t>(record, 0);
+  record.push_back(tombstone ? JOURNAL_OP_DEL : JOURNAL_OP_SET);
+  put<uint32_t>(record, (uint32_t)key.size());
+  put<uint32_t>(record, (uint32_t)value.size());
+  record += key;
+  record += value;
+  uint32_t crc = crc32(record.data() + 4, record.size() - 4);
+  memcpy(&record[0], &crc, sizeof(crc));
+
+  unique_lock<mutex> lock(mtx);
+  auto it = dirty.find(key);
+  if(it == dirty.end() && dirty.size() + flushing.size() >= max_dirty) {
+    // The store is behind: hold new keys until a flush makes room.
+    stalls.fetch_add(1, memory_order_relaxed);
+    flusher_cv.notify_one();
+    auto room = [&]() { return dirty.size() + flushing.size() < max_dirty; };
+    if(!deadline::bounded()) space_cv.wait(lock, room);
+    else if(!space_cv.wait_until(lock, deadline::current(), room)) {
+      throw Exception_("Timeout", "Request deadline exceeded waiting for write-back room", 504);
+    }
+    it = dirty.find(key);
+  }
+  fileutil::write_all(journal_fd, record.data(), record.size(), journal_path(journal_number));
+  journal_bytes += record.size();
+  uint64_t position = appended += record.size();
+  if(it != dirty.end()) {
+    coalesced.fetch_add(1, memory_order_relaxed);
+    it->second.value = value;
+    it->second.tombstone = tombstone;
+  } else {
+    Entry& entry = dirty[key];
+    entry.value = value;
+    entry.tombstone = tombstone;
+  }
+  writes.fetch_add(1, memory_order_relaxed);
+  if(dirty.size() >= batch_size) flusher_cv.notify_one();
+  return position;
+}
+
+void WriteBackBackend::sync_to(uint64_t position) {
+  lock_guard<mutex> lock(sync_mtx);
+  if(synced.load() >= position) return;
+  sync_unsynced();
+  uint64_t target;
+  int fd;
+  {
+    lock_guard<mutex> append_lock(mtx);
+    target = appended.load();
+    fd = journal_fd;
+  }
+  if(fdatasync(fd) != 0) throw Exception_("WriteBack", string("Fail to sync journal: ") + strerror(errno), 500);
+  syncs.fetch_add(1, memory_order_relaxed);
+  raise_to(synced, target);
+}
+
+void WriteBackBackend::sync_unsynced() {
+  if(unsynced_fd < 0) return;
+  if(fdatasync(unsynced_fd) != 0) {
+    throw Exception_("WriteBack", string("Fail to sync sealed journal: ") + strerror(errno), 500);
+  }
+  ::close(unsynced_fd);
+  unsynced_fd = -1;
+}
+
+pair<bool, string> WriteBackBackend::get(const string& key) {
+  Entry entry;
+  if(pending(key, entry)) {
+    if(entry.tombstone) return {false, ""};
+    return {true, entry.value};
+  }
+  return inner.get(key);
+}
+
+unordered_map<string, string> WriteBackBackend::get_many(const vector<string>& keys) {
+  unordered_map<string, string> result;
+  vector<string> rest;
+  {
+    lock_guard<mutex> lock(mtx);
+    for(const string& key : keys) {
+      auto it = dirty.find(key);
+      if(it == dirty.end()) {
+        it = flushing.find(key);
+        if(it == flushing.end()) {
+          rest.push_back(key);
+          continue;
+        }
+      }
+      if(!it->second.tombstone) result.emplace(key, it->second.value);
+    }
+  }
+  if(!rest.empty()) {
+    for(auto& entry : inner.get_many(rest)) result.emplace(entry.first, move(entry.second));
+  }
+  return result;
+}
+
+bool WriteBackBackend::set(const string& key, const string& value) {
+  sync_to(write(key, value, false));
+  return true;
+}
+
+bool WriteBackBackend::remove(const string& key) {
+  Entry entry;
+  bool existed;
+  if(pending(key, entry)) existed = !entry.tombstone;
+  else if(cache && cache->get(key).first) existed = true;
+  else existed = inner.get(key).first;
+  if(!existed) return false;
+  sync_to(write(key, "", true));
+  return true;
+}
+
+void WriteBackBackend::write_batch(const vector<pair<string, string>>& sets, const vector<string>& removes) {
+  uint64_t position = 0;
+  for(const auto& entry : sets) position = write(entry.first, entry.second, false);
+  for(const string& key : removes) position = write(key, "", true);
+  if(position > 0) sync_to(position);
+}
+
+// Pending entries are laid over a store scan that is long enough to survive
+// every pending delete in range.
+vector<pair<string, string>> WriteBackBackend::scan(const string& start, size_t limit) {
+  map<string, Entry> overlay;
+  size_t tombstones = 0;
+  {
+    lock_guard<mutex> lock(mtx);
+    for(auto& entry : flushing) {
+      if(entry.first >= start) overlay[entry.first] = entry.second;
+    }
+    for(auto& entry : dirty) {
+      if(entry.first >= start) overlay[entry.first] = entry.second;
+    }
+  }
+  for(auto& entry : overlay) {
+    if(entry.second.tombstone) tombstones++;
+  }
+
+  map<string, string> merged;
+  for(auto& entry : inner.scan(start, limit + tombstones)) merged.emplace(move(entry.first), move(entry.second));
+  for(auto& entry : overlay) {
+    if(entry.second.tombstone) merged.erase(entry.first);
+    else merged[entry.first] = entry.second.value;
+  }
+  vector<pair<string, string>> out;
+  for(auto& entry : merged) {
+    if(out.size() >= limit) break;
+    out.emplace_back(entry.first, move(entry.second));
+  }
+  return out;
+}
+
+void WriteBackBackend::flush() {
+  flush_once();
+}
+
+void WriteBackBackend::flush_loop() {
+  bool failing = false;
+  unique_lock<mutex> lock(flusher_mtx);
+  while(!stopping) {
+    flusher_cv.wait_for(lock, chrono::milliseconds(flush_ms));
+    if(stopping) break;
+    lock.unlock();
+    try {
+      flush_once();
+      failing = false;
+    } catch(const exception& e) {
+      // Report the first failure of a streak; the batch is retried every tick.
+      if(!failing) cerr << "Write-back flush failed: " << e.what() << endl;
+      failing = true;
+    }
+    lock.lock();
+  }
+}
+
+// Moves the dirty table into the flushing batch and starts a new journal
+// segment, writes the batch to the store, and then drops it together with
+// every segment before the new one.
+size_t WriteBackBackend::flush_once() {
+  lock_guard<mutex> flush_lock(flush_mtx);
+  uint64_t sealed;
+  {
+    lock_guard<mutex> sync_lock(sync_mtx);
+    // At most one segment waits for a retried sync; the batch waits with it.
+    sync_unsynced();
+    int old_fd;
+    uint64_t target;
+    {
+      lock_guard<mutex> lock(mtx);
+      if(dirty.empty() && flushing.empty()) return 0;
+      for(auto& entry : dirty) flushing[entry.first] = move(entry.second);
+      dirty.clear();
+      old_fd = journal_fd;
+      sealed = journal_number;
+      open_journal(sealed + 1);
+      target = appended.load();
+    }
+    // Writers that appended to the sealed segment may still be waiting on it.
+    // If its sync fails `synced` stays put: they fail, or succeed once a
+    // later sync_to manages to sync it.
+    unsynced_fd = old_fd;
+    try {
+      sync_unsynced();
+      raise_to(synced, target);
+    } catch(const Exception_& e) {
+      cerr << "Write-back: " << journal_path(sealed) << ": " << e.what() << endl;
+    }
+  }
+
+  // Only flush cycles change `flushing`, so it is read here without mtx.
+  vector<pair<string, string>> sets;
+  vector<string> removes;
+  auto push = [&]() {
+    inner.write_batch(sets, removes);
+    sets.clear();
+    removes.clear();
+  };
+  try {
+    for(auto& entry : flushing) {
+      if(entry.second.tombstone) removes.push_back(entry.first);
+      else sets.emplace_back(entry.first, entry.second.value);
+      if(sets.size() + removes.size() >= batch_size) push();
+    }
+    push();
+  } catch(...) {
+    flush_failures.fetch_add(1, memory_order_relaxed);
+    throw;
+  }
+
+  size_t count;
+  {
+    lock_guard<mutex> lock(mtx);
+    count = flushing.size();
+    flushing.clear();
+  }
+  space_cv.notify_all();
+  for(uint64_t n : journal_numbers()) {
+    if(n > sealed) break;
+    journal_bytes -= file_size(journal_path(n));
+    ::unlink(journal_path(n).c_str());
+  }
+  flushes.fetch_add(1, memory_order_relaxed);
+  flushed_keys.fetch_add(count, memory_order_relaxed);
+  return count;
+}
+
+void WriteBackBackend::write_metrics(ostream& out) {
+  inner.write_metrics(out);
+  size_t dirty_count, flushing_count;
+  {
+    lock_guard<mutex> lock(mtx);
+    dirty_count = dirty.size();
+    flushing_count = flushing.size();
+  }
+  out << "# TYPE writeback_dirty_keys gauge\n";
+  out << "writeback_dirty_keys " << dirty_count << "\n";
+  out << "# TYPE writeback_flushing_keys gauge\n";
+  out << "writeback_flushing_keys " << flushing_count << "\n";
+  out << "# TYPE writeback_journal_bytes gauge\n";
+  out << "writeback_journal_bytes " << journal_bytes.load() << "\n";
+  out << "# TYPE writeback_writes_total counter\n";
+  out << "writeback_writes_total " << writes.load() << "\n";
+  out << "# TYPE writeback_coalesced_total counter\n";
+  out << "writeback_coalesced_total " << coalesced.load() << "\n";
+  out << "# TYPE writeback_flushes_total counter\n";
+  out << "writeback_flushes_total " << flushes.load() << "\n";
+  out << "# TYPE writeback_flushed_keys_total counter\n";
+  out << "writeback_flushed_keys_total " << flushed_keys.load() << "\n";
+  out << "# TYPE writeback_flush_failures_total counter\n";
+  out << "writeback_flush_failures_total " << flush_failures.load() << "\n";
+  out << "# TYPE writeback_fsyncs_total counter\n";
+  out << "writeback_fsyncs_total " << syncs.load() << "\n";
+  out << "# TYPE writeback_stalls_total counter\n";
+  out << "writeback_stalls_total " << stalls.load() << "\n";
+}
@@ -1,16 +1,137 @@
 #include <iostream>
 #include <libpq-fe.h>
 #include <cstdlib>
+#include <sstream>
+#include <memory>
+#include <algorithm>
 
+#include "StorageBackend.h"
 #include "DBConnectionPool.h"
+#include "ReadRouter.h"
+#include "ShardRouter.h"
+#include "MemoryBackend.h"
+#include "LSMBackend.h"
+#include "BitcaskBackend.h"
+#include "BTreeBackend.h"
+#include "AofBackend.h"
+#include "WriteBackBackend.h"
+#include "CacheCoherence.h"
+#include "ChangeLog.h"
+#include "Router.h"
+#include "BatchCodec.h"
+#include "KeyService.h"
+#include "RespServer.h"
+#include "MemcacheServer.h"
+#include "HttpReactor.h"
+#include "CopyBinary.h"
 #include "Cache.h"
+#include "Deadline.h"
 
 #include "httplib.h"
 
 #define CACHE_BUCKETS 10
+#define DB_POOL_MIN_DEFAULT 4
+#define DB_POOL_MAX_DEFAULT 32
+#define READ_YOUR_WRITES_MS_DEFAULT 1000
+#define DB_SHARD_VNODES_DEFAULT 128
+#define DB_BREAKER_WINDOW_MS_DEFAULT 10000
+#define DB_BREAKER_MIN_CALLS_DEFAULT 20
+#define DB_BREAKER_ERROR_PERCENT_DEFAULT 50
+#define DB_BREAKER_SLOW_MS_DEFAULT 1000
+#define DB_BREAKER_SLOW_PERCENT_DEFAULT 80
+#define DB_BREAKER_OPEN_MS_DEFAULT 5000
+#define DB_BREAKER_PROBES_DEFAULT 3
+#define MISS_BATCH_MAX_DEFAULT 128
+#define MISS_BATCH_WINDOW_US_DEFAULT 200
+#define STORAGE_PATH_DEFAULT "./data"
+#define BTREE_MAP_MB_DEFAULT 65536
+#define AOF_CACHE_BUCKETS 256
+#define AOF_REWRITE_MIN_MB_DEFAULT 64
+#define AOF_REWRITE_PERCENT_DEFAULT 100
+#define WRITE_BACK_FLUSH_MS_DEFAULT 50
+#define WRITE_BACK_BATCH_DEFAULT 1000
+#define WRITE_BACK_MAX_DIRTY_DEFAULT 1000000
+#define CACHE_COHERENCE_CHANNEL_DEFAULT "kv_invalidate"
+#define CACHE_COHERENCE_FLUSH_MS_DEFAULT 5
+#define CHANGES_MAX_EVENTS_DEFAULT 100000
+#define CHANGES_MAX_MB_DEFAULT 64
+#define CHANGES_READ_BATCH 256
+#define CHANGES_HEARTBEAT_MS 5000
+#define KEY_PREFIX "/api/"
+#define BATCH_MAX_KEYS_DEFAULT 1000
+#define RESP_MAX_CLIENTS_DEFAULT 1024
+#define MEMCACHE_MAX_CLIENTS_DEFAULT 1024
+#define HTTP_MAX_CONNECTIONS_DEFAULT 10000
+#define HTTP_IDLE_TIMEOUT_MS_DEFAULT 60000
+#define HTTP_MAX_BODY_MB_DEFAULT 64
+#define REQUEST_TIMEOUT_MS_DEFAULT 5000
+#define REQUEST_TIMEOUT_MAX_MS_DEFAULT 60000
 
 using namespace std;
 
+static int env_int(const char* name, int fallback, int lo) {
+  const char* v = getenv(name);
+  if(!v) return fallback;
+  try {
+    return max(lo, stoi(v));
+  } catch(exception&) {
+    throw Exception_("Config", string(name) + " must be an integer");
+  }
+}
+
+// Deadline for a key request: X-Timeout-Ms when the client sends one (capped
+// at max_ms), the server default otherwise; 0 means unbounded.
+static deadline::Clock::time_point request_deadline(const httplib::Request& req, int default_ms, int max_ms) {
+  long long ms = default_ms;
+  if(req.has_header("X-Timeout-Ms")) {
+    try {
+      // Only the server default can turn deadlines off.
+      ms = min<long long>(max(1LL, stoll(req.get_header_value("X-Timeout-Ms"))), max_ms);
+    } catch(exception&) {}
+  }
+  if(ms == 0) return deadline::Clock::time_point::max();
+  return deadline::Clock::now() + chrono::milliseconds(ms);
+}
+
+static void append_json_string(string& out, const string& s) {
+  static const char* hex = "0123456789abcdef";
+  out.push_back('"');
+  for(unsigned char c : s) {
+    if(c == '"' || c == '\\') {
+      out.push_back('\\');
+      out.push_back(c);
+    } else if(c < 0x20) {
+      out += "\\u00";
+      out.push_back(hex[c >> 4]);
+      out.push_back(hex[c & 15]);
+    } else {
+      out.push_back(c);
+    }
+  }
+  out.push_back('"');
+}
+
+// One server-sent event per change; `id` lets EventSource clients resume
+// through Last-Event-ID.
+static void append_change_event(string& out, const ChangeLog::Event& e) {
+  out += "id: " + to_string(e.seq) + "\nevent: " + (e.removed ? "delete" : "put") + "\ndata: {\"key\":";
+  append_json_string(out, e.key);
+  if(!e.removed) {
+    out += ",\"value\":";
+    append_json_string(out, e.value);
+  }
+  out += "}\n\n";
+}
+
+// 503 when no database connection freed up in time (safe to retry), 504 when
+// the deadline ran out in or waiting for a query, 500 for anything else.
+static void error_response(httplib::Response& res, const Exception_& e) {
+  res.status = e.code_() == 503 || e.code_() == 504 ? e.code_() : 500;
+  string label = res.status == 503 ? "Service Unavailable: " : res.status == 504 ? "Gateway Timeout: " : "Internal Server Error: ";
+  if(res.status == 503) res.set_header("Retry-After", "1");
+  res.set_content(label + string(e.what()), "text/plain");
+}
+
 int main(int argc, char* argv[]) {
   int port = 8000;
   int threads = 8;
@@ -39,22 +160,243 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
-  const char* db_conn = getenv("DB_CONN");
-  string connectionString;
+  // STORAGE selects the persistent tier: postgres (default), memory, an
+  // in-process engine that needs no external service, or one of the embedded
+  // engines kept under STORAGE_PATH: lsm (log-structured merge tree),
+  // bitcask (log-structured hash) or btree (mmap'd copy-on-write B+tree).
+  // STORAGE=aof makes the cache itself the store: it never evicts, and an
+  // append-only file plus snapshots under STORAGE_PATH make it durable.
+  string storage = getenv("STORAGE") ? getenv("STORAGE") : "postgres";
+  bool cacheAuthoritative = storage == "aof";
+
+  int bucket_size = cachesize/CACHE_BUCKETS;
+  Cache cache(cacheAuthoritative ? 0 : bucket_size, cacheAuthoritative ? AOF_CACHE_BUCKETS : CACHE_BUCKETS);
+  unique_ptr<DBConnectionPool> dbclient;
+  unique_ptr<ReadRouter> reader;
+  vector<unique_ptr<DBConnectionPool>> shardPools;
+  unique_ptr<ShardRouter> sharder;
+  unique_ptr<StorageBackend> embedded;
+  unique_ptr<WriteBackBackend> writeback;
+  unique_ptr<CacheCoherence> coherence;
+  StorageBackend* store = nullptr;
+  string primaryConn;
+  int batchInflight = threads;
+  string backendInfo;
+
+  try {
+    if(storage == "postgres") {
+      const char* db_conn = getenv("DB_CONN");
+      if(!db_conn) {
+        cerr << "Database connection string is not provided!\n";
+        return 1;
+      }
+
+      // Pool bounds are independent of the HTTP thread count; the pool grows
+      // towards the max under acquire pressure and shrinks back when idle.
+      int pool_min = env_int("DB_POOL_MIN", DB_POOL_MIN_DEFAULT, 1);
+      int pool_max = max(pool_min, env_int("DB_POOL_MAX", DB_POOL_MAX_DEFAULT, 1));
 
-  if(db_conn) connectionString = db_conn;
-  else {
-    cerr << "Database connection string is not provided!\n";
+      // Optional standbys for cache-miss reads: DB_READ_CONN="<conn>;<conn>;...",
+      // DB_READ_POLICY=round_robin|least_outstanding, DB_READ_YOUR_WRITES_MS window.
+      vector<string> replicaConns;
+      if(const char* v = getenv("DB_READ_CONN")) replicaConns = ReadRouter::split_conn_list(v);
+      ReadRouter::Policy readPolicy = ReadRouter::ROUND_ROBIN;
+      if(const char* v = getenv("DB_READ_POLICY")) {
+        string policy = v;
+        if(policy == "least_outstanding") readPolicy = ReadRouter::LEAST_OUTSTANDING;
+        else if(policy != "round_robin") {
+          throw Exception_("Config", "DB_READ_POLICY must be round_robin or least_outstanding");
+        }
+      }
+      int rywWindow = env_int("DB_READ_YOUR_WRITES_MS", READ_YOUR_WRITES_MS_DEFAULT, 0);
+
+      // DB_SCHEMA picks the table layout, e.g. "unlogged,partitions=8,fillfactor=80";
+      // an existing table is used as-is.
+      SchemaProfile schema;
+      if(const char* v = getenv("DB_SCHEMA")) schema = SchemaProfile::parse(v);
+
+      // Every pool (primary, standby, shard) has its own circuit breaker: it
+      // opens when DB_BREAKER_ERROR_PERCENT of the calls in the last
+      // DB_BREAKER_WINDOW_MS failed, or DB_BREAKER_SLOW_PERCENT took longer
+      // than DB_BREAKER_SLOW_MS, and fails calls fast for DB_BREAKER_OPEN_MS
+      // before probing. DB_BREAKER=0 turns it off.
+      CircuitBreaker::Config breaker;
+      breaker.enabled = env_int("DB_BREAKER", 1, 0) != 0;
+      breaker.window_ms = env_int("DB_BREAKER_WINDOW_MS", DB_BREAKER_WINDOW_MS_DEFAULT, 10);
+      breaker.min_calls = env_int("DB_BREAKER_MIN_CALLS", DB_BREAKER_MIN_CALLS_DEFAULT, 1);
+      breaker.error_percent = env_int("DB_BREAKER_ERROR_PERCENT", DB_BREAKER_ERROR_PERCENT_DEFAULT, 1);
+      breaker.slow_ms = env_int("DB_BREAKER_SLOW_MS", DB_BREAKER_SLOW_MS_DEFAULT, 0);
+      breaker.slow_percent = env_int("DB_BREAKER_SLOW_PERCENT", DB_BREAKER_SLOW_PERCENT_DEFAULT, 1);
+      breaker.open_ms = env_int("DB_BREAKER_OPEN_MS", DB_BREAKER_OPEN_MS_DEFAULT, 1);
+      breaker.probes = env_int("DB_BREAKER_PROBES", DB_BREAKER_PROBES_DEFAULT, 1);
+
+      // DB_CONN may list several databases, ';'-separated: keys are spread
+      // over them on a consistent-hash ring with DB_SHARD_VNODES points per
+      // shard. After appending shards, DB_SHARDS_PREVIOUS=<old count> keeps
+      // keys readable on their old shard until POST /api/_rebalance moves them.
+      vector<string> shardConns = ReadRouter::split_conn_list(db_conn);
+      primaryConn = shardConns.empty() ? db_conn : shardConns[0];
+      if(shardConns.size() > 1) {
+        if(!replicaConns.empty()) throw Exception_("Config", "DB_READ_CONN needs a single database in DB_CONN");
+        int vnodes = env_int("DB_SHARD_VNODES", DB_SHARD_VNODES_DEFAULT, 1);
+        int previous = env_int("DB_SHARDS_PREVIOUS", 0, 0);
+        vector<StorageBackend*> shardStores;
+        for(const string& conn : shardConns) {
+          shardPools.emplace_back(new DBConnectionPool(conn, pool_min, pool_max, schema, breaker));
+          shardPools.back()->createPool();
+          shardStores.push_back(shardPools.back().get());
+        }
+        sharder.reset(new ShardRouter(shardStores, vnodes, threads, previous));
+        store = sharder.get();
+        batchInflight = pool_min * (int)shardConns.size();
+        backendInfo = "postgres, " + to_string(shardConns.size()) + " shards (" + to_string(vnodes) +
+          " vnodes), pool " + to_string(pool_min) + ".." + to_string(pool_max) + " each, schema " + schema.describe();
+        if(previous > 0) backendInfo += ", rebalancing from " + to_string(previous) + " shards";
+      } else {
+        dbclient.reset(new DBConnectionPool(db_conn, pool_min, pool_max, schema, breaker));
+        reader.reset(new ReadRouter(*dbclient, replicaConns, pool_min, pool_max, readPolicy, rywWindow));
+        dbclient->createPool();
+        reader->createPools();
+        store = reader.get();
+        batchInflight = pool_min;
+        backendInfo = "postgres, pool " + to_string(pool_min) + ".." + to_string(pool_max) +
+          ", read replicas " + to_string(replicaConns.size()) + ", schema " + schema.describe();
+      }
+    } else if(storage == "memory") {
+      embedded.reset(new MemoryBackend());
+      store = embedded.get();
+      backendInfo = "memory";
+    } else if(storage == "lsm" || storage == "bitcask" || storage == "btree") {
+      // STORAGE_SYNC=0 acknowledges writes once they reach the OS page cache.
+      string path = getenv("STORAGE_PATH") ? getenv("STORAGE_PATH") : string(STORAGE_PATH_DEFAULT) + "/" + storage;
+      bool sync = env_int("STORAGE_SYNC", 1, 0) != 0;
+      if(storage == "lsm") {
+        embedded.reset(new LSMBackend(path, sync));
+      } else if(storage == "bitcask") {
+        embedded.reset(new BitcaskBackend(path, sync));
+      } else {
+        // BTREE_MAP_MB reserves address space for the file; it bounds its size.
+        size_t map_mb = env_int("BTREE_MAP_MB", BTREE_MAP_MB_DEFAULT, 1);
+        embedded.reset(new BTreeBackend(path + "/data.btree", sync, map_mb << 20));
+      }
+      store = embedded.get();
+      backendInfo = storage + " at " + path + (sync ? "" : ", no fsync");
+    } else if(storage == "aof") {
+      // AOF_FSYNC=always|everysec|no; the AOF is compacted into a snapshot
+      // once it exceeds AOF_REWRITE_MIN_MB (0 disables) and has grown to
+      // AOF_REWRITE_PERCENT of the last snapshot.
+      string path = getenv("STORAGE_PATH") ? getenv("STORAGE_PATH") : string(STORAGE_PATH_DEFAULT) + "/" + storage;
+      string fsyncName = getenv("AOF_FSYNC") ? getenv("AOF_FSYNC") : "everysec";
+      AofBackend::FsyncPolicy fsyncPolicy = AofBackend::parse_policy(fsyncName);
+      uint64_t rewriteMin = (uint64_t)env_int("AOF_REWRITE_MIN_MB", AOF_REWRITE_MIN_MB_DEFAULT, 0) << 20;
+      int rewritePercent = env_int("AOF_REWRITE_PERCENT", AOF_REWRITE_PERCENT_DEFAULT, 0);
+      embedded.reset(new AofBackend(cache, path, fsyncPolicy, rewriteMin, rewritePercent));
+      store = embedded.get();
+      backendInfo = "aof at " + path + ", fsync " + fsyncName;
+    } else {
+      throw Exception_("Config", "STORAGE must be postgres, memory, lsm, bitcask, btree or aof");
+    }
+
+    // CACHE_COHERENCE=1 keeps the caches of several instances on one
+    // database coherent: writes are published on CACHE_COHERENCE_CHANNEL
+    // every CACHE_COHERENCE_FLUSH_MS and evicted by the other instances.
+    if(env_int("CACHE_COHERENCE", 0, 0) != 0) {
+      if(storage != "postgres") throw Exception_("Config", "CACHE_COHERENCE needs STORAGE=postgres");
+      string channel = getenv("CACHE_COHERENCE_CHANNEL") ? getenv("CACHE_COHERENCE_CHANNEL") : CACHE_COHERENCE_CHANNEL_DEFAULT;
+      int flushMs = env_int("CACHE_COHERENCE_FLUSH_MS", CACHE_COHERENCE_FLUSH_MS_DEFAULT, 1);
+      coherence.reset(new CacheCoherence(*store, cache, primaryConn, channel, flushMs));
+      store = coherence.get();
+      backendInfo += ", coherent cache on " + channel;
+    }
+
+    // WRITE_BACK=1 acknowledges PUT and DELETE once they are in the cache and
+    // an fsync'd journal under WRITE_BACK_PATH; the store is updated in the
+    // background every WRITE_BACK_FLUSH_MS, WRITE_BACK_BATCH keys per batch.
+    // New keys wait once WRITE_BACK_MAX_DIRTY are pending.
+    if(env_int("WRITE_BACK", 0, 0) != 0) {
+      if(cacheAuthoritative) throw Exception_("Config", "WRITE_BACK does not apply to STORAGE=aof");
+      string path = getenv("WRITE_BACK_PATH") ? getenv("WRITE_BACK_PATH") : string(STORAGE_PATH_DEFAULT) + "/writeback";
+      int flushMs = env_int("WRITE_BACK_FLUSH_MS", WRITE_BACK_FLUSH_MS_DEFAULT, 1);
+      int batch = env_int("WRITE_BACK_BATCH", WRITE_BACK_BATCH_DEFAULT, 1);
+      int maxDirty = env_int("WRITE_BACK_MAX_DIRTY", WRITE_BACK_MAX_DIRTY_DEFAULT, 1);
+      writeback.reset(new WriteBackBackend(*store, &cache, path, flushMs, batch, maxDirty));
+      store = writeback.get();
+      backendInfo += ", write-back via " + path;
+    }
+  } catch(const Exception_& e) {
+    cerr << e.what() << endl;
     return 1;
   }
-  
-  int bucket_size = cachesize/CACHE_BUCKETS;
-  Cache cache(bucket_size, CACHE_BUCKETS);
 
-  DBConnectionPool dbclient(connectionString, threads);
+  // CHANGES=1 keeps the last CHANGES_MAX_EVENTS PUT/DELETE events (at most
+  // CHANGES_MAX_MB) for GET /api/_changes; each stream holds a server
+  // thread, so at most CHANGES_MAX_STREAMS (default: half the threads) run.
+  unique_ptr<ChangeLog> changes;
+  int changesMaxStreams = 0;
+  try {
+    if(env_int("CHANGES", 0, 0) != 0) {
+      size_t maxEvents = env_int("CHANGES_MAX_EVENTS", CHANGES_MAX_EVENTS_DEFAULT, 1);
+      size_t maxBytes = (size_t)env_int("CHANGES_MAX_MB", CHANGES_MAX_MB_DEFAULT, 1) << 20;
+      changes.reset(new ChangeLog(maxEvents, maxBytes));
+      changesMaxStreams = env_int("CHANGES_MAX_STREAMS", max(1, threads / 2), 1);
+    }
+  } catch(const Exception_& e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+
+  // Concurrent GET misses are coalesced into one get_many (one ANY($1) query
+  // on Postgres). At most MISS_BATCH_INFLIGHT (default: DB_POOL_MIN) batches
+  // run at once; misses beyond that queue and ride the next batch.
+  int batchMax, batchWindow;
+  try {
+    batchMax = env_int("MISS_BATCH_MAX", MISS_BATCH_MAX_DEFAULT, 1);
+    batchWindow = env_int("MISS_BATCH_WINDOW_US", MISS_BATCH_WINDOW_US_DEFAULT, 0);
+    batchInflight = env_int("MISS_BATCH_INFLIGHT", batchInflight, 1);
+  } catch(const Exception_& e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+  // Every key request runs under a deadline that bounds the pool wait, the
+  // miss batch wait and the query itself (cancelled on the server when late).
+  int requestTimeout, requestTimeoutMax, batchMaxKeys;
+  try {
+    requestTimeout = env_int("REQUEST_TIMEOUT_MS", REQUEST_TIMEOUT_MS_DEFAULT, 0);
+    requestTimeoutMax = env_int("REQUEST_TIMEOUT_MAX_MS", REQUEST_TIMEOUT_MAX_MS_DEFAULT, 1);
+    batchMaxKeys = env_int("BATCH_MAX_KEYS", BATCH_MAX_KEYS_DEFAULT, 1);
+  } catch(const Exception_& e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+
+  KeyService keyService(*store, cache, cacheAuthoritative, coherence.get(), changes.get(), batchInflight, batchMax, batchWindow);
+
+  // RESP_PORT opens a Redis protocol listener (RESP2/RESP3) next to HTTP,
+  // for at most RESP_MAX_CLIENTS connections; every command runs under
+  // REQUEST_TIMEOUT_MS.
+  unique_ptr<RespServer> resp;
+  int respPort;
+  try {
+    respPort = env_int("RESP_PORT", 0, 0);
+    if(respPort > 0) {
+      resp.reset(new RespServer(keyService, respPort, env_int("RESP_MAX_CLIENTS", RESP_MAX_CLIENTS_DEFAULT, 1), requestTimeout));
+      resp->start();
+    }
+  } catch(const Exception_& e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
 
+  // MEMCACHE_PORT does the same for the memcached text and meta protocols,
+  // for at most MEMCACHE_MAX_CLIENTS connections.
+  unique_ptr<MemcacheServer> memcache;
+  int memcachePort;
   try {
-    dbclient.createPool(); 
+    memcachePort = env_int("MEMCACHE_PORT", 0, 0);
+    if(memcachePort > 0) {
+      memcache.reset(new MemcacheServer(keyService, memcachePort, env_int("MEMCACHE_MAX_CLIENTS", MEMCACHE_MAX_CLIENTS_DEFAULT, 1), requestTimeout));
+      memcache->start();
+    }
   } catch(const Exception_& e) {
     cerr << e.what() << endl;
     return 1;
@@ -62,57 +404,290 @@ int main(int argc, char* argv[]) {
   
   httplib::Server svr;
   svr.new_task_queue = [&] { return new httplib::ThreadPool(threads); };
+  // Responses go out as header and body writes; without TCP_NODELAY the
+  // body waits on the client's delayed ACK (~40 ms per keep-alive request).
+  svr.set_tcp_nodelay(true);
+
+  // Requests without a body are dispatched here, before httplib's routes,
+  // which std::regex-match the path against every pattern in turn: fixed
+  // paths from a trie, anything else under /api/ to the key handlers.
+  // httplib reads the body of the others and gives them back (below).
+  Router router(KEY_PREFIX);
 
-  svr.Get("/hi", [](const httplib::Request &, httplib::Response &res) {
+  // HTTP_REACTOR=1 serves HTTP from one epoll thread that hands complete
+  // requests to `threads` workers, instead of httplib's worker per
+  // keep-alive connection, so idle connections do not hold threads. It
+  // keeps up to HTTP_MAX_CONNECTIONS, closes those idle for
+  // HTTP_IDLE_TIMEOUT_MS (0: never) and reads bodies of up to
+  // HTTP_MAX_BODY_MB, bulk imports included. HTTP_IO_URING=1 (implies the
+  // reactor) drives its sockets through io_uring, or epoll where the kernel
+  // lacks it.
+  unique_ptr<HttpReactor> reactor;
+  bool ioUring;
+  try {
+    ioUring = env_int("HTTP_IO_URING", 0, 0);
+    if(env_int("HTTP_REACTOR", 0, 0) || ioUring) {
+      reactor.reset(new HttpReactor([&](const httplib::Request &req, httplib::Response &res) {
+          if(!router.dispatch(req, res, true)) res.status = 404;
+        }, threads, env_int("HTTP_MAX_CONNECTIONS", HTTP_MAX_CONNECTIONS_DEFAULT, 1),
+        env_int("HTTP_IDLE_TIMEOUT_MS", HTTP_IDLE_TIMEOUT_MS_DEFAULT, 0),
+        (size_t)env_int("HTTP_MAX_BODY_MB", HTTP_MAX_BODY_MB_DEFAULT, 1) << 20, ioUring));
+    }
+  } catch(const Exception_& e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+
+  router.get("/hi", [](const httplib::Request &, httplib::Response &res) {
     res.set_content("Hello World!", "text/plain");
   });
 
-  svr.Get(R"(/api/(.+))", [&](const httplib::Request &req, httplib::Response &res) {
-    string key = req.matches[1];
-    pair<int, string> result;
-    try{
-      result = cache.get(key);
-      if(!result.first) {
-        result = dbclient.get(key);
-        if(!result.first) {
-          res.status = 404;
-          res.set_content("NOT_FOUND", "text/plain");
-          return;
-        }
-        cache.set(key, result.second);
-        res.status = 200;
-        res.set_content(result.second, "text/plain");
-      } else {
-        res.status = 200;
-        res.set_content(result.second, "text/plain"); 
+  router.get("/metrics", [&](const httplib::Request &, httplib::Response &res) {
+    ostringstream out;
+    store->write_metrics(out);
+    for(size_t i=0; i<shardPools.size(); i++) shardPools[i]->write_metrics(out, "db_shard" + to_string(i) + "_pool");
+    keyService.write_metrics(out);
+    if(resp) resp->write_metrics(out);
+    if(memcache) memcache->write_metrics(out);
+    if(reactor) reactor->write_metrics(out);
+    if(changes) changes->write_metrics(out);
+    res.set_content(out.str(), "text/plain; version=0.0.4");
+  });
+
+  // Bulk endpoints speak the Postgres binary COPY format end to end and are
+  // matched ahead of the key routes so they are not treated as keys.
+  // They need the postgres backend on a single database.
+  // cache=invalidate (default) drops imported keys from the cache, cache=warm
+  // fills it with the imported values, cache=none leaves it untouched;
+  // upsert=0 copies straight into kvstore for seeding an empty store.
+  auto importBulk = [&](const httplib::Request &req, httplib::Response &res,
+      const httplib::ContentReader &content_reader) {
+    string cacheMode = req.has_param("cache") ? req.get_param_value("cache") : "invalidate";
+    bool upsert = !req.has_param("upsert") || req.get_param_value("upsert") != "0";
+    if(!dbclient) {
+      res.status = 501;
+      res.set_content("Bulk import requires the postgres backend on a single database", "text/plain");
+      return;
+    }
+    // Pending write-back entries are older than the import; land them first.
+    if(writeback) {
+      try {
+        writeback->flush();
+      } catch(const Exception_& e) {
+        res.status = 500;
+        res.set_content("Internal Server Error: " + string(e.what()), "text/plain");
+        return;
+      }
+    }
+    if(cacheMode != "invalidate" && cacheMode != "warm" && cacheMode != "none") {
+      res.status = 400;
+      res.set_content("cache must be invalidate, warm or none", "text/plain");
+      return;
+    }
+
+    // The cache is only touched once the COPY has committed: earlier, a
+    // concurrent miss could re-cache the old row after its invalidation, and
+    // warmed values could be read before (or without) the commit. Past the
+    // cache's own capacity the keys are not tracked; the cache is cleared.
+    // The rows skip the KeyService, so the change log gets them (as many as
+    // it holds) and imported keys lose their expiry and client flags then.
+    vector<string> imported, tracked;
+    unordered_map<string, string> warm;
+    ChangeLog::Batch logged;
+    bool overflow = false;
+    CopyBinaryParser parser([&](const char* k, size_t klen, const char* v, size_t vlen) {
+      string key(k, klen);
+      if(keyService.tracks(key)) tracked.push_back(key);
+      if(changes) changes->hold(logged, false, key, string(v, vlen));
+      if(cacheMode == "none" || overflow) return;
+      if(imported.size() + warm.size() >= (size_t)cachesize) {
+        overflow = true;
+        imported.clear();
+        warm.clear();
+        return;
       }
+      if(cacheMode == "invalidate") imported.push_back(move(key));
+      else warm[move(key)] = string(v, vlen);
+    });
+
+    try {
+      size_t rows = dbclient->import_copy([&](const DBConnectionPool::ChunkSink& feed) {
+        return content_reader([&](const char* data, size_t len) {
+          parser.feed(data, len);
+          return feed(data, len);
+        });
+      }, upsert);
+      if(overflow) cache.clear();
+      for(const string& key : imported) cache.delete_(key);
+      if(!warm.empty()) cache.set_many(warm);
+      keyService.forget(tracked);
+      if(changes) changes->append(logged);
+      // Imported keys are not tracked one by one; other instances drop all.
+      if(coherence) coherence->publish_clear();
+      res.status = 200;
+      res.set_content("OK " + to_string(rows), "text/plain");
     } catch(const Exception_& e) {
       res.status = 500;
       res.set_content("Internal Server Error: " + string(e.what()), "text/plain");
     }
+  };
+  // httplib streams the body into COPY; the reactor has it read already.
+  svr.Post("/api/_import", importBulk);
+  router.post("/api/_import", [&](const httplib::Request &req, httplib::Response &res) {
+    importBulk(req, res, httplib::ContentReader([&](httplib::ContentReceiver receiver) {
+      return receiver(req.body.data(), req.body.size());
+    }, nullptr));
+  });
+
+  router.get("/api/_export", [&](const httplib::Request &, httplib::Response &res) {
+    if(!dbclient) {
+      res.status = 501;
+      res.set_content("Bulk export requires the postgres backend on a single database", "text/plain");
+      return;
+    }
+    if(writeback) {
+      try {
+        writeback->flush();
+      } catch(const Exception_& e) {
+        res.status = 500;
+        res.set_content("Internal Server Error: " + string(e.what()), "text/plain");
+        return;
+      }
+    }
+    res.set_chunked_content_provider("application/octet-stream",
+      [&](size_t, httplib::DataSink &sink) {
+        try {
+          if(!dbclient->export_copy([&](const char* data, size_t len) {
+            return sink.write(data, len);
+          })) return false;
+        } catch(const Exception_& e) {
+          cerr << e.what() << endl;
+          return false;
+        }
+        sink.done();
+        return true;
+      });
+  });
+
+  // Moves keys to their owners after shards were appended; GET reports progress.
+  router.post("/api/_rebalance", [&](const httplib::Request &, httplib::Response &res) {
+    if(!sharder) {
+      res.status = 501;
+      res.set_content("Rebalance requires several databases in DB_CONN", "text/plain");
+      return;
+    }
+    if(!sharder->start_rebalance()) {
+      res.status = 409;
+      res.set_content(sharder->rebalance_status(), "text/plain");
+      return;
+    }
+    res.status = 202;
+    res.set_content(sharder->rebalance_status(), "text/plain");
   });
 
-  svr.Put(R"(/api/(.+))", [&](const httplib::Request &req, httplib::Response &res) {
-    string key = req.matches[1];
-    string value = req.body;
+  router.get("/api/_rebalance", [&](const httplib::Request &, httplib::Response &res) {
+    if(!sharder) {
+      res.status = 501;
+      res.set_content("Rebalance requires several databases in DB_CONN", "text/plain");
+      return;
+    }
+    res.set_content(sharder->rebalance_status(), "text/plain");
+  });
 
+  // Server-sent events for every PUT and DELETE after `since` (or the
+  // Last-Event-ID header; only new changes without either). A consumer that
+  // asks for, or falls behind to, changes no longer held gets 410 or a
+  // `reset` event and must resync before resuming from its last_seq. A slow
+  // consumer only holds its socket buffer; it never slows writers down.
+  router.get("/api/_changes", [&](const httplib::Request &req, httplib::Response &res) {
+    if(!changes) {
+      res.status = 501;
+      res.set_content("Change streams need CHANGES=1", "text/plain");
+      return;
+    }
+    uint64_t since;
+    try {
+      if(req.has_param("since")) since = stoull(req.get_param_value("since"));
+      else if(req.has_header("Last-Event-ID")) since = stoull(req.get_header_value("Last-Event-ID"));
+      else since = changes->last_seq();
+    } catch(exception&) {
+      res.status = 400;
+      res.set_content("since must be a sequence number", "text/plain");
+      return;
+    }
+    if(!changes->covers(since)) {
+      changes->count_reset();
+      res.status = 410;
+      res.set_content("Changes after " + to_string(since) + " are no longer held; last_seq " +
+        to_string(changes->last_seq()), "text/plain");
+      return;
+    }
+    if(!changes->open_stream(changesMaxStreams)) {
+      res.status = 503;
+      res.set_header("Retry-After", "1");
+      res.set_content("Too many change streams", "text/plain");
+      return;
+    }
+    res.set_header("Cache-Control", "no-cache");
+    shared_ptr<uint64_t> cursor = make_shared<uint64_t>(since);
+    res.set_chunked_content_provider("text/event-stream",
+      [&, cursor](size_t, httplib::DataSink &sink) {
+        vector<ChangeLog::Event> batch;
+        string out;
+        if(!changes->read(*cursor, CHANGES_READ_BATCH, batch, CHANGES_HEARTBEAT_MS)) {
+          changes->count_reset();
+          out = "event: reset\ndata: {\"last_seq\":" + to_string(changes->last_seq()) + "}\n\n";
+          sink.write(out.data(), out.size());
+          sink.done();
+          return true;
+        }
+        if(batch.empty()) out = ": keepalive\n\n";
+        for(const ChangeLog::Event& e : batch) {
+          append_change_event(out, e);
+          *cursor = e.seq;
+        }
+        return sink.write(out.data(), out.size());
+      },
+      [&](bool) { changes->close_stream(); });
+  });
+
+  auto getKey = [&](const httplib::Request &req, httplib::Response &res, string_view keyView) {
+    string key(keyView);
+    pair<int, string> result;
+    deadline::Scope scope(request_deadline(req, requestTimeout, requestTimeoutMax));
     try{
-      dbclient.set(key, value);
-      cache.set(key, value);
+      result = keyService.get(key);
+      if(!result.first) {
+        res.status = 404;
+        res.set_content("NOT_FOUND", "text/plain");
+        return;
+      }
+      res.status = 200;
+      res.set_content(result.second, "text/plain");
+    } catch(const Exception_& e) {
+      error_response(res, e);
+    }
+  };
+
+  auto putKey = [&](const httplib::Request &req, httplib::Response &res, string_view keyView) {
+    string key(keyView);
+    const string& value = req.body;
+    deadline::Scope scope(request_deadline(req, requestTimeout, requestTimeoutMax));
+
+    try{
+      keyService.set(key, value);
       res.status = 200;
       res.set_content("OK", "text/plain");
     } catch(const Exception_& e) {
-      res.status = 500;
-      res.set_content("Internal Server Error: " + string(e.what()), "text/plain");
+      error_response(res, e);
     }
-  });
+  };
 
-  svr.Delete(R"(/api/(.+))", [&](const httplib::Request &req, httplib::Response &res) {
-    string key = req.matches[1];
+  auto deleteKey = [&](const httplib::Request &req, httplib::Response &res, string_view keyView) {
+    string key(keyView);
+    deadline::Scope scope(request_deadline(req, requestTimeout, requestTimeoutMax));
     try {
-      bool result = dbclient.remove(key);
-      if(result) {
-        cache.delete_(key);
+      if(keyService.remove(key)) {
         res.status = 200;
         res.set_content("OK", "text/plain");
       } else {
@@ -121,13 +696,97 @@ int main(int argc, char* argv[]) {
       }
       
     } catch(const Exception_& e) {
-      res.status = 500;
-      res.set_content("Internal Server Error: " + string(e.what()), "text/plain");
+      error_response(res, e);
+    }
+  };
+
+  router.get_key(getKey);
+  router.put_key(putKey);
+  router.delete_key(deleteKey);
+
+  // Batch endpoints take up to BATCH_MAX_KEYS keys in the BatchCodec body
+  // format. _mget fetches all its cache misses at once; _mset and _mdel are
+  // one write_batch, a single transaction on Postgres.
+  auto readBatch = [&](const httplib::Request &req, httplib::Response &res, vector<string>& items, size_t perKey) {
+    if(!batchcodec::parse(req.body, items) || items.size() % perKey != 0) {
+      res.status = 400;
+      res.set_content("Malformed batch body", "text/plain");
+      return false;
+    }
+    if(items.size() / perKey > (size_t)batchMaxKeys) {
+      res.status = 413;
+      res.set_content("At most " + to_string(batchMaxKeys) + " keys per batch", "text/plain");
+      return false;
+    }
+    return true;
+  };
+
+  router.post(KEY_PREFIX "_mget", [&](const httplib::Request &req, httplib::Response &res) {
+    vector<string> keys;
+    if(!readBatch(req, res, keys, 1)) return;
+    deadline::Scope scope(request_deadline(req, requestTimeout, requestTimeoutMax));
+    try {
+      unordered_map<string, string> found = keyService.get_many(keys);
+      string out;
+      for(const string& key : keys) {
+        auto it = found.find(key);
+        if(it == found.end()) batchcodec::append_missing(out);
+        else batchcodec::append(out, it->second);
+      }
+      res.status = 200;
+      res.set_content(out, "application/octet-stream");
+    } catch(const Exception_& e) {
+      error_response(res, e);
+    }
+  });
+
+  // A key given twice takes its last value.
+  router.post(KEY_PREFIX "_mset", [&](const httplib::Request &req, httplib::Response &res) {
+    vector<string> items;
+    if(!readBatch(req, res, items, 2)) return;
+    unordered_map<string, string> latest;
+    for(size_t i=0; i<items.size(); i+=2) latest[items[i]] = move(items[i+1]);
+    deadline::Scope scope(request_deadline(req, requestTimeout, requestTimeoutMax));
+    try {
+      keyService.set_many(latest);
+      res.status = 200;
+      res.set_content("OK " + to_string(latest.size()), "text/plain");
+    } catch(const Exception_& e) {
+      error_response(res, e);
     }
   });
 
+  router.post(KEY_PREFIX "_mdel", [&](const httplib::Request &req, httplib::Response &res) {
+    vector<string> keys;
+    if(!readBatch(req, res, keys, 1)) return;
+    sort(keys.begin(), keys.end());
+    keys.erase(unique(keys.begin(), keys.end()), keys.end());
+    deadline::Scope scope(request_deadline(req, requestTimeout, requestTimeoutMax));
+    try {
+      keyService.remove_many(keys);
+      res.status = 200;
+      res.set_content("OK " + to_string(keys.size()), "text/plain");
+    } catch(const Exception_& e) {
+      error_response(res, e);
+    }
+  });
+
+  // After the httplib routes above (bulk import streams its body).
+  router.attach(svr);
+
   cout << "server is running at http://localhost:" << port <<endl;
   cout << "Threads: " << threads << " Cache size: " << cachesize << endl; 
+  cout << "Storage: " << backendInfo << endl;
+  if(resp) cout << "RESP listener on port " << respPort << endl;
+  if(memcache) cout << "memcached listener on port " << memcachePort << endl;
+  if(reactor) {
+    cout << "HTTP reactor: " << (ioUring ? "io_uring" : "epoll") << " front end, " << threads << " workers" << endl;
+    if(!reactor->listen("localhost", port)) {
+      cerr << "Fail to listen on port " << port << endl;
+      return 1;
+    }
+    return 0;
+  }
   svr.listen("localhost", port);
   return 0;
 }
\ No newline at end of file